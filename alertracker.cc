@@ -21,6 +21,7 @@
 #include <string>
 #include <vector>
 #include <sstream>
+#include <sched.h>
 
 #include "alertracker.h"
 #include "devicetracker.h"
@@ -34,6 +35,13 @@ Alertracker::Alertracker(GlobalRegistry *in_globalreg) :
 	globalreg = in_globalreg;
 	next_alert_id = 0;
 
+    for (int r = 0; r < max_alert_refs; r++)
+        alert_ref_vec[r] = NULL;
+
+    alert_next_seq = 0;
+    alert_readers = 0;
+    alert_retired = NULL;
+
     pthread_mutex_init(&alert_mutex, NULL);
 
 	if (globalreg->kismet_config == NULL) {
@@ -49,6 +57,8 @@ Alertracker::Alertracker(GlobalRegistry *in_globalreg) :
     globalreg->InsertGlobal("ALERTTRACKER", this);
     globalreg->alertracker = this;
 
+    num_backlog = 50;
+
 	if (globalreg->kismet_config->FetchOpt("alertbacklog") != "") {
 		int scantmp;
 		if (sscanf(globalreg->kismet_config->FetchOpt("alertbacklog").c_str(), 
@@ -56,11 +66,24 @@ Alertracker::Alertracker(GlobalRegistry *in_globalreg) :
 			globalreg->messagebus->InjectMessage("Illegal value for 'alertbacklog' "
 												 "in config file", MSGFLAG_FATAL);
 			globalreg->fatal_condition = 1;
-			return;
+		} else {
+			num_backlog = scantmp;
 		}
-		num_backlog = scantmp;
 	}
 
+	// Alerts attached to packets live in the backlog, so always keep at
+	// least the last one
+	alert_ring_size = kismax(num_backlog, 1);
+	alert_ring = new kis_alert_info *[alert_ring_size];
+	alert_slot_seq = new uint64_t[alert_ring_size];
+	for (unsigned int i = 0; i < alert_ring_size; i++) {
+		alert_ring[i] = NULL;
+		alert_slot_seq[i] = 0;
+	}
+
+	if (globalreg->fatal_condition)
+		return;
+
 	// Parse config file vector of all alerts
 	if (ParseAlertConfig(globalreg->kismet_config) < 0) {
 		_MSG("Failed to parse alert values from Kismet config file", MSGFLAG_FATAL);
@@ -74,6 +97,9 @@ Alertracker::Alertracker(GlobalRegistry *in_globalreg) :
     alert_timestamp_id =
         globalreg->entrytracker->RegisterField("kismet.alert.timestamp",
                 TrackerUInt64, "alert update timestamp");
+    alert_next_seq_id =
+        globalreg->entrytracker->RegisterField("kismet.alert.next_seq",
+                TrackerUInt64, "sequence number of the next alert");
 
     tracked_alert *alert_builder = new tracked_alert(globalreg, 0);
     alert_entry_id =
@@ -91,6 +117,13 @@ Alertracker::Alertracker(GlobalRegistry *in_globalreg) :
 
 	
 	_MSG("Created alert tracker...", MSGFLAG_INFO);
+
+    Httpd_RegisterRoute("GET", "/alerts/all_alerts.msgpack");
+    Httpd_RegisterRoute("GET", "/alerts/all_alerts.json");
+    Httpd_RegisterRoute("GET", "/alerts/last-time/{timestamp:int}/alerts.msgpack");
+    Httpd_RegisterRoute("GET", "/alerts/last-time/{timestamp:int}/alerts.json");
+    Httpd_RegisterRoute("GET", "/alerts/last-seq/{seq:int}/alerts.msgpack");
+    Httpd_RegisterRoute("GET", "/alerts/last-seq/{seq:int}/alerts.json");
 }
 
 Alertracker::~Alertracker() {
@@ -103,6 +136,18 @@ Alertracker::~Alertracker() {
 		 x != alert_ref_map.end(); ++x)
 		delete x->second;
 
+    for (unsigned int i = 0; i < alert_ring_size; i++)
+        delete alert_ring[i];
+    delete[] alert_ring;
+    delete[] alert_slot_seq;
+
+    while (alert_retired != NULL) {
+        alert_retired_node *next = alert_retired->next;
+        delete alert_retired->info;
+        delete alert_retired;
+        alert_retired = next;
+    }
+
     pthread_mutex_destroy(&alert_mutex);
 }
 
@@ -129,6 +174,13 @@ int Alertracker::RegisterAlert(const char *in_header, alert_time_unit in_unit,
 		return -1;
 	}
 
+    if (next_alert_id >= max_alert_refs) {
+		snprintf(err, 1024, "Registering alert '%s' failed, too many alerts "
+                "registered", in_header);
+		globalreg->messagebus->InjectMessage(err, MSGFLAG_ERROR);
+		return -1;
+    }
+
 	alert_rec *arec = new alert_rec;
 
 	arec->ref_index = next_alert_id++;
@@ -137,13 +189,25 @@ int Alertracker::RegisterAlert(const char *in_header, alert_time_unit in_unit,
 	arec->burst_unit = in_burstunit;
 	arec->limit_rate = in_rate;
 	arec->limit_burst = in_burst;
-	arec->burst_sent = 0;
+	arec->total_sent = 0;
 	arec->time_last = 0;
 	arec->phy = in_phy;
 
+    // Each token refills in a unit divided by the bucket size
+    arec->burst_step_usec = in_burst <= 0 ? 0 :
+        (int64_t) alert_time_unit_conv[in_burstunit] * 1000000 / in_burst;
+    arec->burst_full_usec = 0;
+    arec->rate_step_usec = in_rate <= 0 ? 0 :
+        (int64_t) alert_time_unit_conv[in_unit] * 1000000 / in_rate;
+    arec->rate_full_usec = 0;
+
 	alert_name_map[arec->header] = arec->ref_index;
 	alert_ref_map[arec->ref_index] = arec;
 
+    // Publish the record for lock-free lookups once it's filled in
+    __sync_synchronize();
+    alert_ref_vec[arec->ref_index] = arec;
+
 	return arec->ref_index;
 }
 
@@ -156,7 +220,29 @@ int Alertracker::FetchAlertRef(string in_header) {
     return -1;
 }
 
-int Alertracker::CheckTimes(alert_rec *arec) {
+// Take a token from a bucket kept as the time it will be full again.  A
+// bucket with no room never passes.
+static bool alert_take_token(volatile int64_t *full_usec, int64_t step_usec,
+        int size, int64_t now_usec, bool take) {
+    if (size <= 0)
+        return false;
+
+    while (1) {
+        int64_t full = *full_usec;
+        int64_t next = kismax(full, now_usec) + step_usec;
+
+        if (next - now_usec > step_usec * size)
+            return false;
+
+        if (!take)
+            return true;
+
+        if (__sync_bool_compare_and_swap(full_usec, full, next))
+            return true;
+    }
+}
+
+int Alertracker::CheckTimes(alert_rec *arec, bool in_take) {
 	// Is this alert rate-limited?  If not, shortcut out and send it
 	if (arec->limit_rate == 0) {
 		return 1;
@@ -165,53 +251,41 @@ int Alertracker::CheckTimes(alert_rec *arec) {
 	struct timeval now;
 	gettimeofday(&now, NULL);
 
-	// If the last time we sent anything was longer than the main rate limit,
-	// then we reset back to empty
-	if (arec->time_last < (now.tv_sec - alert_time_unit_conv[arec->limit_unit])) {
-		arec->total_sent = 0;
-		arec->burst_sent = 0;
-		return 1;
-	}
+    int64_t now_usec = (int64_t) now.tv_sec * 1000000 + now.tv_usec;
 
-	// If the last time we sent anything was longer than the burst rate, we can
-	// reset the burst to 0
-	if (arec->time_last < (now.tv_sec - alert_time_unit_conv[arec->burst_unit])) {
-		arec->burst_sent = 0;
-	}
+    if (!alert_take_token(&(arec->burst_full_usec), arec->burst_step_usec,
+                arec->limit_burst, now_usec, in_take))
+        return 0;
 
-	// If we're under the limit on both, we're good to go
-	if (arec->burst_sent < arec->limit_burst && arec->total_sent < arec->limit_rate)
-		return 1;
+    if (!alert_take_token(&(arec->rate_full_usec), arec->rate_step_usec,
+                arec->limit_rate, now_usec, in_take)) {
+        // Give back the burst token
+        if (in_take)
+            __sync_fetch_and_sub(&(arec->burst_full_usec), arec->burst_step_usec);
+        return 0;
+    }
 
-	return 0;
+	return 1;
 }
 
 int Alertracker::PotentialAlert(int in_ref) {
-    local_locker lock(&alert_mutex);
-
-	map<int, alert_rec *>::iterator aritr = alert_ref_map.find(in_ref);
+	alert_rec *arec = FetchAlertRec(in_ref);
 
-	if (aritr == alert_ref_map.end())
+	if (arec == NULL)
 		return 0;
 
-	alert_rec *arec = aritr->second;
-
-	return CheckTimes(arec);
+	return CheckTimes(arec, false);
 }
 
 int Alertracker::RaiseAlert(int in_ref, kis_packet *in_pack,
 							mac_addr bssid, mac_addr source, mac_addr dest, 
 							mac_addr other, string in_channel, string in_text) {
-    local_locker lock(&alert_mutex);
+	alert_rec *arec = FetchAlertRec(in_ref);
 
-	map<int, alert_rec *>::iterator aritr = alert_ref_map.find(in_ref);
-
-	if (aritr == alert_ref_map.end())
+	if (arec == NULL)
 		return -1;
 
-	alert_rec *arec = aritr->second;
-
-	if (CheckTimes(arec) != 1)
+	if (CheckTimes(arec, true) != 1)
 		return 0;
 
 	kis_alert_info *info = new kis_alert_info;
@@ -229,16 +303,62 @@ int Alertracker::RaiseAlert(int in_ref, kis_packet *in_pack,
 
 	info->text = in_text;
 
-	// Increment and set the timers
-	arec->burst_sent++;
-	arec->total_sent++;
-	arec->time_last = time(0);
+	__sync_fetch_and_add(&(arec->total_sent), 1);
+	arec->time_last = info->tm.tv_sec;
 
-	alert_backlog.push_back(info);
-	if ((int) alert_backlog.size() > num_backlog) {
-		delete alert_backlog[0];
-		alert_backlog.erase(alert_backlog.begin());
-	}
+    // Anything which outlives the ring slot works from its own copy; the 
+    // ring entry can be replaced and freed as soon as it's published
+    kis_alert_info *pack_info = NULL;
+    if (in_pack != NULL)
+        pack_info = new kis_alert_info(*info);
+
+    string msg = info->header + " " + info->text;
+
+    // Take the next sequence number and claim its slot
+    uint64_t seq = __sync_fetch_and_add(&alert_next_seq, 1);
+
+    info->alert_seq = seq;
+    if (pack_info != NULL)
+        pack_info->alert_seq = seq;
+
+    unsigned int slot = seq % alert_ring_size;
+    bool claimed = false;
+
+    while (1) {
+        uint64_t cur = alert_slot_seq[slot];
+
+        // A newer alert has the slot already; ours was pushed out of the
+        // backlog before it got there
+        if (cur > seq * 2 + 1)
+            break;
+
+        // An older alert is still being written to the slot
+        if (cur & 1) {
+            sched_yield();
+            continue;
+        }
+
+        if (__sync_bool_compare_and_swap(&(alert_slot_seq[slot]), cur, 
+                    seq * 2 + 1)) {
+            claimed = true;
+            break;
+        }
+    }
+
+    if (claimed) {
+        kis_alert_info *old = alert_ring[slot];
+
+        // The alert has to be complete before readers can find it; the CAS
+        // above orders it
+        alert_ring[slot] = info;
+        __sync_synchronize();
+        alert_slot_seq[slot] = seq * 2 + 2;
+
+        RetireAlert(old);
+    } else {
+        // Nobody could have seen it
+        delete info;
+    }
 
 	// Try to get the existing alert info
 	if (in_pack != NULL)  {
@@ -251,13 +371,12 @@ int Alertracker::RaiseAlert(int in_ref, kis_packet *in_pack,
 			in_pack->insert(_PCM(PACK_COMP_ALERT), acomp);
 		}
 
-		// Attach it to the packet
-		acomp->alert_vec.push_back(info);
+		// Attach our copy to the packet
+		acomp->alert_vec.push_back(pack_info);
 	}
 
 	// Send the text info
-	globalreg->messagebus->InjectMessage((info->header + " " + info->text), 
-										 MSGFLAG_ALERT);
+	globalreg->messagebus->InjectMessage(msg, MSGFLAG_ALERT);
 
 	return 1;
 }
@@ -371,41 +490,147 @@ int Alertracker::ActivateConfiguredAlert(const char *in_header, int in_phy) {
 						 rec->burst_unit, rec->limit_burst, in_phy);
 }
 
-const vector<kis_alert_info *> *Alertracker::FetchBacklog() {
-    local_locker lock(&alert_mutex);
+void Alertracker::RetireAlert(kis_alert_info *in_old) {
+    if (in_old == NULL)
+        return;
 
-	return (const vector<kis_alert_info *> *) &alert_backlog;
-}
+    // Readers have to be counted after the slot changed
+    __sync_synchronize();
 
-bool Alertracker::Httpd_VerifyPath(const char *path, const char *method) {
-    if (strcmp(method, "GET") != 0) {
-        return false;
+    if (alert_readers != 0) {
+        alert_retired_node *node = new alert_retired_node;
+        node->info = in_old;
+
+        do {
+            node->next = alert_retired;
+        } while (!__sync_bool_compare_and_swap(&alert_retired, node->next, node));
+
+        return;
     }
 
-    // Split URL and process
-    vector<string> tokenurl = StrTokenize(path, "/");
-    if (tokenurl.size() < 3)
-        return false;
+    delete in_old;
 
-    if (tokenurl[1] == "alerts") {
-        if (tokenurl[2] == "all_alerts.msgpack") {
-            return true;
-        } else if (tokenurl[2] == "all_alerts.json") {
-            return true;
-        } else if (tokenurl[2] == "last-time") {
-            if (tokenurl.size() < 5)
-                return false;
-
-            if (tokenurl[4] == "alerts.msgpack")
-                return true;
-            else if (tokenurl[4] == "alerts.json")
-                return true;
-            else
-                return false;
+    // Take the retired list before checking for readers; anyone who could
+    // still see an entry on it started reading before it was pushed out, 
+    // and is still counted
+    alert_retired_node *list = 
+        __sync_lock_test_and_set(&alert_retired, (alert_retired_node *) NULL);
+
+    if (list == NULL)
+        return;
+
+    __sync_synchronize();
+
+    if (alert_readers != 0) {
+        // Put them back for a later alert
+        alert_retired_node *tail = list;
+        while (tail->next != NULL)
+            tail = tail->next;
+
+        do {
+            tail->next = alert_retired;
+        } while (!__sync_bool_compare_and_swap(&alert_retired, tail->next, list));
+
+        return;
+    }
+
+    while (list != NULL) {
+        alert_retired_node *next = list->next;
+        delete list->info;
+        delete list;
+        list = next;
+    }
+}
+
+uint64_t Alertracker::FetchAlertSequence() {
+    __sync_synchronize();
+    return alert_next_seq;
+}
+
+uint64_t Alertracker::FetchBacklog(uint64_t in_seq, 
+        vector<kis_alert_info> *ret_vec) {
+    __sync_fetch_and_add(&alert_readers, 1);
+
+    uint64_t end = alert_next_seq;
+    uint64_t start = in_seq;
+
+    // Anything older has already fallen out of the ring
+    if (end > alert_ring_size && start < end - alert_ring_size)
+        start = end - alert_ring_size;
+
+    for (uint64_t s = start; s < end; s++) {
+        unsigned int slot = s % alert_ring_size;
+        uint64_t cur = alert_slot_seq[slot];
+
+        // Not published yet; stop here so the next fetch starts with it
+        if (cur < s * 2 + 2) {
+            end = s;
+            break;
         }
+
+        // Skip slots already reused by a newer alert
+        if (cur != s * 2 + 2)
+            continue;
+
+        __sync_synchronize();
+        kis_alert_info copy = *(alert_ring[slot]);
+        __sync_synchronize();
+
+        // Reused while we were copying it
+        if (alert_slot_seq[slot] != cur)
+            continue;
+
+        ret_vec->push_back(copy);
     }
 
-    return false;
+    __sync_fetch_and_sub(&alert_readers, 1);
+
+    return kismax(end, in_seq);
+}
+
+TrackerElement *Alertracker::WrapAlerts(TrackerElement *in_vec, 
+        uint64_t in_next_seq) {
+    TrackerElement *wrapper = new TrackerElement(TrackerMap);
+
+    wrapper->add_map(in_vec);
+
+    TrackerElement *ts =
+        globalreg->entrytracker->GetTrackedInstance(alert_timestamp_id);
+    ts->set((uint64_t) globalreg->timestamp.tv_sec);
+    wrapper->add_map(ts);
+
+    TrackerElement *ns =
+        globalreg->entrytracker->GetTrackedInstance(alert_next_seq_id);
+    ns->set(in_next_seq);
+    wrapper->add_map(ns);
+
+    return wrapper;
+}
+
+int Alertracker::SerializeAlertsSince(TrackerElementSerializer *serializer,
+        uint64_t *io_seq) {
+    vector<kis_alert_info> alerts;
+
+    *io_seq = FetchBacklog(*io_seq, &alerts);
+
+    if (alerts.size() == 0)
+        return 0;
+
+    TrackerElement *msgvec = 
+        globalreg->entrytracker->GetTrackedInstance(alert_vec_id);
+
+    for (unsigned int i = 0; i < alerts.size(); i++) {
+        tracked_alert *ta = new tracked_alert(globalreg, alert_entry_id);
+        ta->from_alert_info(&(alerts[i]));
+        msgvec->add_vector(ta);
+    }
+
+    TrackerElement *wrapper = WrapAlerts(msgvec, *io_seq);
+    TrackerElementScopeLinker slink(wrapper);
+
+    serializer->serialize(wrapper);
+
+    return (int) alerts.size();
 }
 
 void Alertracker::Httpd_CreateStreamResponse(
@@ -416,6 +641,7 @@ void Alertracker::Httpd_CreateStreamResponse(
 
     TrackerElementSerializer *serializer = NULL;
     time_t since_time = 0;
+    uint64_t since_seq = 0;
     bool wrap = false;
 
     if (strcmp(method, "GET") != 0) {
@@ -434,17 +660,25 @@ void Alertracker::Httpd_CreateStreamResponse(
         } else if (tokenurl[2] == "all_alerts.json") {
             serializer =
                 new JsonAdapter::Serializer(globalreg, stream);
-        } else if (tokenurl[2] == "last-time") {
+        } else if (tokenurl[2] == "last-time" || tokenurl[2] == "last-seq") {
             if (tokenurl.size() < 5)
                 return;
 
-            long lastts;
-            if (sscanf(tokenurl[3].c_str(), "%ld", &lastts) != 1)
-                return;
+            if (tokenurl[2] == "last-time") {
+                long lastts;
+                if (sscanf(tokenurl[3].c_str(), "%ld", &lastts) != 1)
+                    return;
 
-            wrap = true;
+                since_time = lastts;
+            } else {
+                unsigned long long lastseq;
+                if (sscanf(tokenurl[3].c_str(), "%llu", &lastseq) != 1)
+                    return;
 
-            since_time = lastts;
+                since_seq = lastseq;
+            }
+
+            wrap = true;
 
             if (tokenurl[4] == "alerts.msgpack") {
                 serializer =
@@ -461,42 +695,34 @@ void Alertracker::Httpd_CreateStreamResponse(
     if (serializer == NULL)
         return;
 
-    {
-        local_locker lock(&alert_mutex);
+    // Copy what we need out of the backlog; raising alerts never waits on us
+    vector<kis_alert_info> alerts;
+    uint64_t next_seq = FetchBacklog(since_seq, &alerts);
 
-        TrackerElement *wrapper;
-        TrackerElement *msgvec = 
-            globalreg->entrytracker->GetTrackedInstance(alert_vec_id);
-       
-        // If we're doing a time-since, wrap the vector
-        if (wrap) {
-            wrapper = new TrackerElement(TrackerMap);
-            wrapper->add_map(msgvec);
-
-            TrackerElement *ts =
-                globalreg->entrytracker->GetTrackedInstance(alert_timestamp_id);
-            ts->set((uint64_t) globalreg->timestamp.tv_sec);
-            wrapper->add_map(ts);
-        } else {
-            wrapper = msgvec;
-        }
+    TrackerElement *wrapper;
+    TrackerElement *msgvec = 
+        globalreg->entrytracker->GetTrackedInstance(alert_vec_id);
 
-        wrapper->link();
+    // If we're doing a time-since, wrap the vector
+    if (wrap) {
+        wrapper = WrapAlerts(msgvec, next_seq);
+    } else {
+        wrapper = msgvec;
+    }
 
-        for (vector<kis_alert_info *>::iterator i = alert_backlog.begin();
-                i != alert_backlog.end(); ++i) {
-            if (since_time < (*i)->tm.tv_sec) {
-                tracked_alert *ta = new tracked_alert(globalreg, alert_entry_id);
-                ta->from_alert_info(*i);
-                msgvec->add_vector(ta);
-            }
+    wrapper->link();
+
+    for (unsigned int i = 0; i < alerts.size(); i++) {
+        if (since_time < alerts[i].tm.tv_sec) {
+            tracked_alert *ta = new tracked_alert(globalreg, alert_entry_id);
+            ta->from_alert_info(&(alerts[i]));
+            msgvec->add_vector(ta);
         }
+    }
 
-        serializer->serialize(wrapper);
+    serializer->serialize(wrapper);
 
-        delete(serializer);
+    delete(serializer);
 
-        wrapper->unlink();
-    }
+    wrapper->unlink();
 }
-
@@ -44,6 +44,8 @@ public:
 		tm.tv_sec = 0;
 		tm.tv_usec = 0;
 		channel = "0";
+		device_key = 0;
+		alert_seq = 0;
 
 		// We do NOT self-destruct because we get cached in the alertracker
 		// for playbacks.  It's responsible for discarding us
@@ -61,16 +63,25 @@ public:
 	mac_addr other;
 	string channel;
 	string text;
+
+	// Position in the alert backlog
+	uint64_t alert_seq;
 };
 
 class kis_alert_component : public packet_component {
 public:
 	kis_alert_component() {
-		// We can self destruct because we won't clear out the vector
-		// of actual alert info
 		self_destruct = 1;
 	}
 
+	// Alerts attached to the packet are copies owned by the component, 
+	// since the backlog entries can be replaced while the packet is still
+	// in the chain
+	~kis_alert_component() {
+		for (unsigned int x = 0; x < alert_vec.size(); x++)
+			delete alert_vec[x];
+	}
+
 	vector<kis_alert_info *> alert_vec;
 };
 
@@ -245,13 +256,21 @@ public:
         // Alerts sent before limiting takes hold
         int limit_burst;
 
-        // How many alerts have been sent burst-mode (decremented once per unit)
-        int burst_sent;
+        // Rate limits are a pair of token buckets, each kept as the time
+        // (in usec) it will be full again, so they can be checked and taken
+        // from with a compare-and-swap instead of the alert lock.  The
+        // burst bucket holds limit_burst alerts and refills over a burst
+        // unit; the rate bucket holds limit_rate and refills over a limit
+        // unit.
+        int64_t burst_step_usec;
+        volatile int64_t burst_full_usec;
+        int64_t rate_step_usec;
+        volatile int64_t rate_full_usec;
+
 		// How many have we sent in total?
-		int total_sent;
+		volatile int total_sent;
 
-		// Last time we sent an alert, to tell if we can reset the burst or
-		// rate counters
+		// Last time we sent an alert
 		time_t time_last;
     };
 
@@ -297,9 +316,21 @@ public:
 	int ActivateConfiguredAlert(const char *in_header);
 	int ActivateConfiguredAlert(const char *in_header, int in_phy);
 
-	const vector<kis_alert_info *> *FetchBacklog();
+    // Sequence number the next alert will get
+    uint64_t FetchAlertSequence();
+
+    // Copy the alerts still in the backlog with a sequence number of at
+    // least in_seq into ret_vec, oldest first.  Returns the sequence number
+    // to ask for next time.
+    uint64_t FetchBacklog(uint64_t in_seq, vector<kis_alert_info> *ret_vec);
+
+    // Serialize the alerts raised since a sequence number, wrapped with the
+    // update timestamp and next sequence number like the last-seq endpoint.
+    // io_seq is advanced past the alerts returned.  Returns the number of
+    // alerts; nothing is serialized if there are none.
+    int SerializeAlertsSince(TrackerElementSerializer *serializer, 
+            uint64_t *io_seq);
 
-    virtual bool Httpd_VerifyPath(const char *path, const char *method);
 
     virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
             struct MHD_Connection *connection,
@@ -309,10 +340,15 @@ public:
 protected:
     pthread_mutex_t alert_mutex;
 
-    int alert_vec_id, alert_entry_id, alert_timestamp_id;
+    int alert_vec_id, alert_entry_id, alert_timestamp_id, alert_next_seq_id;
 
-    // Check and age times
-    int CheckTimes(alert_rec *arec);
+    // Check the rate limits, taking a token from both buckets if in_take
+    // is set
+    int CheckTimes(alert_rec *arec, bool in_take);
+
+    // Wrap a list of alerts with the update timestamp and the sequence
+    // number of the next alert
+    TrackerElement *WrapAlerts(TrackerElement *in_vec, uint64_t in_next_seq);
 
 	// Parse a foo/bar rate/unit option
 	int ParseRateUnit(string in_ru, alert_time_unit *ret_unit, int *ret_rate);
@@ -324,9 +360,46 @@ protected:
     map<string, int> alert_name_map;
     map<int, alert_rec *> alert_ref_map;
 
-	vector<kis_alert_info *> alert_backlog;
+    // Registered alerts by reference, so raising an alert doesn't need
+    // the lock to find it.  Entries are only ever added.
+    static const int max_alert_refs = 4096;
+    alert_rec *alert_ref_vec[max_alert_refs];
+
+    alert_rec *FetchAlertRec(int in_ref) {
+        if (in_ref < 0 || in_ref >= max_alert_refs)
+            return NULL;
+        return alert_ref_vec[in_ref];
+    }
+
+    // Alert backlog, a fixed ring indexed by sequence number.  Raising an
+    // alert takes the next sequence number and claims that slot with a CAS
+    // on the slot's sequence, so writers don't wait on each other; a writer
+    // which finds a newer alert already claiming its slot (the ring wrapped
+    // while it was raising) drops its own.  A slot's sequence is 2*seq+1 
+    // while it's being written and 2*seq+2 once it's published.  Readers 
+    // never lock:  they count themselves in alert_readers, copy entries whose
+    // slot sequence doesn't change while they're copied, and stop at the 
+    // first alert which hasn't been published yet so nothing is skipped.
+    // Entries pushed out while anyone is reading are retired, and deleted by
+    // a later alert once there are no readers.  Ring entries can be freed at
+    // any time after they're published, so anything else which keeps an 
+    // alert (like the packet alert component) keeps its own copy.
+    struct alert_retired_node {
+        kis_alert_info *info;
+        alert_retired_node *next;
+    };
 
     int num_backlog;
+    unsigned int alert_ring_size;
+    kis_alert_info **alert_ring;
+    volatile uint64_t *alert_slot_seq;
+    volatile uint64_t alert_next_seq;
+    volatile int alert_readers;
+    alert_retired_node * volatile alert_retired;
+
+    // Free an entry pushed out of the ring, or retire it if anyone could 
+    // still be reading it
+    void RetireAlert(kis_alert_info *in_old);
 
 	map<string, alert_conf_rec *> alert_conf_map;
 };
@@ -0,0 +1,692 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <sstream>
+
+#include "util.h"
+#include "configfile.h"
+#include "messagebus.h"
+#include "alertrules.h"
+#include "phy_80211.h"
+
+// Names of the rule fields, in rule_field order
+static const char *alertrule_field_names[] = {
+    "type", "subtype", "distrib", "reason", "encrypted", "ess", 
+    "ibss", "retry", "fragmented", "corrupt", "beacon_interval", 
+    "ssid_len", "ssid", "source", "dest", "bssid", "other", 
+    "sequence", "duration", "wps", "datasize", "freq"
+};
+
+typedef struct {
+    const char *name;
+    int value;
+} alertrule_value_name;
+
+static const alertrule_value_name alertrule_type_names[] = {
+    { "mgmt", packet_management }, { "management", packet_management },
+    { "phy", packet_phy }, { "ctrl", packet_phy }, { "control", packet_phy },
+    { "data", packet_data },
+    { NULL, 0 }
+};
+
+// Subtype values depend on the type, so a rule naming a subtype should also
+// name the type
+static const alertrule_value_name alertrule_subtype_names[] = {
+    { "assocreq", packet_sub_association_req },
+    { "assocresp", packet_sub_association_resp },
+    { "reassocreq", packet_sub_reassociation_req },
+    { "reassocresp", packet_sub_reassociation_resp },
+    { "probereq", packet_sub_probe_req },
+    { "proberesp", packet_sub_probe_resp },
+    { "beacon", packet_sub_beacon },
+    { "atim", packet_sub_atim },
+    { "disassoc", packet_sub_disassociation },
+    { "auth", packet_sub_authentication },
+    { "deauth", packet_sub_deauthentication },
+    { "action", packet_sub_action },
+    { "pspoll", packet_sub_pspoll },
+    { "rts", packet_sub_rts },
+    { "cts", packet_sub_cts },
+    { "ack", packet_sub_ack },
+    { "null", packet_sub_data_null },
+    { "qosdata", packet_sub_data_qos_data },
+    { "qosnull", packet_sub_data_qos_null },
+    { NULL, 0 }
+};
+
+static const alertrule_value_name alertrule_distrib_names[] = {
+    { "unknown", distrib_unknown }, { "from", distrib_from }, 
+    { "to", distrib_to }, { "inter", distrib_inter }, { "adhoc", distrib_adhoc },
+    { NULL, 0 }
+};
+
+int alertrules_chain_hook(CHAINCALL_PARMS) {
+    return ((AlertRules *) auxdata)->ProcessPacket(in_pack);
+}
+
+AlertRules::AlertRules(GlobalRegistry *in_globalreg) {
+    globalreg = in_globalreg;
+    rule_root = NULL;
+
+	if (globalreg->packetchain == NULL) {
+		fprintf(stderr, "FATAL OOPS: AlertRules before packetchain\n");
+		exit(1);
+	}
+
+	if (globalreg->alertracker == NULL) {
+		fprintf(stderr, "FATAL OOPS: AlertRules before alertracker\n");
+		exit(1);
+	}
+
+    pack_comp_80211 = _PCM(PACK_COMP_80211) =
+        globalreg->packetchain->RegisterPacketComponent("PHY80211");
+    pack_comp_common = _PCM(PACK_COMP_COMMON) =
+        globalreg->packetchain->RegisterPacketComponent("COMMON");
+
+    vector<string> rules = globalreg->kismet_config->FetchOptVec("alertrule");
+
+    for (unsigned int r = 0; r < rules.size(); r++) {
+        if (AddRule(rules[r]) < 0) {
+            _MSG("Invalid alertrule line in config file: " + rules[r], 
+                    MSGFLAG_FATAL);
+            globalreg->fatal_condition = 1;
+            return;
+        }
+    }
+
+    // Nothing to do for every packet without any rules
+    if (rule_vec.size() == 0)
+        return;
+
+    CompileRules();
+
+	globalreg->packetchain->RegisterHandler(&alertrules_chain_hook, this,
+											CHAINPOS_CLASSIFIER, -40);
+
+    timer_id = 
+        globalreg->timetracker->RegisterTimer(SERVER_TIMESLICES_SEC * 60, NULL, 
+                1, this);
+
+    _MSG("Loaded " + IntToString(rule_vec.size()) + " alert rules", MSGFLAG_INFO);
+}
+
+AlertRules::~AlertRules() {
+    if (rule_root != NULL) {
+        globalreg->packetchain->RemoveHandler(&alertrules_chain_hook, 
+                CHAINPOS_CLASSIFIER);
+        globalreg->timetracker->RemoveTimer(timer_id);
+    }
+
+    DeleteNode(rule_root);
+
+    for (unsigned int r = 0; r < rule_vec.size(); r++)
+        delete rule_vec[r];
+}
+
+int AlertRules::AddRule(string in_rule) {
+    // Name and conditions, then the alert text which may have commas of its own
+    size_t namepos = in_rule.find(',');
+    if (namepos == string::npos)
+        return -1;
+
+    size_t condpos = in_rule.find(',', namepos + 1);
+
+    alert_rule *rule = new alert_rule;
+
+    rule->name = StrUpper(StrStrip(in_rule.substr(0, namepos)));
+    rule->check_ssid = false;
+    rule->count = 0;
+    rule->window = 0;
+    rule->count_field = rf_source;
+
+    if (condpos == string::npos) {
+        rule->text = "Alert rule " + rule->name + " matched";
+    } else {
+        rule->text = StrStrip(in_rule.substr(condpos + 1));
+        condpos -= namepos + 1;
+    }
+
+    vector<string> conds = 
+        StrTokenize(in_rule.substr(namepos + 1, condpos), " ");
+
+    for (unsigned int c = 0; c < conds.size(); c++) {
+        if (conds[c] == "")
+            continue;
+
+        if (ParseCondition(conds[c], rule) < 0) {
+            delete rule;
+            return -1;
+        }
+    }
+
+    if (rule->match_conds.size() == 0 && rule->check_conds.size() == 0) {
+        _MSG("Alert rule " + rule->name + " has no conditions", MSGFLAG_ERROR);
+        delete rule;
+        return -1;
+    }
+
+    // Rules sharing a name raise the same alert
+    rule->alert_ref = globalreg->alertracker->FetchAlertRef(rule->name);
+
+    if (rule->alert_ref < 0)
+        rule->alert_ref = 
+            globalreg->alertracker->ActivateConfiguredAlert(rule->name.c_str());
+
+    // Like the built-in alerts, a rule without an alert= line is disabled
+    if (rule->alert_ref < 0) {
+        _MSG("Alert rule " + rule->name + " has no matching alert= line, "
+                "ignoring it", MSGFLAG_INFO);
+        delete rule;
+        return 0;
+    }
+
+    rule_vec.push_back(rule);
+
+    return 1;
+}
+
+int AlertRules::ParseCondition(string in_cond, alert_rule *rule) {
+    size_t oppos = in_cond.find_first_of("=!<>");
+
+    if (oppos == string::npos || oppos == 0) {
+        _MSG("Alert rule " + rule->name + " invalid condition '" + in_cond + "'",
+                MSGFLAG_ERROR);
+        return -1;
+    }
+
+    string key = StrLower(in_cond.substr(0, oppos));
+    string op = in_cond.substr(oppos, 1);
+
+    if (oppos + 1 < in_cond.length() && in_cond[oppos + 1] == '=')
+        op += "=";
+
+    string value = in_cond.substr(oppos + op.length());
+
+    // Counting options
+    if (key == "count" || key == "per") {
+        if (op != "=") {
+            _MSG("Alert rule " + rule->name + " invalid condition '" + 
+                    in_cond + "'", MSGFLAG_ERROR);
+            return -1;
+        }
+
+        if (key == "per") {
+            string per = StrLower(value);
+
+            if (per == "source")
+                rule->count_field = rf_source;
+            else if (per == "dest")
+                rule->count_field = rf_dest;
+            else if (per == "bssid")
+                rule->count_field = rf_bssid;
+            else if (per == "other")
+                rule->count_field = rf_other;
+            else {
+                _MSG("Alert rule " + rule->name + " can't count per '" + 
+                        value + "', expected source, dest, bssid, or other",
+                        MSGFLAG_ERROR);
+                return -1;
+            }
+
+            return 1;
+        }
+
+        // count=N/unit, per minute if no unit is given like alert rates
+        vector<string> units = StrTokenize(StrLower(value), "/");
+        unsigned int count;
+
+        rule->window = 60;
+
+        if (units.size() > 1) {
+            if (units[1] == "sec" || units[1] == "second")
+                rule->window = 1;
+            else if (units[1] == "min" || units[1] == "minute")
+                rule->window = 60;
+            else if (units[1] == "hr" || units[1] == "hour")
+                rule->window = 3600;
+            else if (units[1] == "day")
+                rule->window = 86400;
+            else
+                rule->window = -1;
+        }
+
+        if (units.size() == 0 || rule->window < 0 ||
+                sscanf(units[0].c_str(), "%u", &count) != 1 || count == 0) {
+            _MSG("Alert rule " + rule->name + " invalid count '" + value + "'",
+                    MSGFLAG_ERROR);
+            return -1;
+        }
+
+        rule->count = count;
+
+        return 1;
+    }
+
+    rule_cond cond;
+
+    cond.field = -1;
+    for (int f = 0; f < rf_max; f++) {
+        if (key == alertrule_field_names[f]) {
+            cond.field = f;
+            break;
+        }
+    }
+
+    if (cond.field < 0) {
+        _MSG("Alert rule " + rule->name + " unknown field '" + key + "'",
+                MSGFLAG_ERROR);
+        return -1;
+    }
+
+    if (op == "=" || op == "==")
+        cond.op = ro_eq;
+    else if (op == "!=")
+        cond.op = ro_ne;
+    else if (op == "<")
+        cond.op = ro_lt;
+    else if (op == "<=")
+        cond.op = ro_le;
+    else if (op == ">")
+        cond.op = ro_gt;
+    else if (op == ">=")
+        cond.op = ro_ge;
+    else {
+        _MSG("Alert rule " + rule->name + " invalid condition '" + in_cond + "'",
+                MSGFLAG_ERROR);
+        return -1;
+    }
+
+    if (ParseValue(cond.field, value, &(cond.value)) < 0) {
+        _MSG("Alert rule " + rule->name + " invalid value for " + key + 
+                " '" + value + "'", MSGFLAG_ERROR);
+        return -1;
+    }
+
+    if (cond.field == rf_ssid) {
+        if (cond.op != ro_eq) {
+            _MSG("Alert rule " + rule->name + " can only match an exact ssid",
+                    MSGFLAG_ERROR);
+            return -1;
+        }
+
+        rule->check_ssid = true;
+        rule->ssid = value;
+    }
+
+    // Only one equality per field can be matched in the tree; any others 
+    // (which can never all be true) are left to the checks
+    bool tested = false;
+    for (unsigned int c = 0; c < rule->match_conds.size(); c++) {
+        if (rule->match_conds[c].field == cond.field)
+            tested = true;
+    }
+
+    if (cond.op == ro_eq && !tested)
+        rule->match_conds.push_back(cond);
+    else
+        rule->check_conds.push_back(cond);
+
+    return 1;
+}
+
+int AlertRules::ParseValue(int in_field, string in_value, uint64_t *ret_value) {
+    const alertrule_value_name *names = NULL;
+
+    switch (in_field) {
+        case rf_type:
+            names = alertrule_type_names;
+            break;
+        case rf_subtype:
+            names = alertrule_subtype_names;
+            break;
+        case rf_distrib:
+            names = alertrule_distrib_names;
+            break;
+        case rf_source:
+        case rf_dest:
+        case rf_bssid:
+        case rf_other:
+            {
+                mac_addr m(in_value);
+
+                if (m.error)
+                    return -1;
+
+                *ret_value = m.longmac;
+                return 1;
+            }
+        case rf_ssid:
+            {
+                // Checksummed the same way as the dissector, with the length 
+                if (in_value.length() == 0 || in_value.length() > 32)
+                    return -1;
+
+                string tag = string(1, (char) in_value.length()) + in_value;
+                *ret_value = Adler32Checksum(tag.c_str(), tag.length());
+                return 1;
+            }
+    }
+
+    if (names != NULL) {
+        string lv = StrLower(in_value);
+
+        for (unsigned int n = 0; names[n].name != NULL; n++) {
+            if (lv == names[n].name) {
+                *ret_value = (uint64_t) names[n].value;
+                return 1;
+            }
+        }
+    }
+
+    char *end;
+    unsigned long long v = strtoull(in_value.c_str(), &end, 0);
+
+    if (in_value.length() == 0 || *end != '\0')
+        return -1;
+
+    *ret_value = v;
+
+    return 1;
+}
+
+void AlertRules::CompileRules() {
+    DeleteNode(rule_root);
+    rule_root = BuildNode(rule_vec, 0);
+}
+
+AlertRules::rule_node *AlertRules::BuildNode(vector<alert_rule *> &in_rules, 
+        uint64_t in_tested) {
+    rule_node *node = new rule_node;
+    node->field = -1;
+    node->other = NULL;
+
+    // Branch on the field the most remaining rules test for equality
+    unsigned int field_count[rf_max];
+    for (int f = 0; f < rf_max; f++)
+        field_count[f] = 0;
+
+    vector<alert_rule *> remaining;
+
+    for (unsigned int r = 0; r < in_rules.size(); r++) {
+        bool done = true;
+
+        for (unsigned int c = 0; c < in_rules[r]->match_conds.size(); c++) {
+            int f = in_rules[r]->match_conds[c].field;
+
+            if (in_tested & ((uint64_t) 1 << f))
+                continue;
+
+            field_count[f]++;
+            done = false;
+        }
+
+        if (done)
+            node->rules.push_back(in_rules[r]);
+        else
+            remaining.push_back(in_rules[r]);
+    }
+
+    if (remaining.size() == 0)
+        return node;
+
+    for (int f = 0; f < rf_max; f++) {
+        if (field_count[f] > 0 && 
+                (node->field < 0 || field_count[f] > field_count[node->field]))
+            node->field = f;
+    }
+
+    // Split the rules by the value they need
+    map<uint64_t, vector<alert_rule *> > value_rules;
+    vector<alert_rule *> other_rules;
+
+    for (unsigned int r = 0; r < remaining.size(); r++) {
+        bool matched = false;
+
+        for (unsigned int c = 0; c < remaining[r]->match_conds.size(); c++) {
+            if (remaining[r]->match_conds[c].field == node->field) {
+                value_rules[remaining[r]->match_conds[c].value].push_back(remaining[r]);
+                matched = true;
+                break;
+            }
+        }
+
+        if (!matched)
+            other_rules.push_back(remaining[r]);
+    }
+
+    uint64_t tested = in_tested | ((uint64_t) 1 << node->field);
+
+    for (map<uint64_t, vector<alert_rule *> >::iterator vi = value_rules.begin();
+            vi != value_rules.end(); ++vi) {
+        node->branches[vi->first] = BuildNode(vi->second, tested);
+    }
+
+    if (other_rules.size() != 0)
+        node->other = BuildNode(other_rules, tested);
+
+    return node;
+}
+
+void AlertRules::DeleteNode(rule_node *in_node) {
+    if (in_node == NULL)
+        return;
+
+    for (map<uint64_t, rule_node *>::iterator bi = in_node->branches.begin();
+            bi != in_node->branches.end(); ++bi)
+        DeleteNode(bi->second);
+
+    DeleteNode(in_node->other);
+
+    delete in_node;
+}
+
+int AlertRules::ProcessPacket(kis_packet *in_pack) {
+    dot11_packinfo *packinfo =
+        (dot11_packinfo *) in_pack->fetch(pack_comp_80211);
+    kis_common_info *common =
+        (kis_common_info *) in_pack->fetch(pack_comp_common);
+
+    if (packinfo == NULL && common == NULL)
+        return 0;
+
+    uint64_t values[rf_max];
+    bool have[rf_max];
+
+    for (int f = 0; f < rf_max; f++)
+        have[f] = false;
+
+    if (packinfo != NULL) {
+        values[rf_type] = (uint64_t) packinfo->type;
+        values[rf_subtype] = (uint64_t) packinfo->subtype;
+        values[rf_distrib] = (uint64_t) packinfo->distrib;
+        values[rf_reason] = packinfo->mgt_reason_code;
+        values[rf_encrypted] = packinfo->encrypted;
+        values[rf_ess] = packinfo->ess;
+        values[rf_ibss] = packinfo->ibss;
+        values[rf_retry] = packinfo->retry;
+        values[rf_fragmented] = packinfo->fragmented;
+        values[rf_corrupt] = packinfo->corrupt;
+        values[rf_beacon_interval] = packinfo->beacon_interval;
+        values[rf_ssid_len] = packinfo->ssid_len;
+        values[rf_source] = packinfo->source_mac.longmac;
+        values[rf_dest] = packinfo->dest_mac.longmac;
+        values[rf_bssid] = packinfo->bssid_mac.longmac;
+        values[rf_other] = packinfo->other_mac.longmac;
+        values[rf_sequence] = packinfo->sequence_number;
+        values[rf_duration] = packinfo->duration;
+        values[rf_wps] = packinfo->wps;
+
+        for (int f = rf_type; f <= rf_wps; f++)
+            have[f] = true;
+
+        // Only frames with an SSID tag have a checksum
+        values[rf_ssid] = packinfo->ssid_csum;
+        have[rf_ssid] = packinfo->ssid_csum != 0;
+    }
+
+    if (common != NULL) {
+        values[rf_datasize] = common->datasize;
+        have[rf_datasize] = true;
+
+        values[rf_freq] = (uint64_t) (common->freq_khz / 1000);
+        have[rf_freq] = common->freq_khz != 0;
+
+        // Non-802.11 phys still have addresses
+        if (packinfo == NULL) {
+            values[rf_source] = common->source.longmac;
+            values[rf_dest] = common->dest.longmac;
+            values[rf_bssid] = common->device.longmac;
+            have[rf_source] = have[rf_dest] = have[rf_bssid] = true;
+        }
+    }
+
+    // Follow the branch for the packet's value and the branch for rules
+    // which don't test the field
+    rule_node *stack[rf_max * 2 + 1];
+    int depth = 0;
+
+    stack[depth++] = rule_root;
+
+    while (depth > 0) {
+        rule_node *node = stack[--depth];
+
+        for (unsigned int r = 0; r < node->rules.size(); r++)
+            MatchRule(node->rules[r], in_pack, values, have);
+
+        if (node->field < 0)
+            continue;
+
+        if (node->other != NULL)
+            stack[depth++] = node->other;
+
+        if (have[node->field]) {
+            map<uint64_t, rule_node *>::iterator bi =
+                node->branches.find(values[node->field]);
+
+            if (bi != node->branches.end())
+                stack[depth++] = bi->second;
+        }
+    }
+
+    return 1;
+}
+
+void AlertRules::MatchRule(alert_rule *rule, kis_packet *in_pack,
+        const uint64_t *in_values, const bool *in_have) {
+    for (unsigned int c = 0; c < rule->check_conds.size(); c++) {
+        const rule_cond &cond = rule->check_conds[c];
+
+        if (!in_have[cond.field])
+            return;
+
+        uint64_t v = in_values[cond.field];
+        bool pass = false;
+
+        switch (cond.op) {
+            case ro_eq:
+                pass = v == cond.value;
+                break;
+            case ro_ne:
+                pass = v != cond.value;
+                break;
+            case ro_lt:
+                pass = v < cond.value;
+                break;
+            case ro_le:
+                pass = v <= cond.value;
+                break;
+            case ro_gt:
+                pass = v > cond.value;
+                break;
+            case ro_ge:
+                pass = v >= cond.value;
+                break;
+        }
+
+        if (!pass)
+            return;
+    }
+
+    dot11_packinfo *packinfo =
+        (dot11_packinfo *) in_pack->fetch(pack_comp_80211);
+    kis_common_info *common =
+        (kis_common_info *) in_pack->fetch(pack_comp_common);
+
+    if (rule->check_ssid && (packinfo == NULL || packinfo->ssid != rule->ssid))
+        return;
+
+    string text = rule->text;
+
+    if (rule->count != 0) {
+        if (!in_have[rule->count_field])
+            return;
+
+        time_t now = globalreg->timestamp.tv_sec;
+        rule_count &rc = rule->counts[in_values[rule->count_field]];
+
+        if (rc.count == 0 || now - rc.window_start >= rule->window) {
+            rc.window_start = now;
+            rc.count = 0;
+        }
+
+        // Alert once per window when the count is reached
+        if (++rc.count != rule->count)
+            return;
+    }
+
+    if (!globalreg->alertracker->PotentialAlert(rule->alert_ref))
+        return;
+
+    if (rule->count != 0) {
+        mac_addr key;
+        key.longmac = in_values[rule->count_field];
+
+        ostringstream oss;
+        oss << text << " (" << rule->count << " packets from " << 
+            alertrule_field_names[rule->count_field] << " " << 
+            key.Mac2String() << " in " << rule->window << " seconds)";
+        text = oss.str();
+    }
+
+    if (packinfo != NULL)
+        _ALERT(rule->alert_ref, in_pack, packinfo, text);
+    else
+        _COMMONALERT(rule->alert_ref, in_pack, common, text);
+}
+
+int AlertRules::timetracker_event(int event_id __attribute__((unused))) {
+    time_t now = globalreg->timestamp.tv_sec;
+
+    for (unsigned int r = 0; r < rule_vec.size(); r++) {
+        alert_rule *rule = rule_vec[r];
+
+        map<uint64_t, rule_count>::iterator ci = rule->counts.begin();
+
+        while (ci != rule->counts.end()) {
+            if (now - ci->second.window_start >= rule->window)
+                rule->counts.erase(ci++);
+            else
+                ++ci;
+        }
+    }
+
+    return 1;
+}
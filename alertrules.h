@@ -0,0 +1,142 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __ALERTRULES_H__
+#define __ALERTRULES_H__
+
+#include "config.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <map>
+#include <vector>
+#include <string>
+
+#include "globalregistry.h"
+#include "packetchain.h"
+#include "timetracker.h"
+#include "alertracker.h"
+
+// Alerts defined in the config file instead of code.  Each rule is a set of
+// conditions on the 802.11 and common packet info, optionally counted per
+// device over a window:
+//
+//   alertrule=NAME,conditions[,alert text]
+//   alertrule=DEAUTHSPRAY,type=mgmt subtype=deauth count=20/sec per=source
+//
+// Rules are compiled into a decision tree on the fields they test for
+// equality.  At each node a packet looks up its value for the node's field
+// and follows that branch (and the branch of rules which don't test the
+// field), and only rules reached that way check their remaining conditions;
+// adding rules which test different values costs a lookup, not another
+// check on every packet.
+class AlertRules : public LifetimeGlobal, public TimetrackerEvent {
+public:
+    AlertRules(GlobalRegistry *in_globalreg);
+    virtual ~AlertRules();
+
+    // Parse a rule from an alertrule= line and add it.  Rules take effect
+    // when they're compiled.
+    int AddRule(string in_rule);
+
+    // Rebuild the decision tree from the rules
+    void CompileRules();
+
+    int ProcessPacket(kis_packet *in_pack);
+
+    // Timetracker API, drops expired window counts
+    virtual int timetracker_event(int event_id);
+
+protected:
+    // Fields rules can test.  Fields are extracted from a packet once, and
+    // packets without the 802.11 or common info lack those fields.
+    enum rule_field {
+        rf_type, rf_subtype, rf_distrib, rf_reason, rf_encrypted, rf_ess, 
+        rf_ibss, rf_retry, rf_fragmented, rf_corrupt, rf_beacon_interval, 
+        rf_ssid_len, rf_ssid, rf_source, rf_dest, rf_bssid, rf_other, 
+        rf_sequence, rf_duration, rf_wps, rf_datasize, rf_freq,
+        rf_max
+    };
+
+    enum rule_op {
+        ro_eq, ro_ne, ro_lt, ro_le, ro_gt, ro_ge
+    };
+
+    struct rule_cond {
+        int field;
+        int op;
+        uint64_t value;
+    };
+
+    // Matches counted for one device in the current window
+    struct rule_count {
+        time_t window_start;
+        unsigned int count;
+    };
+
+    struct alert_rule {
+        string name;
+        string text;
+        int alert_ref;
+
+        // Equality conditions, matched by the decision tree
+        vector<rule_cond> match_conds;
+        // Everything else, checked when a packet reaches the rule
+        vector<rule_cond> check_conds;
+
+        // SSIDs are matched in the tree by checksum and compared here
+        bool check_ssid;
+        string ssid;
+
+        // Alert when a device matches count times in window seconds, counted
+        // per count_field
+        unsigned int count;
+        int window;
+        int count_field;
+        map<uint64_t, rule_count> counts;
+    };
+
+    // Rules fully matched by the path to this node, and the field the node
+    // branches on (-1 at a leaf).  Rules which don't test the field are
+    // under the other branch, which every packet reaching the node follows.
+    struct rule_node {
+        vector<alert_rule *> rules;
+        int field;
+        map<uint64_t, rule_node *> branches;
+        rule_node *other;
+    };
+
+    rule_node *BuildNode(vector<alert_rule *> &in_rules, uint64_t in_tested);
+    void DeleteNode(rule_node *in_node);
+
+    int ParseCondition(string in_cond, alert_rule *rule);
+    int ParseValue(int in_field, string in_value, uint64_t *ret_value);
+
+    void MatchRule(alert_rule *rule, kis_packet *in_pack, 
+            const uint64_t *in_values, const bool *in_have);
+
+    GlobalRegistry *globalreg;
+
+    vector<alert_rule *> rule_vec;
+    rule_node *rule_root;
+
+    int pack_comp_80211, pack_comp_common;
+};
+
+#endif
+
@@ -0,0 +1,204 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Alert rule benchmark:  loads a set of alertrule= lines the way the config
+// file does and times the compiled rules against 802.11 packets which match
+// none of them, and against a mix of traffic where some of them do.
+//
+//   bench_alertrules [rules] [packets]
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench_util.h"
+#include "entrytracker.h"
+#include "packetchain.h"
+#include "timetracker.h"
+#include "alertracker.h"
+#include "alertrules.h"
+#include "phy_80211.h"
+
+// Alerts have a fixed number of references, so larger sets share names
+#define BENCH_ALERT_NAMES       1000
+
+static string bench_rule(unsigned int in_num) {
+    char buf[256];
+    unsigned int name = in_num % BENCH_ALERT_NAMES;
+
+    switch (in_num % 5) {
+        case 0:
+            snprintf(buf, 256, "BENCH%u,type=mgmt subtype=beacon "
+                    "source=00:11:22:33:%02X:%02X,beacon from watched device %u",
+                    name, (in_num / 256) & 0xFF, in_num & 0xFF, in_num);
+            break;
+        case 1:
+            snprintf(buf, 256, "BENCH%u,type=mgmt subtype=deauth reason=%u "
+                    "count=10/sec,deauth flood reason %u",
+                    name, in_num % 64, in_num % 64);
+            break;
+        case 2:
+            snprintf(buf, 256, "BENCH%u,type=mgmt subtype=probereq ssid=net%u",
+                    name, in_num);
+            break;
+        case 3:
+            snprintf(buf, 256, "BENCH%u,type=data "
+                    "bssid=00:AA:22:33:%02X:%02X datasize>1000",
+                    name, (in_num / 256) & 0xFF, in_num & 0xFF);
+            break;
+        default:
+            snprintf(buf, 256, "BENCH%u,freq=%u type=mgmt subtype=beacon "
+                    "beacon_interval<50", name, 2400 + in_num);
+            break;
+    }
+
+    return buf;
+}
+
+// Fill in a packet:  data frames, beacons, probes and deauths from addresses
+// the rules don't watch.  With in_matching, some beacons come from watched
+// devices and some deauths repeat fast enough to trip a count.
+static void bench_fill(unsigned int in_num, bool in_matching,
+        dot11_packinfo *packinfo, kis_common_info *common) {
+    unsigned int pick = rand() % 10;
+
+    packinfo->source_mac = mac_addr((uint64_t) 0x00BB00000000ULL + rand());
+    packinfo->dest_mac = mac_addr((uint64_t) 0x00CC00000000ULL + rand());
+    packinfo->bssid_mac = mac_addr((uint64_t) 0x00DD00000000ULL + rand());
+    packinfo->beacon_interval = 100;
+    common->freq_khz = 2412000 + (rand() % 11) * 5000;
+    common->datasize = rand() % 1500;
+
+    if (pick < 4) {
+        packinfo->type = packet_data;
+        packinfo->subtype = packet_sub_data;
+    } else if (pick < 7) {
+        packinfo->type = packet_management;
+        packinfo->subtype = packet_sub_beacon;
+
+        if (in_matching && in_num % 50 == 0)
+            packinfo->source_mac = mac_addr("00:11:22:33:00:05");
+    } else if (pick < 8) {
+        packinfo->type = packet_management;
+        packinfo->subtype = packet_sub_probe_req;
+    } else if (pick < 9) {
+        packinfo->type = packet_management;
+        packinfo->subtype = packet_sub_deauthentication;
+        packinfo->mgt_reason_code = 100 + rand() % 100;
+
+        if (in_matching && in_num % 3 == 0)
+            packinfo->mgt_reason_code = 6;
+    } else {
+        packinfo->type = packet_phy;
+        packinfo->subtype = packet_sub_ack;
+    }
+}
+
+static double bench_run(AlertRules *in_rules, GlobalRegistry *globalreg,
+        unsigned int in_packets, bool in_matching) {
+    // A pool of prepared packets, cycled through so the time is spent in the
+    // rules and not in making packets
+    unsigned int pool_size = 4096;
+    vector<kis_packet *> pool;
+
+    srand(in_matching ? 2 : 1);
+
+    for (unsigned int p = 0; p < pool_size; p++) {
+        kis_packet *pack = new kis_packet(globalreg);
+        dot11_packinfo *packinfo = new dot11_packinfo();
+        kis_common_info *common = new kis_common_info();
+
+        bench_fill(p, in_matching, packinfo, common);
+
+        pack->insert(_PCM(PACK_COMP_80211), packinfo);
+        pack->insert(_PCM(PACK_COMP_COMMON), common);
+
+        pool.push_back(pack);
+    }
+
+    double start = bench_now();
+
+    for (unsigned int p = 0; p < in_packets; p++) {
+        // Counted rules work in seconds, so let time move on a little
+        if ((p & 0xFFFF) == 0)
+            globalreg->timestamp.tv_sec++;
+
+        in_rules->ProcessPacket(pool[p % pool_size]);
+    }
+
+    double elapsed = bench_now() - start;
+
+    for (unsigned int p = 0; p < pool_size; p++)
+        delete pool[p];
+
+    return elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int num_rules = 500;
+    unsigned int num_packets = 5000000;
+
+    num_rules = bench_arg(argc, argv, 1, num_rules);
+    num_packets = bench_arg(argc, argv, 2, num_packets);
+
+    if (num_rules == 0 || num_packets == 0) {
+        fprintf(stderr, "usage: %s [rules] [packets]\n", argv[0]);
+        return 1;
+    }
+
+    GlobalRegistry *globalreg = bench_globalreg();
+
+    vector<string> alerts, rules;
+
+    for (unsigned int a = 0; a < kismin(num_rules, (unsigned int) BENCH_ALERT_NAMES); a++)
+        alerts.push_back("BENCH" + UIntToString(a) + ",10/min,1/sec");
+
+    for (unsigned int r = 0; r < num_rules; r++)
+        rules.push_back(bench_rule(r));
+
+    globalreg->kismet_config->SetOptVec("alert", alerts, 0);
+    globalreg->kismet_config->SetOptVec("alertrule", rules, 0);
+
+    globalreg->entrytracker = new EntryTracker(globalreg);
+    globalreg->packetchain = new Packetchain(globalreg);
+    globalreg->timetracker = new Timetracker(globalreg);
+
+    new Alertracker(globalreg);
+
+    double load_start = bench_now();
+    AlertRules *alertrules = new AlertRules(globalreg);
+    double load_time = bench_now() - load_start;
+
+    if (globalreg->fatal_condition) {
+        fprintf(stderr, "failed to load the rules\n");
+        return 1;
+    }
+
+    printf("%u rules loaded and compiled in %.1fms, %u packets\n", num_rules,
+            load_time * 1000, num_packets);
+
+    double quiet = bench_run(alertrules, globalreg, num_packets, false);
+    printf("no matches    %7.1f ns/packet\n", quiet * 1000000000.0 / num_packets);
+
+    double mixed = bench_run(alertrules, globalreg, num_packets, true);
+    printf("some matches  %7.1f ns/packet\n", mixed * 1000000000.0 / num_packets);
+
+    return 0;
+}
+
@@ -0,0 +1,158 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// MAC filter benchmark:  fills a kis_mac_filter with addresses, OUI masks and
+// a few masks which aren't a prefix, checks its lookups against a brute force
+// compare, and times them against a macmap holding the same entries.
+//
+//   bench_macfilter [entries] [lookups]
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "bench_util.h"
+#include "macaddr.h"
+#include "kis_macfilter.h"
+
+static uint64_t bench_random_mac() {
+    return ((((uint64_t) rand()) << 32) ^ ((uint64_t) rand() << 8) ^ rand()) &
+        0xFFFFFFFFFFFFULL;
+}
+
+// An address, or a masked one the way the config parser makes them
+static mac_addr bench_mac(uint64_t in_mac, uint64_t in_mask) {
+    mac_addr mac;
+
+    mac.longmac = in_mac & in_mask;
+
+    if (in_mask != 0xFFFFFFFFFFFFULL)
+        mac.longmask = in_mask;
+
+    return mac;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int num_entries = 10000;
+    unsigned int num_lookups = 1000000;
+
+    num_entries = bench_arg(argc, argv, 1, num_entries);
+    num_lookups = bench_arg(argc, argv, 2, num_lookups);
+
+    if (num_entries == 0 || num_lookups == 0) {
+        fprintf(stderr, "usage: %s [entries] [lookups]\n", argv[0]);
+        return 1;
+    }
+
+    srand(1);
+
+    // Every tenth entry is an OUI, one in a hundred has a mask which isn't a
+    // prefix; roles go round bssid, source and dest
+    vector<mac_addr> entries;
+    vector<unsigned int> entry_roles;
+
+    for (unsigned int e = 0; e < num_entries; e++) {
+        uint64_t mask = 0xFFFFFFFFFFFFULL;
+
+        if (e % 100 == 0)
+            mask = 0xFF00FF000000ULL;
+        else if (e % 10 == 0)
+            mask = 0xFFFFFF000000ULL;
+
+        entries.push_back(bench_mac(bench_random_mac(), mask));
+        entry_roles.push_back(1 << (e % 3));
+    }
+
+    kis_mac_filter filter;
+    macmap<unsigned int> map;
+
+    double build_start = bench_now();
+
+    for (unsigned int e = 0; e < num_entries; e++)
+        filter.insert(entries[e], entry_roles[e]);
+
+    double build_filter = bench_now() - build_start;
+
+    build_start = bench_now();
+
+    for (unsigned int e = 0; e < num_entries; e++)
+        map.insert(entries[e], entry_roles[e]);
+
+    double build_map = bench_now() - build_start;
+
+    // Half the lookups hit an entry, half are random addresses
+    vector<mac_addr> lookups;
+
+    for (unsigned int l = 0; l < 65536; l++) {
+        uint64_t mac = bench_random_mac();
+
+        if (l % 2 == 0) {
+            const mac_addr &e = entries[rand() % num_entries];
+            mac = (e.longmac & e.longmask) | (mac & ~e.longmask);
+        }
+
+        lookups.push_back(bench_mac(mac, 0xFFFFFFFFFFFFULL));
+    }
+
+    // Brute force compare of the roles found for a sample of the lookups
+    unsigned int checked = 0, mismatches = 0;
+
+    for (unsigned int l = 0; l < lookups.size(); l += 16) {
+        unsigned int roles = 0;
+
+        for (unsigned int e = 0; e < num_entries; e++) {
+            if ((lookups[l].longmac & entries[e].longmask) == entries[e].longmac)
+                roles |= entry_roles[e];
+        }
+
+        if (roles != filter.find(lookups[l]))
+            mismatches++;
+
+        checked++;
+    }
+
+    unsigned long filter_hits = 0, map_hits = 0;
+
+    double start = bench_now();
+
+    for (unsigned int l = 0; l < num_lookups; l++)
+        filter_hits += filter.find(lookups[l & 0xFFFF]) != 0;
+
+    double filter_time = bench_now() - start;
+
+    start = bench_now();
+
+    for (unsigned int l = 0; l < num_lookups; l++)
+        map_hits += map.find(lookups[l & 0xFFFF]) != map.end();
+
+    double map_time = bench_now() - start;
+
+    printf("%u entries, %u lookups\n", num_entries, num_lookups);
+    printf("build    filter %.1fms, macmap %.1fms\n", build_filter * 1000,
+            build_map * 1000);
+    printf("lookup   filter %.1f ns, macmap %.1f ns  (hits %lu, %lu)\n",
+            filter_time * 1000000000.0 / num_lookups,
+            map_time * 1000000000.0 / num_lookups, filter_hits, map_hits);
+    printf("brute force compare of %u lookups: %u mismatches\n", checked,
+            mismatches);
+
+    return mismatches == 0 ? 0 : 1;
+}
+
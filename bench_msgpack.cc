@@ -0,0 +1,158 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Msgpack round-trip benchmark:  packs a list of populated devices, unpacks
+// it into a new tree, packs that again and checks the two encodings match
+// and that the devices came back as kis_tracked_device_base records.
+//
+//   bench_msgpack [devices] [rounds]
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sstream>
+
+#include "bench_util.h"
+#include "entrytracker.h"
+#include "devicetracker.h"
+#include "msgpack_adapter.h"
+
+int main(int argc, char *argv[]) {
+    unsigned int num_devices = 10000;
+    unsigned int rounds = 5;
+
+    num_devices = bench_arg(argc, argv, 1, num_devices);
+    rounds = bench_arg(argc, argv, 2, rounds);
+
+    if (num_devices == 0 || rounds == 0) {
+        fprintf(stderr, "usage: %s [devices] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    GlobalRegistry *globalreg = bench_globalreg();
+    globalreg->entrytracker = new EntryTracker(globalreg);
+
+    kis_tracked_device_base *base_builder =
+        new kis_tracked_device_base(globalreg, 0);
+    int device_base_id =
+        globalreg->entrytracker->RegisterField("kismet.device.base", 
+                base_builder, "core device record");
+    delete(base_builder);
+    int device_list_id =
+        globalreg->entrytracker->RegisterField("kismet.device.list",
+                TrackerVector, "list of devices");
+    globalreg->entrytracker->RegisterContainerEntry(device_list_id,
+            device_base_id);
+
+    TrackerElement *devlist =
+        globalreg->entrytracker->GetTrackedInstance(device_list_id);
+    devlist->link();
+
+    srand(1);
+
+    for (unsigned int i = 0; i < num_devices; i++) {
+        kis_tracked_device_base *dev =
+            new kis_tracked_device_base(globalreg, device_base_id);
+
+        mac_addr mac((uint64_t) (0x001122000000ULL + i));
+
+        dev->set_key(i + 1);
+        dev->set_macaddr(mac);
+        dev->set_phyname("IEEE802.11");
+        dev->set_devicename("device " + IntToString(i));
+        dev->set_manuf("Bench Manuf");
+        dev->set_first_time(1000000 + i);
+        dev->set_last_time(1000000 + i + rand() % 3600);
+        dev->set_packets(rand() % 10000);
+        dev->set_datasize(rand() % 1000000);
+
+        for (unsigned int f = 0; f < 4; f++)
+            dev->inc_frequency_count(2412000 + (rand() % 13) * 5000);
+
+        for (unsigned int s = 0; s < 120; s++)
+            dev->get_packets_rrd()->add_sample(rand() % 50, 1000000 + i + s);
+
+        devlist->add_vector(dev);
+    }
+
+    double pack_time = 0, unpack_time = 0, repack_time = 0;
+    size_t packed_len = 0;
+    bool match = true;
+    bool typed = true;
+
+    for (unsigned int r = 0; r < rounds; r++) {
+        double start = bench_now();
+
+        std::stringstream packed;
+        MsgpackAdapter::Pack(globalreg, packed, devlist);
+        std::string packed_str = packed.str();
+
+        double pack_end = bench_now();
+
+        msgpack::unpacked result;
+        msgpack::unpack(result, packed_str.data(), packed_str.size());
+
+        MsgpackAdapter::Unpacker unpacker(globalreg);
+        TrackerElement *rebuilt = unpacker.Unpack(result.get(), device_list_id);
+        rebuilt->link();
+
+        double unpack_end = bench_now();
+
+        std::stringstream repacked;
+        MsgpackAdapter::Pack(globalreg, repacked, rebuilt);
+
+        double repack_end = bench_now();
+
+        pack_time += pack_end - start;
+        unpack_time += unpack_end - pack_end;
+        repack_time += repack_end - unpack_end;
+        packed_len = packed_str.length();
+
+        if (repacked.str() != packed_str)
+            match = false;
+
+        // Devices have to come back as real device records, not as generic
+        // maps which happen to repack to the same bytes
+        TrackerElement::tracked_vector *rvec = rebuilt->get_vector();
+        if (rvec->size() != num_devices)
+            typed = false;
+        for (unsigned int d = 0; d < rvec->size(); d++) {
+            if (dynamic_cast<kis_tracked_device_base *>((*rvec)[d]) == NULL)
+                typed = false;
+        }
+
+        rebuilt->unlink();
+    }
+
+    double per = 1000000.0 / ((double) num_devices * rounds);
+
+    printf("%u devices, %u rounds, %lu bytes packed\n", num_devices, rounds,
+            (unsigned long) packed_len);
+    printf("pack     %8.2f us/device\n", pack_time * per);
+    printf("unpack   %8.2f us/device\n", unpack_time * per);
+    printf("repack   %8.2f us/device\n", repack_time * per);
+    printf("round trip %s\n", match ? "matches" : "DOES NOT MATCH");
+    printf("device type %s\n", typed ? "kis_tracked_device_base" : 
+            "WRONG (generic element)");
+
+    devlist->unlink();
+
+    return (match && typed) ? 0 : 1;
+}
+
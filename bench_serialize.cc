@@ -0,0 +1,195 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Serialization benchmark:  builds a device list and times packing all of it
+// as JSON and as msgpack, the way the all_devices endpoints do.  Output goes
+// to a stream which only counts and checksums it, so the output buffer
+// doesn't dominate the memory use.
+//
+// A device record with its RRDs takes tens of KB of memory, so the list is
+// made of a smaller number of distinct records, each of which appears in it
+// several times.
+//
+//   bench_serialize [devices] [distinct records] [rounds]
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sstream>
+#include <streambuf>
+
+#include "bench_util.h"
+#include "entrytracker.h"
+#include "devicetracker.h"
+#include "msgpack_adapter.h"
+#include "json_adapter.h"
+
+// Stream buffer which discards what it's given, keeping the length and a
+// checksum so the output of runs can be compared
+class bench_count_buf : public std::streambuf {
+public:
+    bench_count_buf() {
+        length = 0;
+        checksum = 0;
+    }
+
+    uint64_t length;
+    uint32_t checksum;
+
+protected:
+    virtual int overflow(int c) {
+        if (c != EOF) {
+            checksum = checksum * 31 + (uint8_t) c;
+            length++;
+        }
+
+        return c;
+    }
+
+    virtual std::streamsize xsputn(const char *s, std::streamsize n) {
+        for (std::streamsize i = 0; i < n; i++)
+            checksum = checksum * 31 + (uint8_t) s[i];
+
+        length += n;
+
+        return n;
+    }
+};
+
+int main(int argc, char *argv[]) {
+    unsigned int num_devices = 100000;
+    unsigned int num_distinct = 10000;
+    unsigned int rounds = 3;
+
+    num_devices = bench_arg(argc, argv, 1, num_devices);
+    num_distinct = bench_arg(argc, argv, 2, num_distinct);
+    rounds = bench_arg(argc, argv, 3, rounds);
+
+    if (num_distinct > num_devices)
+        num_distinct = num_devices;
+
+    if (num_devices == 0 || num_distinct == 0 || rounds == 0) {
+        fprintf(stderr, "usage: %s [devices] [distinct records] [rounds]\n", 
+                argv[0]);
+        return 1;
+    }
+
+    GlobalRegistry *globalreg = bench_globalreg();
+    globalreg->entrytracker = new EntryTracker(globalreg);
+
+    kis_tracked_device_base *base_builder =
+        new kis_tracked_device_base(globalreg, 0);
+    int device_base_id =
+        globalreg->entrytracker->RegisterField("kismet.device.base", 
+                base_builder, "core device record");
+    delete(base_builder);
+    int device_list_id =
+        globalreg->entrytracker->RegisterField("kismet.device.list",
+                TrackerVector, "list of devices");
+
+    TrackerElement *devlist =
+        globalreg->entrytracker->GetTrackedInstance(device_list_id);
+    devlist->link();
+
+    srand(1);
+
+    double build_start = bench_now();
+
+    vector<kis_tracked_device_base *> records;
+
+    for (unsigned int i = 0; i < num_distinct; i++) {
+        kis_tracked_device_base *dev =
+            new kis_tracked_device_base(globalreg, device_base_id);
+
+        mac_addr mac((uint64_t) (0x001122000000ULL + i));
+
+        dev->set_key(i + 1);
+        dev->set_macaddr(mac);
+        dev->set_phyname("IEEE802.11");
+        dev->set_devicename("device \"" + IntToString(i) + "\"");
+        dev->set_manuf("Bench Manuf");
+        dev->set_first_time(1000000 + i);
+        dev->set_last_time(1000000 + i + rand() % 3600);
+        dev->set_packets(rand() % 10000);
+        dev->set_datasize(rand() % 1000000);
+        dev->set_frequency(2412000 + (rand() % 13) * 5000);
+
+        for (unsigned int f = 0; f < 4; f++)
+            dev->inc_frequency_count(2412000 + (rand() % 13) * 5000);
+
+        for (unsigned int s = 0; s < 30; s++)
+            dev->get_packets_rrd()->add_sample(rand() % 50, 1000000 + i + s);
+
+        records.push_back(dev);
+    }
+
+    for (unsigned int i = 0; i < num_devices; i++)
+        devlist->add_vector(records[i % num_distinct]);
+
+    printf("%u devices (%u distinct) built in %.2fs, %u rounds\n", 
+            num_devices, num_distinct, bench_now() - build_start, rounds);
+
+    for (unsigned int format = 0; format < 2; format++) {
+        double elapsed = 0, cpu = 0;
+        uint64_t length = 0;
+        uint32_t checksum = 0;
+        bool stable = true;
+
+        for (unsigned int r = 0; r < rounds; r++) {
+            // The adapters take a stringstream; point it at the counting
+            // buffer instead of its own string
+            bench_count_buf buf;
+            std::stringstream stream;
+            stream.std::ios::rdbuf(&buf);
+
+            double start = bench_now();
+            clock_t cpu_start = clock();
+
+            if (format == 0)
+                JsonAdapter::Pack(globalreg, stream, devlist);
+            else
+                MsgpackAdapter::Pack(globalreg, stream, devlist);
+
+            elapsed += bench_now() - start;
+            cpu += (double) (clock() - cpu_start) / CLOCKS_PER_SEC;
+
+            if (r != 0 && (buf.length != length || buf.checksum != checksum))
+                stable = false;
+
+            length = buf.length;
+            checksum = buf.checksum;
+        }
+
+        double per_round = elapsed / rounds;
+        double cpu_round = cpu / rounds;
+
+        printf("%-8s %7.3fs/round (%.3fs cpu)  %6.2f us/device  %7.1f MB/s  "
+                "%llu bytes  checksum %08x%s\n",
+                format == 0 ? "json" : "msgpack", per_round, cpu_round,
+                per_round * 1000000.0 / num_devices,
+                (length / (1024.0 * 1024.0)) / per_round,
+                (unsigned long long) length, checksum,
+                stable ? "" : "  OUTPUT CHANGED BETWEEN ROUNDS");
+    }
+
+    devlist->unlink();
+
+    return 0;
+}
+
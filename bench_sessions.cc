@@ -0,0 +1,197 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// HTTP session load test:  login threads add sessions, and log some of them
+// out again, while lookup threads check session cookies the way the request
+// handler does.  The session log is written by the background flusher as it
+// would be in the server; afterwards a new server replays the log and must
+// end up with the same sessions.
+//
+//   bench_sessions [logins per thread] [login threads] [lookup threads]
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bench_util.h"
+#include "kis_net_microhttpd.h"
+
+// Server with the session calls of the request path exposed
+class bench_session_httpd : public Kis_Net_Httpd {
+public:
+    bench_session_httpd(GlobalRegistry *in_globalreg) :
+        Kis_Net_Httpd(in_globalreg) { }
+
+    void Login(const string &in_key, time_t in_lifetime) {
+        Kis_Net_Httpd_Session *s = new Kis_Net_Httpd_Session();
+
+        s->sessionid = in_key;
+        s->session_created = globalreg->timestamp.tv_sec;
+        s->session_seen = s->session_created;
+        s->session_lifetime = in_lifetime;
+
+        AddSession(s);
+    }
+
+    void Logout(const string &in_key) {
+        DelSession(in_key);
+    }
+
+    bool Lookup(const char *in_key) {
+        unsigned int epoch = session_table.ReadLock();
+        bool valid = TouchSession(in_key) != NULL;
+        session_table.ReadUnlock(epoch);
+
+        return valid;
+    }
+
+    unsigned int LiveSessions() {
+        return session_table.Size();
+    }
+};
+
+static bench_session_httpd *bench_httpd;
+static unsigned int bench_logins = 25000;
+static unsigned int bench_login_threads = 4;
+static volatile int bench_stop = 0;
+static unsigned long bench_lookups = 0, bench_hits = 0;
+
+static void bench_session_key(unsigned int in_thread, unsigned int in_num,
+        char *ret_key) {
+    snprintf(ret_key, 33, "%08X%08X%08X%08X", in_thread, in_num * 2654435761U,
+            in_num, ~in_num);
+}
+
+// Each login thread logs in its own sessions; every fourth one is logged
+// out again and every other one never expires
+static void *bench_login_thread(void *in_aux) {
+    unsigned int id = (unsigned long) in_aux;
+    char key[33];
+
+    for (unsigned int i = 0; i < bench_logins; i++) {
+        bench_session_key(id, i, key);
+        bench_httpd->Login(key, (i % 2) ? 0 : 3600);
+
+        if (i % 4 == 3)
+            bench_httpd->Logout(key);
+    }
+
+    return NULL;
+}
+
+static void *bench_lookup_thread(void *in_aux) {
+    unsigned int id = (unsigned long) in_aux;
+    unsigned long lookups = 0, hits = 0;
+    char key[33];
+
+    while (!bench_stop) {
+        bench_session_key(id % bench_login_threads,
+                (lookups * 7) % bench_logins, key);
+
+        if (bench_httpd->Lookup(key))
+            hits++;
+
+        lookups++;
+    }
+
+    __sync_add_and_fetch(&bench_lookups, lookups);
+    __sync_add_and_fetch(&bench_hits, hits);
+
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int lookup_threads = 4;
+
+    bench_logins = bench_arg(argc, argv, 1, bench_logins);
+    bench_login_threads = bench_arg(argc, argv, 2, bench_login_threads);
+    lookup_threads = bench_arg(argc, argv, 3, lookup_threads);
+
+    if (bench_logins == 0 || bench_login_threads == 0) {
+        fprintf(stderr, "usage: %s [logins per thread] [login threads] "
+                "[lookup threads]\n", argv[0]);
+        return 1;
+    }
+
+    char dbpath[] = "/tmp/bench_sessions_XXXXXX";
+    int dbfd = mkstemp(dbpath);
+
+    if (dbfd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+
+    close(dbfd);
+
+    GlobalRegistry *globalreg = bench_globalreg();
+
+    globalreg->kismet_config->SetOptVec("httpd_session_db",
+            vector<string>(1, dbpath), 0);
+
+    bench_httpd = new bench_session_httpd(globalreg);
+
+    vector<pthread_t> logins(bench_login_threads);
+    vector<pthread_t> lookups(lookup_threads);
+
+    double start = bench_now();
+
+    for (unsigned long i = 0; i < lookup_threads; i++)
+        pthread_create(&lookups[i], NULL, bench_lookup_thread, (void *) i);
+    for (unsigned long i = 0; i < bench_login_threads; i++)
+        pthread_create(&logins[i], NULL, bench_login_thread, (void *) i);
+
+    for (unsigned int i = 0; i < bench_login_threads; i++)
+        pthread_join(logins[i], NULL);
+
+    double elapsed = bench_now() - start;
+
+    bench_stop = 1;
+
+    for (unsigned int i = 0; i < lookup_threads; i++)
+        pthread_join(lookups[i], NULL);
+
+    unsigned long total_logins =
+        (unsigned long) bench_logins * bench_login_threads;
+    unsigned int live = bench_httpd->LiveSessions();
+
+    printf("%u login threads, %u lookup threads, %.3fs\n",
+            bench_login_threads, lookup_threads, elapsed);
+    printf("logins   %9lu  %10.0f/s\n", total_logins, total_logins / elapsed);
+    printf("logouts  %9lu  %10.0f/s\n", total_logins / 4,
+            (total_logins / 4) / elapsed);
+    printf("lookups  %9lu  %10.0f/s  %lu hits\n", bench_lookups,
+            bench_lookups / elapsed, bench_hits);
+
+    // Shutting down writes out the rest of the log
+    delete(bench_httpd);
+
+    bench_httpd = new bench_session_httpd(globalreg);
+    unsigned int reloaded = bench_httpd->LiveSessions();
+    delete(bench_httpd);
+
+    printf("live sessions %u, reloaded from the log %u: %s\n", live, reloaded,
+            live == reloaded ? "match" : "MISMATCH");
+
+    unlink(dbpath);
+
+    return live == reloaded ? 0 : 1;
+}
+
@@ -0,0 +1,64 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Shared helpers for the standalone benchmarks and simulations built by
+// 'make benchmarks'
+
+#ifndef __BENCH_UTIL_H__
+#define __BENCH_UTIL_H__
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "globalregistry.h"
+#include "messagebus.h"
+#include "configfile.h"
+
+// Wall clock time in seconds
+static inline double bench_now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+// Optional positional count argument, numbered from 1
+static inline unsigned int bench_arg(int argc, char *argv[], int in_pos, 
+        unsigned int in_default) {
+    if (argc > in_pos)
+        return strtoul(argv[in_pos], NULL, 10);
+
+    return in_default;
+}
+
+// Registry with a message bus and an empty config, and the clock set to now;
+// anything else a benchmark needs is added on top
+static inline GlobalRegistry *bench_globalreg() {
+    GlobalRegistry *globalreg = new GlobalRegistry();
+
+    globalreg->messagebus = new MessageBus(globalreg);
+    globalreg->kismet_config = new ConfigFile(globalreg);
+    globalreg->timestamp.tv_sec = time(0);
+
+    return globalreg;
+}
+
+#endif
+
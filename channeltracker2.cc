@@ -24,16 +24,26 @@
 #include "devicetracker.h"
 #include "devicetracker_component.h"
 #include "packinfo_signal.h"
+#include "kis_timeseries.h"
 
 Channeltracker_V2::Channeltracker_V2(GlobalRegistry *in_globalreg) :
     tracker_component(in_globalreg, 0), Kis_Net_Httpd_Stream_Handler(in_globalreg) {
 
-    // Number of seconds we consider a device to be active on a frequency 
-    // after the last time we see it
-    device_decay = 5;
+    for (unsigned int i = 0; i < FREQ_SLOTS; i++) {
+        freq_slots[i].freq_khz = 0;
+        freq_slots[i].freq_channel = NULL;
+        freq_slots[i].chan_channel = NULL;
+    }
+
+    channel_changed = 0;
 
     globalreg = in_globalreg;
 
+    timeseries = (TimeseriesStore *) globalreg->FetchGlobal("TIMESERIES_STORE");
+
+    if (timeseries != NULL && !timeseries->FetchEnabled())
+        timeseries = NULL;
+
     globalreg->InsertGlobal("CHANNEL_TRACKER", this);
 
     register_fields();
@@ -62,6 +72,11 @@ Channeltracker_V2::Channeltracker_V2(GlobalRegistry *in_globalreg) :
 
     // Always link ourselves so that serialization doesn't unlink us
     link();
+
+    Httpd_RegisterCachedRoute("GET", "/channels/channels.msgpack", 0, 
+            &channel_generation);
+    Httpd_RegisterCachedRoute("GET", "/channels/channels.json", 0, 
+            &channel_generation);
 }
 
 Channeltracker_V2::~Channeltracker_V2() {
@@ -87,19 +102,9 @@ void Channeltracker_V2::register_fields() {
     channel_entry_id = RegisterComplexField("kismet.channeltracker.channel",
             chan_builder, "channel/frequency entry");
     delete(chan_builder);
-}
-
-bool Channeltracker_V2::Httpd_VerifyPath(const char *path, const char *method) {
-    if (strcmp(method, "GET") != 0)
-        return false;
-
-    if (strcmp(path, "/channels/channels.msgpack") == 0)
-        return true;
-
-    if (strcmp(path, "/channels/channels.json") == 0)
-        return true;
 
-    return false;
+    globalreg->entrytracker->RegisterContainerEntry(freq_map_id, channel_entry_id);
+    globalreg->entrytracker->RegisterContainerEntry(channel_map_id, channel_entry_id);
 }
 
 void Channeltracker_V2::Httpd_CreateStreamResponse(
@@ -117,66 +122,51 @@ void Channeltracker_V2::Httpd_CreateStreamResponse(
     }
 
     if (strcmp(path, "/channels/channels.msgpack") == 0) {
+        lock_channels(true);
         MsgpackAdapter::Pack(globalreg, stream, this);
+        lock_channels(false);
         return;
     }
 
     if (strcmp(path, "/channels/channels.json") == 0) {
+        lock_channels(true);
         JsonAdapter::Pack(globalreg, stream, this);
+        lock_channels(false);
         return;
     }
 }
 
-class channeltracker_v2_device_worker : public DevicetrackerFilterWorker {
-public:
-    channeltracker_v2_device_worker(GlobalRegistry *in_globalreg,
-            Channeltracker_V2 *channelv2) {
-        globalreg = in_globalreg;
-        this->channelv2 = channelv2;
+void Channeltracker_V2::lock_channels(bool in_lock) {
+    for (TrackerElement::double_map_iterator i = frequency_map->double_begin();
+            i != frequency_map->double_end(); ++i) {
+        if (in_lock)
+            i->second->thread_mutex_lock();
+        else
+            i->second->thread_mutex_unlock();
     }
 
-    virtual ~channeltracker_v2_device_worker() {
-
+    for (TrackerElement::string_map_iterator i = channel_map->string_begin();
+            i != channel_map->string_end(); ++i) {
+        if (in_lock)
+            i->second->thread_mutex_lock();
+        else
+            i->second->thread_mutex_unlock();
     }
+}
 
-    // Count all the devices.  We use a filter worker but 'match' on all
-    // and count them into our local map
-    virtual void MatchDevice(Devicetracker *devicetracker __attribute__((unused)),
-            kis_tracked_device_base *device) {
-        if (device == NULL)
-            return;
-
-        if (device->get_last_time() < globalreg->timestamp.tv_sec - 
-                channelv2->device_decay)
-            return;
-
-        map<double, unsigned int>::iterator i =
-            device_count.find(device->get_frequency());
-
-        if (i != device_count.end()) {
-            i->second++;
-        } else {
-            device_count[device->get_frequency()] = 1;
-        }
-    }
+int Channeltracker_V2::timetracker_event(int event_id __attribute__((unused))) {
+    {
+        local_locker locker(&lock);
 
-    // Send it back to our channel tracker
-    virtual void Finalize(Devicetracker *devicetracker __attribute__((unused))) {
-        channelv2->update_device_counts(device_count);
+        // Close out the last second of channels which haven't seen a packet
+        // since
+        flush_device_counts(globalreg->timestamp.tv_sec);
     }
 
-protected:
-    GlobalRegistry *globalreg;
-    Channeltracker_V2 *channelv2;
-
-    map<double, unsigned int> device_count;
-
-};
-
-
-int Channeltracker_V2::timetracker_event(int event_id __attribute__((unused))) {
-    channeltracker_v2_device_worker worker(globalreg, this);
-    globalreg->devicetracker->MatchOnDevices(&worker);
+    // Channel records change with every packet; cached responses are only
+    // invalidated once a second, if anything changed
+    if (__sync_bool_compare_and_swap(&channel_changed, 1, 0))
+        channel_generation.Bump();
 
     // Reschedule
     struct timeval trigger_tm;
@@ -189,70 +179,154 @@ int Channeltracker_V2::timetracker_event(int event_id __attribute__((unused))) {
     return 1;
 }
 
-void Channeltracker_V2::update_device_counts(map<double, unsigned int> in_counts) {
+void Channeltracker_V2::flush_device_counts(time_t in_now) {
+    for (TrackerElement::double_map_iterator i = frequency_map->double_begin();
+            i != frequency_map->double_end(); ++i) {
+        Channeltracker_V2_Channel *chan = (Channeltracker_V2_Channel *) i->second;
+        TrackerElementScopeLocker clock(chan);
+        chan->flush_second_devices(in_now);
+    }
+
+    for (TrackerElement::string_map_iterator i = channel_map->string_begin();
+            i != channel_map->string_end(); ++i) {
+        Channeltracker_V2_Channel *chan = (Channeltracker_V2_Channel *) i->second;
+        TrackerElementScopeLocker clock(chan);
+        chan->flush_second_devices(in_now);
+    }
+}
+
+void Channeltracker_V2::attach_history(Channeltracker_V2_Channel *in_chan,
+        string in_prefix) {
+    if (timeseries == NULL)
+        return;
+
+    in_chan->get_packets_rrd()->set_history(timeseries,
+            timeseries->FetchSeries(in_prefix + "/packets"));
+    in_chan->get_data_rrd()->set_history(timeseries,
+            timeseries->FetchSeries(in_prefix + "/data"));
+    in_chan->get_device_rrd()->set_history(timeseries,
+            timeseries->FetchSeries(in_prefix + "/devices"));
+}
+
+Channeltracker_V2::freq_slot *Channeltracker_V2::find_freq_slot(double in_freq_khz) {
+    // Channels are at least 5MHz apart, so hashing by MHz spreads the common
+    // bands over the table
+    unsigned int start = ((unsigned int) (in_freq_khz / 1000)) % FREQ_SLOTS;
+
+    for (unsigned int i = 0; i < FREQ_SLOTS; i++) {
+        freq_slot *slot = &(freq_slots[(start + i) % FREQ_SLOTS]);
+
+        if (slot->freq_khz == in_freq_khz || slot->freq_channel == NULL)
+            return slot;
+    }
+
+    return NULL;
+}
+
+int64_t Channeltracker_V2::get_recent_packets(unsigned int in_channel, int in_secs) {
     local_locker locker(&lock);
-    time_t ts = globalreg->timestamp.tv_sec;
+    Channeltracker_V2_Channel *chan = NULL;
 
-    for (map<double, unsigned int>::iterator i = in_counts.begin();
-            i != in_counts.end(); ++i) {
+    TrackerElement::string_map_iterator smi =
+        channel_map->string_find(IntToString(in_channel));
 
+    if (smi != channel_map->string_end()) {
+        chan = (Channeltracker_V2_Channel *) smi->second;
+    } else if (in_channel > 1000) {
         TrackerElement::double_map_iterator imi =
-            frequency_map->double_find(i->first);
+            frequency_map->double_find((double) in_channel * 1000);
 
-        // If we can't find the device, skip it
-        if (imi == frequency_map->double_end())
-            continue;
-
-        // Update the device RRD for the count
-        ((Channeltracker_V2_Channel *) imi->second)->get_device_rrd()->add_sample(
-                i->second, ts);
+        if (imi != frequency_map->double_end())
+            chan = (Channeltracker_V2_Channel *) imi->second;
     }
+
+    if (chan == NULL)
+        return 0;
+
+    TrackerElementScopeLocker clock(chan);
+
+    return chan->get_packets_rrd()->get_recent_sum(globalreg->timestamp.tv_sec,
+            in_secs);
 }
 
 int Channeltracker_V2::PacketChainHandler(CHAINCALL_PARMS) {
     Channeltracker_V2 *cv2 = (Channeltracker_V2 *) auxdata;
 
-    local_locker locker(&(cv2->lock));
-
     kis_layer1_packinfo *l1info =
         (kis_layer1_packinfo *) in_pack->fetch(cv2->pack_comp_l1data);
 	kis_common_info *common = 
 		(kis_common_info *) in_pack->fetch(cv2->pack_comp_common);
+    kis_tracked_device_info *devinfo =
+        (kis_tracked_device_info *) in_pack->fetch(cv2->pack_comp_device);
 
     // Nothing to do with no l1info
     if (l1info == NULL)
         return 1;
 
+    time_t ts = cv2->globalreg->timestamp.tv_sec;
+
     Channeltracker_V2_Channel *freq_channel = NULL;
     Channeltracker_V2_Channel *chan_channel = NULL;
+    freq_slot *slot = NULL;
 
-    // Find or make a frequency record if we know our frequency
+    // Packets are handled one at a time under the packet chain lock, so the
+    // slot table and the maps only change here; lookups don't need the 
+    // tracker lock, only adding a record to the maps does
     if (l1info->freq_khz != 0) {
-        TrackerElement::double_map_iterator imi =
-            cv2->frequency_map->double_find(l1info->freq_khz);
+        slot = cv2->find_freq_slot(l1info->freq_khz);
 
-        if (imi == cv2->frequency_map->double_end()) {
-            freq_channel = 
-                new Channeltracker_V2_Channel(cv2->globalreg, cv2->channel_entry_id);
-            freq_channel->set_frequency(l1info->freq_khz);
-            cv2->frequency_map->add_doublemap(l1info->freq_khz, freq_channel);
+        if (slot != NULL && slot->freq_channel != NULL) {
+            freq_channel = slot->freq_channel;
         } else {
-            freq_channel = (Channeltracker_V2_Channel *) imi->second;
+            TrackerElement::double_map_iterator imi =
+                cv2->frequency_map->double_find(l1info->freq_khz);
+
+            if (imi == cv2->frequency_map->double_end()) {
+                freq_channel = 
+                    new Channeltracker_V2_Channel(cv2->globalreg, cv2->channel_entry_id);
+                freq_channel->set_frequency(l1info->freq_khz);
+                cv2->attach_history(freq_channel, 
+                        "frequency/" + ULongToString((unsigned long) l1info->freq_khz));
+
+                local_locker locker(&(cv2->lock));
+                cv2->frequency_map->add_doublemap(l1info->freq_khz, freq_channel);
+            } else {
+                freq_channel = (Channeltracker_V2_Channel *) imi->second;
+            }
+
+            if (slot != NULL) {
+                slot->freq_khz = l1info->freq_khz;
+                slot->freq_channel = freq_channel;
+            }
         }
     }
 
     if (common != NULL) {
         if (!(common->channel == "0") && !(common->channel == "")) {
-            TrackerElement::string_map_iterator smi =
-                cv2->channel_map->string_find(common->channel);
-
-            if (smi == cv2->channel_map->string_end()) {
-                chan_channel =
-                    new Channeltracker_V2_Channel(cv2->globalreg, cv2->channel_entry_id);
-                chan_channel->set_channel(common->channel);
-                cv2->channel_map->add_stringmap(common->channel, chan_channel);
+            if (slot != NULL && slot->chan_channel != NULL &&
+                    slot->channel_name == common->channel) {
+                chan_channel = slot->chan_channel;
             } else {
-                chan_channel = (Channeltracker_V2_Channel *) smi->second;
+                TrackerElement::string_map_iterator smi =
+                    cv2->channel_map->string_find(common->channel);
+
+                if (smi == cv2->channel_map->string_end()) {
+                    chan_channel =
+                        new Channeltracker_V2_Channel(cv2->globalreg, 
+                                cv2->channel_entry_id);
+                    chan_channel->set_channel(common->channel);
+                    cv2->attach_history(chan_channel, "channel/" + common->channel);
+
+                    local_locker locker(&(cv2->lock));
+                    cv2->channel_map->add_stringmap(common->channel, chan_channel);
+                } else {
+                    chan_channel = (Channeltracker_V2_Channel *) smi->second;
+                }
+
+                if (slot != NULL) {
+                    slot->channel_name = common->channel;
+                    slot->chan_channel = chan_channel;
+                }
             }
         }
     }
@@ -261,62 +335,65 @@ int Channeltracker_V2::PacketChainHandler(CHAINCALL_PARMS) {
     if (freq_channel == NULL && chan_channel == NULL)
         return 1;
 
+    if (cv2->channel_changed == 0)
+        cv2->channel_changed = 1;
+
+    // Count the device the first time we see it on this frequency this second;
+    // the distinct device sketches only need to see it once a second too.
+    // There's a bit per frequency slot, so a device seen on many channels is
+    // still counted once on each.
+    bool count_dev = false;
+    kis_tracked_device_base *dev = NULL;
+
+    if (slot != NULL && devinfo != NULL && devinfo->devref != NULL) {
+        dev = devinfo->devref;
+        unsigned int slot_num = (unsigned int) (slot - cv2->freq_slots);
+        uint64_t bit = ((uint64_t) 1) << (slot_num % 64);
+
+        if (dev->channel_count_time != ts) {
+            dev->channel_count_time = ts;
+            memset(dev->channel_count_bits, 0, sizeof(dev->channel_count_bits));
+        }
+
+        if ((dev->channel_count_bits[slot_num / 64] & bit) == 0) {
+            dev->channel_count_bits[slot_num / 64] |= bit;
+            count_dev = true;
+        }
+    }
+
     if (freq_channel) {
+        TrackerElementScopeLocker clock(freq_channel);
+
         (*(freq_channel->get_signal_data())) += *(l1info);
-        freq_channel->get_packets_rrd()->add_sample(1, 
-                cv2->globalreg->timestamp.tv_sec);
+        freq_channel->get_packets_rrd()->add_sample(1, ts);
 
         if (common != NULL) {
-            freq_channel->get_data_rrd()->add_sample(common->datasize,
-                    cv2->globalreg->timestamp.tv_sec);
-            /*
-            freq_channel->seen_device_map[common->device] = true;
-            */
+            freq_channel->get_data_rrd()->add_sample(common->datasize, ts);
         }
 
-        /*
-        // Track unique devices
-        if (globalreg->timestamp.tv_sec != freq_channel->last_device_sec) {
-            freq_channel->last_device_sec = globalreg->timestamp.tv_sec;
-            freq_channel->seen_device_map.clear();
+        if (count_dev) {
+            freq_channel->flush_second_devices(ts);
+            freq_channel->second_devices++;
+            freq_channel->get_unique_devices()->add_device(dev->get_key(), ts);
         }
-        */
-
-        /*
-        freq_channel->get_device_rrd()->add_sample(
-                freq_channel->seen_device_map.size(),
-                globalreg->timestamp.tv_sec);
-                */
-
     }
 
     if (chan_channel) {
+        TrackerElementScopeLocker clock(chan_channel);
+
         (*(chan_channel->get_signal_data())) += *(l1info);
-        chan_channel->get_packets_rrd()->add_sample(1, 
-                cv2->globalreg->timestamp.tv_sec);
+        chan_channel->get_packets_rrd()->add_sample(1, ts);
 
         if (common != NULL) {
-            chan_channel->get_data_rrd()->add_sample(common->datasize,
-                    cv2->globalreg->timestamp.tv_sec);
+            chan_channel->get_data_rrd()->add_sample(common->datasize, ts);
         }
 
-        /*
-        // Track unique devices
-        if (globalreg->timestamp.tv_sec != chan_channel->last_device_sec) {
-            chan_channel->last_device_sec = globalreg->timestamp.tv_sec;
-            chan_channel->seen_device_map.clear();
+        if (count_dev) {
+            chan_channel->flush_second_devices(ts);
+            chan_channel->second_devices++;
+            chan_channel->get_unique_devices()->add_device(dev->get_key(), ts);
         }
-        */
-
-        /*
-        chan_channel->seen_device_map[common->device] = true;
-
-        chan_channel->get_device_rrd()->add_sample(
-                chan_channel->seen_device_map.size(),
-                globalreg->timestamp.tv_sec);
-                */
     }
 
     return 1;
 }
-
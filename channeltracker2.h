@@ -23,6 +23,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 
 #include "globalregistry.h"
 #include "trackedelement.h"
@@ -31,6 +32,8 @@
 #include "packetchain.h"
 #include "timetracker.h"
 
+class TimeseriesStore;
+
 // Can appear in the list as either a numerical frequency or a named
 // channel
 class Channeltracker_V2_Channel : public tracker_component {
@@ -40,7 +43,8 @@ public:
         register_fields();
         reserve_fields(NULL);
 
-        // last_device_sec = 0;
+        second_time = 0;
+        second_devices = 0;
     }
 
     Channeltracker_V2_Channel(GlobalRegistry *in_globalreg, 
@@ -50,7 +54,8 @@ public:
         register_fields();
         reserve_fields(e);
 
-        // last_device_sec = 0;
+        second_time = 0;
+        second_devices = 0;
     }
 
     virtual TrackerElement *clone_type() {
@@ -65,15 +70,27 @@ public:
     __ProxyTrackable(packets_rrd, uint64_rrd, packets_rrd);
     __ProxyTrackable(data_rrd, uint64_rrd, data_rrd);
     __ProxyTrackable(device_rrd,uint64_rrd, device_rrd);
+    __ProxyTrackable(unique_devices, kis_tracked_unique_rrd, unique_devices);
 
     __ProxyTrackable(signal_data, kis_tracked_signal_data, signal_data);
 
-    /*
-    // C++-domain map of devices we've seen in the last second for computing if we
-    // increase the RRD record
-    map<mac_addr, bool> seen_device_map;
-    time_t last_device_sec;
-    */
+    // Devices counted on this channel in second_time, not exported; added to
+    // the device RRD when the next second starts.  Only changed while holding
+    // the record's own lock.
+    time_t second_time;
+    unsigned int second_devices;
+
+    // Add the device count to the RRD if the second is over
+    void flush_second_devices(time_t in_now) {
+        if (second_time == in_now)
+            return;
+
+        if (second_devices != 0)
+            device_rrd->add_sample(second_devices, second_time);
+
+        second_time = in_now;
+        second_devices = 0;
+    }
 
 protected:
     // Timer for updating the device list
@@ -108,6 +125,13 @@ protected:
                     device_rrd_builder, "number of active devices RRD");
         delete(device_rrd_builder);
 
+        kis_tracked_unique_rrd *unique_builder = 
+            new kis_tracked_unique_rrd(globalreg, 0);
+        unique_devices_id =
+            RegisterComplexField("kismet.channelrec.unique_devices",
+                    unique_builder, "distinct devices over time");
+        delete(unique_builder);
+
         kis_tracked_signal_data *sig_builder =
             new kis_tracked_signal_data(globalreg, 0);
         signal_data_id =
@@ -129,6 +153,9 @@ protected:
             device_rrd = 
                 new kis_tracked_rrd<>(globalreg, 
                         device_rrd_id, e->get_map_value(device_rrd_id));
+            unique_devices =
+                new kis_tracked_unique_rrd(globalreg,
+                        unique_devices_id, e->get_map_value(unique_devices_id));
 
             signal_data =
                 new kis_tracked_signal_data(globalreg, signal_data_id,
@@ -143,6 +170,10 @@ protected:
             device_rrd = new kis_tracked_rrd<>(globalreg, device_rrd_id);
             add_map(device_rrd);
 
+            unique_devices = 
+                new kis_tracked_unique_rrd(globalreg, unique_devices_id);
+            add_map(unique_devices);
+
             signal_data =
                 new kis_tracked_signal_data(globalreg, signal_data_id);
             add_map(signal_data);
@@ -173,6 +204,10 @@ protected:
     int device_rrd_id;
     kis_tracked_rrd<> *device_rrd;
 
+    // Distinct devices per minute and hour
+    int unique_devices_id;
+    kis_tracked_unique_rrd *unique_devices;
+
     // Overall signal data.  This could in theory be populated by spectrum
     // analyzers in the future as well.
     int signal_data_id;
@@ -187,7 +222,6 @@ public:
     virtual ~Channeltracker_V2();
 
     // HTTP API
-    virtual bool Httpd_VerifyPath(const char *path, const char *method);
 
     virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
             struct MHD_Connection *connection,
@@ -197,14 +231,26 @@ public:
     // Timetracker API
     virtual int timetracker_event(int event_id);
 
-    // Update device counts
-    void update_device_counts(map<double, unsigned int> in_counts);
-
-    int device_decay;
+    // Packets seen on a channel over the last in_secs seconds (up to a
+    // minute).  Channels are looked up by channel number, and values over
+    // 1000 fall back to the frequency map as MHz, matching how channel lists
+    // name them.
+    int64_t get_recent_packets(unsigned int in_channel, int in_secs);
 
 protected:
+    // Held by readers of the frequency and channel maps, and while adding
+    // records to them.  The packet path doesn't take it for known channels:
+    // packets are processed one at a time under the packet chain lock, so the
+    // slot table and device stamps have a single writer, and each channel
+    // record is updated under its own element lock, which serializers take
+    // too.
     pthread_mutex_t lock;
 
+    // Bumped by the once a second timer if a channel changed, for cached
+    // REST responses
+    Kis_Net_Httpd_Generation channel_generation;
+    volatile int channel_changed;
+
     // Packetchain callback
     static int PacketChainHandler(CHAINCALL_PARMS);
 
@@ -223,6 +269,43 @@ protected:
     // Channel/freq content
     int channel_entry_id;
 
+    // Channel records by frequency in a small open-addressed table, so the
+    // per-packet path doesn't search the maps.  Frequencies past the size
+    // of the table use the maps.
+    struct freq_slot {
+        double freq_khz;
+        Channeltracker_V2_Channel *freq_channel;
+
+        // Logical channel last seen on this frequency
+        string channel_name;
+        Channeltracker_V2_Channel *chan_channel;
+    };
+
+    // Devices keep a bit per slot, in channel_count_bits
+    static const unsigned int FREQ_SLOTS = 256;
+    freq_slot freq_slots[FREQ_SLOTS];
+
+    // Slot holding a frequency, or the empty slot it belongs in; NULL if the
+    // table is full
+    freq_slot *find_freq_slot(double in_freq_khz);
+
+    // Devices are counted once per second on each channel they're seen on,
+    // using a stamp and a bit per frequency slot in the device.  Channels
+    // close out their own second when the next packet arrives; the timer
+    // closes out channels which have gone quiet.
+    void flush_device_counts(time_t in_now);
+
+    // Lock every channel record, so a serializer doesn't see one change
+    // under it; the maps must be held by the tracker lock
+    void lock_channels(bool in_lock);
+
+    // Long-term history of the channel RRDs, if it's enabled
+    TimeseriesStore *timeseries;
+
+    // Hook a new channel record's RRDs to the history, as series named
+    // in_prefix/packets, data, and devices
+    void attach_history(Channeltracker_V2_Channel *in_chan, string in_prefix);
+
     int pack_comp_l1data, pack_comp_devinfo, pack_comp_common, pack_comp_device;
 
     int timer_id;
@@ -168,6 +168,9 @@ Datasourcetracker::Datasourcetracker(GlobalRegistry *in_globalreg) :
                 TrackerVector, "Errored Datasources");
     error_vec->link();
 
+
+    Httpd_RegisterRoute("GET", "/datasource/all_sources.msgpack");
+    Httpd_RegisterRoute("GET", "/datasource/supported_sources.msgpack");
 }
 
 Datasourcetracker::~Datasourcetracker() {
@@ -357,20 +360,6 @@ int Datasourcetracker::open_datasource(string in_source) {
     return 1;
 }
 
-bool Datasourcetracker::Httpd_VerifyPath(const char *path, const char *method) {
-    if (strcmp(method, "GET") == 0) {
-        if (strcmp(path, "/datasource/all_sources.msgpack") == 0) {
-            return true;
-        }
-
-        if (strcmp(path, "/datasource/supported_sources.msgpack") == 0) {
-            return true;
-        }
-    }
-
-    return false;
-}
-
 void Datasourcetracker::Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
        struct MHD_Connection *connection,
        const char *url, const char *method, const char *upload_data,
@@ -179,7 +179,6 @@ public:
     bool remove_datasource(uuid in_uud);
 
     // HTTP api
-    virtual bool Httpd_VerifyPath(const char *path, const char *method);
 
     virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
             struct MHD_Connection *connection,
@@ -40,12 +40,15 @@
 #include "manuf.h"
 #include "packetsourcetracker.h"
 #include "packetsource.h"
+#include "kis_datasource.h"
 #include "dumpfile_devicetracker.h"
 #include "entrytracker.h"
 #include "devicetracker_component.h"
 #include "msgpack_adapter.h"
 #include "xmlserialize_adapter.h"
 #include "json_adapter.h"
+#include "endian_magic.h"
+#include "kis_timeseries.h"
 
 int Devicetracker_packethook_commontracker(CHAINCALL_PARMS) {
 	return ((Devicetracker *) auxdata)->CommonTracker(in_pack);
@@ -60,12 +63,21 @@ Devicetracker::Devicetracker(GlobalRegistry *in_globalreg) :
     globalreg->devicetracker = this;
 	globalreg->InsertGlobal("DEVICE_TRACKER", this);
 
+    // Register the device record with a real builder so anything that
+    // rebuilds a device from its id (msgpack, drone imports) gets a
+    // kis_tracked_device_base and not a generic map
+    kis_tracked_device_base *base_builder =
+        new kis_tracked_device_base(globalreg, 0);
     device_base_id =
-        globalreg->entrytracker->RegisterField("kismet.device.base", TrackerMac,
-                "core device record");
+        globalreg->entrytracker->RegisterField("kismet.device.base", 
+                base_builder, "core device record");
+    delete(base_builder);
+
     device_list_base_id =
         globalreg->entrytracker->RegisterField("kismet.device.list",
                 TrackerVector, "list of devices");
+    globalreg->entrytracker->RegisterContainerEntry(device_list_base_id,
+            device_base_id);
 
     phy_base_id =
         globalreg->entrytracker->RegisterField("kismet.phy.list", TrackerVector,
@@ -85,6 +97,53 @@ Devicetracker::Devicetracker(GlobalRegistry *in_globalreg) :
     device_update_timestamp_id =
         globalreg->entrytracker->RegisterField("kismet.devicelist.timestamp",
                 TrackerInt64, "device list timestamp");
+    device_query_next_offset_id =
+        globalreg->entrytracker->RegisterField("kismet.devicelist.next_offset",
+                TrackerInt64, "offset of the next page of query results, or -1");
+    device_query_next_cursor_id =
+        globalreg->entrytracker->RegisterField("kismet.devicelist.next_cursor",
+                TrackerString, "cursor of the next page of query results, or empty");
+
+    Httpd_RegisterCachedRoute("GET", "/devices/all_devices.msgpack", 
+            route_all_devices | route_msgpack, &device_generation);
+    Httpd_RegisterCachedRoute("GET", "/devices/all_devices.json", 
+            route_all_devices, &device_generation);
+    Httpd_RegisterCachedRoute("GET", "/devices/all_devices_dt.json", 
+            route_all_devices_dt, &device_generation);
+    Httpd_RegisterCachedRoute("GET", "/devices/all_devices.xml", 
+            route_all_devices_xml, &device_generation);
+    Httpd_RegisterCachedRoute("GET", "/devices/all_devices.columnar", 
+            route_all_devices_columnar, &device_generation);
+    Httpd_RegisterRoute("GET", "/devices/query.msgpack", 
+            route_device_query | route_msgpack);
+    Httpd_RegisterRoute("GET", "/devices/query.json", route_device_query);
+    Httpd_RegisterCachedRoute("GET", "/phy/all_phys.msgpack", 
+            route_all_phys | route_msgpack, &phy_generation);
+    Httpd_RegisterCachedRoute("GET", "/phy/all_phys.json", route_all_phys,
+            &phy_generation);
+    Httpd_RegisterCachedRoute("GET", "/phy/all_phys_dt.json", route_all_phys_dt,
+            &phy_generation);
+    Httpd_RegisterRoute("GET", "/devices/by-key/{key:uint}/device.msgpack/{path:*}", 
+            route_by_key | route_msgpack);
+    Httpd_RegisterRoute("GET", "/devices/by-key/{key:uint}/device.json/{path:*}", 
+            route_by_key);
+    Httpd_RegisterRoute("GET", "/devices/by-mac/{mac:mac}/devices.msgpack", 
+            route_by_mac | route_msgpack);
+    Httpd_RegisterRoute("GET", "/devices/by-mac/{mac:mac}/devices.json", 
+            route_by_mac);
+    Httpd_RegisterRoute("GET", "/devices/last-time/{timestamp:int}/devices.msgpack", 
+            route_last_time | route_msgpack);
+    Httpd_RegisterRoute("GET", "/devices/last-time/{timestamp:int}/devices.json", 
+            route_last_time);
+    Httpd_RegisterRoute("GET", 
+            "/devices/by-tile/{min_lat}/{min_lon}/{max_lat}/{max_lon}/devices.msgpack",
+            route_by_tile | route_msgpack);
+    Httpd_RegisterRoute("GET", 
+            "/devices/by-tile/{min_lat}/{min_lon}/{max_lat}/{max_lon}/devices.json",
+            route_by_tile);
+
+    if (httpd != NULL)
+        httpd->RegisterMimeType("columnar", "application/octet-stream");
 
     packets_rrd = new kis_tracked_rrd<>(globalreg, 0);
     packets_rrd->link();
@@ -92,9 +151,20 @@ Devicetracker::Devicetracker(GlobalRegistry *in_globalreg) :
         globalreg->entrytracker->RegisterField("kismet.device.packets_rrd",
                 packets_rrd, "RRD of total packets seen");
 
+	timeseries = (TimeseriesStore *) globalreg->FetchGlobal("TIMESERIES_STORE");
+
+	if (timeseries != NULL && !timeseries->FetchEnabled())
+		timeseries = NULL;
+
+	if (timeseries != NULL)
+		packets_rrd->set_history(timeseries, timeseries->FetchSeries("packets"));
+
 	num_packets = num_datapackets = num_errorpackets =
 		num_filterpackets = 0;
 
+    phy_generation_packets = 0;
+    phy_generation_devices = 0;
+
 	conf_save = 0;
 	next_phy_id = 0;
 
@@ -121,6 +191,9 @@ Devicetracker::Devicetracker(GlobalRegistry *in_globalreg) :
 	pack_comp_capsrc = _PCM(PACK_COMP_KISCAPSRC) =
 		globalreg->packetchain->RegisterPacketComponent("KISCAPSRC");
 
+	pack_comp_datasrc =
+		globalreg->packetchain->RegisterPacketComponent("KISDATASRC");
+
 	// Common tracker, very early in the tracker chain
 	globalreg->packetchain->RegisterHandler(&Devicetracker_packethook_commontracker,
 											this, CHAINPOS_TRACKER, -100);
@@ -174,6 +247,29 @@ Devicetracker::Devicetracker(GlobalRegistry *in_globalreg) :
 	}
 
     full_refresh_time = globalreg->timestamp.tv_sec;
+
+    // Publish device snapshots for the REST readers
+    snapshot_current = new DevicetrackerSnapshot();
+    snapshot_current->timestamp = globalreg->timestamp.tv_sec;
+    snapshot_current->full_refresh_time = full_refresh_time;
+    snapshot_current->devices = DevicetrackerVersionIndex::Patch(NULL, 
+            vector<DevicetrackerDeviceVersion *>(), 
+            vector<DevicetrackerDeviceVersion *>());
+    snapshot_current->by_time = DevicetrackerTimeIndex::Patch(NULL, 
+            vector<DevicetrackerDeviceVersion *>(), 
+            vector<DevicetrackerDeviceVersion *>());
+    snapshot_epoch = 0;
+    snapshot_readers[0] = snapshot_readers[1] = 0;
+    snapshot_time = globalreg->timestamp.tv_sec;
+    snapshot_pending = false;
+
+    unsigned int snapshot_interval =
+        globalreg->kismet_config->FetchOptUInt("tracker_snapshot_interval", 500);
+
+    snapshot_timer =
+        globalreg->timetracker->RegisterTimer(
+                snapshot_interval < 100 ? 1 : snapshot_interval / 100, 
+                NULL, 1, this);
 }
 
 Devicetracker::~Devicetracker() {
@@ -188,6 +284,7 @@ Devicetracker::~Devicetracker() {
 
     globalreg->timetracker->RemoveTimer(device_idle_timer);
 	globalreg->timetracker->RemoveTimer(max_devices_timer);
+    globalreg->timetracker->RemoveTimer(snapshot_timer);
 
     // TODO broken for now
     /*
@@ -206,6 +303,12 @@ Devicetracker::~Devicetracker() {
 
     packets_rrd->unlink();
 
+    // Readers still holding a snapshot free it when they're done
+    for (unsigned int x = 0; x < snapshot_retired.size(); x++)
+        snapshot_retired[x].second->Unref();
+
+    snapshot_current->Unref();
+
     pthread_mutex_destroy(&devicelist_mutex);
 }
 
@@ -275,6 +378,28 @@ int Devicetracker::FetchNumDevices(int in_phy) {
 	return r;
 }
 
+uint64_t Devicetracker::FetchUniqueDevicesHour(int in_phy) {
+    local_locker lock(&devicelist_mutex);
+
+    map<int, kis_unique_rrd>::iterator i = phy_unique_devices.find(in_phy);
+    if (i == phy_unique_devices.end())
+        return 0;
+
+    i->second.advance(globalreg->timestamp.tv_sec);
+    return i->second.estimate_hour();
+}
+
+uint64_t Devicetracker::FetchUniqueDevicesDay(int in_phy) {
+    local_locker lock(&devicelist_mutex);
+
+    map<int, kis_unique_rrd>::iterator i = phy_unique_devices.find(in_phy);
+    if (i == phy_unique_devices.end())
+        return 0;
+
+    i->second.advance(globalreg->timestamp.tv_sec);
+    return i->second.estimate_day();
+}
+
 int Devicetracker::FetchNumPackets(int in_phy) {
 	if (in_phy == KIS_PHY_ANY)
 		return num_packets;
@@ -345,6 +470,8 @@ int Devicetracker::RegisterPhyHandler(Kis_Phy_Handler *in_weak_handler) {
 	phy_errorpackets[num] = 0;
 	phy_filterpackets[num] = 0;
 
+    phy_generation.Bump();
+
 	_MSG("Registered PHY handler '" + strongphy->FetchPhyName() + "' as ID " +
 		 IntToString(num), MSGFLAG_INFO);
 
@@ -353,6 +480,318 @@ int Devicetracker::RegisterPhyHandler(Kis_Phy_Handler *in_weak_handler) {
 
 void Devicetracker::UpdateFullRefresh() {
     full_refresh_time = globalreg->timestamp.tv_sec;
+
+    snapshot_pending = true;
+    phy_generation.Bump();
+}
+
+DevicetrackerDeviceVersion::DevicetrackerDeviceVersion(kis_tracked_device_base *in_device,
+        time_t in_now) {
+    refs = 1;
+
+    TrackerElementScopeLocker slock(in_device);
+
+    // Copy the summary through the same memo so it shares the copied fields
+    std::map<TrackerElement *, TrackerElement *> memo;
+
+    device = in_device->copy_tree(memo);
+    device->link();
+
+    summary = in_device->get_tracked_summary()->copy_tree(memo);
+    summary->link();
+
+    // Only freeze once both are copied, so the shared fields hold a link
+    // from each
+    device->freeze();
+    summary->freeze();
+
+    key = in_device->get_key();
+    macaddr = in_device->get_macaddr();
+    first_time = in_device->get_first_time();
+    last_time = in_device->get_last_time();
+    packets = in_device->get_packets();
+    data_packets = in_device->get_data_packets();
+    datasize = in_device->get_datasize();
+    signal = in_device->get_signal_data()->get_last_signal_dbm();
+    frequency = in_device->get_frequency();
+    channel = in_device->get_channel();
+    type = in_device->get_type_string();
+    name = in_device->get_devicename();
+    manuf = in_device->get_manuf();
+    phy_id = DevicetrackerKey::GetPhy(key);
+
+    tile = in_device->geo_tile;
+    located = tile != 0;
+    avg_lat = avg_lon = 0;
+
+    if (located) {
+        const kis_location_agg *agg = in_device->get_location()->get_agg();
+        avg_lat = agg->get_avg_lat();
+        avg_lon = agg->get_avg_lon();
+    }
+
+    // copy_tree aged the RRDs to now.  Within a minute of the last packet
+    // the minute view moves every second; after that the hour view moves 
+    // every minute and the day view every hour, and each view empties once 
+    // the device has been idle for its span.
+    aged_time = in_now;
+
+    time_t idle = aged_time - last_time;
+
+    if (idle < 60) {
+        expires = aged_time + 1;
+    } else if (idle < 60 * 60) {
+        expires = aged_time - (aged_time % 60) + 60;
+        if (last_time + (60 * 60) + 1 < expires)
+            expires = last_time + (60 * 60) + 1;
+    } else if (idle <= 60 * 60 * 24) {
+        expires = aged_time - (aged_time % 3600) + 3600;
+        if (last_time + (60 * 60 * 24) + 1 < expires)
+            expires = last_time + (60 * 60 * 24) + 1;
+    } else {
+        expires = 0;
+    }
+}
+
+DevicetrackerDeviceVersion::~DevicetrackerDeviceVersion() {
+    // Nothing else can reach us now, so the copies can be freed normally
+    device->thaw();
+    summary->thaw();
+
+    device->unlink();
+    summary->unlink();
+}
+
+DevicetrackerSnapshot *Devicetracker::AcquireSnapshot() {
+    unsigned int epoch;
+
+    // Join the current epoch; if the publisher moved on while we did, try
+    // again in the new one
+    while (1) {
+        epoch = __sync_add_and_fetch(&snapshot_epoch, 0);
+
+        __sync_add_and_fetch(&(snapshot_readers[epoch & 1]), 1);
+
+        if (__sync_add_and_fetch(&snapshot_epoch, 0) == epoch)
+            break;
+
+        __sync_sub_and_fetch(&(snapshot_readers[epoch & 1]), 1);
+    }
+
+    __sync_synchronize();
+    DevicetrackerSnapshot *snap = snapshot_current;
+    snap->Ref();
+
+    __sync_sub_and_fetch(&(snapshot_readers[epoch & 1]), 1);
+
+    return snap;
+}
+
+void Devicetracker::ReclaimSnapshots() {
+    for (vector<pair<unsigned int, DevicetrackerSnapshot *> >::iterator ri =
+            snapshot_retired.begin(); ri != snapshot_retired.end(); /* */ ) {
+        // Readers which joined after the swap find the new snapshot, so once
+        // nobody is counted in the epoch it was swapped out of, nobody can
+        // still be about to take a reference to it.  Later epochs share the
+        // counter, which can only make us wait longer.
+        if (__sync_add_and_fetch(&(snapshot_readers[ri->first & 1]), 0) == 0) {
+            ri->second->Unref();
+            ri = snapshot_retired.erase(ri);
+        } else {
+            ++ri;
+        }
+    }
+}
+
+// Devices leaving and joining each value of an attribute index
+template<class K>
+struct devicetracker_index_changes {
+    typedef map<K, pair<vector<uint64_t>, vector<uint64_t> > > type;
+};
+
+// Carry the attribute index of the last snapshot forward, and patch the 
+// values the changes touch; the rest keep sharing their lists
+template<class M>
+static void devicetracker_patch_index(const M &in_prev, M &ret_index,
+        typename devicetracker_index_changes<typename M::key_type>::type &in_changes) {
+    ret_index = in_prev;
+
+    for (typename M::iterator i = ret_index.begin(); i != ret_index.end(); ++i)
+        i->second->Ref();
+
+    for (typename devicetracker_index_changes<typename M::key_type>::type::iterator 
+            ci = in_changes.begin(); ci != in_changes.end(); ++ci) {
+        vector<uint64_t> &leaving = ci->second.first;
+        vector<uint64_t> &joining = ci->second.second;
+
+        std::sort(leaving.begin(), leaving.end());
+        std::sort(joining.begin(), joining.end());
+
+        typename M::iterator ii = ret_index.find(ci->first);
+        DevicetrackerKeyIndex *prev = (ii == ret_index.end()) ? NULL : ii->second;
+
+        DevicetrackerKeyIndex *patched = 
+            DevicetrackerKeyIndex::Patch(prev, leaving, joining);
+
+        if (prev != NULL)
+            prev->Unref();
+
+        if (patched->size() == 0) {
+            patched->Unref();
+            if (ii != ret_index.end())
+                ret_index.erase(ii);
+        } else if (ii != ret_index.end()) {
+            ii->second = patched;
+        } else {
+            ret_index[ci->first] = patched;
+        }
+    }
+}
+
+void Devicetracker::PublishSnapshot() {
+    time_t now = globalreg->timestamp.tv_sec;
+
+    ReclaimSnapshots();
+
+    DevicetrackerSnapshot *prev = snapshot_current;
+
+    // Versions whose RRDs need aging are copied again as though their device
+    // changed; entries left over from versions since replaced are dropped
+    while (snapshot_expiry.size() != 0 && snapshot_expiry.begin()->first <= now) {
+        multimap<time_t, uint64_t>::iterator ei = snapshot_expiry.begin();
+        DevicetrackerDeviceVersion *v = prev->FindDevice(ei->second);
+
+        if (v != NULL && v->expires == ei->first) {
+            snapshot_dirty.insert(ei->second);
+            snapshot_pending = true;
+        }
+
+        snapshot_expiry.erase(ei);
+    }
+
+    if (!snapshot_pending) {
+        snapshot_time = now;
+        return;
+    }
+
+    DevicetrackerSnapshot *snap = new DevicetrackerSnapshot();
+
+    // Only the changed devices are looked up under the lock; a dirty key
+    // which isn't tracked anymore is a removed device.  The devices are 
+    // held by a link of our own while they're copied, so the lock isn't held
+    // while copying them.
+    vector<pair<uint64_t, kis_tracked_device_base *> > changed;
+
+    {
+        local_locker lock(&devicelist_mutex);
+
+        snap->timestamp = now;
+        snap->full_refresh_time = full_refresh_time;
+
+        for (set<uint64_t>::iterator di = snapshot_dirty.begin();
+                di != snapshot_dirty.end(); ++di) {
+            device_itr ti = tracked_map.find(*di);
+
+            changed.push_back(make_pair(*di, 
+                        ti == tracked_map.end() ? 
+                        (kis_tracked_device_base *) NULL : ti->second));
+        }
+
+        for (unsigned int x = 0; x < changed.size(); x++)
+            if (changed[x].second != NULL)
+                changed[x].second->link();
+    }
+
+    snapshot_dirty.clear();
+    snapshot_pending = false;
+
+    // The changed versions are swapped into the indexes of the last snapshot
+    vector<DevicetrackerDeviceVersion *> old_versions, new_versions;
+
+    devicetracker_index_changes<string>::type manuf_changes;
+    devicetracker_index_changes<int>::type phy_changes;
+    devicetracker_index_changes<uint64_t>::type tile_changes;
+
+    for (unsigned int x = 0; x < changed.size(); x++) {
+        uint64_t key = changed[x].first;
+        kis_tracked_device_base *d = changed[x].second;
+
+        DevicetrackerDeviceVersion *ov = prev->FindDevice(key);
+        DevicetrackerDeviceVersion *nv = NULL;
+
+        if (d != NULL) {
+            nv = new DevicetrackerDeviceVersion(d, now);
+            d->unlink();
+
+            if (nv->expires != 0)
+                snapshot_expiry.insert(make_pair(nv->expires, key));
+
+            new_versions.push_back(nv);
+        }
+
+        if (ov != NULL)
+            old_versions.push_back(ov);
+
+        // Attribute indexes only change when the device moves between values
+        if (ov != NULL && (nv == NULL || ov->manuf != nv->manuf))
+            manuf_changes[ov->manuf].first.push_back(key);
+        if (nv != NULL && (ov == NULL || ov->manuf != nv->manuf))
+            manuf_changes[nv->manuf].second.push_back(key);
+
+        if (ov != NULL && nv == NULL)
+            phy_changes[ov->phy_id].first.push_back(key);
+        if (nv != NULL && ov == NULL)
+            phy_changes[nv->phy_id].second.push_back(key);
+
+        bool ov_tiled = ov != NULL && ov->located;
+        bool nv_tiled = nv != NULL && nv->located;
+
+        if (ov_tiled && (!nv_tiled || ov->tile != nv->tile))
+            tile_changes[ov->tile].first.push_back(key);
+        if (nv_tiled && (!ov_tiled || ov->tile != nv->tile))
+            tile_changes[nv->tile].second.push_back(key);
+    }
+
+    std::sort(old_versions.begin(), old_versions.end(), 
+            devicetracker_version_key_less());
+    std::sort(new_versions.begin(), new_versions.end(), 
+            devicetracker_version_key_less());
+
+    snap->devices = DevicetrackerVersionIndex::Patch(prev->devices,
+            old_versions, new_versions);
+
+    std::sort(old_versions.begin(), old_versions.end(), 
+            devicetracker_version_time_less());
+    std::sort(new_versions.begin(), new_versions.end(), 
+            devicetracker_version_time_less());
+
+    snap->by_time = DevicetrackerTimeIndex::Patch(prev->by_time,
+            old_versions, new_versions);
+
+    // The indexes hold their own references to the new versions now
+    for (unsigned int x = 0; x < new_versions.size(); x++)
+        new_versions[x]->Unref();
+
+    devicetracker_patch_index(prev->manuf_index, snap->manuf_index, 
+            manuf_changes);
+    devicetracker_patch_index(prev->phy_index, snap->phy_index, phy_changes);
+
+    // Only devices which moved to another tile change buckets
+    devicetracker_patch_index(prev->tile_index, snap->tile_index, 
+            tile_changes);
+
+    // Swap it in and start a new epoch.  Readers still in the old epoch may
+    // be about to reference the old snapshot, so it's retired rather than
+    // released; usually nobody is, and it goes straight away.
+    (void) __sync_lock_test_and_set(&snapshot_current, snap);
+    unsigned int epoch = __sync_fetch_and_add(&snapshot_epoch, 1);
+
+    snapshot_retired.push_back(make_pair(epoch, prev));
+    ReclaimSnapshots();
+
+    snapshot_time = now;
+
+    device_generation.Bump();
 }
 
 kis_tracked_device_base *Devicetracker::FetchDevice(uint64_t in_key) {
@@ -371,6 +810,51 @@ kis_tracked_device_base *Devicetracker::FetchDevice(mac_addr in_device,
 	return FetchDevice(DevicetrackerKey::MakeKey(in_device, in_phy));
 }
 
+void Devicetracker::ReindexDevice(kis_tracked_device_base *device) {
+    MarkSnapshotDirty(device);
+}
+
+// Map tiles are 1/64th of a degree; rows start at 1 so 0 is never a tile
+#define DEVICETRACKER_TILE_SCALE    64
+
+static uint32_t devicetracker_tile_row(double in_lat) {
+    if (in_lat < -90)
+        in_lat = -90;
+    if (in_lat > 90)
+        in_lat = 90;
+
+    return (uint32_t) ((in_lat + 90) * DEVICETRACKER_TILE_SCALE) + 1;
+}
+
+static uint32_t devicetracker_tile_col(double in_lon) {
+    if (in_lon < -180)
+        in_lon = -180;
+    if (in_lon > 180)
+        in_lon = 180;
+
+    return (uint32_t) ((in_lon + 180) * DEVICETRACKER_TILE_SCALE);
+}
+
+static uint64_t devicetracker_tile(double in_lat, double in_lon) {
+    return ((uint64_t) devicetracker_tile_row(in_lat) << 32) | 
+        devicetracker_tile_col(in_lon);
+}
+
+void Devicetracker::UpdateDeviceLocation(kis_tracked_device_base *device,
+        kis_gps_packinfo *in_gpsinfo) {
+    kis_tracked_location *location = device->get_location();
+
+    location->add_loc(in_gpsinfo->lat, in_gpsinfo->lon, in_gpsinfo->alt, 
+            in_gpsinfo->fix);
+
+    uint64_t tile = devicetracker_tile(location->get_agg()->get_avg_lat(),
+            location->get_agg()->get_avg_lon());
+
+    // The device is already dirty for this packet; the next snapshot moves
+    // it to its new tile bucket only if the tile changed
+    device->geo_tile = tile;
+}
+
 int Devicetracker::CommonTracker(kis_packet *in_pack) {
 	kis_common_info *pack_common =
 		(kis_common_info *) in_pack->fetch(pack_comp_common);
@@ -476,6 +960,8 @@ kis_tracked_device_base *Devicetracker::UpdateCommonDevice(mac_addr in_mac,
 		(kis_gps_packinfo *) in_pack->fetch(pack_comp_gps);
 	kis_ref_capsource *pack_capsrc =
 		(kis_ref_capsource *) in_pack->fetch(pack_comp_capsrc);
+	kis_ref_datasource *pack_datasrc =
+		(kis_ref_datasource *) in_pack->fetch(pack_comp_datasrc);
 	kis_common_info *pack_common =
 		(kis_common_info *) in_pack->fetch(pack_comp_common);
 
@@ -501,22 +987,55 @@ kis_tracked_device_base *Devicetracker::UpdateCommonDevice(mac_addr in_mac,
         device->set_macaddr(in_mac);
         device->set_phyname(phy->FetchPhyName());
 
+        device->set_first_time(in_pack->ts.tv_sec);
+        device->set_last_time(in_pack->ts.tv_sec);
+
+        if (timeseries != NULL) {
+            string series = "device/" + ULongToString(key) + "/";
+
+            device->get_packets_rrd()->set_history(timeseries,
+                    timeseries->FetchSeries(series + "packets"));
+            device->get_data_rrd()->set_history(timeseries,
+                    timeseries->FetchSeries(series + "data"));
+        }
+
+        if (globalreg->manufdb != NULL)
+            device->set_manuf(globalreg->manufdb->LookupOUI(device->get_macaddr()));
+
         {
             local_locker lock(&devicelist_mutex);
             tracked_map[device->get_key()] = device;
             tracked_vec.push_back(device);
+
+            phy_unique_devices[in_phy].add(key, in_pack->ts.tv_sec);
+            phy_unique_devices[KIS_PHY_ANY].add(key, in_pack->ts.tv_sec);
         }
+    }
 
-        device->set_first_time(in_pack->ts.tv_sec);
+    // The distinct device counts only need to see a device once a second.
+    // The device list lock is never taken while holding a device, since 
+    // readers holding the list may lock devices; only the packet thread 
+    // writes the last time, so it can be read unlocked here.
+    bool new_second = device->get_last_time() != in_pack->ts.tv_sec;
 
-        if (globalreg->manufdb != NULL)
-            device->set_manuf(globalreg->manufdb->LookupOUI(device->get_macaddr()));
+    if (new_second) {
+        local_locker lock(&devicelist_mutex);
+
+        phy_unique_devices[in_phy].add(key, in_pack->ts.tv_sec);
+        phy_unique_devices[KIS_PHY_ANY].add(key, in_pack->ts.tv_sec);
     }
 
     TrackerElementScopeLocker slock(device);
 
+    // The snapshot copies the device and refreshes its query indexes
+    MarkSnapshotDirty(device);
+
     device->set_last_time(in_pack->ts.tv_sec);
 
+    if (new_second && pack_datasrc != NULL && pack_datasrc->ref_source != NULL)
+        pack_datasrc->ref_source->get_unique_devices()->add_device(key,
+                in_pack->ts.tv_sec);
+
     if (in_flags & UCD_UPDATE_PACKETS) {
         device->inc_packets();
 
@@ -577,8 +1096,7 @@ kis_tracked_device_base *Devicetracker::UpdateCommonDevice(mac_addr in_mac,
     }
 
     if ((in_flags & UCD_UPDATE_LOCATION) && pack_gpsinfo != NULL) {
-        device->get_location()->add_loc(pack_gpsinfo->lat, pack_gpsinfo->lon,
-                pack_gpsinfo->alt, pack_gpsinfo->fix);
+        UpdateDeviceLocation(device, pack_gpsinfo);
     }
 
 	// Update seenby records for time, frequency, packets
@@ -588,7 +1106,8 @@ kis_tracked_device_base *Devicetracker::UpdateCommonDevice(mac_addr in_mac,
         if (pack_l1info != NULL)
             f = pack_l1info->freq_khz;
 
-        device->inc_seenby_count(pack_capsrc->ref_source, in_pack->ts.tv_sec, f);
+        device->inc_seenby_count(pack_capsrc->ref_source, in_pack->ts.tv_sec, f,
+                pack_l1info);
 	}
 
     return device;
@@ -664,8 +1183,7 @@ int Devicetracker::PopulateCommon(kis_tracked_device_base *device, kis_packet *i
 	}
 
     if (pack_gpsinfo != NULL) {
-        device->get_location()->add_loc(pack_gpsinfo->lat, pack_gpsinfo->lon,
-                pack_gpsinfo->alt, pack_gpsinfo->fix);
+        UpdateDeviceLocation(device, pack_gpsinfo);
     }
 
 	// Update seenby records for time, frequency, packets
@@ -675,7 +1193,8 @@ int Devicetracker::PopulateCommon(kis_tracked_device_base *device, kis_packet *i
         if (pack_l1info != NULL)
             f = pack_l1info->freq_khz;
 
-        device->inc_seenby_count(pack_capsrc->ref_source, in_pack->ts.tv_sec, f);
+        device->inc_seenby_count(pack_capsrc->ref_source, in_pack->ts.tv_sec, f,
+                pack_l1info);
 	}
 
     device->add_basic_crypt(pack_common->basic_crypt_set);
@@ -1590,133 +2109,6 @@ string Devicetracker::FetchDeviceTag(mac_addr in_device) {
 #endif
 
 // HTTP interfaces
-bool Devicetracker::Httpd_VerifyPath(const char *path, const char *method) {
-    if (strcmp(method, "GET") != 0) {
-        return false;
-    }
-
-    // Simple fixed URLS
-
-    if (strcmp(path, "/devices/all_devices.msgpack") == 0)
-        return true;
-
-    if (strcmp(path, "/devices/all_devices.json") == 0)
-        return true;
-
-    if (strcmp(path, "/devices/all_devices_dt.json") == 0)
-        return true;
-
-    if (strcmp(path, "/devices/all_devices.xml") == 0)
-        return true;
-
-    if (strcmp(path, "/phy/all_phys.msgpack") == 0)
-        return true;
-
-    if (strcmp(path, "/phy/all_phys.json") == 0)
-        return true;
-
-    if (strcmp(path, "/phy/all_phys_dt.json") == 0)
-        return true;
-
-    // Split URL and process
-    vector<string> tokenurl = StrTokenize(path, "/");
-    if (tokenurl.size() < 2)
-        return false;
-
-    if (tokenurl[1] == "devices") {
-        if (tokenurl.size() < 3)
-            return false;
-
-        // Do a by-key lookup and return the device or the device path
-        if (tokenurl[2] == "by-key") {
-            if (tokenurl.size() < 5) {
-                return false;
-            }
-
-            local_locker lock(&devicelist_mutex);
-
-            uint64_t key = 0;
-
-			if (sscanf(tokenurl[3].c_str(), "%lu", &key) != 1)
-				return false;
-
-			if (tokenurl[4] == "device.msgpack")
-                ;
-			else if (tokenurl[4] == "device.json")
-                ;
-			else
-				return false;
-
-            map<uint64_t, kis_tracked_device_base *>::iterator tmi =
-                tracked_map.find(key);
-            if (tmi != tracked_map.end()) {
-                // Try to find the exact field
-                if (tokenurl.size() > 5) {
-                    vector<string>::const_iterator first = tokenurl.begin() + 5;
-                    vector<string>::const_iterator last = tokenurl.end();
-                    vector<string> fpath(first, last);
-
-                    if (tmi->second->get_child_path(fpath) == NULL) {
-                        return false;
-                    }
-                }
-
-                return true;
-            } else {
-                return false;
-            }
-        } else if (tokenurl[2] == "by-mac") {
-            if (tokenurl.size() < 5)
-                return false;
-
-            local_locker lock(&devicelist_mutex);
-
-			if (tokenurl[4] == "devices.msgpack")
-                ;
-			else if (tokenurl[4] == "devices.json")
-                ;
-            else
-                return false;
-
-            mac_addr mac = mac_addr(tokenurl[3]);
-
-            if (mac.error) {
-                return false;
-            }
-
-            // Try to find the actual mac
-            vector<kis_tracked_device_base *>::iterator vi;
-            for (vi = tracked_vec.begin(); vi != tracked_vec.end(); ++vi) {
-                if ((*vi)->get_macaddr() == mac) {
-                    return true;
-                }
-            }
-
-            return false;
-        } else if (tokenurl[2] == "last-time") {
-            if (tokenurl.size() < 5) {
-                return false;
-            }
-
-            // Is the timestamp an int?
-            long lastts;
-            if (sscanf(tokenurl[3].c_str(), "%ld", &lastts) != 1) {
-                return false;
-            }
-
-            // Are we asking for a summary we understand?
-            if (tokenurl[4] == "devices.json")
-                return true;
-            if (tokenurl[4] == "devices.msgpack")
-                return true;
-
-            return false;
-        }
-    }
-
-    return false;
-}
-
 void Devicetracker::httpd_all_phys(TrackerElementSerializer *serializer,
         string in_wrapper_key) {
 
@@ -1750,7 +2142,8 @@ void Devicetracker::httpd_all_phys(TrackerElementSerializer *serializer,
 }
 
 void Devicetracker::httpd_device_summary(TrackerElementSerializer *serializer,
-        TrackerElementVector *subvec, string in_wrapper_key) {
+        TrackerElementVector *subvec, string in_wrapper_key,
+        TrackerElementProjection *projection) {
 
     TrackerElement *devvec =
         globalreg->entrytracker->GetTrackedInstance(device_summary_base_id);
@@ -1769,13 +2162,24 @@ void Devicetracker::httpd_device_summary(TrackerElementSerializer *serializer,
     wrapper->link();
 
     if (subvec == NULL) {
-        local_locker lock(&devicelist_mutex);
+        DevicetrackerSnapshot *snap = AcquireSnapshot();
 
-        for (unsigned int x = 0; x < tracked_vec.size(); x++) {
-            devvec->add_vector(tracked_vec[x]->get_tracked_summary());
+        for (DevicetrackerVersionIndex::const_iterator vi = 
+                snap->devices->begin(); vi != snap->devices->end(); ++vi) {
+            if (projection != NULL)
+                devvec->add_vector(projection->Project((*vi)->device,
+                            device_summary_base_id));
+            else
+                devvec->add_vector((*vi)->summary);
         }
 
         serializer->serialize(wrapper);
+
+        // Drop our references to the snapshot records before the snapshot
+        wrapper->unlink();
+        snap->Unref();
+
+        return;
     } else {
         /* we do NOT want to lock here actually, we're processing a subvec of
          * stuff not the master device list
@@ -1784,7 +2188,10 @@ void Devicetracker::httpd_device_summary(TrackerElementSerializer *serializer,
          */
         for (TrackerElementVector::const_iterator x = subvec->begin();
                 x != subvec->end(); ++x) {
-            devvec->add_vector(((kis_tracked_device_base *) *x)->get_tracked_summary());
+            if (projection != NULL)
+                devvec->add_vector(projection->Project(*x, device_summary_base_id));
+            else
+                devvec->add_vector(((kis_tracked_device_base *) *x)->get_tracked_summary());
         }
 
         serializer->serialize(wrapper);
@@ -1793,16 +2200,645 @@ void Devicetracker::httpd_device_summary(TrackerElementSerializer *serializer,
     wrapper->unlink();
 }
 
+bool DevicetrackerQuery::MatchDevice(DevicetrackerDeviceVersion *device) {
+    if (last_time_min != 0 && device->last_time < last_time_min)
+        return false;
+
+    if (last_time_max != 0 && device->last_time > last_time_max)
+        return false;
+
+    if (phy_id != -1 && device->phy_id != phy_id)
+        return false;
+
+    if (type_set.size() != 0 && type_set.find(device->type) == type_set.end())
+        return false;
+
+    if (signal_filter && 
+            (device->signal < signal_min || device->signal > signal_max))
+        return false;
+
+    if (manuf.length() != 0 && device->manuf != manuf)
+        return false;
+
+    if (ssid_prefix.length() != 0 &&
+            device->name.compare(0, ssid_prefix.length(), ssid_prefix) != 0)
+        return false;
+
+    return true;
+}
+
+// Sort value of a device; string fields only fill in the string, numeric 
+// fields only the number
+static void devicetracker_query_value(DevicetrackerQuery::sort_field_t field,
+        DevicetrackerDeviceVersion *device, int64_t *ret_num, string *ret_str) {
+    *ret_num = 0;
+
+    switch (field) {
+        case DevicetrackerQuery::sort_first_time:
+            *ret_num = device->first_time;
+            break;
+        case DevicetrackerQuery::sort_signal:
+            *ret_num = device->signal;
+            break;
+        case DevicetrackerQuery::sort_packets:
+            *ret_num = device->packets;
+            break;
+        case DevicetrackerQuery::sort_manuf:
+            *ret_str = device->manuf;
+            break;
+        case DevicetrackerQuery::sort_name:
+            *ret_str = device->name;
+            break;
+        default:
+            *ret_num = device->last_time;
+            break;
+    }
+}
+
+static bool devicetracker_query_strfield(DevicetrackerQuery::sort_field_t field) {
+    return field == DevicetrackerQuery::sort_manuf ||
+        field == DevicetrackerQuery::sort_name;
+}
+
+bool DevicetrackerQuery::AfterCursor(DevicetrackerDeviceVersion *device) {
+    int64_t num;
+    string str;
+    int cmp;
+
+    devicetracker_query_value(sort_field, device, &num, &str);
+
+    if (devicetracker_query_strfield(sort_field))
+        cmp = str.compare(cursor_str);
+    else
+        cmp = (num < cursor_num) ? -1 : (num > cursor_num);
+
+    if (cmp == 0)
+        cmp = (device->key < cursor_key) ? -1 : (device->key > cursor_key);
+
+    if (sort_desc)
+        return cmp < 0;
+
+    return cmp > 0;
+}
+
+string DevicetrackerQuery::MakeCursor(DevicetrackerDeviceVersion *device) {
+    int64_t num;
+    string str;
+    stringstream ss;
+
+    devicetracker_query_value(sort_field, device, &num, &str);
+
+    ss << device->key << ":";
+
+    if (devicetracker_query_strfield(sort_field))
+        ss << str;
+    else
+        ss << num;
+
+    return ss.str();
+}
+
+bool DevicetrackerQuery::ParseCursor(string in_cursor) {
+    size_t pos = in_cursor.find(':');
+    unsigned long long key;
+    long long num;
+
+    if (pos == string::npos)
+        return false;
+
+    if (sscanf(in_cursor.substr(0, pos).c_str(), "%llu", &key) != 1)
+        return false;
+
+    cursor_key = key;
+    cursor_num = 0;
+    cursor_str = "";
+
+    if (devicetracker_query_strfield(sort_field)) {
+        cursor_str = in_cursor.substr(pos + 1);
+    } else {
+        if (sscanf(in_cursor.substr(pos + 1).c_str(), "%lld", &num) != 1)
+            return false;
+        cursor_num = num;
+    }
+
+    cursor_set = true;
+
+    return true;
+}
+
+// Sort order for query results which can't be read from the last_time index;
+// ties are broken by key, the same as the index, so a cursor always names a
+// single position
+class devicetracker_query_sort {
+public:
+    devicetracker_query_sort(DevicetrackerQuery::sort_field_t in_field, 
+            bool in_desc) {
+        field = in_field;
+        desc = in_desc;
+    }
+
+    bool operator()(DevicetrackerDeviceVersion *a, 
+            DevicetrackerDeviceVersion *b) const {
+        if (desc)
+            return less(b, a);
+
+        return less(a, b);
+    }
+
+protected:
+    bool less(DevicetrackerDeviceVersion *a, DevicetrackerDeviceVersion *b) const {
+        if (value_less(a, b))
+            return true;
+        if (value_less(b, a))
+            return false;
+
+        return a->key < b->key;
+    }
+
+    bool value_less(DevicetrackerDeviceVersion *a, 
+            DevicetrackerDeviceVersion *b) const {
+        switch (field) {
+            case DevicetrackerQuery::sort_first_time:
+                return a->first_time < b->first_time;
+            case DevicetrackerQuery::sort_signal:
+                return a->signal < b->signal;
+            case DevicetrackerQuery::sort_packets:
+                return a->packets < b->packets;
+            case DevicetrackerQuery::sort_manuf:
+                return a->manuf < b->manuf;
+            case DevicetrackerQuery::sort_name:
+                return a->name < b->name;
+            default:
+                return a->last_time < b->last_time;
+        }
+    }
+
+    DevicetrackerQuery::sort_field_t field;
+    bool desc;
+};
+
+// Walk a range of the last_time index in order, filling in one page of 
+// results.  Stops as soon as the page is full, so paging through a time-sorted
+// list only visits the devices before the end of the requested page; the walk
+// of a cursor query starts at the cursor so deep pages cost no more than the 
+// first.
+template<class I> 
+static int64_t devicetracker_query_walk(I begin, I end, DevicetrackerQuery *query, 
+        vector<DevicetrackerDeviceVersion *> &page) {
+    unsigned int matched = 0;
+
+    for (I i = begin; i != end; ++i) {
+        if (!query->MatchDevice(*i))
+            continue;
+
+        if (matched++ < query->offset)
+            continue;
+
+        // There's at least one more result than fits on this page
+        if (query->limit != 0 && page.size() >= query->limit)
+            return query->offset + query->limit;
+
+        page.push_back(*i);
+    }
+
+    return -1;
+}
+
+// Compare snapshot devices against a (last time, key) position in the order
+// of the snapshot last_time index
+class devicetracker_version_time_pos {
+public:
+    bool operator()(DevicetrackerDeviceVersion *a, 
+            const pair<time_t, uint64_t> &b) const {
+        return make_pair(a->last_time, a->key) < b;
+    }
+
+    bool operator()(const pair<time_t, uint64_t> &a, 
+            DevicetrackerDeviceVersion *b) const {
+        return a < make_pair(b->last_time, b->key);
+    }
+};
+
+bool Devicetracker::ParseDeviceQuery(struct MHD_Connection *connection,
+        DevicetrackerQuery *query) {
+    const char *arg;
+    long l;
+    int i;
+
+    // Negative times are relative to the current time
+    if ((arg = MHD_lookup_connection_value(connection, 
+                    MHD_GET_ARGUMENT_KIND, "last_time_min")) != NULL) {
+        if (sscanf(arg, "%ld", &l) != 1)
+            return false;
+
+        if (l < 0)
+            l = globalreg->timestamp.tv_sec + l;
+
+        query->last_time_min = l;
+    }
+
+    if ((arg = MHD_lookup_connection_value(connection, 
+                    MHD_GET_ARGUMENT_KIND, "last_time_max")) != NULL) {
+        if (sscanf(arg, "%ld", &l) != 1)
+            return false;
+
+        if (l < 0)
+            l = globalreg->timestamp.tv_sec + l;
+
+        query->last_time_max = l;
+    }
+
+    if ((arg = MHD_lookup_connection_value(connection, 
+                    MHD_GET_ARGUMENT_KIND, "phy")) != NULL) {
+        // An unknown phy matches nothing
+        query->phy_id = -2;
+
+        for (map<int, Kis_Phy_Handler *>::iterator pi = phy_handler_map.begin();
+                pi != phy_handler_map.end(); ++pi) {
+            if (pi->second->FetchPhyName() == arg) {
+                query->phy_id = pi->first;
+                break;
+            }
+        }
+    }
+
+    if ((arg = MHD_lookup_connection_value(connection, 
+                    MHD_GET_ARGUMENT_KIND, "type")) != NULL) {
+        vector<string> types = StrTokenize(arg, ",");
+
+        for (unsigned int t = 0; t < types.size(); t++) {
+            if (types[t].length() != 0)
+                query->type_set.insert(types[t]);
+        }
+    }
+
+    if ((arg = MHD_lookup_connection_value(connection, 
+                    MHD_GET_ARGUMENT_KIND, "signal_min")) != NULL) {
+        if (sscanf(arg, "%d", &i) != 1)
+            return false;
+
+        if (!query->signal_filter)
+            query->signal_max = 0x7FFFFFFF;
+
+        query->signal_filter = true;
+        query->signal_min = i;
+    }
+
+    if ((arg = MHD_lookup_connection_value(connection, 
+                    MHD_GET_ARGUMENT_KIND, "signal_max")) != NULL) {
+        if (sscanf(arg, "%d", &i) != 1)
+            return false;
+
+        if (!query->signal_filter)
+            query->signal_min = -0x7FFFFFFF;
+
+        query->signal_filter = true;
+        query->signal_max = i;
+    }
+
+    if ((arg = MHD_lookup_connection_value(connection, 
+                    MHD_GET_ARGUMENT_KIND, "manuf")) != NULL) 
+        query->manuf = arg;
+
+    if ((arg = MHD_lookup_connection_value(connection, 
+                    MHD_GET_ARGUMENT_KIND, "ssid")) != NULL) 
+        query->ssid_prefix = arg;
+
+    if ((arg = MHD_lookup_connection_value(connection, 
+                    MHD_GET_ARGUMENT_KIND, "sort")) != NULL) {
+        string sort = StrLower(arg);
+
+        if (sort == "last_time")
+            query->sort_field = DevicetrackerQuery::sort_last_time;
+        else if (sort == "first_time")
+            query->sort_field = DevicetrackerQuery::sort_first_time;
+        else if (sort == "signal")
+            query->sort_field = DevicetrackerQuery::sort_signal;
+        else if (sort == "packets")
+            query->sort_field = DevicetrackerQuery::sort_packets;
+        else if (sort == "manuf")
+            query->sort_field = DevicetrackerQuery::sort_manuf;
+        else if (sort == "name")
+            query->sort_field = DevicetrackerQuery::sort_name;
+        else
+            return false;
+    }
+
+    if ((arg = MHD_lookup_connection_value(connection, 
+                    MHD_GET_ARGUMENT_KIND, "order")) != NULL) {
+        string order = StrLower(arg);
+
+        if (order == "asc")
+            query->sort_desc = false;
+        else if (order == "desc")
+            query->sort_desc = true;
+        else
+            return false;
+    }
+
+    if ((arg = MHD_lookup_connection_value(connection, 
+                    MHD_GET_ARGUMENT_KIND, "offset")) != NULL) {
+        if (sscanf(arg, "%u", &(query->offset)) != 1)
+            return false;
+    }
+
+    if ((arg = MHD_lookup_connection_value(connection, 
+                    MHD_GET_ARGUMENT_KIND, "limit")) != NULL) {
+        if (sscanf(arg, "%u", &(query->limit)) != 1)
+            return false;
+    }
+
+    // The cursor is read in terms of the sort field, so it has to be parsed
+    // after the sort
+    if ((arg = MHD_lookup_connection_value(connection, 
+                    MHD_GET_ARGUMENT_KIND, "cursor")) != NULL && arg[0] != '\0') {
+        if (!query->ParseCursor(arg))
+            return false;
+    }
+
+    return true;
+}
+
+void Devicetracker::httpd_device_query(TrackerElementSerializer *serializer,
+        DevicetrackerQuery *query, TrackerElementProjection *projection) {
+
+    // Queries are answered from the snapshot and its indexes, so neither the
+    // device list nor any device is locked
+    DevicetrackerSnapshot *snap = AcquireSnapshot();
+
+    vector<DevicetrackerDeviceVersion *> page;
+    int64_t next_offset = -1;
+
+    typedef DevicetrackerTimeIndex::const_iterator version_itr;
+
+    // Bound the walk of the time index by the requested time range
+    version_itr lo = snap->by_time->begin();
+    version_itr hi = snap->by_time->end();
+
+    if (query->last_time_min != 0)
+        lo = snap->by_time->lower_bound(
+                make_pair(query->last_time_min, (uint64_t) 0), 
+                devicetracker_version_time_pos());
+    if (query->last_time_max != 0)
+        hi = snap->by_time->upper_bound(
+                make_pair(query->last_time_max, (uint64_t) ~0ULL), 
+                devicetracker_version_time_pos());
+
+    if (query->sort_field == DevicetrackerQuery::sort_last_time && 
+            query->cursor_set) {
+        // Start the walk just past the cursor; the index orders by time and
+        // then key, the same as the cursor
+        pair<time_t, uint64_t> cursor((time_t) query->cursor_num, 
+                query->cursor_key);
+
+        if (query->sort_desc) {
+            version_itr ci = snap->by_time->lower_bound(cursor, 
+                    devicetracker_version_time_pos());
+
+            if (ci < hi)
+                hi = ci;
+        } else {
+            version_itr ci = snap->by_time->upper_bound(cursor, 
+                    devicetracker_version_time_pos());
+
+            if (ci > lo)
+                lo = ci;
+        }
+    }
+
+    // The range may be empty or inverted
+    if (lo > hi)
+        lo = hi;
+
+    if (query->sort_field == DevicetrackerQuery::sort_last_time) {
+        // Results come straight out of the ordered index
+        if (query->sort_desc)
+            next_offset = 
+                devicetracker_query_walk(std::reverse_iterator<version_itr>(hi),
+                        std::reverse_iterator<version_itr>(lo), query, page);
+        else
+            next_offset = devicetracker_query_walk(lo, hi, query, page);
+    } else {
+        // Collect the candidates from the narrowest index available, then 
+        // only sort as far as the end of the requested page
+        vector<DevicetrackerDeviceVersion *> matched;
+        DevicetrackerKeyIndex *candidates = NULL;
+        bool no_candidates = false;
+
+        if (query->manuf.length() != 0) {
+            unordered_map<string, DevicetrackerKeyIndex *>::iterator mi = 
+                snap->manuf_index.find(query->manuf);
+
+            if (mi == snap->manuf_index.end())
+                no_candidates = true;
+            else
+                candidates = mi->second;
+        }
+
+        if (query->phy_id != -1) {
+            unordered_map<int, DevicetrackerKeyIndex *>::iterator pi = 
+                snap->phy_index.find(query->phy_id);
+
+            if (pi == snap->phy_index.end())
+                no_candidates = true;
+            else if (candidates == NULL || pi->second->size() < candidates->size())
+                candidates = pi->second;
+        }
+
+        if (no_candidates) {
+            // Nothing has the requested manufacturer or phy
+        } else if (candidates != NULL) {
+            // The attribute indexes hold keys; the versions come from this
+            // snapshot
+            for (DevicetrackerKeyIndex::const_iterator ki = candidates->begin();
+                    ki != candidates->end(); ++ki) {
+                DevicetrackerDeviceVersion *v = snap->FindDevice(*ki);
+
+                if (v != NULL && query->MatchDevice(v) &&
+                        (!query->cursor_set || query->AfterCursor(v)))
+                    matched.push_back(v);
+            }
+        } else {
+            for (version_itr ci = lo; ci != hi; ++ci) {
+                if (query->MatchDevice(*ci) &&
+                        (!query->cursor_set || query->AfterCursor(*ci)))
+                    matched.push_back(*ci);
+            }
+        }
+
+        if (query->offset < matched.size()) {
+            size_t end = matched.size();
+
+            if (query->limit != 0 && query->offset + query->limit < end) {
+                end = query->offset + query->limit;
+                next_offset = end;
+            }
+
+            std::partial_sort(matched.begin(), matched.begin() + end, 
+                    matched.end(), 
+                    devicetracker_query_sort(query->sort_field, query->sort_desc));
+
+            page.assign(matched.begin() + query->offset, matched.begin() + end);
+        }
+    }
+
+    TrackerElement *wrapper = new TrackerElement(TrackerMap);
+    TrackerElementScopeLinker slink(wrapper);
+
+    TrackerElement *updatets =
+        globalreg->entrytracker->GetTrackedInstance(device_update_timestamp_id);
+    updatets->set((int64_t) globalreg->timestamp.tv_sec);
+    wrapper->add_map(updatets);
+
+    TrackerElement *nextoffset =
+        globalreg->entrytracker->GetTrackedInstance(device_query_next_offset_id);
+    nextoffset->set((int64_t) next_offset);
+    wrapper->add_map(nextoffset);
+
+    TrackerElement *nextcursor =
+        globalreg->entrytracker->GetTrackedInstance(device_query_next_cursor_id);
+    if (next_offset != -1 && page.size() != 0)
+        nextcursor->set(query->MakeCursor(page[page.size() - 1]));
+    else
+        nextcursor->set(string(""));
+    wrapper->add_map(nextcursor);
+
+    TrackerElement *devvec =
+        globalreg->entrytracker->GetTrackedInstance(device_list_base_id);
+    wrapper->add_map(devvec);
+
+    for (unsigned int x = 0; x < page.size(); x++) {
+        if (projection != NULL)
+            devvec->add_vector(projection->Project(page[x]->device, 
+                        device_summary_base_id));
+        else
+            devvec->add_vector(page[x]->summary);
+    }
+
+    serializer->serialize(wrapper);
+
+    snap->Unref();
+}
+
+void Devicetracker::FetchBoxDevices(DevicetrackerSnapshot *snap, 
+        double in_min_lat, double in_min_lon, 
+        double in_max_lat, double in_max_lon, 
+        vector<DevicetrackerDeviceVersion *> *ret_devices) {
+    // Column ranges of the box; a box over the antimeridian is two
+    vector<pair<uint32_t, uint32_t> > cols;
+
+    if (in_min_lon <= in_max_lon) {
+        cols.push_back(make_pair(devicetracker_tile_col(in_min_lon), 
+                    devicetracker_tile_col(in_max_lon)));
+    } else {
+        cols.push_back(make_pair(devicetracker_tile_col(in_min_lon), 
+                    devicetracker_tile_col(180)));
+        cols.push_back(make_pair(devicetracker_tile_col(-180), 
+                    devicetracker_tile_col(in_max_lon)));
+    }
+
+    uint32_t row_lo = devicetracker_tile_row(in_min_lat);
+    uint32_t row_hi = devicetracker_tile_row(in_max_lat);
+
+    vector<DevicetrackerKeyIndex *> tiles;
+
+    if ((uint64_t) (row_hi - row_lo + 1) * cols.size() > snap->tile_index.size()) {
+        // More rows than occupied tiles, so check the occupied tiles instead
+        for (map<uint64_t, DevicetrackerKeyIndex *>::iterator ti = 
+                snap->tile_index.begin(); ti != snap->tile_index.end(); ++ti) {
+            uint32_t row = ti->first >> 32;
+            uint32_t col = ti->first & 0xFFFFFFFF;
+
+            if (row < row_lo || row > row_hi)
+                continue;
+
+            for (unsigned int c = 0; c < cols.size(); c++) {
+                if (col >= cols[c].first && col <= cols[c].second) {
+                    tiles.push_back(ti->second);
+                    break;
+                }
+            }
+        }
+    } else {
+        for (uint32_t row = row_lo; row <= row_hi; row++) {
+            for (unsigned int c = 0; c < cols.size(); c++) {
+                uint64_t end = ((uint64_t) row << 32) | cols[c].second;
+
+                map<uint64_t, DevicetrackerKeyIndex *>::iterator ti = 
+                    snap->tile_index.lower_bound(((uint64_t) row << 32) | 
+                            cols[c].first);
+
+                for (; ti != snap->tile_index.end() && ti->first <= end; ++ti)
+                    tiles.push_back(ti->second);
+            }
+        }
+    }
+
+    // The tiles hold keys; the versions come from this snapshot
+    for (unsigned int t = 0; t < tiles.size(); t++) {
+        for (DevicetrackerKeyIndex::const_iterator ki = tiles[t]->begin();
+                ki != tiles[t]->end(); ++ki) {
+            DevicetrackerDeviceVersion *v = snap->FindDevice(*ki);
+
+            if (v != NULL)
+                ret_devices->push_back(v);
+        }
+    }
+}
+
+void Devicetracker::httpd_devices_in_box(TrackerElementSerializer *serializer,
+        double in_min_lat, double in_min_lon, double in_max_lat, double in_max_lon,
+        TrackerElementProjection *projection) {
+
+    DevicetrackerSnapshot *snap = AcquireSnapshot();
+
+    vector<DevicetrackerDeviceVersion *> devices;
+    FetchBoxDevices(snap, in_min_lat, in_min_lon, in_max_lat, in_max_lon, 
+            &devices);
+
+    TrackerElement *devvec =
+        globalreg->entrytracker->GetTrackedInstance(device_list_base_id);
+    devvec->link();
+
+    for (unsigned int d = 0; d < devices.size(); d++) {
+        // Tiles at the edge of the box are only partly inside it
+        double lat = devices[d]->avg_lat;
+        double lon = devices[d]->avg_lon;
+
+        if (lat < in_min_lat || lat > in_max_lat)
+            continue;
+
+        if (in_min_lon <= in_max_lon) {
+            if (lon < in_min_lon || lon > in_max_lon)
+                continue;
+        } else if (lon < in_min_lon && lon > in_max_lon) {
+            continue;
+        }
+
+        if (projection != NULL)
+            devvec->add_vector(projection->Project(devices[d]->device, 
+                        device_summary_base_id));
+        else
+            devvec->add_vector(devices[d]->summary);
+    }
+
+    serializer->serialize(devvec);
+
+    devvec->unlink();
+    snap->Unref();
+}
+
 void Devicetracker::httpd_xml_device_summary(std::stringstream &stream) {
-    local_locker lock(&devicelist_mutex);
+    DevicetrackerSnapshot *snap = AcquireSnapshot();
 
     TrackerElement *devvec =
         globalreg->entrytracker->GetTrackedInstance(device_summary_base_id);
 
     devvec->link();
 
-    for (unsigned int x = 0; x < tracked_vec.size(); x++) {
-        devvec->add_vector(tracked_vec[x]->get_tracked_summary());
+    for (DevicetrackerVersionIndex::const_iterator vi = snap->devices->begin();
+            vi != snap->devices->end(); ++vi) {
+        devvec->add_vector((*vi)->summary);
     }
 
     XmlserializeAdapter *xml = new XmlserializeAdapter(globalreg);
@@ -1865,269 +2901,515 @@ void Devicetracker::httpd_xml_device_summary(std::stringstream &stream) {
     delete(xml);
 
     devvec->unlink();
+    snap->Unref();
 }
 
-void Devicetracker::Httpd_CreateStreamResponse(
-        Kis_Net_Httpd *httpd __attribute__((unused)),
-        struct MHD_Connection *connection,
-        const char *path, const char *method, const char *upload_data,
-        size_t *upload_data_size, std::stringstream &stream) {
+// Columns of the columnar device summary.  Each column is written as one
+// contiguous little-endian array over all devices.
+enum devicetracker_column_type {
+    column_uint64 = 1, column_int64 = 2, column_int32 = 3, column_double = 4,
+
+    // uint32 offsets[rows + 1] followed by the string bytes
+    column_string = 5
+};
+
+enum devicetracker_column_id {
+    column_key, column_macaddr, column_phy, column_first_time, column_last_time,
+    column_packets, column_data_packets, column_datasize, column_signal,
+    column_channel, column_frequency, column_type, column_name
+};
+
+static const struct {
+    const char *name;
+    int type;
+} devicetracker_columns[] = {
+    { "key", column_uint64 },
+    { "macaddr", column_uint64 },
+    { "phy", column_int32 },
+    { "first_time", column_int64 },
+    { "last_time", column_int64 },
+    { "packets", column_uint64 },
+    { "data_packets", column_uint64 },
+    { "datasize", column_uint64 },
+    { "signal", column_int32 },
+    { "channel", column_string },
+    { "frequency", column_double },
+    { "type", column_string },
+    { "name", column_string },
+};
+
+static const char *devicetracker_default_columns = 
+    "key,macaddr,last_time,packets,signal,channel";
+
+static void columnar_put32(string &out, uint32_t in_v) {
+    in_v = kis_htole32(in_v);
+    out.append((const char *) &in_v, 4);
+}
 
-    if (strcmp(method, "GET") != 0) {
-        return;
-    }
+static void columnar_put64(string &out, uint64_t in_v) {
+    in_v = kis_htole64(in_v);
+    out.append((const char *) &in_v, 8);
+}
 
-    if (strcmp(path, "/devices/all_devices.msgpack") == 0) {
-        TrackerElementSerializer *serializer =
-            new MsgpackAdapter::Serializer(globalreg, stream);
-        httpd_device_summary(serializer);
-        delete(serializer);
-        return;
-    }
+// Everything after the header starts on an 8 byte boundary so consumers can
+// use the arrays in place
+static void columnar_pad(string &out) {
+    if (out.length() % 8)
+        out.append(8 - (out.length() % 8), '\0');
+}
 
-    if (strcmp(path, "/devices/all_devices.json") == 0) {
-        TrackerElementSerializer *serializer =
-            new JsonAdapter::Serializer(globalreg, stream);
-        httpd_device_summary(serializer);
-        delete(serializer);
-        return;
-    }
+bool Devicetracker::httpd_device_columnar(std::stringstream &stream, 
+        string in_columns) {
+    if (in_columns == "")
+        in_columns = devicetracker_default_columns;
 
-    // Datatable wrapper
-    if (strcmp(path, "/devices/all_devices_dt.json") == 0) {
-        TrackerElementSerializer *serializer =
-            new JsonAdapter::Serializer(globalreg, stream);
-        httpd_device_summary(serializer, NULL, "aaData");
-        delete(serializer);
-        return;
-    }
+    vector<string> names = StrTokenize(in_columns, ",");
+    vector<int> columns;
 
-    if (strcmp(path, "/devices/all_devices.xml") == 0) {
-        httpd_xml_device_summary(stream);
-        return;
-    }
+    unsigned int ncolumns = 
+        sizeof(devicetracker_columns) / sizeof(devicetracker_columns[0]);
 
-    if (strcmp(path, "/phy/all_phys.msgpack") == 0) {
-        TrackerElementSerializer *serializer =
-            new MsgpackAdapter::Serializer(globalreg, stream);
-        httpd_all_phys(serializer);
-        delete(serializer);
-        return;
-    }
+    for (unsigned int x = 0; x < names.size(); x++) {
+        string n = StrLower(StrStrip(names[x]));
+        unsigned int c;
 
-    if (strcmp(path, "/phy/all_phys.json") == 0) {
-        TrackerElementSerializer *serializer =
-            new JsonAdapter::Serializer(globalreg, stream);
-        httpd_all_phys(serializer);
-        delete(serializer);
-    }
+        for (c = 0; c < ncolumns; c++) {
+            if (n == devicetracker_columns[c].name)
+                break;
+        }
 
-    // Datatable wrapper
-    if (strcmp(path, "/phy/all_phys_dt.json") == 0) {
-        TrackerElementSerializer *serializer =
-            new JsonAdapter::Serializer(globalreg, stream);
-        httpd_all_phys(serializer, "aaData");
-        delete(serializer);
+        if (c == ncolumns)
+            return false;
+
+        columns.push_back(c);
     }
 
-    vector<string> tokenurl = StrTokenize(path, "/");
+    string out;
 
-    if (tokenurl.size() < 2)
-        return;
+    DevicetrackerSnapshot *snap = AcquireSnapshot();
 
-    if (tokenurl[1] == "devices") {
-        if (tokenurl.size() < 5)
-            return;
+    uint64_t rows = snap->devices->size();
 
-        if (tokenurl[2] == "by-key") {
-            if (tokenurl.size() < 5) {
-                return;
-            }
+    // Rough guess, strings will grow it
+    out.reserve(32 + columns.size() * (32 + rows * 8));
 
-            local_locker lock(&devicelist_mutex);
+    out.append("KCOL", 4);
+    columnar_put32(out, 1);
+    columnar_put64(out, rows);
+    columnar_put64(out, (uint64_t) snap->timestamp);
+    columnar_put32(out, columns.size());
+    columnar_put32(out, 0);
+
+    for (unsigned int c = 0; c < columns.size(); c++) {
+        int id = columns[c];
+        int type = devicetracker_columns[id].type;
+        string name = devicetracker_columns[id].name;
+
+        columnar_put32(out, type);
+        columnar_put32(out, name.length());
+
+        // Data length is filled in once the column is written
+        size_t len_pos = out.length();
+        columnar_put64(out, 0);
 
-            uint64_t key = 0;
+        out.append(name);
+        columnar_pad(out);
 
-            bool use_msgpack = false;
-            bool use_json = false;
+        size_t data_pos = out.length();
 
-			if (sscanf(tokenurl[3].c_str(), "%lu", &key) != 1) {
-				return;
+        if (type == column_string) {
+            vector<const string *> strs;
+            strs.reserve(rows);
+
+            for (DevicetrackerVersionIndex::const_iterator vi = 
+                    snap->devices->begin(); vi != snap->devices->end(); ++vi) {
+                DevicetrackerDeviceVersion *d = *vi;
+
+                if (id == column_channel)
+                    strs.push_back(&(d->channel));
+                else if (id == column_type)
+                    strs.push_back(&(d->type));
+                else
+                    strs.push_back(&(d->name));
             }
 
-			if (tokenurl[4] == "device.msgpack")
-				use_msgpack = true;
-			else if (tokenurl[4] == "device.json")
-				use_json = true;
-			else 
-				return;
-
-            map<uint64_t, kis_tracked_device_base *>::iterator tmi =
-                tracked_map.find(key);
-            if (tmi != tracked_map.end()) {
-                TrackerElementScopeLinker slink(tmi->second);
-
-                // Try to find the exact field
-                if (tokenurl.size() > 5) {
-                    vector<string>::const_iterator first = tokenurl.begin() + 5;
-                    vector<string>::const_iterator last = tokenurl.end();
-                    vector<string> fpath(first, last);
-
-                    TrackerElement *sub = tmi->second->get_child_path(fpath);
-
-                    TrackerElementScopeLinker slink(sub);
-
-                    if (sub == NULL) {
-                        return;
-                    } 
-
-                    TrackerElementSerializer *serializer = NULL;
-                    if (use_msgpack) {
-                        serializer =
-                            new MsgpackAdapter::Serializer(globalreg, stream);
-                    } else if (use_json) {
-                        serializer =
-                            new JsonAdapter::Serializer(globalreg, stream);
-                    } else {
-                        return;
-                    }
+            uint32_t offt = 0;
+            columnar_put32(out, offt);
 
-                    serializer->serialize(sub);
-                    delete(serializer);
+            for (uint64_t r = 0; r < rows; r++) {
+                offt += strs[r]->length();
+                columnar_put32(out, offt);
+            }
 
-                    return;
+            for (uint64_t r = 0; r < rows; r++)
+                out.append(*(strs[r]));
+        } else {
+            size_t width = (type == column_int32) ? 4 : 8;
+
+            out.resize(data_pos + rows * width);
+            char *data = &(out[data_pos]);
+
+            uint64_t r = 0;
+
+            for (DevicetrackerVersionIndex::const_iterator vi = 
+                    snap->devices->begin(); vi != snap->devices->end(); 
+                    ++vi, ++r) {
+                DevicetrackerDeviceVersion *d = *vi;
+                uint64_t v64 = 0;
+                uint32_t v32 = 0;
+
+                switch (id) {
+                    case column_key:
+                        v64 = d->key;
+                        break;
+                    case column_macaddr:
+                        v64 = d->macaddr.longmac;
+                        break;
+                    case column_phy:
+                        v32 = DevicetrackerKey::GetPhy(d->key);
+                        break;
+                    case column_first_time:
+                        v64 = (int64_t) d->first_time;
+                        break;
+                    case column_last_time:
+                        v64 = (int64_t) d->last_time;
+                        break;
+                    case column_packets:
+                        v64 = d->packets;
+                        break;
+                    case column_data_packets:
+                        v64 = d->data_packets;
+                        break;
+                    case column_datasize:
+                        v64 = d->datasize;
+                        break;
+                    case column_signal:
+                        v32 = (int32_t) d->signal;
+                        break;
+                    case column_frequency: {
+                        double f = d->frequency;
+                        memcpy(&v64, &f, 8);
+                        break;
+                    }
                 }
 
-                TrackerElementSerializer *serializer = NULL;
-
-                if (use_msgpack) {
-                    serializer =
-                        new MsgpackAdapter::Serializer(globalreg, stream);
-                } else if (use_json) {
-                    serializer =
-                        new JsonAdapter::Serializer(globalreg, stream);
+                if (width == 4) {
+                    v32 = kis_htole32(v32);
+                    memcpy(data + r * 4, &v32, 4);
                 } else {
-                    return;
+                    v64 = kis_htole64(v64);
+                    memcpy(data + r * 8, &v64, 8);
                 }
-
-                serializer->serialize(tmi->second);
-                delete(serializer);
-                return;
-            } else {
-                return;
             }
-        } else if (tokenurl[2] == "by-mac") {
-            if (tokenurl.size() < 5)
-                return;
+        }
 
-            local_locker lock(&devicelist_mutex);
+        uint64_t data_len = kis_htole64((uint64_t) (out.length() - data_pos));
+        memcpy(&(out[len_pos]), &data_len, 8);
 
-            bool use_msgpack = false;
-            bool use_json = false;
+        columnar_pad(out);
+    }
 
-			if (tokenurl[4] == "devices.msgpack")
-				use_msgpack = true;
-			else if (tokenurl[4] == "devices.json")
-				use_json = true;
-            else
-                return;
+    snap->Unref();
 
-            mac_addr mac = mac_addr(tokenurl[3]);
+    stream.write(out.data(), out.length());
 
-            if (mac.error) {
-                return;
-            }
+    return true;
+}
 
-            TrackerElement *devvec =
-                globalreg->entrytracker->GetTrackedInstance(device_list_base_id);
+// Pick the serializer for a routed request
+static TrackerElementSerializer *devicetracker_serializer(GlobalRegistry *globalreg,
+        int route_id, std::stringstream &stream) {
+    if (route_id & Devicetracker::route_msgpack)
+        return new MsgpackAdapter::Serializer(globalreg, stream);
 
-            TrackerElementScopeLinker slink(devvec);
+    return new JsonAdapter::Serializer(globalreg, stream);
+}
 
-            vector<kis_tracked_device_base *>::iterator vi;
-            for (vi = tracked_vec.begin(); vi != tracked_vec.end(); ++vi) {
-                if ((*vi)->get_macaddr() == mac) {
-                    devvec->add_vector((*vi));
-                }
-            }
+int Devicetracker::Httpd_CreateRoutedResponse(
+        Kis_Net_Httpd *httpd __attribute__((unused)),
+        struct MHD_Connection *connection, int route_id,
+        Kis_Net_Httpd_Route_Params &params,
+        const char *path __attribute__((unused)), 
+        const char *method __attribute__((unused)), 
+        const char *upload_data __attribute__((unused)),
+        size_t *upload_data_size __attribute__((unused)), 
+        std::stringstream &stream) {
+
+    // Optional field projection, as a comma-separated list of field paths, ie
+    // ?fields=kismet.device.base.key,kismet.device.base.signal/kismet.common.signal.last_signal_dbm
+    // Compiled once for the whole request.  Asking for fields when none of
+    // them exist is an error, rather than a silent full record.
+    const char *fields_arg =
+        MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "fields");
+    TrackerElementProjection fields_plan(globalreg, 
+            fields_arg == NULL ? string("") : string(fields_arg));
+    TrackerElementProjection *projection = NULL;
+
+    if (!fields_plan.empty())
+        projection = &fields_plan;
+    else if (fields_arg != NULL && fields_arg[0] != '\0')
+        return MHD_HTTP_BAD_REQUEST;
+
+    TrackerElementSerializer *serializer = NULL;
+
+    switch (route_id & ~route_msgpack) {
+        case route_all_devices:
+            serializer = devicetracker_serializer(globalreg, route_id, stream);
+            httpd_device_summary(serializer, NULL, "", projection);
+            delete(serializer);
+            return MHD_HTTP_OK;
+
+        case route_all_devices_dt:
+            // Datatable wrapper
+            serializer = devicetracker_serializer(globalreg, route_id, stream);
+            httpd_device_summary(serializer, NULL, "aaData", projection);
+            delete(serializer);
+            return MHD_HTTP_OK;
+
+        case route_all_devices_xml:
+            httpd_xml_device_summary(stream);
+            return MHD_HTTP_OK;
+
+        case route_all_devices_columnar: {
+            const char *columns = 
+                MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, 
+                        "columns");
+
+            if (!httpd_device_columnar(stream, 
+                        columns == NULL ? string("") : string(columns)))
+                return MHD_HTTP_BAD_REQUEST;
+
+            return MHD_HTTP_OK;
+        }
 
-            TrackerElementSerializer *serializer = NULL;
-            if (use_msgpack) {
-                serializer =
-                    new MsgpackAdapter::Serializer(globalreg, stream);
-            } else if (use_json) {
-                serializer =
-                    new JsonAdapter::Serializer(globalreg, stream);
-            }
+        case route_device_query: {
+            DevicetrackerQuery query;
 
-            if (serializer != NULL) {
-                serializer->serialize(devvec);
-                delete(serializer);
+            if (!ParseDeviceQuery(connection, &query))
+                return MHD_HTTP_BAD_REQUEST;
+
+            serializer = devicetracker_serializer(globalreg, route_id, stream);
+            httpd_device_query(serializer, &query, projection);
+            delete(serializer);
+            return MHD_HTTP_OK;
+        }
+
+        case route_all_phys:
+            serializer = devicetracker_serializer(globalreg, route_id, stream);
+            httpd_all_phys(serializer);
+            delete(serializer);
+            return MHD_HTTP_OK;
+
+        case route_all_phys_dt:
+            // Datatable wrapper
+            serializer = devicetracker_serializer(globalreg, route_id, stream);
+            httpd_all_phys(serializer, "aaData");
+            delete(serializer);
+            return MHD_HTTP_OK;
+
+        case route_by_key: {
+            // Return the device, or a field of the device
+            DevicetrackerSnapshot *snap = AcquireSnapshot();
+
+            DevicetrackerDeviceVersion *version = 
+                snap->FindDevice(params["key"].uint_value);
+
+            if (version == NULL) {
+                snap->Unref();
+                return MHD_HTTP_NOT_FOUND;
             }
 
-            // delete(devvec);
+            TrackerElement *dev = version->device;
 
-            return;
-        } else if (tokenurl[2] == "last-time") {
-            if (tokenurl.size() < 5)
-                return;
+            vector<string> &fpath = params["path"].path_value;
 
-            // Is the timestamp an int?
-            long lastts;
-            if (sscanf(tokenurl[3].c_str(), "%ld", &lastts) != 1)
-                return;
+            if (fpath.size() > 0) {
+                // Same walk as tracker_component::get_child_path, over the
+                // snapshot copy
+                TrackerElement *sub = dev;
 
-            local_locker lock(&devicelist_mutex);
+                for (unsigned int x = 0; x < fpath.size() && sub != NULL; x++) {
+                    if (fpath[x].length() == 0)
+                        continue;
+
+                    int id = globalreg->entrytracker->GetFieldId(fpath[x]);
+
+                    if (id < 0)
+                        sub = NULL;
+                    else
+                        sub = sub->get_map_value(id);
+                }
 
-            TrackerElement *wrapper = new TrackerElement(TrackerMap);
-            TrackerElementScopeLinker slink(wrapper);
+                if (sub == NULL) {
+                    snap->Unref();
+                    return MHD_HTTP_NOT_FOUND;
+                }
 
-            TrackerElement *refresh =
-                globalreg->entrytracker->GetTrackedInstance(device_update_required_id);
+                serializer = devicetracker_serializer(globalreg, route_id, stream);
+                serializer->serialize(sub);
+                delete(serializer);
 
-            // If we've changed the list more recently, we have to do a refresh
-            if (lastts < full_refresh_time) {
-                refresh->set((uint8_t) 1);
+                snap->Unref();
+                return MHD_HTTP_OK;
+            }
+
+            serializer = devicetracker_serializer(globalreg, route_id, stream);
+
+            if (projection != NULL) {
+                TrackerElement *proj = projection->Project(dev, device_base_id);
+                TrackerElementScopeLinker plink(proj);
+
+                serializer->serialize(proj);
             } else {
-                refresh->set((uint8_t) 0);
+                serializer->serialize(dev);
             }
 
-            wrapper->add_map(refresh);
+            delete(serializer);
 
-            TrackerElement *updatets =
-                globalreg->entrytracker->GetTrackedInstance(device_update_timestamp_id);
-            updatets->set((int64_t) globalreg->timestamp.tv_sec);
+            snap->Unref();
+            return MHD_HTTP_OK;
+        }
 
-            wrapper->add_map(updatets);
+        case route_by_mac: {
+            DevicetrackerSnapshot *snap = AcquireSnapshot();
+
+            mac_addr mac = params["mac"].mac_value;
 
             TrackerElement *devvec =
                 globalreg->entrytracker->GetTrackedInstance(device_list_base_id);
 
-            wrapper->add_map(devvec);
+            devvec->link();
 
-            vector<kis_tracked_device_base *>::iterator vi;
-            for (vi = tracked_vec.begin(); vi != tracked_vec.end(); ++vi) {
-                if ((*vi)->get_last_time() > lastts)
-                    devvec->add_vector((*vi));
+            DevicetrackerVersionIndex::const_iterator vi;
+            for (vi = snap->devices->begin(); vi != snap->devices->end(); ++vi) {
+                if ((*vi)->macaddr == mac) {
+                    if (projection != NULL)
+                        devvec->add_vector(projection->Project((*vi)->device,
+                                    device_base_id));
+                    else
+                        devvec->add_vector((*vi)->device);
+                }
             }
 
-            TrackerElementSerializer *serializer = NULL;
-            // Are we asking for a summary we understand?
-            if (tokenurl[4] == "devices.json")
-                serializer =
-                    new JsonAdapter::Serializer(globalreg, stream);
-            if (tokenurl[4] == "devices.msgpack")
-                serializer =
-                    new MsgpackAdapter::Serializer(globalreg, stream);
-
-            if (serializer != NULL) {
-                serializer->serialize(wrapper);
-                delete(serializer);
-            }
+            serializer = devicetracker_serializer(globalreg, route_id, stream);
+            serializer->serialize(devvec);
+            delete(serializer);
+
+            // Release the list before the snapshot which owns its contents
+            devvec->unlink();
+            snap->Unref();
 
-            return;
+            return MHD_HTTP_OK;
         }
 
+        case route_last_time:
+            serializer = devicetracker_serializer(globalreg, route_id, stream);
+            httpd_devices_since(serializer, params["timestamp"].int_value, 
+                    projection);
+            delete(serializer);
+
+            return MHD_HTTP_OK;
+
+        case route_by_tile: {
+            double min_lat, min_lon, max_lat, max_lon;
+
+            if (sscanf(params["min_lat"].value.c_str(), "%lf", &min_lat) != 1 ||
+                    sscanf(params["min_lon"].value.c_str(), "%lf", &min_lon) != 1 ||
+                    sscanf(params["max_lat"].value.c_str(), "%lf", &max_lat) != 1 ||
+                    sscanf(params["max_lon"].value.c_str(), "%lf", &max_lon) != 1)
+                return MHD_HTTP_BAD_REQUEST;
+
+            if (min_lat < -90 || max_lat > 90 || min_lat > max_lat ||
+                    min_lon < -180 || min_lon > 180 || 
+                    max_lon < -180 || max_lon > 180)
+                return MHD_HTTP_BAD_REQUEST;
+
+            serializer = devicetracker_serializer(globalreg, route_id, stream);
+            httpd_devices_in_box(serializer, min_lat, min_lon, max_lat, max_lon,
+                    projection);
+            delete(serializer);
+
+            return MHD_HTTP_OK;
+        }
+    }
+
+    return MHD_HTTP_NOT_FOUND;
+}
+
+// Sort devices by last time, for searching the snapshot time index
+// Compares a time against the last_time index of a snapshot
+class devicetracker_version_after {
+public:
+    bool operator()(time_t in_since, DevicetrackerDeviceVersion *in_version) const {
+        return in_since < in_version->last_time;
+    }
+
+    bool operator()(DevicetrackerDeviceVersion *in_version, time_t in_since) const {
+        return in_version->last_time < in_since;
     }
+};
+
+int Devicetracker::httpd_devices_since(TrackerElementSerializer *serializer,
+        time_t in_since, TrackerElementProjection *projection, 
+        bool in_skip_empty) {
+    // Snapshots are current as of the last publish, even when nothing
+    // changed and the snapshot itself is older
+    time_t update_time = snapshot_time;
+    __sync_synchronize();
+
+    DevicetrackerSnapshot *snap = AcquireSnapshot();
+
+    // Walk the last_time index from the requested time forwards
+    DevicetrackerTimeIndex::const_iterator ti =
+        snap->by_time->upper_bound(in_since, devicetracker_version_after());
+
+    // If we've changed the list more recently, we have to do a refresh
+    bool need_refresh = in_since < snap->full_refresh_time;
+
+    if (in_skip_empty && !need_refresh && ti == snap->by_time->end()) {
+        snap->Unref();
+        return 0;
+    }
+
+    TrackerElement *wrapper = new TrackerElement(TrackerMap);
+    wrapper->link();
+
+    TrackerElement *refresh =
+        globalreg->entrytracker->GetTrackedInstance(device_update_required_id);
+    refresh->set((uint8_t) need_refresh);
+
+    wrapper->add_map(refresh);
+
+    // Clients resume from the time of the snapshot, not the current time,
+    // so nothing seen since is skipped
+    TrackerElement *updatets =
+        globalreg->entrytracker->GetTrackedInstance(device_update_timestamp_id);
+    updatets->set((int64_t) update_time);
+
+    wrapper->add_map(updatets);
+
+    TrackerElement *devvec =
+        globalreg->entrytracker->GetTrackedInstance(device_list_base_id);
+
+    wrapper->add_map(devvec);
+
+    int num = 0;
+
+    for (; ti != snap->by_time->end(); ++ti) {
+        if (projection != NULL)
+            devvec->add_vector(projection->Project((*ti)->device, device_base_id));
+        else
+            devvec->add_vector((*ti)->device);
+
+        num++;
+    }
+
+    serializer->serialize(wrapper);
+
+    wrapper->unlink();
+    snap->Unref();
+
+    return num;
 }
 
 void Devicetracker::MatchOnDevices(DevicetrackerFilterWorker *worker) {
@@ -2162,7 +3444,7 @@ int Devicetracker::timetracker_event(int eventid) {
             if (globalreg->timestamp.tv_sec - (*i)->get_last_time() >
                     device_idle_expiration) {
                 target_devs.push_back(*i);
-                tracked_vec.erase(i);
+                i = tracked_vec.erase(i);
             } else {
                 ++i;
             }
@@ -2180,6 +3462,9 @@ int Devicetracker::timetracker_event(int eventid) {
             if (mi != tracked_map.end())
                 tracked_map.erase(mi);
 
+            // The next snapshot drops it from its indexes
+            MarkSnapshotDirty(*i);
+
             fprintf(stderr, "debug - forgetting device %s age %lu expiration %d\n", (*i)->get_macaddr().Mac2String().c_str(), globalreg->timestamp.tv_sec - (*i)->get_last_time(), device_idle_expiration);
 
             (*i)->unlink();
@@ -2214,14 +3499,27 @@ int Devicetracker::timetracker_event(int eventid) {
 			if (mi != tracked_map.end())
 				tracked_map.erase(mi);
 
+            MarkSnapshotDirty(tracked_vec[d]);
+
 			// Pre-emptively unlink because we're about to go through and clear
 			// them out of the vec in bulk
-			mi->second->unlink();
+			tracked_vec[d]->unlink();
 		}
 
 		// Clear them out of the vector
 		tracked_vec.erase(tracked_vec.begin(), tracked_vec.begin() + drop);
-	}
+	} else if (eventid == snapshot_timer) {
+        // The phy counts move with every packet, so cached phy responses are
+        // only invalidated here, and only when the counts changed
+        if (num_packets != phy_generation_packets || 
+                tracked_vec.size() != phy_generation_devices) {
+            phy_generation_packets = num_packets;
+            phy_generation_devices = tracked_vec.size();
+            phy_generation.Bump();
+        }
+
+        PublishSnapshot();
+    }
 
     // Loop
     return 1;
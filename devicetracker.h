@@ -22,9 +22,12 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <list>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <vector>
 #include <algorithm>
 #include <string>
@@ -49,6 +52,7 @@
 #include "trackercomponent_legacy.h"
 #include "timetracker.h"
 #include "kis_net_microhttpd.h"
+#include "devicetracker_index.h"
 
 // How big the main vector of components is, if we ever get more than this
 // many tracked components we'll need to expand this but since it ties to
@@ -99,6 +103,8 @@ public:
 
 // fwd
 class Devicetracker;
+class TimeseriesStore;
+class DevicetrackerDeviceVersion;
 
 // Bitfield of basic types a device is classified as.  The device may be multiple
 // of these depending on the phy.  The UI will display them based on the type
@@ -148,6 +154,10 @@ public:
 
         register_fields();
         reserve_fields(NULL);
+
+        channel_count_time = 0;
+        memset(channel_count_bits, 0, sizeof(channel_count_bits));
+        geo_tile = 0;
     }
 
     kis_tracked_device_base(GlobalRegistry *in_globalreg, int in_id,
@@ -164,6 +174,10 @@ public:
 
         register_fields();
         reserve_fields(e);
+
+        channel_count_time = 0;
+        memset(channel_count_bits, 0, sizeof(channel_count_bits));
+        geo_tile = 0;
     }
 
     virtual ~kis_tracked_device_base() {
@@ -269,6 +283,16 @@ public:
 
     kis_tracked_location *get_location() { return location; }
 
+    // Second and channel slots the channel tracker has counted this device
+    // in, one bit per frequency slot, so it's counted once per second per 
+    // channel; not exported
+    time_t channel_count_time;
+    uint64_t channel_count_bits[4];
+
+    // Map tile of the average location, or 0 if the device hasn't been 
+    // located; snapshots index devices by it.  Not exported
+    uint64_t geo_tile;
+
     void inc_frequency_count(double frequency) {
         if (frequency <= 0)
             return;
@@ -289,7 +313,8 @@ public:
         return (kis_tracked_seenby_data *) seenby_map;
     }
 
-    void inc_seenby_count(KisPacketSource *source, time_t tv_sec, int frequency) {
+    void inc_seenby_count(KisPacketSource *source, time_t tv_sec, int frequency,
+            kis_layer1_packinfo *l1info = NULL) {
         TrackerElement::map_iterator seenby_iter;
         kis_tracked_seenby_data *seenby;
 
@@ -319,6 +344,9 @@ public:
                 seenby->inc_frequency_count(frequency);
         }
 
+        if (l1info != NULL)
+            seenby->add_signal(*l1info);
+
     }
 
 protected:
@@ -457,6 +485,8 @@ protected:
         frequency_val_id =
             globalreg->entrytracker->RegisterField("kismet.device.base.frequency.count",
                     TrackerUInt64, "frequency packet count");
+        globalreg->entrytracker->RegisterContainerEntry(freq_khz_map_id, 
+                frequency_val_id);
 
         kis_tracked_seenby_data *seenby_builder =
             new kis_tracked_seenby_data(globalreg, 0);
@@ -464,6 +494,7 @@ protected:
             globalreg->entrytracker->RegisterField("kismet.device.base.seenby.data",
                     seenby_builder, "seen-by data");
         delete(seenby_builder);
+        globalreg->entrytracker->RegisterContainerEntry(seenby_map_id, seenby_val_id);
 
         kis_tracked_minute_rrd<> *bin_rrd_builder =
             new kis_tracked_minute_rrd<>(globalreg, 0);
@@ -728,6 +759,246 @@ public:
     virtual void Finalize(Devicetracker *devicetracker) { }
 };
 
+// Server-side device query, parsed from the options of the /devices/query 
+// endpoints.  Unset options match everything.
+class DevicetrackerQuery {
+public:
+    DevicetrackerQuery() {
+        last_time_min = 0;
+        last_time_max = 0;
+        phy_id = -1;
+        signal_filter = false;
+        signal_min = 0;
+        signal_max = 0;
+        sort_field = sort_last_time;
+        sort_desc = true;
+        offset = 0;
+        limit = 0;
+        cursor_set = false;
+        cursor_key = 0;
+        cursor_num = 0;
+    }
+
+    enum sort_field_t {
+        sort_last_time, sort_first_time, sort_signal, sort_packets,
+        sort_manuf, sort_name
+    };
+
+    // Does a device match all the predicates of this query
+    bool MatchDevice(DevicetrackerDeviceVersion *device);
+
+    // Does a device sort after the cursor
+    bool AfterCursor(DevicetrackerDeviceVersion *device);
+
+    // Cursor resuming after a device, as "key:value" of its sort field
+    string MakeCursor(DevicetrackerDeviceVersion *device);
+
+    // Parse a cursor made by MakeCursor for the current sort field
+    bool ParseCursor(string in_cursor);
+
+    // Last seen time range, 0 for unbounded
+    time_t last_time_min, last_time_max;
+
+    // Phy id, -1 for any phy
+    int phy_id;
+
+    // Set of acceptable device type strings, empty for any type
+    std::set<string> type_set;
+
+    // Last signal range, in dBm
+    bool signal_filter;
+    int signal_min, signal_max;
+
+    // Exact manufacturer
+    string manuf;
+
+    // SSID prefix; matched against the device name, which phy handlers
+    // populate with the advertised SSID
+    string ssid_prefix;
+
+    sort_field_t sort_field;
+    bool sort_desc;
+
+    // Results page, a limit of 0 returns all results after the offset
+    unsigned int offset, limit;
+
+    // Resume after the last result of a previous page; results are ordered
+    // by the sort field and then the device key, so the sort value and key
+    // of that result pick out where the next page starts without walking 
+    // the pages before it.  Only one of the values is used, depending on 
+    // the sort field.
+    bool cursor_set;
+    uint64_t cursor_key;
+    int64_t cursor_num;
+    string cursor_str;
+};
+
+// A device as it was when a snapshot was taken.  Versions are frozen copies
+// shared by every snapshot until the device changes, and are freed by 
+// whichever snapshot drops them last.
+class DevicetrackerDeviceVersion {
+public:
+    DevicetrackerDeviceVersion(kis_tracked_device_base *in_device, time_t in_now);
+    ~DevicetrackerDeviceVersion();
+
+    void Ref() {
+        __sync_add_and_fetch(&refs, 1);
+    }
+
+    void Unref() {
+        if (__sync_sub_and_fetch(&refs, 1) == 0)
+            delete(this);
+    }
+
+    // Full record, and the summary record sharing its fields
+    TrackerElement *device;
+    TrackerElement *summary;
+
+    // Copied out for lookups and the columnar summary
+    uint64_t key;
+    mac_addr macaddr;
+    time_t first_time, last_time;
+    uint64_t packets, data_packets, datasize;
+    int signal;
+    double frequency;
+    string channel, type, name, manuf;
+    int phy_id;
+
+    // Average location and its map tile, if the device has been located
+    bool located;
+    double avg_lat, avg_lon;
+    uint64_t tile;
+
+    // The RRDs of the copy were aged to the time it was made, and a copy 
+    // can't age itself; expires is when they next roll over, and the version
+    // has to be remade from the device, or 0 once they're all empty and 
+    // can't change until the device does
+    time_t aged_time;
+    time_t expires;
+
+protected:
+    int refs;
+};
+
+// Snapshot indexes hold a reference to each version in them
+template<> inline void devicetracker_index_ref<DevicetrackerDeviceVersion *>(
+        DevicetrackerDeviceVersion *in_version) {
+    in_version->Ref();
+}
+
+template<> inline void devicetracker_index_unref<DevicetrackerDeviceVersion *>(
+        DevicetrackerDeviceVersion *in_version) {
+    in_version->Unref();
+}
+
+// Order of snapshot versions by key; also compares against a bare key
+class devicetracker_version_key_less {
+public:
+    bool operator()(DevicetrackerDeviceVersion *a, 
+            DevicetrackerDeviceVersion *b) const {
+        return a->key < b->key;
+    }
+
+    bool operator()(DevicetrackerDeviceVersion *a, uint64_t b) const {
+        return a->key < b;
+    }
+
+    bool operator()(uint64_t a, DevicetrackerDeviceVersion *b) const {
+        return a < b->key;
+    }
+};
+
+// Order of the last_time index of a snapshot; ties are broken by key so a 
+// cursor always names a single position
+class devicetracker_version_time_less {
+public:
+    bool operator()(DevicetrackerDeviceVersion *a, 
+            DevicetrackerDeviceVersion *b) const {
+        if (a->last_time != b->last_time)
+            return a->last_time < b->last_time;
+
+        return a->key < b->key;
+    }
+};
+
+typedef DevicetrackerIndex<DevicetrackerDeviceVersion *, 
+        devicetracker_version_key_less> DevicetrackerVersionIndex;
+typedef DevicetrackerIndex<DevicetrackerDeviceVersion *, 
+        devicetracker_version_time_less> DevicetrackerTimeIndex;
+typedef DevicetrackerIndex<uint64_t, std::less<uint64_t> > DevicetrackerKeyIndex;
+
+// Point-in-time view of all devices.  Snapshots are published by the packet
+// thread at a fixed interval, so they never hold a half-processed packet, and
+// REST readers walk them without taking the device list or device locks.
+// Each snapshot is made by patching the indexes of the one before it with
+// the devices which changed, sharing everything else with it.
+class DevicetrackerSnapshot {
+public:
+    DevicetrackerSnapshot() {
+        timestamp = 0;
+        full_refresh_time = 0;
+        devices = NULL;
+        by_time = NULL;
+        refs = 1;
+    }
+
+    ~DevicetrackerSnapshot() {
+        if (devices != NULL)
+            devices->Unref();
+        if (by_time != NULL)
+            by_time->Unref();
+
+        for (unordered_map<string, DevicetrackerKeyIndex *>::iterator i =
+                manuf_index.begin(); i != manuf_index.end(); ++i)
+            i->second->Unref();
+        for (unordered_map<int, DevicetrackerKeyIndex *>::iterator i =
+                phy_index.begin(); i != phy_index.end(); ++i)
+            i->second->Unref();
+        for (map<uint64_t, DevicetrackerKeyIndex *>::iterator i =
+                tile_index.begin(); i != tile_index.end(); ++i)
+            i->second->Unref();
+    }
+
+    void Ref() {
+        __sync_add_and_fetch(&refs, 1);
+    }
+
+    void Unref() {
+        if (__sync_sub_and_fetch(&refs, 1) == 0)
+            delete(this);
+    }
+
+    // Version of a device in this snapshot, or NULL
+    DevicetrackerDeviceVersion *FindDevice(uint64_t in_key) const {
+        DevicetrackerVersionIndex::const_iterator i =
+            devices->lower_bound(in_key, devicetracker_version_key_less());
+
+        if (i == devices->end() || (*i)->key != in_key)
+            return NULL;
+
+        return *i;
+    }
+
+    time_t timestamp;
+    time_t full_refresh_time;
+
+    // By key, and by last time and then key
+    DevicetrackerVersionIndex *devices;
+    DevicetrackerTimeIndex *by_time;
+
+    // Query indexes, each listing the keys of the devices with that 
+    // manufacturer, phy or map tile.  Tiles are 1/64th of a degree square; 
+    // the key is the tile row (from 1, counted up from the south pole) in the
+    // upper 32 bits and the column (counted east from -180) in the lower, 
+    // so each row of a bounding box is one range of the map.
+    unordered_map<string, DevicetrackerKeyIndex *> manuf_index;
+    unordered_map<int, DevicetrackerKeyIndex *> phy_index;
+    map<uint64_t, DevicetrackerKeyIndex *> tile_index;
+
+protected:
+    int refs;
+};
+
 class Devicetracker : public Kis_Net_Httpd_Stream_Handler,
     public TimetrackerEvent, public LifetimeGlobal {
 public:
@@ -750,6 +1021,10 @@ public:
 	int FetchNumErrorpackets(int in_phy);
 	int FetchNumFilterpackets(int in_phy);
 
+    // Estimated distinct devices seen in the past hour and day
+    uint64_t FetchUniqueDevicesHour(int in_phy);
+    uint64_t FetchUniqueDevicesDay(int in_phy);
+
 	int AddFilter(string in_filter);
 	int AddNetCliFilter(string in_filter);
 
@@ -758,6 +1033,15 @@ public:
     // components due to timeouts / max device cleanup
     void UpdateFullRefresh();
 
+    // Take a reference to the latest device snapshot; release it with
+    // Unref().  Never blocks on the packet thread.
+    DevicetrackerSnapshot *AcquireSnapshot();
+
+    // Time the device snapshot was last known current
+    time_t FetchSnapshotTime() {
+        return snapshot_time;
+    }
+
 #if 0
 	int SetDeviceTag(mac_addr in_device, string in_data);
 	int ClearDeviceTag(mac_addr in_device);
@@ -773,6 +1057,14 @@ public:
     // done inside the worker
     void MatchOnDevices(DevicetrackerFilterWorker *worker);
 
+    // Refresh the snapshot copy and query indexes of a device.  Each 
+    // snapshot patches the previous snapshot's indexes with the devices 
+    // UpdateCommonDevice saw change; phy handlers which change a device
+    // outside of UpdateCommonDevice (such as the manufacturer, or records
+    // removed by a timer) call this so the next snapshot picks the change 
+    // up.  Packet thread only.
+    void ReindexDevice(kis_tracked_device_base *device);
+
 	typedef map<uint64_t, kis_tracked_device_base *>::iterator device_itr;
 	typedef map<uint64_t, kis_tracked_device_base *>::const_iterator const_device_itr;
 
@@ -817,11 +1109,28 @@ public:
     kis_tracked_device_base *UpdateCommonDevice(mac_addr in_mac, int in_phy,
             kis_packet *in_pack, unsigned int in_flags);
 
-    // HTTP handlers
-    virtual bool Httpd_VerifyPath(const char *path, const char *method);
+    // REST routes; msgpack variants of a route are flagged with route_msgpack
+    enum httpd_route {
+        route_all_devices, route_all_devices_dt, route_all_devices_xml,
+        route_device_query, route_all_phys, route_all_phys_dt,
+        route_by_key, route_by_mac, route_last_time, route_all_devices_columnar,
+        route_by_tile,
+
+        route_msgpack = 0x100
+    };
 
-    virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
-            struct MHD_Connection *connection,
+    // HTTP handlers
+    virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd __attribute__((unused)),
+            struct MHD_Connection *connection __attribute__((unused)),
+            const char *url __attribute__((unused)), 
+            const char *method __attribute__((unused)), 
+            const char *upload_data __attribute__((unused)),
+            size_t *upload_data_size __attribute__((unused)), 
+            std::stringstream &stream __attribute__((unused))) { }
+
+    virtual int Httpd_CreateRoutedResponse(Kis_Net_Httpd *httpd,
+            struct MHD_Connection *connection, int route_id,
+            Kis_Net_Httpd_Route_Params &params,
             const char *url, const char *method, const char *upload_data,
             size_t *upload_data_size, std::stringstream &stream);
 
@@ -834,13 +1143,41 @@ public:
     // Generate a device summary, serialized.  Optionally provide an existing
     // vector to generate a summary of devices matching a given criteria via
     // a worker.  Also optionally, wrap the results in a dictionary named via
-    // the in_wrapper key, which is required for some js libs like datatables
+    // the in_wrapper key, which is required for some js libs like datatables.
+    // If a projection is provided, only the projected fields of each device
+    // are serialized instead of the summary.
     void httpd_device_summary(TrackerElementSerializer *serializer,
-            TrackerElementVector *subvec = NULL, string in_wrapper_key = "");
+            TrackerElementVector *subvec = NULL, string in_wrapper_key = "",
+            TrackerElementProjection *projection = NULL);
 
     // TODO merge this into a normal serializer call
     void httpd_xml_device_summary(std::stringstream &stream);
 
+    // Generate the columnar device summary for the comma-separated list of
+    // columns (or the default set); the layout is described in 
+    // docs/dev/webui_rest.md.  Returns false if a column is unknown.
+    bool httpd_device_columnar(std::stringstream &stream, string in_columns);
+
+    // Generate a sorted, paged list of devices matching a query.  If a 
+    // projection is provided, only the projected fields of each device are 
+    // serialized instead of the summary.
+    void httpd_device_query(TrackerElementSerializer *serializer,
+            DevicetrackerQuery *query, TrackerElementProjection *projection = NULL);
+
+    // Generate the devices seen after a time, wrapped with the full refresh
+    // flag and update timestamp.  Returns the number of devices; if 
+    // in_skip_empty is set and there are no devices and no refresh, nothing 
+    // is serialized.
+    int httpd_devices_since(TrackerElementSerializer *serializer, time_t in_since,
+            TrackerElementProjection *projection = NULL, bool in_skip_empty = false);
+
+    // Generate the list of devices whose average location is inside a 
+    // bounding box.  A box with min_lon > max_lon crosses the antimeridian.
+    void httpd_devices_in_box(TrackerElementSerializer *serializer,
+            double in_min_lat, double in_min_lon, 
+            double in_max_lat, double in_max_lon,
+            TrackerElementProjection *projection = NULL);
+
     // Timetracker event handler
     virtual int timetracker_event(int eventid);
 
@@ -856,6 +1193,8 @@ protected:
     int device_list_base_id, device_base_id, phy_base_id, phy_entry_id;
     int device_summary_base_id;
     int device_update_required_id, device_update_timestamp_id;
+    int device_query_next_offset_id;
+    int device_query_next_cursor_id;
 
 	// Total # of packets
 	int num_packets;
@@ -869,10 +1208,17 @@ protected:
 	map<int, int> phy_errorpackets;
 	map<int, int> phy_filterpackets;
 
+    // Per-phy (and KIS_PHY_ANY) distinct devices over time, guarded by the 
+    // device list lock
+    map<int, kis_unique_rrd> phy_unique_devices;
+
     // Total packet history
     int packets_rrd_id;
     kis_tracked_rrd<> *packets_rrd;
 
+    // Long-term history of the packet RRDs, if it's enabled
+    TimeseriesStore *timeseries;
+
     // Timeout of idle devices
     int device_idle_expiration;
     int device_idle_timer;
@@ -884,18 +1230,82 @@ protected:
     // Timestamp for the last time we removed a device
     time_t full_refresh_time;
 
+    // Change counters for cached REST responses; devices changes when a new
+    // device snapshot is published, phys covers the per-phy packet and 
+    // device counts.  The phy counts are checked at the snapshot interval, 
+    // against the totals the phy generation was last bumped for.
+    Kis_Net_Httpd_Generation device_generation;
+    Kis_Net_Httpd_Generation phy_generation;
+    int phy_generation_packets;
+    unsigned int phy_generation_devices;
+
+    // Device snapshots.  The packet thread records which devices changed
+    // and publishes a new snapshot every snapshot interval, copying only
+    // those.  Readers find the current snapshot inside a short epoch 
+    // section.  A snapshot swapped out is retired with the epoch it was
+    // swapped out of, and the publisher only drops its reference once no
+    // reader is counted in that epoch, so no reader can take a reference
+    // to a snapshot which has been freed.
+    DevicetrackerSnapshot *snapshot_current;
+    unsigned int snapshot_epoch;
+    unsigned int snapshot_readers[2];
+    vector<pair<unsigned int, DevicetrackerSnapshot *> > snapshot_retired;
+
+    // Time of the last publish; a snapshot stays current until a device
+    // changes, so this may be newer than the snapshot
+    time_t snapshot_time;
+
+    int snapshot_timer;
+
+    // Devices changed or removed since the last snapshot, and if a snapshot
+    // is needed even if no device changed; packet thread only
+    set<uint64_t> snapshot_dirty;
+    bool snapshot_pending;
+
+    // When the RRDs of snapshot versions next need aging, by device key; 
+    // those devices are copied again as if they'd changed.  Packet thread
+    // only.
+    multimap<time_t, uint64_t> snapshot_expiry;
+
+    void MarkSnapshotDirty(kis_tracked_device_base *device) {
+        snapshot_dirty.insert(device->get_key());
+        snapshot_pending = true;
+    }
+
+    void PublishSnapshot();
+
+    // Release the retired snapshots no reader can still be finding
+    void ReclaimSnapshots();
+
 	// Common device component
 	int devcomp_ref_common;
 
     // Packet components we add or interact with
 	int pack_comp_device, pack_comp_common, pack_comp_basicdata,
-		pack_comp_radiodata, pack_comp_gps, pack_comp_capsrc;
+		pack_comp_radiodata, pack_comp_gps, pack_comp_capsrc, pack_comp_datasrc;
 
 	// Tracked devices
 	map<uint64_t, kis_tracked_device_base *> tracked_map;
 	// Vector of tracked devices so we can iterate them quickly
 	vector<kis_tracked_device_base *> tracked_vec;
 
+    // Add a GPS sample to a device and record the tile of its new average
+    // location; snapshots carry the tile buckets forward and move only the
+    // devices whose tile changed
+    void UpdateDeviceLocation(kis_tracked_device_base *device,
+            kis_gps_packinfo *in_gpsinfo);
+
+    // Devices of a snapshot in the tiles covering a bounding box
+    void FetchBoxDevices(DevicetrackerSnapshot *snap, 
+            double in_min_lat, double in_min_lon, 
+            double in_max_lat, double in_max_lon, 
+            vector<DevicetrackerDeviceVersion *> *ret_devices);
+
+    // Parse the query options of a request.  Returns false if an option is
+    // malformed.
+    bool ParseDeviceQuery(struct MHD_Connection *connection, 
+            DevicetrackerQuery *query);
+
 	// Filtering
 	FilterCore *track_filter;
 
@@ -945,6 +1355,8 @@ public:
     __Proxy(num_crypt_packets, uint64_t, uint64_t, uint64_t, num_crypt_packets);
     __Proxy(num_error_packets, uint64_t, uint64_t, uint64_t, num_error_packets);
     __Proxy(num_filter_packets, uint64_t, uint64_t, uint64_t, num_filter_packets);
+    __Proxy(unique_devices_hour, uint64_t, uint64_t, uint64_t, unique_devices_hour);
+    __Proxy(unique_devices_day, uint64_t, uint64_t, uint64_t, unique_devices_day);
 
     void set_from_phy(Devicetracker *devicetracker, int phy) {
         set_phy_id(phy);
@@ -955,6 +1367,8 @@ public:
         set_num_crypt_packets(devicetracker->FetchNumCryptpackets(phy));
         set_num_error_packets(devicetracker->FetchNumErrorpackets(phy));
         set_num_filter_packets(devicetracker->FetchNumFilterpackets(phy));
+        set_unique_devices_hour(devicetracker->FetchUniqueDevicesHour(phy));
+        set_unique_devices_day(devicetracker->FetchUniqueDevicesDay(phy));
     }
 
 protected:
@@ -980,6 +1394,14 @@ protected:
         num_filter_packets_id =
             RegisterField("kismet.phy.packets.filtered", TrackerUInt64,
                     "number of filtered packets", (void **) &num_filter_packets);
+        unique_devices_hour_id =
+            RegisterField("kismet.phy.unique_devices.hour", TrackerUInt64,
+                    "estimated distinct devices in the past hour", 
+                    (void **) &unique_devices_hour);
+        unique_devices_day_id =
+            RegisterField("kismet.phy.unique_devices.day", TrackerUInt64,
+                    "estimated distinct devices in the past day", 
+                    (void **) &unique_devices_day);
     }
 
     int phy_id_id;
@@ -1006,6 +1428,12 @@ protected:
     int num_filter_packets_id;
     TrackerElement *num_filter_packets;
 
+    int unique_devices_hour_id;
+    TrackerElement *unique_devices_hour;
+
+    int unique_devices_day_id;
+    TrackerElement *unique_devices_day;
+
 };
 
 #endif
@@ -38,8 +38,10 @@
 #include "entrytracker.h"
 #include "gps_manager.h"
 #include "packet.h"
+#include "kis_signal_stats.h"
 #include "uuid.h"
 #include "packinfo_signal.h"
+#include "kis_hyperloglog.h"
 
 // Aggregator class used for RRD.  Performs functions like combining elements
 // (for instance, adding to the existing element, or choosing to replace the
@@ -71,14 +73,50 @@ public:
     }
 };
 
+class kis_tracked_rrd_history_source;
+
+// Long-term storage for RRD history.  RRDs with a history hand it the value
+// of each hour of the day view as the hour is done.  An RRD only notices an
+// hour is done when it's next updated, so the RRDs also register with the 
+// history, which collects the hours of RRDs gone quiet and the hours still 
+// open when it shuts down.
+class kis_tracked_rrd_history {
+public:
+    virtual ~kis_tracked_rrd_history() { }
+
+    virtual void AddPoint(uint32_t in_series, time_t in_time, int64_t in_value) = 0;
+
+    virtual void RegisterSource(kis_tracked_rrd_history_source *in_source) = 0;
+    virtual void RemoveSource(kis_tracked_rrd_history_source *in_source) = 0;
+};
+
+// RRD feeding a history
+class kis_tracked_rrd_history_source {
+public:
+    virtual ~kis_tracked_rrd_history_source() { }
+
+    // Hand over the last active hour if it's over by in_now, or even if it 
+    // isn't when in_open is set.  Each hour is only handed over once.
+    virtual void flush_history(time_t in_now, bool in_open) = 0;
+
+    virtual uint32_t fetch_history_series() = 0;
+
+    // The history is shutting down
+    virtual void detach_history() = 0;
+};
+
 template <class Aggregator = kis_tracked_rrd_default_aggregator>
-class kis_tracked_rrd : public tracker_component {
+class kis_tracked_rrd : public tracker_component, 
+    public kis_tracked_rrd_history_source {
 public:
     kis_tracked_rrd(GlobalRegistry *in_globalreg, int in_id) :
         tracker_component(in_globalreg, in_id) {
         register_fields();
         reserve_fields(NULL);
         update_first = true;
+        history = NULL;
+        history_series = 0;
+        history_time = 0;
     }
 
     kis_tracked_rrd(GlobalRegistry *in_globalreg, int in_id, TrackerElement *e) :
@@ -87,6 +125,14 @@ public:
         register_fields();
         reserve_fields(e);
         update_first = true;
+        history = NULL;
+        history_series = 0;
+        history_time = 0;
+    }
+
+    virtual ~kis_tracked_rrd() {
+        // Whatever we have of the last hour is all there will be
+        set_history(NULL, 0);
     }
 
     virtual TrackerElement *clone_type() {
@@ -103,6 +149,53 @@ public:
         update_first = in_upd;
     }
 
+    // Record each completed hour in a long-term history as series in_series.
+    // Copies of the RRD don't keep the history.
+    void set_history(kis_tracked_rrd_history *in_history, uint32_t in_series) {
+        if (history != NULL) {
+            flush_history(0, true);
+            history->RemoveSource(this);
+        }
+
+        history = NULL;
+        history_series = 0;
+
+        if (in_history != NULL && in_series != 0) {
+            history = in_history;
+            history_series = in_series;
+            history->RegisterSource(this);
+        }
+    }
+
+    virtual void flush_history(time_t in_now, bool in_open) {
+        time_t ltime = get_last_time();
+
+        if (history == NULL || ltime == 0)
+            return;
+
+        time_t hour = ltime - (ltime % 3600);
+
+        if (hour <= history_time)
+            return;
+
+        if (!in_open && in_now / 3600 == ltime / 3600)
+            return;
+
+        history_time = hour;
+
+        history->AddPoint(history_series, hour,
+                GetTrackerValue<int64_t>(day_vec->get_vector_value((ltime / 3600) % 24)));
+    }
+
+    virtual uint32_t fetch_history_series() {
+        return history_series;
+    }
+
+    virtual void detach_history() {
+        history = NULL;
+        history_series = 0;
+    }
+
     __Proxy(last_time, uint64_t, time_t, time_t, last_time);
 
     // Add a sample.  Use combinator function 'c' to derive the new sample value
@@ -126,6 +219,10 @@ public:
             // printf("debug - rrd - timewarp to the past?  discard\n");
             return;
         }
+
+        // Moving into a new hour, so the last hour we have data for is done
+        if (in_time / 3600 != ltime / 3600)
+            flush_history(in_time, false);
         
         TrackerElement *e;
 
@@ -285,6 +382,25 @@ public:
         set_last_time(in_time);
     }
 
+    // Sum of the per-second samples over the last in_secs seconds before
+    // in_now, at most the past minute.  Seconds with no samples count as 0.
+    int64_t get_recent_sum(time_t in_now, int in_secs) {
+        time_t ltime = get_last_time();
+        int64_t sum = 0;
+
+        if (in_secs > 60)
+            in_secs = 60;
+
+        for (time_t t = in_now - in_secs + 1; t <= in_now; t++) {
+            if (t > ltime || ltime - t >= 60)
+                continue;
+
+            sum += GetTrackerValue<int64_t>(minute_vec->get_vector_value(t % 60));
+        }
+
+        return sum;
+    }
+
     virtual void pre_serialize() {
         tracker_component::pre_serialize();
         Aggregator agg;
@@ -354,6 +470,9 @@ protected:
             RegisterField("kismet.common.rrd.hour", TrackerInt64, 
                     "hour value", NULL);
 
+        globalreg->entrytracker->RegisterContainerEntry(minute_vec_id, second_entry_id);
+        globalreg->entrytracker->RegisterContainerEntry(hour_vec_id, minute_entry_id);
+        globalreg->entrytracker->RegisterContainerEntry(day_vec_id, hour_entry_id);
     } 
 
     virtual void reserve_fields(TrackerElement *e) {
@@ -405,6 +524,12 @@ protected:
     int hour_entry_id;
 
     bool update_first;
+
+    kis_tracked_rrd_history *history;
+    uint32_t history_series;
+
+    // Start of the last hour handed to the history
+    time_t history_time;
 };
 
 // Easier to make this it's own class since for a single-minute RRD the logic is
@@ -525,6 +650,8 @@ protected:
         second_entry_id = 
             RegisterField("kismet.common.rrd.second", TrackerInt64, 
                     "second value", NULL);
+
+        globalreg->entrytracker->RegisterContainerEntry(minute_vec_id, second_entry_id);
     } 
 
     virtual void reserve_fields(TrackerElement *e) {
@@ -554,6 +681,176 @@ protected:
     bool update_first;
 };
 
+// Distinct devices over time, as an RRD of HyperLogLog sketches.  Exports
+// estimates of the distinct devices in each minute of the past hour and each
+// hour of the past day, and over the whole hour and day, in the same bucket
+// layout as kis_tracked_rrd.  The sketches themselves are kept outside the
+// tracked tree; their size is fixed however many devices are added.
+class kis_tracked_unique_rrd : public tracker_component {
+public:
+    kis_tracked_unique_rrd(GlobalRegistry *in_globalreg, int in_id) :
+        tracker_component(in_globalreg, in_id) {
+        register_fields();
+        reserve_fields(NULL);
+        pthread_mutex_init(&unique_mutex, NULL);
+    }
+
+    kis_tracked_unique_rrd(GlobalRegistry *in_globalreg, int in_id, 
+            TrackerElement *e) :
+        tracker_component(in_globalreg, in_id) {
+        register_fields();
+        reserve_fields(e);
+        pthread_mutex_init(&unique_mutex, NULL);
+    }
+
+    virtual ~kis_tracked_unique_rrd() {
+        pthread_mutex_destroy(&unique_mutex);
+    }
+
+    virtual TrackerElement *clone_type() {
+        return new kis_tracked_unique_rrd(globalreg, get_id());
+    }
+
+    __Proxy(last_time, uint64_t, time_t, time_t, last_time);
+    __Proxy(hour_count, uint64_t, uint64_t, uint64_t, hour_count);
+    __Proxy(day_count, uint64_t, uint64_t, uint64_t, day_count);
+    __Proxy(hour_registers, string, string, string, hour_registers);
+    __Proxy(day_registers, string, string, string, day_registers);
+
+    void add_device(uint64_t in_key, time_t in_time) {
+        local_locker lock(&unique_mutex);
+        unique.add(in_key, in_time);
+    }
+
+    virtual void pre_serialize() {
+        tracker_component::pre_serialize();
+
+        // Devices are added from the packet threads while we're serialized
+        // from the httpd threads, so age out old buckets on a copy
+        kis_unique_rrd unique_copy;
+
+        {
+            local_locker lock(&unique_mutex);
+            unique_copy = unique;
+        }
+
+        unique_copy.advance(globalreg->timestamp.tv_sec);
+
+        set_last_time(unique_copy.get_last_time());
+
+        for (unsigned int m = 0; m < 60; m++)
+            hour_vec->get_vector_value(m)->set(unique_copy.estimate_minute(m));
+
+        for (unsigned int h = 0; h < 24; h++)
+            day_vec->get_vector_value(h)->set(unique_copy.estimate_hour_bucket(h));
+
+        kis_hyperloglog hour_hll, day_hll;
+        unique_copy.merge_hour(&hour_hll);
+        unique_copy.merge_day(&day_hll);
+
+        set_hour_count(hour_hll.estimate());
+        set_day_count(day_hll.estimate());
+
+        set_hour_registers(hour_hll.hex_registers());
+        set_day_registers(day_hll.hex_registers());
+    }
+
+protected:
+    virtual void register_fields() {
+        tracker_component::register_fields();
+
+        last_time_id =
+            RegisterField("kismet.common.unique_rrd.last_time", TrackerUInt64,
+                    "last time updated", (void **) &last_time);
+
+        hour_count_id =
+            RegisterField("kismet.common.unique_rrd.hour_count", TrackerUInt64,
+                    "distinct devices in the past hour", (void **) &hour_count);
+        day_count_id =
+            RegisterField("kismet.common.unique_rrd.day_count", TrackerUInt64,
+                    "distinct devices in the past day", (void **) &day_count);
+
+        hour_registers_id =
+            RegisterField("kismet.common.unique_rrd.hour_registers", 
+                    TrackerString, 
+                    "sketch registers for the past hour, as hex bytes", 
+                    (void **) &hour_registers);
+        day_registers_id =
+            RegisterField("kismet.common.unique_rrd.day_registers", 
+                    TrackerString, 
+                    "sketch registers for the past day, as hex bytes", 
+                    (void **) &day_registers);
+
+        hour_vec_id = 
+            RegisterField("kismet.common.unique_rrd.hour_vec", TrackerVector,
+                    "distinct devices per minute for the past hour", 
+                    (void **) &hour_vec);
+        day_vec_id = 
+            RegisterField("kismet.common.unique_rrd.day_vec", TrackerVector,
+                    "distinct devices per hour for the past day", 
+                    (void **) &day_vec);
+
+        minute_entry_id = 
+            RegisterField("kismet.common.unique_rrd.minute", TrackerUInt64, 
+                    "minute value", NULL);
+        hour_entry_id = 
+            RegisterField("kismet.common.unique_rrd.hour", TrackerUInt64, 
+                    "hour value", NULL);
+
+        globalreg->entrytracker->RegisterContainerEntry(hour_vec_id, minute_entry_id);
+        globalreg->entrytracker->RegisterContainerEntry(day_vec_id, hour_entry_id);
+    }
+
+    virtual void reserve_fields(TrackerElement *e) {
+        tracker_component::reserve_fields(e);
+
+        int x;
+        if ((x = hour_vec->get_vector()->size()) != 60) {
+            for ( ; x < 60; x++) {
+                TrackerElement *me =
+                    new TrackerElement(TrackerUInt64, minute_entry_id);
+                hour_vec->add_vector(me);
+            }
+        }
+
+        if ((x = day_vec->get_vector()->size()) != 24) {
+            for ( ; x < 24; x++) {
+                TrackerElement *he =
+                    new TrackerElement(TrackerUInt64, hour_entry_id);
+                day_vec->add_vector(he);
+            }
+        }
+    }
+
+    // Guards the sketches, not the exported fields
+    pthread_mutex_t unique_mutex;
+    kis_unique_rrd unique;
+
+    int last_time_id;
+    TrackerElement *last_time;
+
+    int hour_count_id;
+    TrackerElement *hour_count;
+
+    int day_count_id;
+    TrackerElement *day_count;
+
+    int hour_registers_id;
+    TrackerElement *hour_registers;
+
+    int day_registers_id;
+    TrackerElement *day_registers;
+
+    int hour_vec_id;
+    TrackerElement *hour_vec;
+
+    int day_vec_id;
+    TrackerElement *day_vec;
+
+    int minute_entry_id;
+    int hour_entry_id;
+};
+
 // Signal level RRD, peak selector
 class kis_tracked_rrd_peak_signal_aggregator {
 public:
@@ -730,11 +1027,103 @@ protected:
     TrackerElement *lat, *lon, *alt, *spd, *fix, *valid;
 };
 
-// min/max/avg location
-class kis_tracked_location : public tracker_component {
+// Running min/max/average of a location, kept in plain values so adding
+// a GPS sample doesn't touch a dozen tracked elements.  The average is
+// accumulated as fixed point so it can't drift.
+class kis_location_agg {
 public:
     const static int precision_multiplier = 10000;
 
+    kis_location_agg() {
+        valid = false;
+        fix = 0;
+
+        min_lat = min_lon = min_alt = 0;
+        max_lat = max_lon = max_alt = 0;
+
+        agg_lat = agg_lon = agg_alt = 0;
+        num_agg = num_alt_agg = 0;
+    }
+
+    void add(double in_lat, double in_lon, double in_alt, unsigned int in_fix) {
+        valid = true;
+
+        if (in_fix > fix)
+            fix = in_fix;
+
+        // Zero is treated as unset, as it always has been
+        if (in_lat < min_lat || min_lat == 0)
+            min_lat = in_lat;
+        if (in_lat > max_lat || max_lat == 0)
+            max_lat = in_lat;
+        if (in_lon < min_lon || min_lon == 0)
+            min_lon = in_lon;
+        if (in_lon > max_lon || max_lon == 0)
+            max_lon = in_lon;
+
+        agg_lat += (int64_t) (in_lat * precision_multiplier);
+        agg_lon += (int64_t) (in_lon * precision_multiplier);
+        num_agg++;
+
+        if (in_fix > 2) {
+            if (in_alt < min_alt || min_alt == 0)
+                min_alt = in_alt;
+            if (in_alt > max_alt || max_alt == 0)
+                max_alt = in_alt;
+
+            agg_alt += (int64_t) (in_alt * precision_multiplier);
+            num_alt_agg++;
+        }
+
+        // Are we getting too close to the maximum size of any of our counters?
+        // This would take a really long time but we might as well be safe.  We're
+        // throwing away some of the highest ranges but it's a cheap compare.
+        uint64_t max_size_mask = 0xF000000000000000LL;
+        if ((agg_lat & max_size_mask) || (agg_lon & max_size_mask) ||
+                (agg_alt & max_size_mask) || (num_agg & max_size_mask) ||
+                (num_alt_agg & max_size_mask)) {
+            agg_lat = (int64_t) (get_avg_lat() * precision_multiplier);
+            agg_lon = (int64_t) (get_avg_lon() * precision_multiplier);
+            agg_alt = (int64_t) (get_avg_alt() * precision_multiplier);
+            num_agg = 1;
+            num_alt_agg = 1;
+        }
+    }
+
+    double get_avg_lat() const {
+        if (num_agg == 0)
+            return 0;
+        return (double) (agg_lat / num_agg) / precision_multiplier;
+    }
+
+    double get_avg_lon() const {
+        if (num_agg == 0)
+            return 0;
+        return (double) (agg_lon / num_agg) / precision_multiplier;
+    }
+
+    double get_avg_alt() const {
+        if (num_alt_agg == 0)
+            return 0;
+        return (double) (agg_alt / num_alt_agg) / precision_multiplier;
+    }
+
+    bool valid;
+    unsigned int fix;
+
+    double min_lat, min_lon, min_alt;
+    double max_lat, max_lon, max_alt;
+
+    int64_t agg_lat, agg_lon, agg_alt;
+    int64_t num_agg, num_alt_agg;
+};
+
+// min/max/avg location.  Samples go into an inline kis_location_agg, and the
+// tracked fields are only brought up to date when they're read or serialized.
+class kis_tracked_location : public tracker_component {
+public:
+    const static int precision_multiplier = kis_location_agg::precision_multiplier;
+
     kis_tracked_location(GlobalRegistry *in_globalreg, int in_id) :
         tracker_component(in_globalreg, in_id) { 
         register_fields();
@@ -752,95 +1141,62 @@ public:
         return new kis_tracked_location(globalreg, get_id());
     }
 
-
     void add_loc(double in_lat, double in_lon, double in_alt, unsigned int fix) {
-        set_valid(1);
-
-        if (fix > get_fix()) {
-            set_fix(fix);
-        }
+        agg.add(in_lat, in_lon, in_alt, fix);
+        agg_dirty = true;
+    }
 
-        if (in_lat < min_loc->get_lat() || min_loc->get_lat() == 0) {
-            min_loc->set_lat(in_lat);
-        }
+    const kis_location_agg *get_agg() { return &agg; }
 
-        if (in_lat > max_loc->get_lat() || max_loc->get_lat() == 0) {
-            max_loc->set_lat(in_lat);
-        }
+    bool get_valid() { return agg.valid; }
+    unsigned int get_fix() { return agg.fix; }
 
-        if (in_lon < min_loc->get_lon() || min_loc->get_lon() == 0) {
-            min_loc->set_lon(in_lon);
-        }
+    kis_tracked_location_triplet *get_min_loc() { update_fields(); return min_loc; }
+    kis_tracked_location_triplet *get_max_loc() { update_fields(); return max_loc; }
+    kis_tracked_location_triplet *get_avg_loc() { update_fields(); return avg_loc; }
 
-        if (in_lon > max_loc->get_lon() || max_loc->get_lon() == 0) {
-            max_loc->set_lon(in_lon);
-        }
+    uint64_t get_agg_lat() { return agg.agg_lat; }
+    uint64_t get_agg_lon() { return agg.agg_lon; }
+    uint64_t get_agg_alt() { return agg.agg_alt; }
+    int64_t get_num_agg() { return agg.num_agg; }
+    int64_t get_num_alt_agg() { return agg.num_alt_agg; }
 
-        if (fix > 2) {
-            if (in_alt < min_loc->get_alt() || min_loc->get_alt() == 0) {
-                min_loc->set_alt(in_alt);
-            }
-
-            if (in_alt > max_loc->get_alt() || max_loc->get_alt() == 0) {
-                max_loc->set_alt(in_alt);
-            }
-        }
+    virtual void pre_serialize() {
+        tracker_component::pre_serialize();
+        update_fields();
+    }
 
-        // Append to averaged location
-        (*avg_lat) += (int64_t) (in_lat * precision_multiplier);
-        (*avg_lon) += (int64_t) (in_lon * precision_multiplier);
-        (*num_avg)++;
+protected:
+    kis_location_agg agg;
+    bool agg_dirty;
 
-        if (fix > 2) {
-            (*avg_alt) += (int64_t) (in_alt * precision_multiplier);
-            (*num_alt_avg)++;
-        }
+    // Copy the accumulated location into the tracked fields
+    void update_fields() {
+        if (!agg_dirty)
+            return;
 
-        double calc_lat, calc_lon, calc_alt;
+        agg_dirty = false;
 
-        calc_lat = (double) (GetTrackerValue<int64_t>(avg_lat) / 
-                GetTrackerValue<int64_t>(num_avg)) / precision_multiplier;
-        calc_lon = (double) (GetTrackerValue<int64_t>(avg_lon) / 
-                GetTrackerValue<int64_t>(num_avg)) / precision_multiplier;
-        if (GetTrackerValue<int64_t>(num_alt_avg) != 0) {
-            calc_alt = (double) (GetTrackerValue<int64_t>(avg_alt) / 
-                    GetTrackerValue<int64_t>(num_alt_avg)) / precision_multiplier;
-        } else {
-            calc_alt = 0;
-        }
-        avg_loc->set(calc_lat, calc_lon, calc_alt, 3);
+        loc_valid->set((uint8_t) agg.valid);
+        loc_fix->set((uint8_t) agg.fix);
 
-        // Are we getting too close to the maximum size of any of our counters?
-        // This would take a really long time but we might as well be safe.  We're
-        // throwing away some of the highest ranges but it's a cheap compare.
-        uint64_t max_size_mask = 0xF000000000000000LL;
-        if ((GetTrackerValue<int64_t>(avg_lat) & max_size_mask) ||
-                (GetTrackerValue<int64_t>(avg_lon) & max_size_mask) ||
-                (GetTrackerValue<int64_t>(avg_alt) & max_size_mask) ||
-                (GetTrackerValue<int64_t>(num_avg) & max_size_mask) ||
-                (GetTrackerValue<int64_t>(num_alt_avg) & max_size_mask)) {
-            avg_lat->set((int64_t) (calc_lat * precision_multiplier));
-            avg_lon->set((int64_t) (calc_lon * precision_multiplier));
-            avg_alt->set((int64_t) (calc_alt * precision_multiplier));
-            num_avg->set((int64_t) 1);
-            num_alt_avg->set((int64_t) 1);
-        }
-    }
+        min_loc->set_lat(agg.min_lat);
+        min_loc->set_lon(agg.min_lon);
+        min_loc->set_alt(agg.min_alt);
 
-    __Proxy(valid, uint8_t, bool, bool, loc_valid);
-    __Proxy(fix, uint8_t, unsigned int, unsigned int, loc_fix);
+        max_loc->set_lat(agg.max_lat);
+        max_loc->set_lon(agg.max_lon);
+        max_loc->set_alt(agg.max_alt);
 
-    kis_tracked_location_triplet *get_min_loc() { return min_loc; }
-    kis_tracked_location_triplet *get_max_loc() { return max_loc; }
-    kis_tracked_location_triplet *get_avg_loc() { return avg_loc; }
+        avg_loc->set(agg.get_avg_lat(), agg.get_avg_lon(), agg.get_avg_alt(), 3);
 
-    __Proxy(agg_lat, uint64_t, uint64_t, uint64_t, avg_lat);
-    __Proxy(agg_lon, uint64_t, uint64_t, uint64_t, avg_lon);
-    __Proxy(agg_alt, uint64_t, uint64_t, uint64_t, avg_alt);
-    __Proxy(num_agg, int64_t, int64_t, int64_t, num_avg);
-    __Proxy(num_alt_agg, int64_t, int64_t, int64_t, num_alt_avg);
+        avg_lat->set(agg.agg_lat);
+        avg_lon->set(agg.agg_lon);
+        avg_alt->set(agg.agg_alt);
+        num_avg->set(agg.num_agg);
+        num_alt_avg->set(agg.num_alt_agg);
+    }
 
-protected:
     virtual void register_fields() {
         tracker_component::register_fields();
 
@@ -889,6 +1245,24 @@ protected:
                     e->get_map_value(max_loc_id));
             avg_loc = new kis_tracked_location_triplet(globalreg, avg_loc_id,
                     e->get_map_value(avg_loc_id));
+
+            // Pick up where the existing record left off
+            agg.valid = GetTrackerValue<uint8_t>(loc_valid);
+            agg.fix = GetTrackerValue<uint8_t>(loc_fix);
+
+            agg.min_lat = min_loc->get_lat();
+            agg.min_lon = min_loc->get_lon();
+            agg.min_alt = min_loc->get_alt();
+
+            agg.max_lat = max_loc->get_lat();
+            agg.max_lon = max_loc->get_lon();
+            agg.max_alt = max_loc->get_alt();
+
+            agg.agg_lat = GetTrackerValue<int64_t>(avg_lat);
+            agg.agg_lon = GetTrackerValue<int64_t>(avg_lon);
+            agg.agg_alt = GetTrackerValue<int64_t>(avg_alt);
+            agg.num_agg = GetTrackerValue<int64_t>(num_avg);
+            agg.num_alt_agg = GetTrackerValue<int64_t>(num_alt_avg);
         } else {
             min_loc = new kis_tracked_location_triplet(globalreg, min_loc_id);
             add_map(min_loc);
@@ -899,6 +1273,8 @@ protected:
             avg_loc = new kis_tracked_location_triplet(globalreg, avg_loc_id);
             add_map(avg_loc);
         }
+
+        agg_dirty = false;
     }
 
     kis_tracked_location_triplet *min_loc, *max_loc, *avg_loc;
@@ -936,189 +1312,80 @@ public:
     }
 
     kis_tracked_signal_data& operator+= (const kis_layer1_packinfo& lay1) {
-        if (lay1.signal_type == kis_l1_signal_type_dbm) {
-            if (lay1.signal_dbm != 0) {
-
-                last_signal_dbm->set((int32_t) lay1.signal_dbm);
-
-                if ((*min_signal_dbm) == (int32_t) 0 ||
-                        (*min_signal_dbm) > (int32_t) lay1.signal_dbm) {
-                    min_signal_dbm->set((int32_t) lay1.signal_dbm);
-                }
-
-                if ((*max_signal_dbm) == (int32_t) 0 ||
-                        (*max_signal_dbm) < (int32_t) lay1.signal_dbm) {
-                    max_signal_dbm->set((int32_t) lay1.signal_dbm);
-                }
-            }
-
-            if (lay1.noise_dbm != 0) {
-                last_noise_dbm->set((int32_t) lay1.noise_dbm);
-
-                if ((*min_noise_dbm) == (int32_t) 0 ||
-                        (*min_noise_dbm) > (int32_t) lay1.noise_dbm) {
-                    min_noise_dbm->set((int32_t) lay1.noise_dbm);
-                }
-
-                if ((*max_noise_dbm) == (int32_t) 0 ||
-                        (*max_noise_dbm) < (int32_t) lay1.noise_dbm) {
-                    max_noise_dbm->set((int32_t) lay1.noise_dbm);
-                }
-            }
-        } else if (lay1.signal_type == kis_l1_signal_type_rssi) {
-            if (lay1.signal_rssi != 0) {
-                last_signal_rssi->set((int32_t) lay1.signal_rssi);
-
-                if ((*min_signal_rssi) == (int32_t) 0 ||
-                        (*min_signal_rssi) > (int32_t) lay1.signal_rssi) {
-                    min_signal_dbm->set((int32_t) lay1.signal_rssi);
-                }
-
-                if ((*max_signal_rssi) == (int32_t) 0 ||
-                        (*max_signal_rssi) < (int32_t) lay1.signal_rssi) {
-                    max_signal_rssi->set((int32_t) lay1.signal_rssi);
-                }
-            }
-
-            if (lay1.noise_rssi != 0) {
-                last_noise_rssi->set((int32_t) lay1.noise_rssi);
-
-                if ((*min_noise_rssi) == (int32_t) 0 ||
-                        (*min_noise_rssi) > (int32_t) lay1.noise_rssi) {
-                    min_noise_rssi->set((int32_t) lay1.noise_rssi);
-                }
-
-                if ((*max_noise_rssi) == (int32_t) 0 ||
-                        (*max_noise_rssi) < (int32_t) lay1.noise_rssi) {
-                    max_noise_rssi->set((int32_t) lay1.noise_rssi);
-                }
-            }
-
-            (*carrierset) |= (uint64_t) lay1.carrier;
-            (*encodingset) |= (uint64_t) lay1.encoding;
-
-            if ((*maxseenrate) < (double) lay1.datarate) {
-                maxseenrate->set((double) lay1.datarate);
-            }
-        }
+        agg.add(lay1);
+        agg_dirty = true;
 
         return *this;
     }
 
 	kis_tracked_signal_data& operator+= (const Packinfo_Sig_Combo& in) {
         if (in.lay1 != NULL) {
-            if (in.lay1->signal_type == kis_l1_signal_type_dbm) {
-                if (in.lay1->signal_dbm != 0) {
-
-                    last_signal_dbm->set((int32_t) in.lay1->signal_dbm);
-
-                    if ((*min_signal_dbm) == (int32_t) 0 ||
-                            (*min_signal_dbm) > (int32_t) in.lay1->signal_dbm) {
-                        min_signal_dbm->set((int32_t) in.lay1->signal_dbm);
-                    }
-
-                    if ((*max_signal_dbm) == (int32_t) 0 ||
-                            (*max_signal_dbm) < (int32_t) in.lay1->signal_dbm) {
-                        max_signal_dbm->set((int32_t) in.lay1->signal_dbm);
-
-                        if (in.gps != NULL) {
-                            peak_loc->set(in.gps->lat, in.gps->lon, in.gps->alt, 
-                                    in.gps->fix);
-                        }
-                    }
-
-                    signal_min_rrd->add_sample(in.lay1->signal_dbm, 
-                            globalreg->timestamp.tv_sec);
-                }
-
-                if (in.lay1->noise_dbm != 0) {
-                    last_noise_dbm->set((int32_t) in.lay1->noise_dbm);
-
-                    if ((*min_noise_dbm) == (int32_t) 0 ||
-                            (*min_noise_dbm) > (int32_t) in.lay1->noise_dbm) {
-                        min_noise_dbm->set((int32_t) in.lay1->noise_dbm);
-                    }
-
-                    if ((*max_noise_dbm) == (int32_t) 0 ||
-                            (*max_noise_dbm) < (int32_t) in.lay1->noise_dbm) {
-                        max_noise_dbm->set((int32_t) in.lay1->noise_dbm);
-                    }
-                }
-            } else if (in.lay1->signal_type == kis_l1_signal_type_rssi) {
-                if (in.lay1->signal_rssi != 0) {
-                    last_signal_rssi->set((int32_t) in.lay1->signal_rssi);
-
-                    if ((*min_signal_rssi) == (int32_t) 0 ||
-                            (*min_signal_rssi) > (int32_t) in.lay1->signal_rssi) {
-                        min_signal_dbm->set((int32_t) in.lay1->signal_rssi);
-                    }
-
-                    if ((*max_signal_rssi) == (int32_t) 0 ||
-                            (*max_signal_rssi) < (int32_t) in.lay1->signal_rssi) {
-                        max_signal_rssi->set((int32_t) in.lay1->signal_rssi);
-
-                        if (in.gps != NULL) {
-                            peak_loc->set(in.gps->lat, in.gps->lon, in.gps->alt, 
-                                    in.gps->fix);
-                        }
-                    }
-
-                    signal_min_rrd->add_sample(in.lay1->signal_rssi, 
-                            globalreg->timestamp.tv_sec);
-                }
-
-                if (in.lay1->noise_rssi != 0) {
-                    last_noise_rssi->set((int32_t) in.lay1->noise_rssi);
-
-                    if ((*min_noise_rssi) == (int32_t) 0 ||
-                            (*min_noise_rssi) > (int32_t) in.lay1->noise_rssi) {
-                        min_noise_rssi->set((int32_t) in.lay1->noise_rssi);
-                    }
-
-                    if ((*max_noise_rssi) == (int32_t) 0 ||
-                            (*max_noise_rssi) < (int32_t) in.lay1->noise_rssi) {
-                        max_noise_rssi->set((int32_t) in.lay1->noise_rssi);
-                    }
-                }
+            bool peak = agg.add(*(in.lay1));
+            agg_dirty = true;
 
+            if (peak && in.gps != NULL) {
+                peak_loc->set(in.gps->lat, in.gps->lon, in.gps->alt, in.gps->fix);
             }
 
-            (*carrierset) |= (uint64_t) in.lay1->carrier;
-            (*encodingset) |= (uint64_t) in.lay1->encoding;
-
-            if ((*maxseenrate) < (double) in.lay1->datarate) {
-                maxseenrate->set((double) in.lay1->datarate);
+            if (in.lay1->signal_type == kis_l1_signal_type_dbm && 
+                    in.lay1->signal_dbm != 0) {
+                signal_min_rrd->add_sample(in.lay1->signal_dbm, 
+                        globalreg->timestamp.tv_sec);
+            } else if (in.lay1->signal_type == kis_l1_signal_type_rssi &&
+                    in.lay1->signal_rssi != 0) {
+                signal_min_rrd->add_sample(in.lay1->signal_rssi, 
+                        globalreg->timestamp.tv_sec);
             }
 		}
 
 		return *this;
 	}
 
-    __ProxyGet(last_signal_dbm, int32_t, int, last_signal_dbm);
-    __ProxyGet(min_signal_dbm, int32_t, int, min_signal_dbm);
-    __ProxyGet(max_signal_dbm, int32_t, int, max_signal_dbm);
+    // Combine the signal seen by another record, for instance to total the
+    // signal of a device over several sources
+    void merge(const kis_signal_agg &in_agg) {
+        agg.merge(in_agg);
+        agg_dirty = true;
+    }
+
+    const kis_signal_agg *get_agg() { return &agg; }
+
+    int get_last_signal_dbm() { return agg.last_signal_dbm; }
+    int get_min_signal_dbm() { return agg.min_signal_dbm; }
+    int get_max_signal_dbm() { return agg.max_signal_dbm; }
 
-    __ProxyGet(last_noise_dbm, int32_t, int, last_noise_dbm);
-    __ProxyGet(min_noise_dbm, int32_t, int, min_noise_dbm);
-    __ProxyGet(max_noise_dbm, int32_t, int, max_noise_dbm);
+    int get_last_noise_dbm() { return agg.last_noise_dbm; }
+    int get_min_noise_dbm() { return agg.min_noise_dbm; }
+    int get_max_noise_dbm() { return agg.max_noise_dbm; }
 
-    __ProxyGet(last_signal_rssi, int32_t, int, last_signal_rssi);
-    __ProxyGet(min_signal_rssi, int32_t, int, min_signal_rssi);
-    __ProxyGet(max_signal_rssi, int32_t, int, max_signal_rssi);
+    int get_last_signal_rssi() { return agg.last_signal_rssi; }
+    int get_min_signal_rssi() { return agg.min_signal_rssi; }
+    int get_max_signal_rssi() { return agg.max_signal_rssi; }
 
-    __ProxyGet(last_noise_rssi, int32_t, int, last_noise_rssi);
-    __ProxyGet(min_noise_rssi, int32_t, int, min_noise_rssi);
-    __ProxyGet(max_noise_rssi, int32_t, int, max_noise_rssi);
+    int get_last_noise_rssi() { return agg.last_noise_rssi; }
+    int get_min_noise_rssi() { return agg.min_noise_rssi; }
+    int get_max_noise_rssi() { return agg.max_noise_rssi; }
 
-    __ProxyGet(maxseenrate, double, double, maxseenrate);
-    __ProxyGet(encodingset, uint64_t, uint64_t, encodingset);
-    __ProxyGet(carrierset, uint64_t, uint64_t, carrierset);
+    double get_maxseenrate() { return agg.maxseenrate; }
+    uint64_t get_encodingset() { return agg.encodingset; }
+    uint64_t get_carrierset() { return agg.carrierset; }
+
+    // Signal percentile, in dBm if the signal has been seen in dBm and RSSI
+    // otherwise
+    double get_signal_percentile(double in_quantile) { 
+        return agg.signal_percentile(in_quantile);
+    }
 
     typedef kis_tracked_minute_rrd<kis_tracked_rrd_peak_signal_aggregator> msig_rrd;
     __ProxyTrackable(signal_min_rrd, msig_rrd, signal_min_rrd);
 
     kis_tracked_location_triplet *get_peak_loc() { return peak_loc; }
 
+    virtual void pre_serialize() {
+        tracker_component::pre_serialize();
+        update_fields();
+    }
+
 protected:
     virtual void register_fields() {
         tracker_component::register_fields();
@@ -1165,6 +1432,13 @@ protected:
             RegisterField("kismet.common.signal.max_noise_rssi", TrackerInt32,
                     "maximum noise (RSSI)", (void **) &max_noise_rssi);
 
+        median_signal_id =
+            RegisterField("kismet.common.signal.median_signal", TrackerDouble,
+                    "median signal (dBm, or RSSI if no dBm)", (void **) &median_signal);
+        p90_signal_id =
+            RegisterField("kismet.common.signal.p90_signal", TrackerDouble,
+                    "90th percentile signal (dBm, or RSSI if no dBm)", 
+                    (void **) &p90_signal);
 
         kis_tracked_location_triplet *loc_builder = 
             new kis_tracked_location_triplet(globalreg, 0);
@@ -1202,10 +1476,27 @@ protected:
                 signal_min_rrd = new 
                 kis_tracked_minute_rrd<kis_tracked_rrd_peak_signal_aggregator>(globalreg,
                         signal_min_rrd_id, e->get_map_value(signal_min_rrd_id));
+
+            // Pick up where the existing record left off; the histogram 
+            // starts over
+            agg.last_signal_dbm = GetTrackerValue<int32_t>(last_signal_dbm);
+            agg.min_signal_dbm = GetTrackerValue<int32_t>(min_signal_dbm);
+            agg.max_signal_dbm = GetTrackerValue<int32_t>(max_signal_dbm);
+            agg.last_noise_dbm = GetTrackerValue<int32_t>(last_noise_dbm);
+            agg.min_noise_dbm = GetTrackerValue<int32_t>(min_noise_dbm);
+            agg.max_noise_dbm = GetTrackerValue<int32_t>(max_noise_dbm);
+
+            agg.last_signal_rssi = GetTrackerValue<int32_t>(last_signal_rssi);
+            agg.min_signal_rssi = GetTrackerValue<int32_t>(min_signal_rssi);
+            agg.max_signal_rssi = GetTrackerValue<int32_t>(max_signal_rssi);
+            agg.last_noise_rssi = GetTrackerValue<int32_t>(last_noise_rssi);
+            agg.min_noise_rssi = GetTrackerValue<int32_t>(min_noise_rssi);
+            agg.max_noise_rssi = GetTrackerValue<int32_t>(max_noise_rssi);
+
+            agg.maxseenrate = GetTrackerValue<double>(maxseenrate);
+            agg.encodingset = GetTrackerValue<uint64_t>(encodingset);
+            agg.carrierset = GetTrackerValue<uint64_t>(carrierset);
         } else {
-            signal_min_rrd = new
-                kis_tracked_minute_rrd<kis_tracked_rrd_peak_signal_aggregator>(globalreg,
-                        signal_min_rrd_id);
             peak_loc = new kis_tracked_location_triplet(globalreg, peak_loc_id);
             add_map(peak_loc);
 
@@ -1215,6 +1506,40 @@ protected:
             add_map(signal_min_rrd);
 
         }
+
+        agg_dirty = false;
+    }
+
+    kis_signal_agg agg;
+    bool agg_dirty;
+
+    // Copy the accumulated signal into the tracked fields
+    void update_fields() {
+        if (!agg_dirty)
+            return;
+
+        agg_dirty = false;
+
+        last_signal_dbm->set((int32_t) agg.last_signal_dbm);
+        min_signal_dbm->set((int32_t) agg.min_signal_dbm);
+        max_signal_dbm->set((int32_t) agg.max_signal_dbm);
+        last_noise_dbm->set((int32_t) agg.last_noise_dbm);
+        min_noise_dbm->set((int32_t) agg.min_noise_dbm);
+        max_noise_dbm->set((int32_t) agg.max_noise_dbm);
+
+        last_signal_rssi->set((int32_t) agg.last_signal_rssi);
+        min_signal_rssi->set((int32_t) agg.min_signal_rssi);
+        max_signal_rssi->set((int32_t) agg.max_signal_rssi);
+        last_noise_rssi->set((int32_t) agg.last_noise_rssi);
+        min_noise_rssi->set((int32_t) agg.min_noise_rssi);
+        max_noise_rssi->set((int32_t) agg.max_noise_rssi);
+
+        median_signal->set(agg.signal_percentile(0.5));
+        p90_signal->set(agg.signal_percentile(0.9));
+
+        maxseenrate->set(agg.maxseenrate);
+        encodingset->set(agg.encodingset);
+        carrierset->set(agg.carrierset);
     }
 
     int last_signal_dbm_id, last_noise_dbm_id,
@@ -1225,6 +1550,8 @@ protected:
         min_signal_rssi_id, min_noise_rssi_id,
         max_signal_rssi_id, max_noise_rssi_id,
 
+        median_signal_id, p90_signal_id,
+
         peak_loc_id,
         maxseenrate_id, encodingset_id, carrierset_id;
 
@@ -1236,6 +1563,8 @@ protected:
     TrackerElement *min_signal_rssi, *min_noise_rssi;
     TrackerElement *max_signal_rssi, *max_noise_rssi;
 
+    TrackerElement *median_signal, *p90_signal;
+
     kis_tracked_location_triplet *peak_loc;
 
     TrackerElement *maxseenrate, *encodingset, *carrierset;
@@ -1287,6 +1616,22 @@ public:
         }
     }
 
+    // Signal this source has seen the device at, kept inline; only the 
+    // percentiles are exported, for locating the device from several 
+    // sources.  Merge them with kis_tracked_signal_data::merge for a total.
+    void add_signal(const kis_layer1_packinfo &lay1) {
+        signal_agg.add(lay1);
+    }
+
+    const kis_signal_agg *get_signal_agg() { return &signal_agg; }
+
+    virtual void pre_serialize() {
+        tracker_component::pre_serialize();
+
+        median_signal->set(signal_agg.signal_percentile(0.5));
+        p90_signal->set(signal_agg.signal_percentile(0.9));
+    }
+
 protected:
     virtual void register_fields() {
         tracker_component::register_fields();
@@ -1309,6 +1654,15 @@ protected:
         frequency_val_id =
             globalreg->entrytracker->RegisterField("kismet.common.seenby.frequency.count",
                     TrackerUInt64, "frequency packet count");
+        globalreg->entrytracker->RegisterContainerEntry(freq_khz_map_id, frequency_val_id);
+
+        median_signal_id =
+            RegisterField("kismet.common.seenby.median_signal", TrackerDouble,
+                    "median signal seen by this source", (void **) &median_signal);
+        p90_signal_id =
+            RegisterField("kismet.common.seenby.p90_signal", TrackerDouble,
+                    "90th percentile signal seen by this source", 
+                    (void **) &p90_signal);
     }
 
     TrackerElement *src_uuid;
@@ -1327,6 +1681,14 @@ protected:
     int freq_khz_map_id;
 
     int frequency_val_id;
+
+    TrackerElement *median_signal;
+    int median_signal_id;
+
+    TrackerElement *p90_signal;
+    int p90_signal_id;
+
+    kis_signal_agg signal_agg;
 };
 
 // Arbitrary tag data added to network
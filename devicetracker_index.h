@@ -0,0 +1,373 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __DEVICETRACKER_INDEX_H__
+#define __DEVICETRACKER_INDEX_H__
+
+#include "config.h"
+
+#include <stddef.h>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+
+// Reference hooks for the entries of an index; plain keys need nothing,
+// device versions are referenced by every chunk holding them
+template<class T> inline void devicetracker_index_ref(T) { }
+template<class T> inline void devicetracker_index_unref(T) { }
+
+// Sorted, immutable list of entries shared between device snapshots.  The
+// entries are kept in reference counted chunks; patching an index makes a new
+// index which shares every chunk the patch didn't touch with the old one, so
+// publishing a snapshot costs the changed entries and not the whole list.
+// Indexes are built by the packet thread and only read afterwards.
+template<class T, class Compare>
+class DevicetrackerIndex {
+public:
+    // Chunks hold up to CHUNK_MAX entries; a patch merges chunks it leaves
+    // under CHUNK_MIN with their neighbors, so only the last can be smaller
+    static const size_t CHUNK_MAX = 256;
+    static const size_t CHUNK_MIN = 64;
+
+    DevicetrackerIndex() {
+        count = 0;
+        refs = 1;
+    }
+
+    ~DevicetrackerIndex() {
+        for (size_t c = 0; c < chunks.size(); c++)
+            release(chunks[c]);
+    }
+
+    void Ref() {
+        __sync_add_and_fetch(&refs, 1);
+    }
+
+    void Unref() {
+        if (__sync_sub_and_fetch(&refs, 1) == 0)
+            delete(this);
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    class const_iterator {
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const T *pointer;
+        typedef const T &reference;
+
+        const_iterator() {
+            index = NULL;
+            pos = ci = off = 0;
+        }
+
+        const_iterator(const DevicetrackerIndex *in_index, size_t in_pos) {
+            index = in_index;
+            seek(in_pos);
+        }
+
+        const_iterator(const DevicetrackerIndex *in_index, size_t in_ci,
+                size_t in_off) {
+            index = in_index;
+            ci = in_ci;
+            off = in_off;
+            pos = ci < index->chunks.size() ? index->starts[ci] + off : index->count;
+        }
+
+        reference operator*() const {
+            return index->chunks[ci]->entries[off];
+        }
+
+        pointer operator->() const {
+            return &(index->chunks[ci]->entries[off]);
+        }
+
+        reference operator[](difference_type n) const {
+            return *(*this + n);
+        }
+
+        const_iterator &operator++() {
+            pos++;
+            if (++off == index->chunks[ci]->entries.size()) {
+                ci++;
+                off = 0;
+            }
+            return *this;
+        }
+
+        const_iterator operator++(int) {
+            const_iterator r = *this;
+            ++(*this);
+            return r;
+        }
+
+        const_iterator &operator--() {
+            pos--;
+            if (off == 0) {
+                ci--;
+                off = index->chunks[ci]->entries.size() - 1;
+            } else {
+                off--;
+            }
+            return *this;
+        }
+
+        const_iterator operator--(int) {
+            const_iterator r = *this;
+            --(*this);
+            return r;
+        }
+
+        const_iterator &operator+=(difference_type n) {
+            seek(pos + n);
+            return *this;
+        }
+
+        const_iterator &operator-=(difference_type n) {
+            seek(pos - n);
+            return *this;
+        }
+
+        const_iterator operator+(difference_type n) const {
+            return const_iterator(index, pos + n);
+        }
+
+        const_iterator operator-(difference_type n) const {
+            return const_iterator(index, pos - n);
+        }
+
+        difference_type operator-(const const_iterator &i) const {
+            return (difference_type) pos - (difference_type) i.pos;
+        }
+
+        bool operator==(const const_iterator &i) const { return pos == i.pos; }
+        bool operator!=(const const_iterator &i) const { return pos != i.pos; }
+        bool operator<(const const_iterator &i) const { return pos < i.pos; }
+        bool operator>(const const_iterator &i) const { return pos > i.pos; }
+        bool operator<=(const const_iterator &i) const { return pos <= i.pos; }
+        bool operator>=(const const_iterator &i) const { return pos >= i.pos; }
+
+    protected:
+        void seek(size_t in_pos) {
+            pos = in_pos;
+            off = 0;
+
+            if (pos >= index->count) {
+                ci = index->chunks.size();
+                return;
+            }
+
+            ci = (std::upper_bound(index->starts.begin(), index->starts.end(),
+                        pos) - index->starts.begin()) - 1;
+            off = pos - index->starts[ci];
+        }
+
+        const DevicetrackerIndex *index;
+        size_t pos, ci, off;
+    };
+
+    const_iterator begin() const {
+        return const_iterator(this, 0, 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, chunks.size(), 0);
+    }
+
+    // First entry not ordered before in_value, finding the chunk first;
+    // in_comp compares entries and values in both orders, as for the std
+    // algorithms
+    template<class V, class C>
+    const_iterator lower_bound(const V &in_value, C in_comp) const {
+        size_t lo = 0, hi = chunks.size();
+
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (in_comp(chunks[mid]->entries.back(), in_value))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        if (lo == chunks.size())
+            return end();
+
+        const std::vector<T> &e = chunks[lo]->entries;
+        return const_iterator(this, lo,
+                std::lower_bound(e.begin(), e.end(), in_value, in_comp) - e.begin());
+    }
+
+    // First entry ordered after in_value
+    template<class V, class C>
+    const_iterator upper_bound(const V &in_value, C in_comp) const {
+        size_t lo = 0, hi = chunks.size();
+
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (!in_comp(in_value, chunks[mid]->entries.back()))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        if (lo == chunks.size())
+            return end();
+
+        const std::vector<T> &e = chunks[lo]->entries;
+        return const_iterator(this, lo,
+                std::upper_bound(e.begin(), e.end(), in_value, in_comp) - e.begin());
+    }
+
+    // Make a new index from in_prev (which may be NULL) with the entries
+    // equivalent to in_remove taken out and in_insert added.  Both have to be
+    // sorted by Compare.  Chunks neither of them falls in are shared.
+    static DevicetrackerIndex *Patch(const DevicetrackerIndex *in_prev,
+            const std::vector<T> &in_remove, const std::vector<T> &in_insert) {
+        Compare cmp;
+        DevicetrackerIndex *ret = new DevicetrackerIndex();
+
+        size_t nchunks = in_prev == NULL ? 0 : in_prev->chunks.size();
+        size_t ri = 0, ii = 0;
+
+        // Entries of touched chunks, and small chunks merged into them,
+        // waiting to be split into new chunks
+        std::vector<T> pending;
+        bool merging = false;
+
+        for (size_t c = 0; c < nchunks; c++) {
+            chunk *ch = in_prev->chunks[c];
+            bool last = (c + 1 == nchunks);
+
+            // A chunk takes the changes ordered before the next chunk; the
+            // first and last take everything before and after them
+            size_t rend = ri, iend = ii;
+
+            while (rend < in_remove.size() && (last ||
+                        cmp(in_remove[rend], in_prev->chunks[c + 1]->entries.front())))
+                rend++;
+            while (iend < in_insert.size() && (last ||
+                        cmp(in_insert[iend], in_prev->chunks[c + 1]->entries.front())))
+                iend++;
+
+            if (rend == ri && iend == ii &&
+                    !(merging && pending.size() < CHUNK_MIN)) {
+                ret->flush(pending);
+                merging = false;
+
+                __sync_add_and_fetch(&(ch->refs), 1);
+                ret->chunks.push_back(ch);
+                continue;
+            }
+
+            // Merge the chunk, less its removals, with its insertions
+            const std::vector<T> &e = ch->entries;
+            size_t ei = 0;
+
+            while (ei < e.size() || ii < iend) {
+                if (ei == e.size() || (ii < iend && cmp(in_insert[ii], e[ei]))) {
+                    pending.push_back(in_insert[ii++]);
+                    continue;
+                }
+
+                while (ri < rend && cmp(in_remove[ri], e[ei]))
+                    ri++;
+
+                if (ri < rend && !cmp(e[ei], in_remove[ri])) {
+                    ri++;
+                    ei++;
+                    continue;
+                }
+
+                pending.push_back(e[ei++]);
+            }
+
+            ri = rend;
+            merging = true;
+        }
+
+        // Everything goes in the first chunk of an empty index
+        while (ii < in_insert.size())
+            pending.push_back(in_insert[ii++]);
+
+        ret->flush(pending);
+
+        ret->starts.resize(ret->chunks.size());
+        for (size_t c = 0; c < ret->chunks.size(); c++) {
+            ret->starts[c] = ret->count;
+            ret->count += ret->chunks[c]->entries.size();
+        }
+
+        return ret;
+    }
+
+protected:
+    struct chunk {
+        std::vector<T> entries;
+        int refs;
+    };
+
+    // Split the pending entries into chunks of about the same size
+    void flush(std::vector<T> &in_pending) {
+        if (in_pending.size() == 0)
+            return;
+
+        size_t pieces = (in_pending.size() + CHUNK_MAX - 1) / CHUNK_MAX;
+        size_t start = 0;
+
+        for (size_t p = 0; p < pieces; p++) {
+            size_t end = in_pending.size() * (p + 1) / pieces;
+
+            chunk *ch = new chunk();
+            ch->refs = 1;
+            ch->entries.assign(in_pending.begin() + start, in_pending.begin() + end);
+
+            for (size_t x = 0; x < ch->entries.size(); x++)
+                devicetracker_index_ref(ch->entries[x]);
+
+            chunks.push_back(ch);
+            start = end;
+        }
+
+        in_pending.clear();
+    }
+
+    static void release(chunk *in_chunk) {
+        if (__sync_sub_and_fetch(&(in_chunk->refs), 1) != 0)
+            return;
+
+        for (size_t x = 0; x < in_chunk->entries.size(); x++)
+            devicetracker_index_unref(in_chunk->entries[x]);
+
+        delete(in_chunk);
+    }
+
+    std::vector<chunk *> chunks;
+
+    // Position of the first entry of each chunk
+    std::vector<size_t> starts;
+    size_t count;
+
+    int refs;
+};
+
+#endif
+
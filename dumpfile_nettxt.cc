@@ -114,8 +114,8 @@ int Dumpfile_Nettxt::Flush() {
 		globalreg->netracker->FetchTrackedNets();
 
 	// Get the alerts
-	const vector<kis_alert_info *> *alerts =
-		globalreg->alertracker->FetchBacklog();
+	vector<kis_alert_info> alerts;
+	globalreg->alertracker->FetchBacklog(0, &alerts);
 
 	map<mac_addr, Netracker::tracked_network *>::const_iterator x;
 	map<mac_addr, Netracker::tracked_client *>::const_iterator y;
@@ -381,11 +381,11 @@ int Dumpfile_Nettxt::Flush() {
 
 		// Sloppy iteration but it doesn't happen often and alert backlogs shouldn't
 		// be that huge
-		for (unsigned int an = 0; an < alerts->size(); an++) {
-			if ((*alerts)[an]->bssid != net->bssid)
+		for (unsigned int an = 0; an < alerts.size(); an++) {
+			if (alerts[an].bssid != net->bssid)
 				continue;
 
-			kis_alert_info *ali = (*alerts)[an];
+			kis_alert_info *ali = &(alerts[an]);
 
 			fprintf(txtfile, " Alert      : %.24s %s %s\n",
 					ctime((const time_t *) &(ali->tm.tv_sec)),
@@ -30,6 +30,8 @@ EntryTracker::EntryTracker(GlobalRegistry *in_globalreg) :
     globalreg->InsertGlobal("ENTRY_TRACKER", this);
 
     next_field_num = 1;
+
+    Httpd_RegisterRoute("GET", "/system/tracked_fields.html");
 }
 
 EntryTracker::~EntryTracker() {
@@ -146,6 +148,23 @@ string EntryTracker::GetFieldName(int in_id) {
     return itr->second->field_name;
 }
 
+void EntryTracker::RegisterContainerEntry(int in_container_id, int in_entry_id) {
+    if (in_container_id < 0 || in_entry_id < 0)
+        return;
+
+    container_entry_map[in_container_id] = in_entry_id;
+}
+
+int EntryTracker::GetContainerEntryId(int in_container_id) {
+    map<int, int>::iterator itr = container_entry_map.find(in_container_id);
+
+    if (itr == container_entry_map.end()) {
+        return -1;
+    }
+
+    return itr->second;
+}
+
 TrackerElement *EntryTracker::RegisterAndGetField(string in_name, TrackerType in_type, 
         string in_desc) {
 
@@ -220,16 +239,6 @@ TrackerElement *EntryTracker::GetTrackedInstance(string in_name) {
     return ret;
 }
 
-bool EntryTracker::Httpd_VerifyPath(const char *path, const char *method) {
-    if (strcmp(method, "GET") != 0)
-        return false;
-
-    if (strcmp(path, "/system/tracked_fields.html") == 0)
-        return true;
-
-    return false;
-}
-
 void EntryTracker::Httpd_CreateStreamResponse(
         Kis_Net_Httpd *httpd __attribute__((unused)),
         struct MHD_Connection *connection __attribute__((unused)),
@@ -64,13 +64,21 @@ public:
     int GetFieldId(string in_name);
     string GetFieldName(int in_id);
 
+    // Record which field id is used to build the anonymous entries of a
+    // container field (vectors and int/mac/string/double maps).  The 
+    // serialized forms don't carry entry ids, so the deserializers use this
+    // to rebuild entries via the proper builder.
+    void RegisterContainerEntry(int in_container_id, int in_entry_id);
+
+    // Return: Field id of container entries, or negative if unknown
+    int GetContainerEntryId(int in_container_id);
+
     // Get a field instance
     // Return: NULL if unknown
     TrackerElement *GetTrackedInstance(string in_name);
     TrackerElement *GetTrackedInstance(int in_id);
 
     // HTTP api
-    virtual bool Httpd_VerifyPath(const char *path, const char *method);
 
     virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
             struct MHD_Connection *connection,
@@ -100,6 +108,9 @@ protected:
     map<string, reserved_field *> field_name_map;
     map<int, reserved_field *> field_id_map;
 
+    // Container field id to entry field id
+    map<int, int> container_entry_map;
+
 };
 
 #endif
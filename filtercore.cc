@@ -53,6 +53,11 @@ FilterCore::FilterCore(GlobalRegistry *in_globalreg) {
 #define _filter_type_any		3
 #define _filter_type_pcre		4
 
+// Role bits of addresses in the mac filter
+#define _filter_role_bssid		0x01
+#define _filter_role_source		0x02
+#define _filter_role_dest		0x04
+
 int FilterCore::AddFilterLine(string filter_str) {
 	_kis_lex_rec ltop;
 	int type = _filter_stacker_none;
@@ -505,7 +510,7 @@ int FilterCore::AddFilterLine(string filter_str) {
 		macvec = local_maps[_filter_type_bssid];
 		bssid_invert = negate;
 		for (unsigned int x = 0; x < macvec.size(); x++) {
-			bssid_map.insert(macvec[x], 1);
+			mac_filter.insert(macvec[x], _filter_role_bssid);
 		}
 	}
 
@@ -514,7 +519,7 @@ int FilterCore::AddFilterLine(string filter_str) {
 		macvec = local_maps[_filter_type_source];
 		source_invert = negate;
 		for (unsigned int x = 0; x < macvec.size(); x++) {
-			source_map.insert(macvec[x], 1);
+			mac_filter.insert(macvec[x], _filter_role_source);
 		}
 	}
 
@@ -523,7 +528,7 @@ int FilterCore::AddFilterLine(string filter_str) {
 		macvec = local_maps[_filter_type_dest];
 		dest_invert = negate;
 		for (unsigned int x = 0; x < macvec.size(); x++) {
-			dest_map.insert(macvec[x], 1);
+			mac_filter.insert(macvec[x], _filter_role_dest);
 		}
 	}
 
@@ -531,9 +536,8 @@ int FilterCore::AddFilterLine(string filter_str) {
 	if (negate != -1) {
 		macvec = local_maps[_filter_type_any];
 		for (unsigned int x = 0; x < macvec.size(); x++) {
-			dest_map.insert(macvec[x], 1);
-			source_map.insert(macvec[x], 1);
-			bssid_map.insert(macvec[x], 1);
+			mac_filter.insert(macvec[x], _filter_role_bssid | 
+							  _filter_role_source | _filter_role_dest);
 		}
 	}
 
@@ -543,6 +547,10 @@ int FilterCore::AddFilterLine(string filter_str) {
 		pcre_invert = negate;
 		for (unsigned int x = 0; x < local_pcre.size(); x++) {
 			pcre_vec.push_back(local_pcre[x]);
+
+			// Already compiled once above, so this can't fail
+			string error;
+			pcre_set.AddPattern(local_pcre[x]->filter, &error);
 		}
 	}
 #endif
@@ -668,7 +676,7 @@ int FilterCore::AddFilterLine(string filter_str) {
 						 MSGFLAG_ERROR);
 					return -1;
 				}
-                bssid_map.insert(mac, invert);
+                mac_filter.insert(mac, _filter_role_bssid);
 				bssid_invert = invert;
             } if (address_target & 0x02) {
 				if (source_invert != -1 && invert != source_invert) {
@@ -678,7 +686,7 @@ int FilterCore::AddFilterLine(string filter_str) {
 						 MSGFLAG_ERROR);
 					return -1;
 				}
-                source_map.insert(mac, invert);
+                mac_filter.insert(mac, _filter_role_source);
 				source_invert = invert;
             } if (address_target & 0x04) {
 				if (dest_invert != -1 && invert != dest_invert) {
@@ -688,7 +696,7 @@ int FilterCore::AddFilterLine(string filter_str) {
 						 MSGFLAG_ERROR);
 					return -1;
 				}
-                dest_map.insert(mac, invert);
+                mac_filter.insert(mac, _filter_role_dest);
 				dest_invert = invert;
             }
 
@@ -707,26 +715,41 @@ int FilterCore::AddFilterLine(string filter_str) {
 int FilterCore::RunFilter(mac_addr bssidmac, mac_addr sourcemac,
 						  mac_addr destmac) {
 	int hit = 0;
-	// Clumsy artifact of how iters are defined for macmap currently, must
-	// be defined as an assign
-	macmap<int>::iterator fitr = bssid_map.find(bssidmac);
-	
-	if ((fitr != bssid_map.end() && bssid_invert == 1) ||
-		(fitr == bssid_map.end() && bssid_invert == 0)) {
+	unsigned int bssid_roles = 0, source_roles = 0, dest_roles = 0;
+
+	// One lookup per address gives every role it's filtered in; the bssid
+	// is usually also the source or dest, so don't look it up twice
+	if (bssid_invert != -1)
+		bssid_roles = mac_filter.find(bssidmac);
+
+	if (source_invert != -1) {
+		if (bssid_invert != -1 && sourcemac == bssidmac)
+			source_roles = bssid_roles;
+		else
+			source_roles = mac_filter.find(sourcemac);
+	}
+
+	if (dest_invert != -1) {
+		if (bssid_invert != -1 && destmac == bssidmac)
+			dest_roles = bssid_roles;
+		else
+			dest_roles = mac_filter.find(destmac);
+	}
+
+	if (bssid_invert != -1 && 
+		((bssid_roles & _filter_role_bssid) != 0) == (bssid_invert == 1)) {
 		bssid_hit++;
 		hit = 1;
 	}
 
-	fitr = source_map.find(sourcemac);
-	if ((fitr != source_map.end() && source_invert == 1) ||
-		(fitr == source_map.end() && source_invert == 0)) {
+	if (source_invert != -1 &&
+		((source_roles & _filter_role_source) != 0) == (source_invert == 1)) {
 		source_hit++;
 		hit = 1;
 	}
 
-	fitr = dest_map.find(destmac);
-	if ((fitr != dest_map.end() && dest_invert == 1) ||
-		(fitr == dest_map.end() && dest_invert == 0)) {
+	if (dest_invert != -1 &&
+		((dest_roles & _filter_role_dest) != 0) == (dest_invert == 1)) {
 		dest_hit++;
 		hit = 1;
 	}
@@ -746,15 +769,17 @@ int FilterCore::RunPcreFilter(string in_text) {
 #ifndef HAVE_LIBPCRE
 	return 0;
 #else
-	int ovector[128];
-	int rc;
-
-	for (unsigned int x = 0; x < pcre_vec.size(); x++) {
-		rc = pcre_exec(pcre_vec[x]->re, pcre_vec[x]->study, in_text.c_str(),
-					   in_text.length(), 0, 0, ovector, 128);
-		if ((rc >= 0 && pcre_invert == 0) || (rc < 0 && pcre_invert == 1))
-			return 1;
-	}
+	if (pcre_set.size() == 0)
+		return 0;
+
+	vector<int> matched;
+	int num = pcre_set.MatchCached(in_text, 
+			Adler32Checksum(in_text.c_str(), in_text.length()), &matched);
+
+	// Any filter matching, or inverted, any filter not matching
+	if ((num > 0 && pcre_invert == 0) || 
+		(num < (int) pcre_set.size() && pcre_invert == 1))
+		return 1;
 #endif
 	return 0;
 }
@@ -36,12 +36,14 @@
 
 #ifdef HAVE_LIBPCRE
 #include <pcre.h>
+#include "kis_pcre_set.h"
 #endif
 
 #include "globalregistry.h"
 #include "messagebus.h"
 #include "packetchain.h"
 #include "timetracker.h"
+#include "kis_macfilter.h"
 
 class FilterCore {
 public:
@@ -79,9 +81,8 @@ public:
 protected:
 	GlobalRegistry *globalreg;
 
-	macmap<int> bssid_map;
-	macmap<int> source_map;
-	macmap<int> dest_map;
+	// Addresses for every role, tagged with the roles they filter
+	kis_mac_filter mac_filter;
 	int bssid_invert;
 	int source_invert;
 	int dest_invert;
@@ -92,6 +93,8 @@ protected:
 
 #ifdef HAVE_LIBPCRE
 	vector<FilterCore::pcre_filter *> pcre_vec;
+	// The same filters matched in one pass by RunPcreFilter
+	Kis_Pcre_Set pcre_set;
 	int pcre_invert;
 	int pcre_hit;
 #endif
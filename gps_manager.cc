@@ -251,13 +251,6 @@ int GpsManager::kis_gpspack_hook(CHAINCALL_PARMS) {
     return 1;
 }
 
-bool GpsManager::Httpd_VerifyPath(const char *path, const char *method) {
-    if (strcmp(method, "GET") != 0)
-        return false;
-
-    return false;
-}
-
 void GpsManager::Httpd_CreateStreamResponse(
         Kis_Net_Httpd *httpd __attribute__((unused)),
         struct MHD_Connection *connection __attribute__((unused)),
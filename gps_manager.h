@@ -82,7 +82,6 @@ public:
     GpsManager(GlobalRegistry *in_globalreg);
     virtual ~GpsManager();
 
-    virtual bool Httpd_VerifyPath(const char *path, const char *method);
 
     virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
             struct MHD_Connection *connection,
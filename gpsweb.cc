@@ -59,6 +59,8 @@ int GPSWeb::OpenGps(string in_opts) {
     // Call the http stream handler init to bind to the webserver
     Bind_Httpd_Server(globalreg);
 
+    Httpd_RegisterRoute("POST", "/gps/web/update.cmd");
+
     return 1;
 }
 
@@ -96,15 +98,6 @@ kis_gps_packinfo *GPSWeb::FetchGpsLocation() {
     return gps_location;
 }
 
-bool GPSWeb::Httpd_VerifyPath(const char *path, const char *method) {
-    if (strcmp(method, "POST") == 0 &&
-            strcmp(path, "/gps/web/update.cmd") == 0) {
-        return true;
-    }
-
-    return false;
-}
-
 void GPSWeb::Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
         struct MHD_Connection *connection,
         const char *url, const char *method, const char *upload_data,
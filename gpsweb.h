@@ -52,7 +52,6 @@ public:
     virtual kis_gps_packinfo *FetchGpsLocation();
 
     // HTTP api
-    virtual bool Httpd_VerifyPath(const char *path, const char *method);
 
     virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
             struct MHD_Connection *connection,
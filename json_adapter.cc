@@ -25,6 +25,14 @@
 #include <vector>
 #include <algorithm>
 #include <string>
+#include <math.h>
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "globalregistry.h"
 #include "trackedelement.h"
@@ -34,31 +42,277 @@
 #include "devicetracker_component.h"
 #include "json_adapter.h"
 
+static const char json_hex_digits_upper[] = "0123456789ABCDEF";
+static const char json_hex_digits_lower[] = "0123456789abcdef";
+
+// Find the first character at or after pos which needs escaping in a JSON 
+// string:  quote, backslash, or a control character
+static size_t json_escape_scan(const char *in, size_t pos, size_t len) {
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x1F);
+
+    for (; pos + 16 <= len; pos += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + pos));
+
+        // Unsigned v <= 0x1F is min(v, 0x1F) == v
+        __m128i m = _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v);
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, quote));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, bslash));
+
+        int mask = _mm_movemask_epi8(m);
+
+        if (mask != 0)
+            return pos + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; pos < len; pos++) {
+        unsigned char c = (unsigned char) in[pos];
+
+        if (c < 0x20 || c == '"' || c == '\\')
+            return pos;
+    }
+
+    return len;
+}
+
+void JsonAdapter::Writer::WriteEscaped(const char *in, size_t len) {
+    size_t pos = 0;
+
+    while (pos < len) {
+        size_t next = json_escape_scan(in, pos, len);
+
+        buffer.append(in + pos, next - pos);
+
+        if (next >= len)
+            break;
+
+        unsigned char c = (unsigned char) in[next];
+
+        switch (c) {
+            case '"':
+                buffer.append("\\\"", 2);
+                break;
+            case '\\':
+                buffer.append("\\\\", 2);
+                break;
+            case '\b':
+                buffer.append("\\b", 2);
+                break;
+            case '\f':
+                buffer.append("\\f", 2);
+                break;
+            case '\n':
+                buffer.append("\\n", 2);
+                break;
+            case '\r':
+                buffer.append("\\r", 2);
+                break;
+            case '\t':
+                buffer.append("\\t", 2);
+                break;
+            default:
+                char u[6] = { '\\', 'u', '0', '0', 
+                    json_hex_digits_lower[c >> 4], json_hex_digits_lower[c & 0xF] };
+                buffer.append(u, 6);
+                break;
+        }
+
+        pos = next + 1;
+    }
+}
+
+void JsonAdapter::Writer::WriteUInt(uint64_t in) {
+    char b[20];
+    char *p = b + sizeof(b);
+
+    do {
+        *--p = '0' + (in % 10);
+        in /= 10;
+    } while (in != 0);
+
+    buffer.append(p, (b + sizeof(b)) - p);
+}
+
+void JsonAdapter::Writer::WriteInt(int64_t in) {
+    if (in < 0) {
+        buffer.push_back('-');
+        // Negate as unsigned so INT64_MIN survives
+        WriteUInt(~((uint64_t) in) + 1);
+    } else {
+        WriteUInt((uint64_t) in);
+    }
+}
+
+void JsonAdapter::Writer::WriteDouble(double in) {
+    if (in != in || in > DBL_MAX || in < -DBL_MAX) {
+        buffer.push_back('0');
+        return;
+    }
+
+    // Integral values in the exactly representable range are written as
+    // integers, which covers frequencies, timestamps, and counters
+    if (in == floor(in) && fabs(in) < 9007199254740992.0) {
+        WriteInt((int64_t) in);
+        return;
+    }
+
+    // Use the shortest precision which reads back as the same value; 
+    // 17 significant digits always does
+    char b[32];
+    for (int prec = 15; prec <= 17; prec++) {
+        snprintf(b, sizeof(b), "%.*g", prec, in);
+
+        if (strtod(b, NULL) == in)
+            break;
+    }
+
+    buffer.append(b);
+}
+
+void JsonAdapter::Writer::WriteFloat(float in) {
+    if (in != in || in > FLT_MAX || in < -FLT_MAX) {
+        buffer.push_back('0');
+        return;
+    }
+
+    if (in == floorf(in) && fabsf(in) < 16777216.0f) {
+        WriteInt((int64_t) in);
+        return;
+    }
+
+    char b[32];
+    for (int prec = 6; prec <= 9; prec++) {
+        snprintf(b, sizeof(b), "%.*g", prec, (double) in);
+
+        if ((float) strtod(b, NULL) == in)
+            break;
+    }
+
+    buffer.append(b);
+}
+
+void JsonAdapter::Writer::WriteMac(const mac_addr &in, bool in_mask) {
+    // Matches mac_addr::Mac2String and MacFull2String
+    char m[MAC_LEN_MAX * 3 * 2 + 2];
+    char *p = m;
+
+    *p++ = '"';
+
+    for (unsigned int x = 0; x < MAC_LEN_MAX; x++) {
+        uint8_t b = (uint8_t) (in.longmac >> ((MAC_LEN_MAX - x - 1) * 8));
+        *p++ = json_hex_digits_upper[b >> 4];
+        *p++ = json_hex_digits_upper[b & 0xF];
+        *p++ = ':';
+    }
+
+    if (in_mask) {
+        p[-1] = '/';
+
+        for (unsigned int x = 0; x < MAC_LEN_MAX; x++) {
+            uint8_t b = (uint8_t) (in.longmask >> ((MAC_LEN_MAX - x - 1) * 8));
+            *p++ = json_hex_digits_upper[b >> 4];
+            *p++ = json_hex_digits_upper[b & 0xF];
+            *p++ = ':';
+        }
+    }
+
+    p[-1] = '"';
+
+    buffer.append(m, p - m);
+}
+
+void JsonAdapter::Writer::WriteUuid(const uuid &in) {
+    // Matches uuid::UUID2String, fields are in host order
+    uint32_t time_low;
+    uint16_t time_mid, time_hi, clock_seq;
+
+    memcpy(&time_low, &(in.uuid_block[0]), 4);
+    memcpy(&time_mid, &(in.uuid_block[4]), 2);
+    memcpy(&time_hi, &(in.uuid_block[6]), 2);
+    memcpy(&clock_seq, &(in.uuid_block[8]), 2);
+
+    char u[38];
+    char *p = u;
+
+    *p++ = '"';
+
+    for (int s = 28; s >= 0; s -= 4)
+        *p++ = json_hex_digits_lower[(time_low >> s) & 0xF];
+    *p++ = '-';
+
+    for (int s = 12; s >= 0; s -= 4)
+        *p++ = json_hex_digits_lower[(time_mid >> s) & 0xF];
+    *p++ = '-';
+
+    for (int s = 12; s >= 0; s -= 4)
+        *p++ = json_hex_digits_lower[(time_hi >> s) & 0xF];
+    *p++ = '-';
+
+    for (int s = 12; s >= 0; s -= 4)
+        *p++ = json_hex_digits_lower[(clock_seq >> s) & 0xF];
+    *p++ = '-';
+
+    for (unsigned int x = 0; x < 6; x++) {
+        *p++ = json_hex_digits_lower[in.uuid_block[10 + x] >> 4];
+        *p++ = json_hex_digits_lower[in.uuid_block[10 + x] & 0xF];
+    }
+
+    *p++ = '"';
+
+    buffer.append(u, p - u);
+}
+
 void JsonAdapter::Pack(GlobalRegistry *globalreg, std::stringstream &stream, 
         tracker_component *c) {
     Pack(globalreg, stream, (TrackerElement *) c);
 }
 
+void JsonAdapter::Pack(GlobalRegistry *globalreg, std::stringstream &stream,
+        TrackerElement *e) {
+    // Build the whole record in a flat buffer and hand it to the stream in
+    // one write
+    Writer writer;
+
+    Pack(globalreg, writer, e);
+
+    stream.write(writer.str().data(), writer.str().length());
+}
+
 string JsonAdapter::SanitizeString(string in) {
-    return MultiReplaceAll(in, "\\", "\\\\");
+    Writer writer;
+
+    writer.WriteEscaped(in.data(), in.length());
+
+    return writer.str();
 }
 
+// Map member keys are written as '"name": ', with the name sanitized and 
+// JSON-friendly
+static string json_plan_key(GlobalRegistry *globalreg, int in_id, 
+        TrackerType in_type __attribute__((unused))) {
+    string tname = globalreg->entrytracker->GetFieldName(in_id);
 
-void JsonAdapter::Pack(GlobalRegistry *globalreg, std::stringstream &stream,
+    // JSON is special, and considers '.' to be a path separator, so
+    // change all our '.' to '_'.
+    std::replace(tname.begin(), tname.end(), '.', '_');
+
+    return "\"" + JsonAdapter::SanitizeString(tname) + "\": ";
+}
+
+static TrackerElementPlanCache json_plan_cache(json_plan_key);
+
+void JsonAdapter::Pack(GlobalRegistry *globalreg, Writer &writer,
     TrackerElement *e) {
 
-    TrackerElementScopeLocker slock(e);
+    // Only containers need to be locked while we walk them; scalar values 
+    // are covered by the lock held on the container they live in
+    TrackerElementScopeLocker slock(e->get_type() >= TrackerVector ? e : NULL);
 
     e->pre_serialize();
 
-    // XXX no, they don't, this only happens when we're a map of some sort,
-    // vectors etc get normal treatment.  Delete this after confirmation.
-    /*
-    // All fields get "name": [value]
-    stream << "\"" << globalreg->entrytracker->GetFieldName(e->get_id()) <<
-        "\":";
-    */
-
     TrackerElement::tracked_vector *tvec;
     TrackerElement::vector_iterator vec_iter;
 
@@ -74,136 +328,162 @@ void JsonAdapter::Pack(GlobalRegistry *globalreg, std::stringstream &stream,
     TrackerElement::tracked_double_map *tdoublemap;
     TrackerElement::double_map_iterator double_map_iter;
 
-    mac_addr mac;
-    uuid euuid;
-
     string tname;
 
+    TrackerElementPlanCache::plan *plan;
+    TrackerElementPlanCache::plan_field *plan_field;
+    unsigned int plan_pos;
+    bool plan_missed;
+
     switch (e->get_type()) {
         case TrackerString:
-            stream << "\"" << SanitizeString(GetTrackerValue<string>(e)) << "\"";
+            writer.WriteString(GetTrackerValue<string>(e));
             break;
         case TrackerInt8:
-            stream << (int) GetTrackerValue<int8_t>(e);
+            writer.WriteInt(GetTrackerValue<int8_t>(e));
             break;
         case TrackerUInt8:
-            stream << (unsigned int) GetTrackerValue<uint8_t>(e);
+            writer.WriteUInt(GetTrackerValue<uint8_t>(e));
             break;
         case TrackerInt16:
-            stream << (int) GetTrackerValue<int16_t>(e);
+            writer.WriteInt(GetTrackerValue<int16_t>(e));
             break;
         case TrackerUInt16:
-            stream << (unsigned int) GetTrackerValue<uint16_t>(e);
+            writer.WriteUInt(GetTrackerValue<uint16_t>(e));
             break;
         case TrackerInt32:
-            stream << GetTrackerValue<int32_t>(e);
+            writer.WriteInt(GetTrackerValue<int32_t>(e));
             break;
         case TrackerUInt32:
-            stream << GetTrackerValue<uint32_t>(e);
+            writer.WriteUInt(GetTrackerValue<uint32_t>(e));
             break;
         case TrackerInt64:
-            stream << GetTrackerValue<int64_t>(e);
+            writer.WriteInt(GetTrackerValue<int64_t>(e));
             break;
         case TrackerUInt64:
-            stream << GetTrackerValue<uint64_t>(e);
+            writer.WriteUInt(GetTrackerValue<uint64_t>(e));
             break;
         case TrackerFloat:
-            stream << fixed << GetTrackerValue<float>(e);
+            writer.WriteFloat(GetTrackerValue<float>(e));
             break;
         case TrackerDouble:
-            stream << fixed << GetTrackerValue<double>(e);
+            writer.WriteDouble(GetTrackerValue<double>(e));
             break;
         case TrackerMac:
-            mac = GetTrackerValue<mac_addr>(e);
             // Mac is quoted as a string value
-            stream << "\"" << mac.MacFull2String() << "\"";
+            writer.WriteMac(GetTrackerValue<mac_addr>(e), true);
             break;
         case TrackerUuid:
-            euuid = GetTrackerValue<uuid>(e);
             // UUID is quoted as a string value
-            stream << "\"" << euuid.UUID2String() << "\"";
+            writer.WriteUuid(GetTrackerValue<uuid>(e));
             break;
         case TrackerVector:
             tvec = e->get_vector();
-            stream << "[";
+            writer.WriteRaw('[');
             for (vec_iter = tvec->begin(); vec_iter != tvec->end(); /* */ ) {
-                JsonAdapter::Pack(globalreg, stream, *vec_iter);
+                JsonAdapter::Pack(globalreg, writer, *vec_iter);
                 if (++vec_iter != tvec->end())
-                    stream << ",";
+                    writer.WriteRaw(',');
             }
-            stream << "]";
+            writer.WriteRaw(']');
             break;
         case TrackerMap:
             tmap = e->get_map();
-            stream << "{";
+
+            // Field names come pre-encoded from the plan for this type
+            plan = json_plan_cache.GetPlan(e->get_id());
+            plan_pos = 0;
+            plan_missed = false;
+
+            writer.WriteRaw('{');
             for (map_iter = tmap->begin(); map_iter != tmap->end(); /* */) {
-                if ((tname = map_iter->second->get_local_name()) == "")
-                    tname = globalreg->entrytracker->GetFieldName(map_iter->first);
+                plan_field = TrackerElementPlanCache::Advance(plan, plan_pos,
+                        map_iter->first);
+
+                if (plan_field == NULL)
+                    plan_missed = true;
 
-                // JSON is special, and considers '.' to be a path separator, so
-                // change all our '.' to '_'.
-                std::replace(tname.begin(), tname.end(), '.', '_');
+                if (map_iter->second->has_local_name() || plan_field == NULL) {
+                    if ((tname = map_iter->second->get_local_name()) == "")
+                        tname = 
+                            globalreg->entrytracker->GetFieldName(map_iter->first);
 
-                tname = SanitizeString(tname);
+                    // JSON is special, and considers '.' to be a path separator, so
+                    // change all our '.' to '_'.
+                    std::replace(tname.begin(), tname.end(), '.', '_');
 
-                stream << "\"" << 
-                    tname <<
-                    "\": ";
-                JsonAdapter::Pack(globalreg, stream, map_iter->second);
+                    writer.WriteString(tname);
+                    writer.WriteRaw(": ", 2);
+                } else {
+                    writer.WriteRaw(plan_field->key);
+                }
+
+                JsonAdapter::Pack(globalreg, writer, map_iter->second);
                 if (++map_iter != tmap->end()) // Increment iter in loop
-                    stream << ",";
+                    writer.WriteRaw(',');
             }
-            stream << "}";
+            writer.WriteRaw('}');
+
+            // Only take the plan cache lock when this record has members
+            // the plan doesn't know about yet
+            if (plan_missed)
+                json_plan_cache.ExtendPlan(globalreg, e);
             break;
         case TrackerIntMap:
             tmap = e->get_intmap();
-            stream << "{";
+            writer.WriteRaw('{');
             for (map_iter = tmap->begin(); map_iter != tmap->end(); /* */) {
                 // Integer dictionary keys in json are still quoted as strings
-                stream << "\"" << map_iter->first << "\": ";
-                JsonAdapter::Pack(globalreg, stream, map_iter->second);
+                writer.WriteRaw('"');
+                writer.WriteInt(map_iter->first);
+                writer.WriteRaw("\": ", 3);
+                JsonAdapter::Pack(globalreg, writer, map_iter->second);
                 if (++map_iter != tmap->end()) // Increment iter in loop
-                    stream << ",";
+                    writer.WriteRaw(',');
             }
-            stream << "}";
+            writer.WriteRaw('}');
             break;
         case TrackerMacMap:
             tmacmap = e->get_macmap();
-            stream << "{";
+            writer.WriteRaw('{');
             for (mac_map_iter = tmacmap->begin(); 
                     mac_map_iter != tmacmap->end(); /* */) {
                 // Mac keys are strings and we push only the mac not the mask */
-                stream << "\"" << mac_map_iter->first.Mac2String() << "\": ";
-                JsonAdapter::Pack(globalreg, stream, mac_map_iter->second);
+                writer.WriteMac(mac_map_iter->first, false);
+                writer.WriteRaw(": ", 2);
+                JsonAdapter::Pack(globalreg, writer, mac_map_iter->second);
                 if (++mac_map_iter != tmacmap->end())
-                    stream << ",";
+                    writer.WriteRaw(',');
             }
-            stream << "}";
+            writer.WriteRaw('}');
             break;
         case TrackerStringMap:
             tstringmap = e->get_stringmap();
-            stream << "{";
+            writer.WriteRaw('{');
             for (string_map_iter = tstringmap->begin();
                     string_map_iter != tstringmap->end(); /* */) {
-                stream << "\"" << string_map_iter->first << "\": ";
-                JsonAdapter::Pack(globalreg, stream, string_map_iter->second);
+                writer.WriteString(string_map_iter->first);
+                writer.WriteRaw(": ", 2);
+                JsonAdapter::Pack(globalreg, writer, string_map_iter->second);
                 if (++string_map_iter != tstringmap->end())
-                    stream << ",";
+                    writer.WriteRaw(',');
             }
-            stream << "}";
+            writer.WriteRaw('}');
             break;
         case TrackerDoubleMap:
             tdoublemap = e->get_doublemap();
-            stream << "{";
+            writer.WriteRaw('{');
             for (double_map_iter = tdoublemap->begin();
                     double_map_iter != tdoublemap->end(); /* */) {
                 // Double keys are handled as strings in json
-                stream << "\"" << fixed << double_map_iter->first << "\": ";
-                JsonAdapter::Pack(globalreg, stream, double_map_iter->second);
+                writer.WriteRaw('"');
+                writer.WriteDouble(double_map_iter->first);
+                writer.WriteRaw("\": ", 3);
+                JsonAdapter::Pack(globalreg, writer, double_map_iter->second);
                 if (++double_map_iter != tdoublemap->end())
-                    stream << ",";
+                    writer.WriteRaw(',');
             }
-            stream << "}";
+            writer.WriteRaw('}');
             break;
         default:
             break;
@@ -28,10 +28,65 @@
 
 namespace JsonAdapter {
 
+// Buffer-based JSON writer.  Values are formatted directly into a flat buffer
+// without going through iostreams:  integers and hex are converted by hand,
+// doubles are written in the shortest form which reads back to the same value,
+// and strings are scanned for characters which need escaping a block at a 
+// time.
+class Writer {
+public:
+    Writer() { }
+
+    void WriteRaw(const char *in, size_t len) {
+        buffer.append(in, len);
+    }
+
+    void WriteRaw(const string &in) {
+        buffer.append(in);
+    }
+
+    void WriteRaw(char in) {
+        buffer.push_back(in);
+    }
+
+    // Write the escaped contents of a string, without quotes
+    void WriteEscaped(const char *in, size_t len);
+
+    // Write a quoted, escaped string
+    void WriteString(const string &in) {
+        buffer.push_back('"');
+        WriteEscaped(in.data(), in.length());
+        buffer.push_back('"');
+    }
+
+    void WriteInt(int64_t in);
+    void WriteUInt(uint64_t in);
+
+    // JSON has no representation of NaN or infinity, they're written as 0
+    void WriteDouble(double in);
+    void WriteFloat(float in);
+
+    // Quoted mac, optionally with the /mask
+    void WriteMac(const mac_addr &in, bool in_mask);
+
+    // Quoted UUID
+    void WriteUuid(const uuid &in);
+
+    const string &str() {
+        return buffer;
+    }
+
+protected:
+    string buffer;
+};
+
 void Pack(GlobalRegistry *globalreg, std::stringstream &stream, TrackerElement *e);
 
 void Pack(GlobalRegistry *globalreg, std::stringstream &stream, tracker_component *c);
 
+void Pack(GlobalRegistry *globalreg, Writer &writer, TrackerElement *e);
+
+// Escape a string for use inside a JSON string
 string SanitizeString(string in);
 
 class Serializer : public TrackerElementSerializer {
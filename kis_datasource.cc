@@ -35,6 +35,7 @@ KisDataSource::KisDataSource(GlobalRegistry *in_globalreg) :
 	pack_comp_linkframe = packetchain->RegisterPacketComponent("LINKFRAME");
     pack_comp_l1info = packetchain->RegisterPacketComponent("RADIODATA");
     pack_comp_gps = packetchain->RegisterPacketComponent("GPS");
+    pack_comp_datasrc = packetchain->RegisterPacketComponent("KISDATASRC");
 
     pthread_mutex_init(&source_lock, NULL);
 
@@ -144,6 +145,27 @@ void KisDataSource::register_fields() {
     num_reports_id =
         RegisterField("kismet.datasource.num_reports", TrackerUInt64,
                 "number of packtes/device reports", (void **) &num_reports);
+
+    kis_tracked_unique_rrd *unique_builder = 
+        new kis_tracked_unique_rrd(globalreg, 0);
+    unique_devices_id =
+        RegisterComplexField("kismet.datasource.unique_devices", unique_builder,
+                "distinct devices seen over time");
+    delete(unique_builder);
+}
+
+void KisDataSource::reserve_fields(TrackerElement *e) {
+    tracker_component::reserve_fields(e);
+
+    if (e != NULL) {
+        unique_devices =
+            new kis_tracked_unique_rrd(globalreg, unique_devices_id,
+                    e->get_map_value(unique_devices_id));
+    } else {
+        unique_devices = 
+            new kis_tracked_unique_rrd(globalreg, unique_devices_id);
+        add_map(unique_devices);
+    }
 }
 
 void KisDataSource::BufferAvailable(size_t in_amt) {
@@ -680,6 +702,10 @@ void KisDataSource::handle_packet_data(KVmap in_kvpairs) {
         packet->insert(pack_comp_gps, gpsinfo);
     }
 
+    kis_ref_datasource *datasrc = new kis_ref_datasource;
+    datasrc->ref_source = this;
+    packet->insert(pack_comp_datasrc, datasrc);
+
     // Update the last valid report time
     inc_num_reports(1);
     set_last_report_time(globalreg->timestamp.tv_sec);
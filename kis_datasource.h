@@ -147,6 +147,8 @@ public:
 
     __ProxyTrackable(source_hop_vec, TrackerElement, source_hop_vec);
 
+    __ProxyTrackable(unique_devices, kis_tracked_unique_rrd, unique_devices);
+
     // Ringbuffer API
     virtual void BufferAvailable(size_t in_amt);
     virtual void BufferError(string in_error);
@@ -159,7 +161,7 @@ protected:
     GlobalRegistry *globalreg;
     Packetchain *packetchain;
 
-    int pack_comp_linkframe, pack_comp_l1info, pack_comp_gps;
+    int pack_comp_linkframe, pack_comp_l1info, pack_comp_gps, pack_comp_datasrc;
 
     pthread_mutex_t source_lock;
 
@@ -173,6 +175,7 @@ protected:
     void *open_aux;
 
     virtual void register_fields();
+    virtual void reserve_fields(TrackerElement *e);
 
     // Human name
     int source_name_id;
@@ -242,6 +245,10 @@ protected:
     int num_reports_id;
     TrackerElement *num_reports;
 
+    // Distinct devices seen by this source over time
+    int unique_devices_id;
+    kis_tracked_unique_rrd *unique_devices;
+
     IPCRemoteV2 *source_ipc;
     RingbufferHandler *ipchandler;
 
@@ -301,5 +308,16 @@ public:
     char *object;
 };
 
+// Packet component referencing the data source a packet came from
+class kis_ref_datasource : public packet_component {
+public:
+    KisDataSource *ref_source;
+
+    kis_ref_datasource() {
+        self_destruct = 1; // Just a pointer container
+        ref_source = NULL;
+    }
+};
+
 #endif
 
@@ -0,0 +1,511 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sstream>
+
+#include "util.h"
+#include "configfile.h"
+#include "messagebus.h"
+#include "alertracker.h"
+#include "devicetracker.h"
+#include "json_adapter.h"
+#include "kis_httpd_eventstream.h"
+
+// Guards every stream and the stream list.  The httpd threads reading a
+// stream block on the condition in thread mode.
+static pthread_mutex_t eventstream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t eventstream_cond = PTHREAD_COND_INITIALIZER;
+
+Kis_Httpd_Eventstream::Kis_Httpd_Eventstream(GlobalRegistry *in_globalreg) :
+    Kis_Net_Httpd_Handler(in_globalreg),
+    MessageClient(in_globalreg, NULL) {
+
+    globalreg = in_globalreg;
+
+    pthread_mutex_init(&pending_mutex, NULL);
+    alerts_pending = false;
+
+    alert_seq = 0;
+    if (globalreg->alertracker != NULL)
+        alert_seq = globalreg->alertracker->FetchAlertSequence();
+
+    message_vec_id =
+        globalreg->entrytracker->RegisterField("kismet.messagebus.list",
+                TrackerVector, "list of messages");
+
+    tracked_message *msg_builder = new tracked_message(globalreg, 0);
+    message_entry_id =
+        globalreg->entrytracker->RegisterField("kismet.messagebus.message",
+                msg_builder, "Kismet message");
+    delete(msg_builder);
+
+    flush_interval =
+        globalreg->kismet_config->FetchOptUInt("httpd_eventstream_interval", 500);
+    max_clients =
+        globalreg->kismet_config->FetchOptUInt("httpd_eventstream_max_clients", 16);
+    max_pending =
+        globalreg->kismet_config->FetchOptUInt("httpd_eventstream_max_pending",
+                1024 * 1024);
+    keepalive =
+        globalreg->kismet_config->FetchOptUInt("httpd_eventstream_keepalive", 15);
+
+    // Timers run in 1/10th second slices
+    int slices = flush_interval / (1000 / SERVER_TIMESLICES_SEC);
+    if (slices < 1)
+        slices = 1;
+
+    timer_id =
+        globalreg->timetracker->RegisterTimer(slices, NULL, 1, this);
+
+    globalreg->messagebus->RegisterClient(this, MSGFLAG_ALL);
+
+    Httpd_RegisterRoute("GET", "/eventstream/events");
+}
+
+Kis_Httpd_Eventstream::~Kis_Httpd_Eventstream() {
+    globalreg->timetracker->RemoveTimer(timer_id);
+    globalreg->messagebus->RemoveClient(this);
+
+    {
+        // End any open streams; they clean themselves up when the httpd
+        // lets go of them
+        local_locker lock(&eventstream_mutex);
+
+        for (unsigned int x = 0; x < client_vec.size(); x++) {
+            stream_client *client = client_vec[x];
+
+            client->eventstream = NULL;
+            client->closed = true;
+
+            if (client->suspended) {
+                client->suspended = false;
+                MHD_resume_connection(client->connection);
+            }
+        }
+
+        client_vec.clear();
+
+        pthread_cond_broadcast(&eventstream_cond);
+    }
+
+    {
+        local_locker lock(&pending_mutex);
+
+        for (unsigned int x = 0; x < pending_messages.size(); x++)
+            pending_messages[x]->unlink();
+
+        pending_messages.clear();
+    }
+
+    pthread_mutex_destroy(&pending_mutex);
+}
+
+void Kis_Httpd_Eventstream::ProcessMessage(string in_msg, int in_flags) {
+    tracked_message *msg = (tracked_message *)
+        globalreg->entrytracker->GetTrackedInstance(message_entry_id);
+
+    msg->set_from_message(in_msg, in_flags);
+    msg->link();
+
+    local_locker lock(&pending_mutex);
+
+    // Raised alerts are announced on the bus; the alerts themselves are
+    // fetched from the alert tracker when we flush
+    if (in_flags & MSGFLAG_ALERT)
+        alerts_pending = true;
+
+    pending_messages.push_back(msg);
+
+    // Keep the same backlog as the messagebus REST client
+    if (pending_messages.size() > 50) {
+        pending_messages.front()->unlink();
+        pending_messages.erase(pending_messages.begin());
+    }
+}
+
+void Kis_Httpd_Eventstream::AppendEvent(string &out, const char *in_event,
+        const string &in_data, time_t in_id) {
+    char idbuf[32];
+
+    out += "event: ";
+    out += in_event;
+    out += "\n";
+
+    if (in_id != 0) {
+        snprintf(idbuf, 32, "%ld", (long) in_id);
+        out += "id: ";
+        out += idbuf;
+        out += "\n";
+    }
+
+    // Our JSON is always a single line
+    out += "data: ";
+    out += in_data;
+    out += "\n\n";
+}
+
+int Kis_Httpd_Eventstream::timetracker_event(int eventid __attribute__((unused))) {
+    time_t now = globalreg->timestamp.tv_sec;
+
+    // Device requests in this flush, by the time they want devices since and
+    // their field list.  Almost every client shares one of these after their
+    // first flush, so each is only rendered once no matter how many streams
+    // are open.
+    map<pair<time_t, string>, string> device_events;
+    bool want_alerts = false, want_messages = false;
+
+    {
+        local_locker lock(&eventstream_mutex);
+
+        for (unsigned int x = 0; x < client_vec.size(); x++) {
+            stream_client *client = client_vec[x];
+
+            if (client->closed)
+                continue;
+
+            if (client->topics & topic_devices)
+                device_events[make_pair(client->device_since, client->fields)] = "";
+
+            if (client->topics & topic_alerts)
+                want_alerts = true;
+
+            if (client->topics & topic_messages)
+                want_messages = true;
+        }
+    }
+
+    // Device events come from the device snapshot, which may trail the
+    // current time by the snapshot interval
+    time_t device_time = globalreg->devicetracker->FetchSnapshotTime();
+
+    // Render outside of the stream lock; the httpd threads only need it to
+    // take what's already been rendered
+    for (map<pair<time_t, string>, string>::iterator di = device_events.begin();
+            di != device_events.end(); ++di) {
+        std::stringstream stream;
+
+        TrackerElementProjection projection(globalreg, di->first.second);
+        JsonAdapter::Serializer serializer(globalreg, stream);
+
+        globalreg->devicetracker->httpd_devices_since(&serializer,
+                di->first.first, projection.empty() ? NULL : &projection, true);
+
+        if (stream.str().length() != 0)
+            AppendEvent(di->second, "devices", stream.str(), device_time);
+    }
+
+    string alert_event, message_event;
+    bool check_alerts = false;
+    vector<tracked_message *> messages;
+
+    {
+        local_locker lock(&pending_mutex);
+
+        check_alerts = alerts_pending;
+        alerts_pending = false;
+
+        messages.swap(pending_messages);
+    }
+
+    if (check_alerts) {
+        std::stringstream stream;
+        JsonAdapter::Serializer serializer(globalreg, stream);
+
+        // Always advance past what's been raised, even with nobody listening
+        if (globalreg->alertracker->SerializeAlertsSince(&serializer,
+                    &alert_seq) > 0 && want_alerts)
+            AppendEvent(alert_event, "alerts", stream.str(), 0);
+    }
+
+    if (messages.size() != 0) {
+        if (want_messages) {
+            std::stringstream stream;
+            JsonAdapter::Serializer serializer(globalreg, stream);
+
+            TrackerElement *msgvec =
+                globalreg->entrytracker->GetTrackedInstance(message_vec_id);
+            TrackerElementScopeLinker slink(msgvec);
+
+            for (unsigned int x = 0; x < messages.size(); x++)
+                msgvec->add_vector(messages[x]);
+
+            serializer.serialize(msgvec);
+
+            AppendEvent(message_event, "messages", stream.str(), 0);
+        }
+
+        for (unsigned int x = 0; x < messages.size(); x++)
+            messages[x]->unlink();
+    }
+
+    local_locker lock(&eventstream_mutex);
+
+    for (unsigned int x = 0; x < client_vec.size(); x++) {
+        stream_client *client = client_vec[x];
+
+        if (client->closed)
+            continue;
+
+        size_t start_len = client->pending.length();
+
+        if (client->topics & topic_devices) {
+            map<pair<time_t, string>, string>::iterator di =
+                device_events.find(make_pair(client->device_since, client->fields));
+
+            // Streams which opened while we were rendering catch up next time
+            if (di != device_events.end()) {
+                client->pending += di->second;
+
+                // Device times are only to the second, so the next event
+                // repeats devices seen later in this second rather than
+                // missing them
+                client->device_since = device_time - 1;
+            }
+        }
+
+        if (client->topics & topic_alerts)
+            client->pending += alert_event;
+
+        if (client->topics & topic_messages)
+            client->pending += message_event;
+
+        if (client->pending.length() == start_len) {
+            // Keep idle streams open through proxies, and notice clients
+            // which have gone away
+            if (client->pending.length() == 0 &&
+                    now - client->last_event >= (time_t) keepalive) {
+                client->pending = ":\n\n";
+                client->last_event = now;
+            } else {
+                continue;
+            }
+        } else {
+            client->last_event = now;
+        }
+
+        // A client this far behind isn't keeping up; end the stream, and
+        // let it reconnect and refresh
+        if (max_pending != 0 && client->pending.length() > max_pending) {
+            client->pending.clear();
+            client->closed = true;
+        }
+
+        if (client->suspended) {
+            client->suspended = false;
+            MHD_resume_connection(client->connection);
+        }
+    }
+
+    pthread_cond_broadcast(&eventstream_cond);
+
+    return 1;
+}
+
+int Kis_Httpd_Eventstream::Httpd_HandleRoutedRequest(Kis_Net_Httpd *httpd,
+        struct MHD_Connection *connection,
+        int route_id __attribute__((unused)),
+        Kis_Net_Httpd_Route_Params &params __attribute__((unused)),
+        const char *url __attribute__((unused)), const char *method,
+        const char *upload_data __attribute__((unused)),
+        size_t *upload_data_size __attribute__((unused))) {
+
+    if (strcmp(method, "GET") != 0)
+        return MHD_NO;
+
+    struct MHD_Response *response;
+    const char *arg;
+
+    // Refuse a device field list which names no known fields up front,
+    // instead of streaming full records
+    if ((arg = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND,
+                    "fields")) != NULL && arg[0] != '\0' &&
+            TrackerElementProjection(globalreg, string(arg)).empty()) {
+        string bad = "No known fields in field list";
+
+        response =
+            MHD_create_response_from_buffer(bad.length(), (void *) bad.c_str(),
+                    MHD_RESPMEM_MUST_COPY);
+
+        int ret = MHD_queue_response(connection, MHD_HTTP_BAD_REQUEST, response);
+        MHD_destroy_response(response);
+
+        return ret;
+    }
+
+    stream_client *client = new stream_client();
+
+    client->eventstream = this;
+    client->connection = connection;
+    client->event_mode = httpd->FetchEventMode();
+    client->suspended = false;
+    client->closed = false;
+    client->last_event = globalreg->timestamp.tv_sec;
+
+    // Start from now unless we're asked to catch up, either by the client
+    // or by an EventSource reconnecting
+    client->device_since = globalreg->timestamp.tv_sec - 1;
+
+    long since;
+
+    if ((arg = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND,
+                    "since")) != NULL && sscanf(arg, "%ld", &since) == 1)
+        client->device_since = since;
+
+    // A reconnect repeats the original URL, so the last event wins.  Event
+    // ids are the snapshot time of the devices sent, and like the stream
+    // itself we repeat that second rather than miss devices seen later in it.
+    if ((arg = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                    "Last-Event-ID")) != NULL && sscanf(arg, "%ld", &since) == 1)
+        client->device_since = since - 1;
+
+    client->topics = topic_all;
+
+    if ((arg = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND,
+                    "topics")) != NULL) {
+        vector<string> topics = StrTokenize(arg, ",");
+
+        client->topics = 0;
+
+        for (unsigned int x = 0; x < topics.size(); x++) {
+            string t = StrLower(StrStrip(topics[x]));
+
+            if (t == "devices")
+                client->topics |= topic_devices;
+            else if (t == "alerts")
+                client->topics |= topic_alerts;
+            else if (t == "messages")
+                client->topics |= topic_messages;
+        }
+    }
+
+    if ((arg = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND,
+                    "fields")) != NULL)
+        client->fields = arg;
+
+    // Tell the browser how soon to reconnect if we drop it
+    char retry[32];
+    snprintf(retry, 32, "retry: %u\n\n", flush_interval * 4);
+    client->pending = retry;
+
+    bool full = false;
+
+    {
+        local_locker lock(&eventstream_mutex);
+
+        if (max_clients != 0 && client_vec.size() >= max_clients)
+            full = true;
+        else
+            client_vec.push_back(client);
+    }
+
+    if (full) {
+        delete(client);
+
+        string busy = "Too many event streams open";
+
+        response =
+            MHD_create_response_from_buffer(busy.length(), (void *) busy.c_str(),
+                    MHD_RESPMEM_MUST_COPY);
+
+        int ret = MHD_queue_response(connection, MHD_HTTP_SERVICE_UNAVAILABLE,
+                response);
+        MHD_destroy_response(response);
+
+        return ret;
+    }
+
+    response =
+        MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 32 * 1024,
+                &stream_reader, client, &stream_free);
+
+    if (response == NULL) {
+        stream_free(client);
+        return MHD_NO;
+    }
+
+    MHD_add_response_header(response, "Content-Type", "text/event-stream");
+    MHD_add_response_header(response, "Cache-Control", "no-cache");
+
+    int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+
+    return ret;
+}
+
+ssize_t Kis_Httpd_Eventstream::stream_reader(void *cls,
+        uint64_t pos __attribute__((unused)), char *buf, size_t max) {
+    stream_client *client = (stream_client *) cls;
+
+    pthread_mutex_lock(&eventstream_mutex);
+
+    while (client->pending.length() == 0 && !client->closed) {
+        if (client->event_mode) {
+            // Don't hold up an event loop thread; we're resumed by the next
+            // flush with something to send
+            client->suspended = true;
+            MHD_suspend_connection(client->connection);
+            pthread_mutex_unlock(&eventstream_mutex);
+            return 0;
+        }
+
+        pthread_cond_wait(&eventstream_cond, &eventstream_mutex);
+    }
+
+    if (client->pending.length() == 0) {
+        pthread_mutex_unlock(&eventstream_mutex);
+        return MHD_CONTENT_READER_END_OF_STREAM;
+    }
+
+    size_t len = client->pending.length();
+
+    if (len > max)
+        len = max;
+
+    memcpy(buf, client->pending.data(), len);
+    client->pending.erase(0, len);
+
+    pthread_mutex_unlock(&eventstream_mutex);
+
+    return len;
+}
+
+void Kis_Httpd_Eventstream::stream_free(void *cls) {
+    stream_client *client = (stream_client *) cls;
+
+    pthread_mutex_lock(&eventstream_mutex);
+
+    if (client->eventstream != NULL) {
+        vector<stream_client *> &cv = client->eventstream->client_vec;
+
+        for (vector<stream_client *>::iterator i = cv.begin(); i != cv.end(); ++i) {
+            if (*i == client) {
+                cv.erase(i);
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&eventstream_mutex);
+
+    delete(client);
+}
+
@@ -0,0 +1,142 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_HTTPD_EVENTSTREAM_H__
+#define __KIS_HTTPD_EVENTSTREAM_H__
+
+#include "config.h"
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "globalregistry.h"
+#include "messagebus.h"
+#include "messagebus_restclient.h"
+#include "timetracker.h"
+#include "kis_net_microhttpd.h"
+
+// Push channel for the web UI, as server-sent events on
+// /eventstream/events.
+//
+// Instead of each client polling the last-time endpoints, updates are
+// collected once per flush interval and the same rendered events are
+// written to every open stream:
+//
+//   devices    devices seen since the last flush, in the same form as
+//              /devices/last-time/.../devices.json
+//   alerts     alerts raised since the last flush, as
+//              /alerts/last-seq/.../alerts.json
+//   messages   messagebus messages since the last flush
+//
+// Clients choose topics with ?topics=devices,alerts,messages (default all),
+// may limit device fields with ?fields= like the device endpoints, and may
+// start the device stream from a time with ?since=.  Device events carry the
+// update time as the event id, so a reconnecting EventSource resumes where
+// it left off.
+class Kis_Httpd_Eventstream : public Kis_Net_Httpd_Handler, public MessageClient,
+    public TimetrackerEvent, public LifetimeGlobal {
+public:
+    Kis_Httpd_Eventstream(GlobalRegistry *in_globalreg);
+    virtual ~Kis_Httpd_Eventstream();
+
+    virtual int Httpd_HandleRequest(Kis_Net_Httpd *httpd __attribute__((unused)),
+            struct MHD_Connection *connection __attribute__((unused)),
+            const char *url __attribute__((unused)),
+            const char *method __attribute__((unused)),
+            const char *upload_data __attribute__((unused)),
+            size_t *upload_data_size __attribute__((unused))) {
+        return MHD_NO;
+    }
+
+    virtual int Httpd_HandleRoutedRequest(Kis_Net_Httpd *httpd,
+            struct MHD_Connection *connection, int route_id,
+            Kis_Net_Httpd_Route_Params &params,
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size);
+
+    // Queue messagebus messages for the next flush
+    virtual void ProcessMessage(string in_msg, int in_flags);
+
+    // Flush timer
+    virtual int timetracker_event(int eventid);
+
+protected:
+    enum stream_topic {
+        topic_devices = 1, topic_alerts = 2, topic_messages = 4,
+
+        topic_all = 7
+    };
+
+    // An open stream.  Streams are shared with the httpd threads and may
+    // outlive us during shutdown, so they're guarded by a file-scope lock
+    // instead of one of ours.
+    struct stream_client {
+        Kis_Httpd_Eventstream *eventstream;
+        struct MHD_Connection *connection;
+
+        int topics;
+        string fields;
+
+        // Devices seen after this time are sent in the next device event
+        time_t device_since;
+
+        // Rendered events not yet taken by the httpd
+        string pending;
+
+        time_t last_event;
+
+        // Suspended waiting for events (event mode only)
+        bool event_mode;
+        bool suspended;
+
+        // No more events; end the stream once pending is drained
+        bool closed;
+    };
+
+    // MHD content reader and free callbacks for a stream
+    static ssize_t stream_reader(void *cls, uint64_t pos, char *buf, size_t max);
+    static void stream_free(void *cls);
+
+    // Format a server-sent event
+    static void AppendEvent(string &out, const char *in_event,
+            const string &in_data, time_t in_id);
+
+    GlobalRegistry *globalreg;
+
+    // Open streams, guarded by the stream lock
+    vector<stream_client *> client_vec;
+
+    // Messages waiting for the next flush, and if any alerts were raised
+    pthread_mutex_t pending_mutex;
+    vector<tracked_message *> pending_messages;
+    bool alerts_pending;
+
+    // Sequence number of the next alert to send
+    uint64_t alert_seq;
+
+    int message_vec_id, message_entry_id;
+
+    unsigned int flush_interval;
+    unsigned int max_clients;
+    unsigned int max_pending;
+    unsigned int keepalive;
+};
+
+#endif
+
@@ -41,7 +41,10 @@ Kis_Httpd_Websession::Kis_Httpd_Websession(GlobalRegistry *in_globalreg) :
 
     conf_username = up[0];
     conf_password = up[1];
-    }
+
+    Httpd_RegisterRoute("GET", "/session/create_session");
+    Httpd_RegisterRoute("GET", "/session/check_session");
+}
 
 Kis_Httpd_Websession::~Kis_Httpd_Websession() {
 
@@ -59,19 +62,6 @@ void Kis_Httpd_Websession::SetLogin(string in_username, string in_password) {
 
 }
 
-bool Kis_Httpd_Websession::Httpd_VerifyPath(const char *path, const char *method) {
-    if (strcmp(method, "GET") != 0)
-        return false;
-
-    if (strcmp(path, "/session/create_session") == 0)
-        return true;
-
-    if (strcmp(path, "/session/check_session") == 0)
-        return true;
-
-    return false;
-}
-
 int Kis_Httpd_Websession::Httpd_HandleRequest(Kis_Net_Httpd *httpd, 
             struct MHD_Connection *connection,
             const char *url, const char *method, 
@@ -34,7 +34,6 @@ public:
     Kis_Httpd_Websession(GlobalRegistry *in_globalreg);
     ~Kis_Httpd_Websession();
 
-    virtual bool Httpd_VerifyPath(const char *path, const char *method);
 
     virtual int Httpd_HandleRequest(Kis_Net_Httpd *httpd, 
             struct MHD_Connection *connection,
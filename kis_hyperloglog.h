@@ -0,0 +1,201 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_HYPERLOGLOG_H__
+#define __KIS_HYPERLOGLOG_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include <string>
+
+// HyperLogLog sketch for counting distinct keys (device keys, MACs) in a
+// fixed 256 bytes, with about 6.5% standard error no matter how many keys
+// are added.  Two sketches merge into the sketch of the union by taking
+// the larger of each register, which is what lets distinct counts be
+// rolled up from small time buckets into larger ones.
+class kis_hyperloglog {
+public:
+    enum {
+        precision = 8,
+        num_registers = 1 << precision
+    };
+
+    kis_hyperloglog() {
+        clear();
+    }
+
+    void clear() {
+        memset(registers, 0, sizeof(registers));
+    }
+
+    void add(uint64_t in_key) {
+        uint64_t h = hash(in_key);
+
+        // Top bits pick the register, the rank is the position of the first
+        // set bit in what's left
+        unsigned int r = (unsigned int) (h >> (64 - precision));
+        uint64_t w = h << precision;
+        uint8_t rank = w == 0 ? (64 - precision + 1) : (__builtin_clzll(w) + 1);
+
+        if (rank > registers[r])
+            registers[r] = rank;
+    }
+
+    void merge(const kis_hyperloglog &in_hll) {
+        for (unsigned int r = 0; r < num_registers; r++) {
+            if (in_hll.registers[r] > registers[r])
+                registers[r] = in_hll.registers[r];
+        }
+    }
+
+    uint64_t estimate() const {
+        double sum = 0;
+        unsigned int zeros = 0;
+
+        for (unsigned int r = 0; r < num_registers; r++) {
+            sum += ldexp(1.0, -registers[r]);
+            if (registers[r] == 0)
+                zeros++;
+        }
+
+        double m = num_registers;
+        double e = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+
+        // Small counts are better estimated by how many registers are unused
+        if (e <= 2.5 * m && zeros != 0)
+            e = m * log(m / zeros);
+
+        return (uint64_t) (e + 0.5);
+    }
+
+    // Registers as hex bytes, so a client can merge the sketches of 
+    // several sources itself
+    std::string hex_registers() const {
+        static const char hex[] = "0123456789abcdef";
+        std::string ret(num_registers * 2, '0');
+
+        for (unsigned int r = 0; r < num_registers; r++) {
+            ret[r * 2] = hex[registers[r] >> 4];
+            ret[r * 2 + 1] = hex[registers[r] & 0xF];
+        }
+
+        return ret;
+    }
+
+    uint8_t registers[num_registers];
+
+protected:
+    // Keys like MAC addresses are far from uniformly distributed, so mix
+    // them before they pick registers
+    static uint64_t hash(uint64_t in_key) {
+        in_key ^= in_key >> 33;
+        in_key *= 0xff51afd7ed558ccdULL;
+        in_key ^= in_key >> 33;
+        in_key *= 0xc4ceb9fe1a85ec53ULL;
+        in_key ^= in_key >> 33;
+        return in_key;
+    }
+};
+
+// Distinct keys over time, bucketed like kis_tracked_rrd: a sketch for each
+// minute of the past hour and each hour of the past day, indexed by minute
+// of the hour and hour of the day.  Buckets fall out as time moves on, and
+// counts over the whole hour or day come from merging the buckets, so the
+// memory used is fixed (84 sketches, about 21k) however many keys are seen.
+class kis_unique_rrd {
+public:
+    kis_unique_rrd() {
+        last_time = 0;
+    }
+
+    void add(uint64_t in_key, time_t in_time) {
+        advance(in_time);
+
+        if (last_time / 60 - in_time / 60 < 60)
+            minute_hll[(in_time / 60) % 60].add(in_key);
+
+        if (last_time / 3600 - in_time / 3600 < 24)
+            hour_hll[(in_time / 3600) % 24].add(in_key);
+    }
+
+    // Clear the buckets we've moved past since the last update
+    void advance(time_t in_time) {
+        if (in_time <= last_time)
+            return;
+
+        time_t lmin = last_time / 60, nmin = in_time / 60;
+        for (time_t m = 1; m <= nmin - lmin && m <= 60; m++)
+            minute_hll[(lmin + m) % 60].clear();
+
+        time_t lhour = last_time / 3600, nhour = in_time / 3600;
+        for (time_t h = 1; h <= nhour - lhour && h <= 24; h++)
+            hour_hll[(lhour + h) % 24].clear();
+
+        last_time = in_time;
+    }
+
+    time_t get_last_time() const {
+        return last_time;
+    }
+
+    uint64_t estimate_minute(unsigned int in_minute) const {
+        return minute_hll[in_minute % 60].estimate();
+    }
+
+    uint64_t estimate_hour_bucket(unsigned int in_hour) const {
+        return hour_hll[in_hour % 24].estimate();
+    }
+
+    // Distinct keys over the past hour and day
+    uint64_t estimate_hour() const {
+        kis_hyperloglog hll;
+        merge_hour(&hll);
+        return hll.estimate();
+    }
+
+    uint64_t estimate_day() const {
+        kis_hyperloglog hll;
+        merge_day(&hll);
+        return hll.estimate();
+    }
+
+    // Merge the sketch of the past hour or day into another
+    void merge_hour(kis_hyperloglog *ret_hll) const {
+        for (unsigned int m = 0; m < 60; m++)
+            ret_hll->merge(minute_hll[m]);
+    }
+
+    void merge_day(kis_hyperloglog *ret_hll) const {
+        for (unsigned int h = 0; h < 24; h++)
+            ret_hll->merge(hour_hll[h]);
+    }
+
+protected:
+    time_t last_time;
+
+    kis_hyperloglog minute_hll[60];
+    kis_hyperloglog hour_hll[24];
+};
+
+#endif
+
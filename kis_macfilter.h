@@ -0,0 +1,248 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_MACFILTER_H__
+#define __KIS_MACFILTER_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+#include "macaddr.h"
+
+// MAC filter entries compiled into a path-compressed binary trie over the
+// 48 bits of the address, so a lookup follows at most 48 branches however
+// many entries there are, instead of macmap's scan of masked entries.  Each
+// entry carries a set of role bits (bssid, source, dest, or whatever the
+// caller uses them for), so one structure serves every role and a lookup
+// returns every role with a matching entry.
+//
+// Masks which are a prefix of the address (ff:ff:ff:00:00:00) go in the
+// trie; anything else is rare, and is kept in a sorted list per mask.
+class kis_mac_filter {
+public:
+    kis_mac_filter() {
+        clear();
+    }
+
+    void clear() {
+        node_vec.assign(1, trie_node());
+        mask_vec.clear();
+        num_entries = 0;
+    }
+
+    unsigned int size() const {
+        return num_entries;
+    }
+
+    void insert(const mac_addr &in_mac, unsigned int in_roles) {
+        uint64_t mask = in_mac.longmask & mac_bits_mask;
+        int len = prefix_len(mask);
+
+        num_entries++;
+
+        if (len < 0) {
+            insert_masked(in_mac.longmac & mask, mask, in_roles);
+            return;
+        }
+
+        uint64_t prefix = in_mac.longmac & mask;
+        unsigned int n = 0;
+
+        while (1) {
+            if (node_vec[n].len == len) {
+                node_vec[n].roles |= in_roles;
+                return;
+            }
+
+            unsigned int b = bit_at(prefix, node_vec[n].len);
+            int c = node_vec[n].child[b];
+
+            // add_node can grow node_vec, so never assign its result
+            // through a reference into the vector
+            if (c < 0) {
+                int leaf = add_node(prefix, len, in_roles);
+                node_vec[n].child[b] = leaf;
+                return;
+            }
+
+            // How much of the child's prefix we share
+            int common = common_len(prefix, node_vec[c].prefix);
+            if (common > len)
+                common = len;
+            if (common > node_vec[c].len)
+                common = node_vec[c].len;
+
+            if (common == node_vec[c].len) {
+                n = c;
+                continue;
+            }
+
+            // Split the child at the shared prefix
+            int mid = add_node(prefix & prefix_mask(common), common, 0);
+            node_vec[mid].child[bit_at(node_vec[c].prefix, common)] = c;
+            node_vec[n].child[b] = mid;
+
+            if (common == len) {
+                node_vec[mid].roles |= in_roles;
+            } else {
+                int leaf = add_node(prefix, len, in_roles);
+                node_vec[mid].child[bit_at(prefix, common)] = leaf;
+            }
+
+            return;
+        }
+    }
+
+    // Roles of all the entries matching an address
+    unsigned int find(const mac_addr &in_mac) const {
+        uint64_t mac = in_mac.longmac & mac_bits_mask;
+        unsigned int roles = node_vec[0].roles;
+        unsigned int n = 0;
+
+        while (node_vec[n].len < 48) {
+            int c = node_vec[n].child[bit_at(mac, node_vec[n].len)];
+
+            if (c < 0 || 
+                    ((mac ^ node_vec[c].prefix) & prefix_mask(node_vec[c].len)) != 0)
+                break;
+
+            roles |= node_vec[c].roles;
+            n = c;
+        }
+
+        for (unsigned int i = 0; i < mask_vec.size(); i++) {
+            std::vector<masked_entry>::const_iterator mi =
+                std::lower_bound(mask_vec[i].entries.begin(), 
+                        mask_vec[i].entries.end(), mac & mask_vec[i].mask);
+
+            if (mi != mask_vec[i].entries.end() && 
+                    mi->mac == (mac & mask_vec[i].mask))
+                roles |= mi->roles;
+        }
+
+        return roles;
+    }
+
+protected:
+    static const uint64_t mac_bits_mask = 0xFFFFFFFFFFFFULL;
+
+    // A node matches addresses starting with the first len bits of prefix
+    struct trie_node {
+        trie_node() {
+            prefix = 0;
+            len = 0;
+            roles = 0;
+            child[0] = child[1] = -1;
+        }
+
+        uint64_t prefix;
+        int len;
+        unsigned int roles;
+        int child[2];
+    };
+
+    struct masked_entry {
+        uint64_t mac;
+        unsigned int roles;
+
+        bool operator<(const uint64_t in_mac) const {
+            return mac < in_mac;
+        }
+    };
+
+    // Entries sharing a non-prefix mask, sorted by masked address
+    struct mask_group {
+        uint64_t mask;
+        std::vector<masked_entry> entries;
+    };
+
+    std::vector<trie_node> node_vec;
+    std::vector<mask_group> mask_vec;
+    unsigned int num_entries;
+
+    int add_node(uint64_t in_prefix, int in_len, unsigned int in_roles) {
+        trie_node node;
+        node.prefix = in_prefix;
+        node.len = in_len;
+        node.roles = in_roles;
+        node_vec.push_back(node);
+        return node_vec.size() - 1;
+    }
+
+    void insert_masked(uint64_t in_mac, uint64_t in_mask, unsigned int in_roles) {
+        unsigned int g;
+
+        for (g = 0; g < mask_vec.size(); g++) {
+            if (mask_vec[g].mask == in_mask)
+                break;
+        }
+
+        if (g == mask_vec.size()) {
+            mask_vec.push_back(mask_group());
+            mask_vec[g].mask = in_mask;
+        }
+
+        std::vector<masked_entry>::iterator mi =
+            std::lower_bound(mask_vec[g].entries.begin(), 
+                    mask_vec[g].entries.end(), in_mac);
+
+        if (mi != mask_vec[g].entries.end() && mi->mac == in_mac) {
+            mi->roles |= in_roles;
+            return;
+        }
+
+        masked_entry e;
+        e.mac = in_mac;
+        e.roles = in_roles;
+        mask_vec[g].entries.insert(mi, e);
+    }
+
+    static uint64_t prefix_mask(int in_len) {
+        if (in_len == 0)
+            return 0;
+        return (mac_bits_mask << (48 - in_len)) & mac_bits_mask;
+    }
+
+    // Bit following the first in_pos bits
+    static unsigned int bit_at(uint64_t in_mac, int in_pos) {
+        return (in_mac >> (47 - in_pos)) & 1;
+    }
+
+    static int common_len(uint64_t in_a, uint64_t in_b) {
+        uint64_t x = (in_a ^ in_b) & mac_bits_mask;
+        if (x == 0)
+            return 48;
+        return __builtin_clzll(x) - 16;
+    }
+
+    // Length of a prefix mask, or -1 if the mask isn't one
+    static int prefix_len(uint64_t in_mask) {
+        for (int len = 48; len >= 0; len--) {
+            if (in_mask == prefix_mask(len))
+                return len;
+        }
+
+        return -1;
+    }
+};
+
+#endif
+
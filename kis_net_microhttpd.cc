@@ -29,20 +29,87 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 #include <microhttpd.h>
 #include <msgpack.hpp>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <unistd.h>
 
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+#ifdef SYS_LINUX
+#include <sys/inotify.h>
+#endif
+
 #include "globalregistry.h"
 #include "messagebus.h"
 #include "configfile.h"
 #include "kis_net_microhttpd.h"
 #include "base64.h"
+#include "entrytracker.h"
+#include "json_adapter.h"
+
+Kis_Net_Httpd_Histogram::Kis_Net_Httpd_Histogram() {
+    for (unsigned int x = 0; x < NUM_BUCKETS; x++)
+        buckets[x] = 0;
+
+    count = 0;
+    sum = 0;
+    max = 0;
+}
+
+uint64_t Kis_Net_Httpd_Histogram::BucketLower(unsigned int in_bucket) {
+    if (in_bucket < 4)
+        return in_bucket;
+
+    unsigned int msb = in_bucket / 4 + 1;
+
+    return (uint64_t) (4 + (in_bucket & 3)) << (msb - 2);
+}
+
+uint64_t Kis_Net_Httpd_Histogram::BucketUpper(unsigned int in_bucket) {
+    if (in_bucket < 4)
+        return in_bucket + 1;
+
+    return BucketLower(in_bucket) + (1ULL << (in_bucket / 4 - 1));
+}
+
+uint64_t Kis_Net_Httpd_Histogram::Percentile(double in_quantile) {
+    uint64_t total = FetchCount();
+
+    if (total == 0)
+        return 0;
+
+    uint64_t target = (uint64_t) (in_quantile * total + 0.5);
+
+    if (target == 0)
+        target = 1;
 
-Kis_Net_Httpd::Kis_Net_Httpd(GlobalRegistry *in_globalreg) {
+    uint64_t seen = 0;
+
+    for (unsigned int x = 0; x < NUM_BUCKETS; x++) {
+        seen += FetchBucket(x);
+
+        if (seen >= target) {
+            uint64_t lower = BucketLower(x);
+            uint64_t mid = lower + (BucketUpper(x) - lower) / 2;
+            uint64_t top = FetchMax();
+
+            return mid > top ? top : mid;
+        }
+    }
+
+    return FetchMax();
+}
+
+Kis_Net_Httpd::Kis_Net_Httpd(GlobalRegistry *in_globalreg) :
+    session_table(1024) {
     globalreg = in_globalreg;
 
     globalreg->InsertGlobal("HTTPD_SERVER", this);
@@ -56,11 +123,96 @@ Kis_Net_Httpd::Kis_Net_Httpd(GlobalRegistry *in_globalreg) {
 
     pthread_mutex_init(&controller_mutex, NULL);
 
+    pthread_mutex_init(&work_mutex, NULL);
+    pthread_cond_init(&work_cond, NULL);
+    workers_shutdown = false;
+    pending_requests = 0;
+    peak_pending_requests = 0;
+    workers_busy = 0;
+    deferred_requests = 0;
+
+    microhttpd = NULL;
+
+    pthread_mutex_init(&cache_mutex, NULL);
+    pthread_mutex_init(&asset_mutex, NULL);
+    asset_bytes = 0;
+    asset_notify_fd = -1;
+    cache_hits = 0;
+    cache_stale_hits = 0;
+    cache_misses = 0;
+    cache_evictions = 0;
+
     if (globalreg->kismet_config == NULL) {
         fprintf(stderr, "FATAL OOPS: Kis_Net_Httpd called without kismet_config\n");
         exit(1);
     }
 
+    string mode = 
+        StrLower(globalreg->kismet_config->FetchOpt("httpd_mode"));
+
+    if (mode == "event") {
+        event_mode = true;
+    } else {
+        if (mode != "" && mode != "thread") 
+            _MSG("Unknown httpd_mode '" + mode + "', expected 'thread' or 'event'; "
+                    "using thread-per-connection", MSGFLAG_ERROR);
+        event_mode = false;
+    }
+
+    io_threads = globalreg->kismet_config->FetchOptUInt("httpd_io_threads", 2);
+    num_workers = globalreg->kismet_config->FetchOptUInt("httpd_workers", 4);
+    max_connections = 
+        globalreg->kismet_config->FetchOptUInt("httpd_max_connections", 0);
+    max_pending_requests = 
+        globalreg->kismet_config->FetchOptUInt("httpd_max_queue", 256);
+    endpoint_default_limit = 
+        globalreg->kismet_config->FetchOptUInt("httpd_endpoint_default_limit", 0);
+
+    cache_enabled = 
+        globalreg->kismet_config->FetchOptBoolean("httpd_cache", true);
+    cache_max_staleness = 
+        globalreg->kismet_config->FetchOptUInt("httpd_cache_max_staleness", 500);
+    cache_max_entries = 
+        globalreg->kismet_config->FetchOptUInt("httpd_cache_max_entries", 64);
+
+    compress_enabled =
+        globalreg->kismet_config->FetchOptBoolean("httpd_compress", true);
+    compress_min_size =
+        globalreg->kismet_config->FetchOptUInt("httpd_compress_min_size", 1024);
+    compress_level =
+        globalreg->kismet_config->FetchOptInt("httpd_compress_level", 3);
+    asset_max_bytes =
+        globalreg->kismet_config->FetchOptUInt("httpd_asset_cache_size", 
+                32 * 1024 * 1024);
+
+    if (compress_level < 1 || compress_level > 9)
+        compress_level = 3;
+
+#ifndef HAVE_LIBZ
+    compress_enabled = false;
+#endif
+
+    if (io_threads == 0)
+        io_threads = 1;
+
+    if (num_workers == 0)
+        num_workers = 1;
+
+    vector<string> limitopts = 
+        globalreg->kismet_config->FetchOptVec("httpd_endpoint_limit");
+    for (unsigned int i = 0; i < limitopts.size(); i++) {
+        size_t comma = limitopts[i].rfind(',');
+        unsigned int limit;
+
+        if (comma == string::npos || 
+                sscanf(limitopts[i].substr(comma + 1).c_str(), "%u", &limit) != 1) {
+            _MSG("Expected httpd_endpoint_limit=pattern,limit", MSGFLAG_ERROR);
+            continue;
+        }
+
+        endpoint_limit_map[limitopts[i].substr(0, comma)] = limit;
+    }
+
     http_port = globalreg->kismet_config->FetchOptUInt("httpd_port", 2501);
 
     http_data_dir = globalreg->kismet_config->FetchOpt("httpd_home");
@@ -92,13 +244,37 @@ Kis_Net_Httpd::Kis_Net_Httpd(GlobalRegistry *in_globalreg) {
     }
 
     if (http_serve_files == false && http_serve_user_files == false) {
-        RegisterHandler(new Kis_Net_Httpd_No_Files_Handler());
+        Kis_Net_Httpd_No_Files_Handler *nofiles = 
+            new Kis_Net_Httpd_No_Files_Handler();
+
+        RegisterHandler(nofiles);
+        RegisterRoute(nofiles, "GET", "/", 0);
+        RegisterRoute(nofiles, "GET", "/index.html", 0);
     }
 
     use_ssl = globalreg->kismet_config->FetchOptBoolean("httpd_ssl", false);
     pem_path = globalreg->kismet_config->FetchOpt("httpd_ssl_cert");
     key_path = globalreg->kismet_config->FetchOpt("httpd_ssl_key");
 
+    Kis_Net_Httpd_Stats_Handler *stats = new Kis_Net_Httpd_Stats_Handler(globalreg);
+    RegisterRoute(stats, "GET", "/system/httpd_queue.msgpack", 
+            Kis_Net_Httpd_Stats_Handler::route_queue | 
+            Kis_Net_Httpd_Stats_Handler::route_msgpack);
+    RegisterRoute(stats, "GET", "/system/httpd_queue.json", 
+            Kis_Net_Httpd_Stats_Handler::route_queue);
+    RegisterRoute(stats, "GET", "/system/httpd_cache.msgpack", 
+            Kis_Net_Httpd_Stats_Handler::route_cache | 
+            Kis_Net_Httpd_Stats_Handler::route_msgpack);
+    RegisterRoute(stats, "GET", "/system/httpd_cache.json", 
+            Kis_Net_Httpd_Stats_Handler::route_cache);
+    RegisterRoute(stats, "GET", "/system/httpd_stats.msgpack", 
+            Kis_Net_Httpd_Stats_Handler::route_stats | 
+            Kis_Net_Httpd_Stats_Handler::route_msgpack);
+    RegisterRoute(stats, "GET", "/system/httpd_stats.json", 
+            Kis_Net_Httpd_Stats_Handler::route_stats);
+    RegisterRoute(stats, "GET", "/system/httpd_stats.prom", 
+            Kis_Net_Httpd_Stats_Handler::route_prometheus);
+
     RegisterMimeType("html", "text/html");
     RegisterMimeType("svg", "image/svg+xml");
     RegisterMimeType("css", "text/css");
@@ -106,6 +282,10 @@ Kis_Net_Httpd::Kis_Net_Httpd(GlobalRegistry *in_globalreg) {
     RegisterMimeType("gif", "image/gif");
     RegisterMimeType("ico", "image/x-icon");
     RegisterMimeType("json", "application/json");
+    RegisterMimeType("js", "application/javascript");
+    RegisterMimeType("txt", "text/plain");
+    RegisterMimeType("xml", "application/xml");
+    RegisterMimeType("prom", "text/plain; version=0.0.4");
 
     vector<string> mimeopts = globalreg->kismet_config->FetchOptVec("httpd_mime");
     for (unsigned int i = 0; i < mimeopts.size(); i++) {
@@ -122,9 +302,35 @@ Kis_Net_Httpd::Kis_Net_Httpd(GlobalRegistry *in_globalreg) {
         
     }
 
+    if (http_serve_files) {
+#ifdef SYS_LINUX
+        asset_notify_fd = inotify_init();
+
+        if (asset_notify_fd >= 0) 
+            fcntl(asset_notify_fd, F_SETFL, 
+                    fcntl(asset_notify_fd, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+        PreloadStaticAssets(http_data_dir, "");
+
+        stringstream ss;
+        ss << "Loaded " << asset_map.size() << " static files (" << 
+            asset_bytes / 1024 << "KB) from '" << http_data_dir << "'";
+        _MSG(ss.str(), MSGFLAG_INFO);
+    }
+
     // Do we store sessions?
     store_sessions = false;
-    session_db = NULL;
+
+    pthread_mutex_init(&session_log_mutex, NULL);
+    pthread_cond_init(&session_log_cond, NULL);
+    session_flush_shutdown = false;
+    session_flush_running = false;
+    session_log = NULL;
+    session_log_lines = 0;
+
+    session_flush_interval =
+        globalreg->kismet_config->FetchOptUInt("httpd_session_flush_interval", 1000);
 
     sessiondb_file = globalreg->kismet_config->FetchOpt("httpd_session_db");
 
@@ -132,48 +338,19 @@ Kis_Net_Httpd::Kis_Net_Httpd(GlobalRegistry *in_globalreg) {
         sessiondb_file = 
             globalreg->kismet_config->ExpandLogPath(sessiondb_file, "", "", 0, 1);
 
-        session_db = new ConfigFile(globalreg);
-
         store_sessions = true;
 
-        struct stat buf;
-        if (stat(sessiondb_file.c_str(), &buf) == 0) {
-            session_db->ParseConfig(sessiondb_file.c_str());
-
-            vector<string> oldsessions = session_db->FetchOptVec("session");
-
-            if (oldsessions.size() > 0) 
-                _MSG("Loading saved HTTP sessions", MSGFLAG_INFO);
-
-            for (unsigned int s = 0; s < oldsessions.size(); s++) {
-                vector<string> sestok = StrTokenize(oldsessions[s], ",");
-
-                if (sestok.size() != 4)
-                    continue;
-
-                Kis_Net_Httpd_Session *sess = new Kis_Net_Httpd_Session();
-
-                sess->sessionid = sestok[0];
-
-                if (sscanf(sestok[1].c_str(), "%lu", &(sess->session_created)) != 1) {
-                    delete sess;
-                    continue;
-                }
-
-                if (sscanf(sestok[2].c_str(), "%lu", &(sess->session_seen)) != 1) {
-                    delete sess;
-                    continue;
-                }
-
-                if (sscanf(sestok[3].c_str(), "%lu", &(sess->session_lifetime)) != 1) {
-                    delete sess;
-                    continue;
-                }
-
-                session_map[sess->sessionid] = sess;
+        LoadSessions();
+    }
 
-            }
-        }
+    // The flusher also frees removed sessions, so it runs even when sessions
+    // aren't saved
+    if (pthread_create(&session_flush_tid, NULL, session_flush_thread, this) != 0) {
+        _MSG("Failed to start HTTP session thread, sessions will not be "
+                "saved: " + string(strerror(errno)), MSGFLAG_ERROR);
+        store_sessions = false;
+    } else {
+        session_flush_running = true;
     }
 }
 
@@ -189,16 +366,49 @@ Kis_Net_Httpd::~Kis_Net_Httpd() {
     if (running)
         StopHttpd();
 
-    if (session_db) {
-        delete(session_db);
+    StopWorkers();
+
+    for (std::map<string, Kis_Net_Httpd_Endpoint *>::iterator i = endpoint_map.begin();
+            i != endpoint_map.end(); ++i) {
+        delete(i->second);
+    }
+
+    for (std::map<string, Kis_Net_Httpd_Cache_Entry *>::iterator i = 
+            response_cache.begin(); i != response_cache.end(); ++i) {
+        i->second->Unref();
     }
 
-    for (map<string, Kis_Net_Httpd_Session *>::iterator i = session_map.begin();
-            i != session_map.end(); ++i) {
+    // Stopping the server freed the responses, so only the map holds 
+    // the assets
+    for (std::map<string, static_asset *>::iterator i = asset_map.begin();
+            i != asset_map.end(); ++i) {
         delete(i->second);
     }
 
+    if (asset_notify_fd >= 0)
+        close(asset_notify_fd);
+
+    // Write out whatever sessions are still queued
+    if (session_flush_running) {
+        {
+            local_locker lock(&session_log_mutex);
+            session_flush_shutdown = true;
+            pthread_cond_broadcast(&session_log_cond);
+        }
+
+        pthread_join(session_flush_tid, NULL);
+    }
+
+    if (session_log != NULL)
+        fclose(session_log);
+
     pthread_mutex_destroy(&controller_mutex);
+    pthread_mutex_destroy(&work_mutex);
+    pthread_cond_destroy(&work_cond);
+    pthread_mutex_destroy(&cache_mutex);
+    pthread_mutex_destroy(&asset_mutex);
+    pthread_mutex_destroy(&session_log_mutex);
+    pthread_cond_destroy(&session_log_cond);
 }
 
 char *Kis_Net_Httpd::read_ssl_file(string in_fname) {
@@ -248,6 +458,7 @@ void Kis_Net_Httpd::RegisterHandler(Kis_Net_Httpd_Handler *in_handler) {
     local_locker lock(&controller_mutex);
 
     handler_vec.push_back(in_handler);
+    unrouted_handler_vec.push_back(in_handler);
 }
 
 void Kis_Net_Httpd::RemoveHandler(Kis_Net_Httpd_Handler *in_handler) {
@@ -259,413 +470,2473 @@ void Kis_Net_Httpd::RemoveHandler(Kis_Net_Httpd_Handler *in_handler) {
             break;
         }
     }
-}
-
-int Kis_Net_Httpd::StartHttpd() {
-    if (use_ssl) {
-        // If we can't load the SSL key files, crash and burn.  We can't safely
-        // degrade to non-ssl when the user is expecting encryption.
-        if (pem_path == "") {
-            _MSG("SSL requested but missing httpd_ssl_cert= configuration option.",
-                    MSGFLAG_FATAL);
-            globalreg->fatal_condition = 1;
-            return -1;
-        }
 
-        if (key_path == "") {
-            _MSG("SSL requested but missing httpd_ssl_key= configuration option.",
-                    MSGFLAG_FATAL);
-            globalreg->fatal_condition = 1;
-            return -1;
+    for (unsigned int x = 0; x < unrouted_handler_vec.size(); x++) {
+        if (unrouted_handler_vec[x] == in_handler) {
+            unrouted_handler_vec.erase(unrouted_handler_vec.begin() + x);
+            break;
         }
+    }
 
-        pem_path =
-            globalreg->kismet_config->ExpandLogPath(pem_path, "", "", 0, 1);
-        key_path =
-            globalreg->kismet_config->ExpandLogPath(key_path, "", "", 0, 1);
+    route_table.RemoveHandler(in_handler);
+}
 
-        cert_pem = read_ssl_file(pem_path);
-        cert_key = read_ssl_file(key_path);
+bool Kis_Net_Httpd::RegisterRoute(Kis_Net_Httpd_Handler *in_handler, 
+        string in_method, string in_pattern, int in_route_id) {
+    local_locker lock(&controller_mutex);
 
-        if (cert_pem == NULL || cert_key == NULL) {
-            _MSG("SSL requested but unable to load cert and key files, check your "
-                    "configuration!", MSGFLAG_FATAL);
-            globalreg->fatal_condition = 1;
-            return -1;
-        }
-    }
+    Kis_Net_Httpd_Endpoint *endpoint = NULL;
 
+    std::map<string, Kis_Net_Httpd_Endpoint *>::iterator ei =
+        endpoint_map.find(in_method + " " + in_pattern);
 
-    if (!use_ssl) {
-        microhttpd = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION,
-                http_port, NULL, NULL, 
-                &http_request_handler, this, 
-                MHD_OPTION_NOTIFY_COMPLETED, &http_request_completed, NULL,
-                MHD_OPTION_END); 
+    if (ei != endpoint_map.end()) {
+        endpoint = ei->second;
     } else {
-        microhttpd = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION | MHD_USE_SSL,
-                http_port, NULL, NULL, &http_request_handler, this, 
-                MHD_OPTION_HTTPS_MEM_KEY, cert_key,
-                MHD_OPTION_HTTPS_MEM_CERT, cert_pem,
-                MHD_OPTION_END); 
-    }
+        endpoint = new Kis_Net_Httpd_Endpoint();
+        endpoint->method = in_method;
+        endpoint->pattern = in_pattern;
+        endpoint->max_concurrent = endpoint_default_limit;
 
+        std::map<string, unsigned int>::iterator li = 
+            endpoint_limit_map.find(in_pattern);
+        if (li != endpoint_limit_map.end())
+            endpoint->max_concurrent = li->second;
 
-    if (microhttpd == NULL) {
-        _MSG("Failed to start http server on port " + UIntToString(http_port),
-                MSGFLAG_FATAL);
-        globalreg->fatal_condition = 1;
-        return -1;
+        endpoint_map[in_method + " " + in_pattern] = endpoint;
     }
 
-    MHD_set_panic_func(Kis_Net_Httpd::MHD_Panic, this);
+    if (!route_table.AddRoute(in_handler, in_method, in_pattern, in_route_id,
+                endpoint)) {
+        _MSG("Invalid HTTP route pattern '" + in_pattern + "'", MSGFLAG_ERROR);
+        return false;
+    }
 
-    _MSG("Started http server on port " + UIntToString(http_port), MSGFLAG_INFO);
+    for (unsigned int x = 0; x < unrouted_handler_vec.size(); x++) {
+        if (unrouted_handler_vec[x] == in_handler) {
+            unrouted_handler_vec.erase(unrouted_handler_vec.begin() + x);
+            break;
+        }
+    }
 
-    return 1;
+    return true;
 }
 
-int Kis_Net_Httpd::StopHttpd() {
-    if (microhttpd != NULL) {
-        // We would want to stop but that seems to have some problems with
-        // thread joining; for now, quiesce it, and we'll kill it when the
-        // process exits, because we never shut down httpd and keep running
-        MHD_quiesce_daemon(microhttpd);
+bool Kis_Net_Httpd::CacheRoute(string in_method, string in_pattern,
+        Kis_Net_Httpd_Generation *in_generation) {
+    local_locker lock(&controller_mutex);
 
-        // MHD_stop_daemon(microhttpd);
-        return 1;
-    }
+    std::map<string, Kis_Net_Httpd_Endpoint *>::iterator ei =
+        endpoint_map.find(in_method + " " + in_pattern);
 
-    return 0;
-}
+    if (ei == endpoint_map.end())
+        return false;
 
-void Kis_Net_Httpd::MHD_Panic(void *cls, const char *file, unsigned int line,
-        const char *reason) {
-    Kis_Net_Httpd *httpd = (Kis_Net_Httpd *) cls;
+    local_locker clock(&cache_mutex);
 
-    httpd->globalreg->fatal_condition = 1;
-    httpd->globalreg->messagebus->InjectMessage("Unable to continue after "
-            "MicroHTTPD fatal error: " + string(reason), MSGFLAG_FATAL);
+    ei->second->cached = true;
+    ei->second->generation = in_generation;
 
-    // Null out the microhttpd since it can't keep operating and can't be
-    // trusted to close down properly
-    httpd->microhttpd = NULL;
+    return true;
 }
 
-void Kis_Net_Httpd::AddSession(Kis_Net_Httpd_Session *in_session) {
-    session_map[in_session->sessionid] = in_session;
-    WriteSessions();
-}
+// Split a URL into path segments, ignoring empty segments and any query string
+static vector<string> httpd_route_segments(const char *in_url) {
+    vector<string> ret;
+    const char *start = in_url;
+    const char *p = in_url;
 
-void Kis_Net_Httpd::DelSession(string in_key) {
-    map<string, Kis_Net_Httpd_Session *>::iterator i = session_map.find(in_key);
+    while (1) {
+        if (*p == '/' || *p == '\0' || *p == '?') {
+            if (p != start)
+                ret.push_back(string(start, p - start));
 
-    DelSession(i);
-}
+            if (*p != '/')
+                break;
 
-void Kis_Net_Httpd::DelSession(map<string, Kis_Net_Httpd_Session *>::iterator in_itr) {
-    if (in_itr != session_map.end()) {
-        delete in_itr->second;
-        session_map.erase(in_itr);
-        WriteSessions();
+            start = p + 1;
+        }
+
+        p++;
     }
+
+    return ret;
 }
 
-void Kis_Net_Httpd::WriteSessions() {
-    if (!store_sessions)
-        return;
+Kis_Net_Httpd_Route_Table::Kis_Net_Httpd_Route_Table() {
+    root = new route_node();
+}
 
-    vector<string> sessions;
-    stringstream str;
+Kis_Net_Httpd_Route_Table::~Kis_Net_Httpd_Route_Table() {
+    DeleteNode(root);
+}
 
-    for (map<string, Kis_Net_Httpd_Session *>::iterator i = session_map.begin();
-            i != session_map.end(); ++i) {
-        str.str("");
+void Kis_Net_Httpd_Route_Table::DeleteNode(route_node *in_node) {
+    for (std::map<string, route_node *>::iterator i = in_node->literals.begin();
+            i != in_node->literals.end(); ++i)
+        DeleteNode(i->second);
 
-        str << i->second->sessionid << "," << i->second->session_created << "," <<
-            i->second->session_seen << "," << i->second->session_lifetime;
+    for (unsigned int x = 0; x < in_node->captures.size(); x++)
+        DeleteNode(in_node->captures[x].child);
 
-        sessions.push_back(str.str());
-    }
+    delete(in_node);
+}
 
-    session_db->SetOptVec("session", sessions, true);
+bool Kis_Net_Httpd_Route_Table::AddRoute(Kis_Net_Httpd_Handler *in_handler,
+        string in_method, string in_pattern, int in_route_id,
+        Kis_Net_Httpd_Endpoint *in_endpoint) {
+    vector<string> segments = httpd_route_segments(in_pattern.c_str());
 
-    // Ignore failures here I guess?
-    session_db->SaveConfig(sessiondb_file.c_str());
+    // Validate the whole pattern before we touch the trie
+    for (unsigned int x = 0; x < segments.size(); x++) {
+        const string &seg = segments[x];
 
-}
+        if (seg[0] != '{')
+            continue;
 
-int Kis_Net_Httpd::http_request_handler(void *cls, struct MHD_Connection *connection,
-    const char *url, const char *method, const char *version __attribute__ ((unused)),
-    const char *upload_data, size_t *upload_data_size, void **ptr) {
+        if (seg[seg.length() - 1] != '}' || seg.length() < 3)
+            return false;
 
-    //fprintf(stderr, "debug - HTTP request: '%s' method '%s'\n", url, method); 
-    //
-    Kis_Net_Httpd *kishttpd = (Kis_Net_Httpd *) cls;
-    
-    // Update the session records if one exists
-    Kis_Net_Httpd_Session *s = NULL;
-    const char *cookieval;
-    int ret = MHD_NO;
+        size_t colon = seg.find(':');
 
-    cookieval = MHD_lookup_connection_value(connection, 
-            MHD_COOKIE_KIND, KIS_SESSION_COOKIE);
+        if (colon != string::npos) {
+            string type = seg.substr(colon + 1, seg.length() - colon - 2);
 
-    if (cookieval != NULL) {
-        map<string, Kis_Net_Httpd_Session *>::iterator si = 
-            kishttpd->session_map.find(cookieval);
+            if (type == "*") {
+                if (x != segments.size() - 1)
+                    return false;
+            } else if (type != "string" && type != "int" && type != "uint" && 
+                    type != "mac") {
+                return false;
+            }
+        }
+    }
 
-        if (si != kishttpd->session_map.end()) {
-            s = si->second;
+    route_node *node = root;
 
-            if (s->session_lifetime != 0) {
-                // Delete if the session has expired
-                if (s->session_seen + s->session_lifetime < 
-                        kishttpd->globalreg->timestamp.tv_sec) {
-                    kishttpd->DelSession(si);
-                }
+    for (unsigned int x = 0; x < segments.size(); x++) {
+        const string &seg = segments[x];
+
+        if (seg[0] != '{') {
+            std::map<string, route_node *>::iterator li = node->literals.find(seg);
+
+            if (li == node->literals.end()) {
+                route_node *child = new route_node();
+                node->literals[seg] = child;
+                node = child;
+            } else {
+                node = li->second;
             }
 
-            // Update the last seen
-            s->session_seen = kishttpd->globalreg->timestamp.tv_sec;
+            continue;
         }
-    } 
-    
-    Kis_Net_Httpd_Handler *handler = NULL;
 
-    {
-        local_locker(&(kishttpd->controller_mutex));
-        /* Find a handler that can handle this path & method */
-        for (unsigned int i = 0; i < kishttpd->handler_vec.size(); i++) {
-            Kis_Net_Httpd_Handler *h = kishttpd->handler_vec[i];
+        string name = seg.substr(1, seg.length() - 2);
+        capture_type type = capture_string;
+        size_t colon = name.find(':');
+
+        if (colon != string::npos) {
+            string tname = name.substr(colon + 1);
+            name = name.substr(0, colon);
+
+            if (tname == "int")
+                type = capture_int;
+            else if (tname == "uint")
+                type = capture_uint;
+            else if (tname == "mac")
+                type = capture_mac;
+            else if (tname == "*")
+                type = capture_tail;
+        }
 
-            if (h->Httpd_VerifyPath(url, method)) {
-                handler = h;
+        route_node *child = NULL;
+
+        for (unsigned int c = 0; c < node->captures.size(); c++) {
+            if (node->captures[c].name == name && node->captures[c].type == type) {
+                child = node->captures[c].child;
                 break;
             }
         }
-    }
 
-    if (handler == NULL) {
-        // Try to check a static url
-        if (handle_static_file(cls, connection, url, method) < 0) {
-            // fprintf(stderr, "   404 no handler for request\n");
+        if (child == NULL) {
+            capture_edge e;
+            e.name = name;
+            e.type = type;
+            e.child = child = new route_node();
+            node->captures.push_back(e);
+        }
 
-            string fourohfour = "404";
+        node = child;
+    }
 
-            struct MHD_Response *response = 
-                MHD_create_response_from_buffer(fourohfour.length(), 
-                        (void *) fourohfour.c_str(), MHD_RESPMEM_MUST_COPY);
+    route_target t;
+    t.handler = in_handler;
+    t.route_id = in_route_id;
+    t.endpoint = in_endpoint;
+    node->methods[in_method] = t;
 
-            return MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, response);
-        }
+    return true;
+}
 
-        return MHD_YES;
+void Kis_Net_Httpd_Route_Table::RemoveHandler(Kis_Net_Httpd_Handler *in_handler) {
+    RemoveHandler(root, in_handler);
+}
+
+void Kis_Net_Httpd_Route_Table::RemoveHandler(route_node *in_node, 
+        Kis_Net_Httpd_Handler *in_handler) {
+    for (std::map<string, route_target>::iterator i = in_node->methods.begin();
+            i != in_node->methods.end(); /* */) {
+        if (i->second.handler == in_handler)
+            in_node->methods.erase(i++);
+        else
+            ++i;
     }
 
-    // If we don't have a connection state, make one
-    if (*ptr == NULL) {
-        Kis_Net_Httpd_Connection *concls = new Kis_Net_Httpd_Connection();
+    for (std::map<string, route_node *>::iterator i = in_node->literals.begin();
+            i != in_node->literals.end(); ++i)
+        RemoveHandler(i->second, in_handler);
 
-        concls->httpd = kishttpd;
-        concls->httpdhandler = handler;
-        // printf("%s %s session = %p\n", method, url, s);
-        concls->session = s;
-        concls->httpcode = MHD_HTTP_OK;
-        concls->url = string(url);
+    for (unsigned int x = 0; x < in_node->captures.size(); x++)
+        RemoveHandler(in_node->captures[x].child, in_handler);
+}
 
-        /* If we're doing a post, set up a post handler */
-        if (strcmp(method, "POST") == 0) {
-            concls->connection_type = Kis_Net_Httpd_Connection::CONNECTION_POST;
+bool Kis_Net_Httpd_Route_Table::CaptureSegment(capture_type in_type, 
+        const string &in_segment, Kis_Net_Httpd_Route_Param *ret_param) {
+    char *end;
+
+    ret_param->value = in_segment;
+
+    switch (in_type) {
+        case capture_int:
+            errno = 0;
+            ret_param->int_value = strtoll(in_segment.c_str(), &end, 10);
+            return (errno == 0 && *end == '\0');
+        case capture_uint:
+            if (in_segment[0] == '-')
+                return false;
+            errno = 0;
+            ret_param->uint_value = strtoull(in_segment.c_str(), &end, 10);
+            return (errno == 0 && *end == '\0');
+        case capture_mac:
+            ret_param->mac_value = mac_addr(in_segment);
+            return !ret_param->mac_value.error;
+        default:
+            return true;
+    }
+}
 
-            concls->postprocessor =
-                MHD_create_post_processor(connection, KIS_HTTPD_POSTBUFFERSZ,
-                        kishttpd->http_post_handler, (void *) concls);
+Kis_Net_Httpd_Session_Table::Kis_Net_Httpd_Session_Table(unsigned int in_buckets) {
+    num_buckets = in_buckets;
+    buckets = new Kis_Net_Httpd_Session *[num_buckets];
 
-            if (concls->postprocessor == NULL) {
-                delete(concls);
-                return MHD_NO;
-            }
+    for (unsigned int x = 0; x < num_buckets; x++)
+        buckets[x] = NULL;
 
-        } else {
-            concls->connection_type = Kis_Net_Httpd_Connection::CONNECTION_POST;
-        }
+    pthread_mutex_init(&write_mutex, NULL);
 
-        *ptr = (void *) concls;
+    num_sessions = 0;
 
-        return MHD_YES;
-    }
+    epoch = 0;
+    readers[0] = 0;
+    readers[1] = 0;
+}
 
-    // Handle post
-    if (strcmp(method, "POST") == 0) {
-        Kis_Net_Httpd_Connection *concls = (Kis_Net_Httpd_Connection *) *ptr;
+Kis_Net_Httpd_Session_Table::~Kis_Net_Httpd_Session_Table() {
+    for (unsigned int x = 0; x < num_buckets; x++) {
+        Kis_Net_Httpd_Session *s = buckets[x];
 
-        if (*upload_data_size != 0) {
-            MHD_post_process(concls->postprocessor, upload_data, *upload_data_size);
-            *upload_data_size = 0;
-            return MHD_YES;
-        } else if (concls->response_stream.str().length() != 0) {
-            // Send the content
-            ret = kishttpd->SendHttpResponse(kishttpd, connection, 
-                    url, concls->httpcode, concls->response_stream.str());
-    
-            return ret;
+        while (s != NULL) {
+            Kis_Net_Httpd_Session *n = s->session_next;
+            delete(s);
+            s = n;
         }
-    } else {
-        ret = 
-            handler->Httpd_HandleRequest(kishttpd, connection, url, method, 
-                    upload_data, upload_data_size);
     }
 
-    return ret;
-}
-
-int Kis_Net_Httpd::http_post_handler(void *coninfo_cls, enum MHD_ValueKind kind, 
-        const char *key, const char *filename, const char *content_type,
-        const char *transfer_encoding, const char *data, 
-        uint64_t off, size_t size) {
+    for (unsigned int x = 0; x < retired.size(); x++)
+        delete(retired[x]);
 
-    Kis_Net_Httpd_Connection *concls = (Kis_Net_Httpd_Connection *) coninfo_cls;
+    delete[] buckets;
 
-    return (concls->httpdhandler)->Httpd_PostIterator(coninfo_cls, kind,
-            key, filename, content_type, transfer_encoding, data, off, size);
+    pthread_mutex_destroy(&write_mutex);
+}
+
+unsigned int Kis_Net_Httpd_Session_Table::Hash(const string &in_key) {
+    // FNV-1a; session keys are random, so anything cheap will do
+    uint32_t h = 2166136261U;
+
+    for (unsigned int x = 0; x < in_key.length(); x++) {
+        h ^= (uint8_t) in_key[x];
+        h *= 16777619U;
+    }
+
+    return h % num_buckets;
+}
+
+unsigned int Kis_Net_Httpd_Session_Table::ReadLock() {
+    while (1) {
+        unsigned int e = __sync_add_and_fetch(&epoch, 0);
+
+        __sync_add_and_fetch(&(readers[e & 1]), 1);
+
+        // If the epoch moved on before we were counted, a reclaim may not
+        // have waited for us; count ourselves under the new one
+        if (__sync_add_and_fetch(&epoch, 0) == e)
+            return e;
+
+        __sync_sub_and_fetch(&(readers[e & 1]), 1);
+    }
+}
+
+void Kis_Net_Httpd_Session_Table::ReadUnlock(unsigned int in_epoch) {
+    __sync_sub_and_fetch(&(readers[in_epoch & 1]), 1);
+}
+
+Kis_Net_Httpd_Session *Kis_Net_Httpd_Session_Table::Find(const string &in_key) {
+    Kis_Net_Httpd_Session *s = 
+        __sync_fetch_and_add(&(buckets[Hash(in_key)]), 0);
+
+    while (s != NULL) {
+        if (!s->session_removed && s->sessionid == in_key)
+            return s;
+
+        s = s->session_next;
+    }
+
+    return NULL;
+}
+
+bool Kis_Net_Httpd_Session_Table::Insert(Kis_Net_Httpd_Session *in_session) {
+    local_locker lock(&write_mutex);
+
+    unsigned int b = Hash(in_session->sessionid);
+
+    for (Kis_Net_Httpd_Session *s = buckets[b]; s != NULL; s = s->session_next) {
+        if (s->sessionid == in_session->sessionid)
+            return false;
+    }
+
+    in_session->session_removed = 0;
+    in_session->session_next = buckets[b];
+
+    // Publish the session only once it's complete
+    __sync_synchronize();
+    buckets[b] = in_session;
+
+    num_sessions++;
+
+    return true;
+}
+
+bool Kis_Net_Httpd_Session_Table::Remove(const string &in_key) {
+    local_locker lock(&write_mutex);
+
+    Kis_Net_Httpd_Session **prev = &(buckets[Hash(in_key)]);
+
+    for (Kis_Net_Httpd_Session *s = *prev; s != NULL; s = s->session_next) {
+        if (s->sessionid == in_key) {
+            s->session_removed = 1;
+
+            // Readers already past us still follow our next pointer, which
+            // stays intact until the session is reclaimed
+            __sync_synchronize();
+            *prev = s->session_next;
+
+            retired.push_back(s);
+            num_sessions--;
+
+            return true;
+        }
+
+        prev = &(s->session_next);
+    }
+
+    return false;
+}
+
+void Kis_Net_Httpd_Session_Table::Reclaim() {
+    std::vector<Kis_Net_Httpd_Session *> reclaim;
+
+    {
+        local_locker lock(&write_mutex);
+        reclaim.swap(retired);
+    }
+
+    if (reclaim.size() == 0)
+        return;
+
+    // Everything we're reclaiming was unlinked before the epoch moves on, so
+    // only readers counted under the old epoch can still see it
+    unsigned int e = __sync_fetch_and_add(&epoch, 1);
+
+    while (__sync_add_and_fetch(&(readers[e & 1]), 0) != 0)
+        usleep(100);
+
+    for (unsigned int x = 0; x < reclaim.size(); x++)
+        delete(reclaim[x]);
+}
+
+void Kis_Net_Httpd_Session_Table::Snapshot(std::vector<Kis_Net_Httpd_Session> *ret_sessions) {
+    local_locker lock(&write_mutex);
+
+    ret_sessions->reserve(num_sessions);
+
+    for (unsigned int x = 0; x < num_buckets; x++) {
+        for (Kis_Net_Httpd_Session *s = buckets[x]; s != NULL; s = s->session_next)
+            ret_sessions->push_back(*s);
+    }
+}
+
+unsigned int Kis_Net_Httpd_Session_Table::Size() {
+    local_locker lock(&write_mutex);
+
+    return num_sessions;
+}
+
+bool Kis_Net_Httpd_Route_Table::MatchNode(route_node *in_node, 
+        const vector<string> &in_segments, unsigned int in_pos, 
+        const char *in_method, route_target **ret_target, 
+        Kis_Net_Httpd_Route_Params *ret_params) {
+
+    if (in_pos == in_segments.size()) {
+        std::map<string, route_target>::iterator mi = 
+            in_node->methods.find(in_method);
+
+        if (mi != in_node->methods.end()) {
+            *ret_target = &(mi->second);
+            return true;
+        }
+
+        // A tail capture may match no segments at all
+        for (unsigned int c = 0; c < in_node->captures.size(); c++) {
+            if (in_node->captures[c].type != capture_tail)
+                continue;
+
+            if (MatchNode(in_node->captures[c].child, in_segments, in_pos,
+                        in_method, ret_target, ret_params)) {
+                (*ret_params)[in_node->captures[c].name] = 
+                    Kis_Net_Httpd_Route_Param();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    const string &seg = in_segments[in_pos];
+
+    std::map<string, route_node *>::iterator li = in_node->literals.find(seg);
+
+    if (li != in_node->literals.end() &&
+            MatchNode(li->second, in_segments, in_pos + 1, in_method, 
+                ret_target, ret_params))
+        return true;
+
+    for (unsigned int c = 0; c < in_node->captures.size(); c++) {
+        capture_edge *e = &(in_node->captures[c]);
+
+        if (e->type == capture_tail) {
+            std::map<string, route_target>::iterator mi = 
+                e->child->methods.find(in_method);
+
+            if (mi == e->child->methods.end())
+                continue;
+
+            Kis_Net_Httpd_Route_Param param;
+
+            for (unsigned int x = in_pos; x < in_segments.size(); x++) {
+                if (x != in_pos)
+                    param.value += "/";
+                param.value += in_segments[x];
+                param.path_value.push_back(in_segments[x]);
+            }
+
+            (*ret_params)[e->name] = param;
+            *ret_target = &(mi->second);
+
+            return true;
+        }
+
+        Kis_Net_Httpd_Route_Param param;
+
+        if (!CaptureSegment(e->type, seg, &param))
+            continue;
+
+        if (MatchNode(e->child, in_segments, in_pos + 1, in_method, 
+                    ret_target, ret_params)) {
+            (*ret_params)[e->name] = param;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+Kis_Net_Httpd_Handler *Kis_Net_Httpd_Route_Table::Match(const char *in_url,
+        const char *in_method, int *ret_route_id, 
+        Kis_Net_Httpd_Route_Params *ret_params,
+        Kis_Net_Httpd_Endpoint **ret_endpoint) {
+    vector<string> segments = httpd_route_segments(in_url);
+    route_target *target = NULL;
+
+    if (!MatchNode(root, segments, 0, in_method, &target, ret_params))
+        return NULL;
+
+    *ret_route_id = target->route_id;
+
+    if (ret_endpoint != NULL)
+        *ret_endpoint = target->endpoint;
+
+    return target->handler;
+}
+
+int Kis_Net_Httpd::StartHttpd() {
+    if (use_ssl) {
+        // If we can't load the SSL key files, crash and burn.  We can't safely
+        // degrade to non-ssl when the user is expecting encryption.
+        if (pem_path == "") {
+            _MSG("SSL requested but missing httpd_ssl_cert= configuration option.",
+                    MSGFLAG_FATAL);
+            globalreg->fatal_condition = 1;
+            return -1;
+        }
+
+        if (key_path == "") {
+            _MSG("SSL requested but missing httpd_ssl_key= configuration option.",
+                    MSGFLAG_FATAL);
+            globalreg->fatal_condition = 1;
+            return -1;
+        }
+
+        pem_path =
+            globalreg->kismet_config->ExpandLogPath(pem_path, "", "", 0, 1);
+        key_path =
+            globalreg->kismet_config->ExpandLogPath(key_path, "", "", 0, 1);
+
+        cert_pem = read_ssl_file(pem_path);
+        cert_key = read_ssl_file(key_path);
+
+        if (cert_pem == NULL || cert_key == NULL) {
+            _MSG("SSL requested but unable to load cert and key files, check your "
+                    "configuration!", MSGFLAG_FATAL);
+            globalreg->fatal_condition = 1;
+            return -1;
+        }
+    }
+
+
+    unsigned int flags = 0;
+    struct MHD_OptionItem options[6];
+    int nopt = 0;
+
+    if (event_mode) {
+#ifdef SYS_LINUX
+        flags |= MHD_USE_EPOLL_INTERNALLY;
+#else
+        flags |= MHD_USE_SELECT_INTERNALLY | MHD_USE_POLL;
+#endif
+        flags |= MHD_USE_SUSPEND_RESUME | MHD_USE_PIPE_FOR_SHUTDOWN;
+
+        options[nopt].option = MHD_OPTION_THREAD_POOL_SIZE;
+        options[nopt].value = io_threads;
+        options[nopt].ptr_value = NULL;
+        nopt++;
+    } else {
+        flags |= MHD_USE_THREAD_PER_CONNECTION;
+    }
+
+    options[nopt].option = MHD_OPTION_NOTIFY_COMPLETED;
+    options[nopt].value = (intptr_t) &http_request_completed;
+    options[nopt].ptr_value = NULL;
+    nopt++;
+
+    if (max_connections != 0) {
+        options[nopt].option = MHD_OPTION_CONNECTION_LIMIT;
+        options[nopt].value = max_connections;
+        options[nopt].ptr_value = NULL;
+        nopt++;
+    }
+
+    if (use_ssl) {
+        flags |= MHD_USE_SSL;
+
+        options[nopt].option = MHD_OPTION_HTTPS_MEM_KEY;
+        options[nopt].value = 0;
+        options[nopt].ptr_value = cert_key;
+        nopt++;
+
+        options[nopt].option = MHD_OPTION_HTTPS_MEM_CERT;
+        options[nopt].value = 0;
+        options[nopt].ptr_value = cert_pem;
+        nopt++;
+    }
+
+    options[nopt].option = MHD_OPTION_END;
+    options[nopt].value = 0;
+    options[nopt].ptr_value = NULL;
+
+    microhttpd = MHD_start_daemon(flags, http_port, NULL, NULL, 
+            &http_request_handler, this, 
+            MHD_OPTION_ARRAY, options,
+            MHD_OPTION_END); 
+
+
+    if (microhttpd == NULL) {
+        _MSG("Failed to start http server on port " + UIntToString(http_port),
+                MSGFLAG_FATAL);
+        globalreg->fatal_condition = 1;
+        return -1;
+    }
+
+    MHD_set_panic_func(Kis_Net_Httpd::MHD_Panic, this);
+
+    if (event_mode) {
+        StartWorkers();
+
+        _MSG("Started http server on port " + UIntToString(http_port) + 
+                " in event mode, " + UIntToString(io_threads) + " IO threads and " +
+                UIntToString(num_workers) + " workers", MSGFLAG_INFO);
+    } else {
+        _MSG("Started http server on port " + UIntToString(http_port), MSGFLAG_INFO);
+    }
+
+    return 1;
+}
+
+int Kis_Net_Httpd::StopHttpd() {
+    if (microhttpd != NULL) {
+        // We would want to stop but that seems to have some problems with
+        // thread joining; for now, quiesce it, and we'll kill it when the
+        // process exits, because we never shut down httpd and keep running
+        MHD_quiesce_daemon(microhttpd);
+
+        // MHD_stop_daemon(microhttpd);
+        return 1;
+    }
+
+    return 0;
+}
+
+void Kis_Net_Httpd::MHD_Panic(void *cls, const char *file, unsigned int line,
+        const char *reason) {
+    Kis_Net_Httpd *httpd = (Kis_Net_Httpd *) cls;
+
+    httpd->globalreg->fatal_condition = 1;
+    httpd->globalreg->messagebus->InjectMessage("Unable to continue after "
+            "MicroHTTPD fatal error: " + string(reason), MSGFLAG_FATAL);
+
+    // Null out the microhttpd since it can't keep operating and can't be
+    // trusted to close down properly
+    httpd->microhttpd = NULL;
+}
+
+void Kis_Net_Httpd::AddSession(Kis_Net_Httpd_Session *in_session) {
+    in_session->session_logged = in_session->session_seen;
+
+    if (!session_table.Insert(in_session)) {
+        delete(in_session);
+        return;
+    }
+
+    if (store_sessions) {
+        char line[128];
+        snprintf(line, 128, ",%lu,%lu,%lu", in_session->session_created,
+                in_session->session_seen, in_session->session_lifetime);
+
+        QueueSessionLog("session=" + in_session->sessionid + line);
+    }
+}
+
+void Kis_Net_Httpd::DelSession(string in_key) {
+    if (session_table.Remove(in_key) && store_sessions)
+        QueueSessionLog("expire=" + in_key);
+}
+
+Kis_Net_Httpd_Session *Kis_Net_Httpd::TouchSession(const char *in_key) {
+    Kis_Net_Httpd_Session *s = session_table.Find(in_key);
+
+    if (s == NULL)
+        return NULL;
+
+    time_t now = globalreg->timestamp.tv_sec;
+
+    // Sessions are shared by every request thread using the cookie, so the
+    // timestamps are only touched atomically
+    time_t seen = __sync_add_and_fetch(&(s->session_seen), 0);
+
+    // Delete if the session has expired
+    if (s->session_lifetime != 0 && seen + s->session_lifetime < now) {
+        DelSession(s->sessionid);
+        return NULL;
+    }
+
+    // Update the last seen; the log only needs to keep up closely enough
+    // that a restored session doesn't expire early
+    if (seen != now)
+        (void) __sync_lock_test_and_set(&(s->session_seen), now);
+
+    if (store_sessions && s->session_lifetime != 0) {
+        time_t logged = __sync_add_and_fetch(&(s->session_logged), 0);
+
+        // Only the thread which moves session_logged forward writes the log
+        // line
+        if (now - logged >= 60 &&
+                __sync_bool_compare_and_swap(&(s->session_logged), logged, now)) {
+            char line[128];
+            snprintf(line, 128, ",%lu,%lu,%lu", s->session_created,
+                    now, s->session_lifetime);
+
+            QueueSessionLog("session=" + s->sessionid + line);
+        }
+    }
+
+    return s;
+}
+
+void Kis_Net_Httpd::LoadSessions() {
+    FILE *f = fopen(sessiondb_file.c_str(), "r");
+
+    if (f == NULL)
+        return;
+
+    _MSG("Loading saved HTTP sessions", MSGFLAG_INFO);
+
+    char buf[1024];
+
+    // Replay the log in order; the last line for a session wins
+    while (fgets(buf, 1024, f) != NULL) {
+        string line = StrStrip(buf);
+
+        session_log_lines++;
+
+        if (line.compare(0, 7, "expire=") == 0) {
+            session_table.Remove(line.substr(7));
+            continue;
+        }
+
+        if (line.compare(0, 8, "session=") != 0)
+            continue;
+
+        vector<string> sestok = StrTokenize(line.substr(8), ",");
+
+        if (sestok.size() != 4)
+            continue;
+
+        Kis_Net_Httpd_Session *sess = new Kis_Net_Httpd_Session();
+
+        sess->sessionid = sestok[0];
+
+        if (sscanf(sestok[1].c_str(), "%lu", &(sess->session_created)) != 1 ||
+                sscanf(sestok[2].c_str(), "%lu", &(sess->session_seen)) != 1 ||
+                sscanf(sestok[3].c_str(), "%lu", &(sess->session_lifetime)) != 1) {
+            delete sess;
+            continue;
+        }
+
+        sess->session_logged = sess->session_seen;
+
+        session_table.Remove(sess->sessionid);
+        session_table.Insert(sess);
+    }
+
+    fclose(f);
+
+    // Nothing else is running yet, so the replaced records can go now
+    session_table.Reclaim();
+
+    if (session_log_lines > session_table.Size())
+        CompactSessionLog();
+}
+
+void Kis_Net_Httpd::QueueSessionLog(const string &in_line) {
+    local_locker lock(&session_log_mutex);
+
+    session_log_pending.push_back(in_line);
+}
+
+void Kis_Net_Httpd::FlushSessionLog() {
+    if (!store_sessions)
+        return;
+
+    std::vector<string> lines;
+
+    {
+        local_locker lock(&session_log_mutex);
+        lines.swap(session_log_pending);
+    }
+
+    if (lines.size() == 0)
+        return;
+
+    if (session_log == NULL)
+        session_log = fopen(sessiondb_file.c_str(), "a");
+
+    // Ignore failures here I guess?
+    if (session_log == NULL)
+        return;
+
+    for (unsigned int x = 0; x < lines.size(); x++) {
+        fputs(lines[x].c_str(), session_log);
+        fputc('\n', session_log);
+    }
+
+    fflush(session_log);
+
+    session_log_lines += lines.size();
+
+    if (session_log_lines > 1024 && session_log_lines > 4 * session_table.Size())
+        CompactSessionLog();
+}
+
+void Kis_Net_Httpd::CompactSessionLog() {
+    std::vector<Kis_Net_Httpd_Session> sessions;
+    session_table.Snapshot(&sessions);
+
+    string tmpfile = sessiondb_file + ".tmp";
+
+    FILE *f = fopen(tmpfile.c_str(), "w");
+
+    if (f == NULL)
+        return;
+
+    for (unsigned int x = 0; x < sessions.size(); x++) {
+        fprintf(f, "session=%s,%lu,%lu,%lu\n", sessions[x].sessionid.c_str(),
+                sessions[x].session_created, sessions[x].session_seen,
+                sessions[x].session_lifetime);
+    }
+
+    if (fclose(f) != 0 || rename(tmpfile.c_str(), sessiondb_file.c_str()) != 0) {
+        unlink(tmpfile.c_str());
+        return;
+    }
+
+    // Anything logged after the snapshot goes on the end of the new file
+    if (session_log != NULL) {
+        fclose(session_log);
+        session_log = NULL;
+    }
+
+    session_log_lines = sessions.size();
+}
+
+void *Kis_Net_Httpd::session_flush_thread(void *in_aux) {
+    Kis_Net_Httpd *httpd = (Kis_Net_Httpd *) in_aux;
+
+    // Leave signal handling to the main thread
+    sigset_t mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    bool shutdown = false;
+
+    while (!shutdown) {
+        pthread_mutex_lock(&(httpd->session_log_mutex));
+
+        if (!httpd->session_flush_shutdown) {
+            struct timeval now;
+            struct timespec wake;
+
+            gettimeofday(&now, NULL);
+
+            uint64_t usec = now.tv_usec + 
+                (uint64_t) httpd->session_flush_interval * 1000;
+            wake.tv_sec = now.tv_sec + usec / 1000000;
+            wake.tv_nsec = (usec % 1000000) * 1000;
+
+            pthread_cond_timedwait(&(httpd->session_log_cond), 
+                    &(httpd->session_log_mutex), &wake);
+        }
+
+        shutdown = httpd->session_flush_shutdown;
+
+        pthread_mutex_unlock(&(httpd->session_log_mutex));
+
+        httpd->FlushSessionLog();
+
+        // Free sessions removed since the last pass
+        httpd->session_table.Reclaim();
+    }
+
+    return NULL;
+}
+
+// Refuse a request when an endpoint or the work queue is full
+static int send_unavailable(struct MHD_Connection *connection) {
+    string busy = "503 server busy";
+
+    struct MHD_Response *response = 
+        MHD_create_response_from_buffer(busy.length(), 
+                (void *) busy.c_str(), MHD_RESPMEM_MUST_COPY);
+
+    MHD_add_response_header(response, MHD_HTTP_HEADER_RETRY_AFTER, "1");
+
+    int ret = MHD_queue_response(connection, MHD_HTTP_SERVICE_UNAVAILABLE, response);
+
+    MHD_destroy_response(response);
+
+    return ret;
+}
+
+int Kis_Net_Httpd::http_request_handler(void *cls, struct MHD_Connection *connection,
+    const char *url, const char *method, const char *version __attribute__ ((unused)),
+    const char *upload_data, size_t *upload_data_size, void **ptr) {
+
+    //fprintf(stderr, "debug - HTTP request: '%s' method '%s'\n", url, method); 
+    //
+    Kis_Net_Httpd *kishttpd = (Kis_Net_Httpd *) cls;
+
+    uint64_t time_start = 0;
+    if (*ptr == NULL)
+        time_start = TimeUsec();
+    
+    // Update the session records if one exists
+    Kis_Net_Httpd_Session *s = NULL;
+    const char *cookieval;
+    int ret = MHD_NO;
+
+    cookieval = MHD_lookup_connection_value(connection, 
+            MHD_COOKIE_KIND, KIS_SESSION_COOKIE);
+
+    if (cookieval != NULL) {
+        unsigned int epoch = kishttpd->session_table.ReadLock();
+        s = kishttpd->TouchSession(cookieval);
+        kishttpd->session_table.ReadUnlock(epoch);
+    } 
+    
+    Kis_Net_Httpd_Handler *handler = NULL;
+    Kis_Net_Httpd_Connection *concls = (Kis_Net_Httpd_Connection *) *ptr;
+
+    bool routed = false;
+    int route_id = 0;
+    Kis_Net_Httpd_Route_Params route_params;
+    Kis_Net_Httpd_Endpoint *endpoint = NULL;
+
+    if (concls != NULL && concls->asset != NULL) {
+        // Static file, the response is already queued
+        return MHD_YES;
+    } else if (concls != NULL) {
+        // We already routed this request when we set up the connection
+        handler = concls->httpdhandler;
+    } else {
+        local_locker lock(&(kishttpd->controller_mutex));
+
+        handler = kishttpd->route_table.Match(url, method, &route_id, 
+                &route_params, &endpoint);
+
+        if (handler != NULL) {
+            routed = true;
+        } else {
+            /* Find a legacy handler that can handle this path & method */
+            for (unsigned int i = 0; i < kishttpd->unrouted_handler_vec.size(); i++) {
+                Kis_Net_Httpd_Handler *h = kishttpd->unrouted_handler_vec[i];
+
+                if (h->Httpd_VerifyPath(url, method)) {
+                    handler = h;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (handler == NULL) {
+        // Try to check a static url
+        if (handle_static_file(cls, connection, url, method, ptr) < 0) {
+            // fprintf(stderr, "   404 no handler for request\n");
+
+            string fourohfour = "404";
+
+            struct MHD_Response *response = 
+                MHD_create_response_from_buffer(fourohfour.length(), 
+                        (void *) fourohfour.c_str(), MHD_RESPMEM_MUST_COPY);
+
+            return MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, response);
+        }
+
+        return MHD_YES;
+    }
+
+    // If we don't have a connection state, make one
+    if (*ptr == NULL) {
+        concls = new Kis_Net_Httpd_Connection();
+
+        concls->httpd = kishttpd;
+        concls->httpdhandler = handler;
+        concls->routed = routed;
+        concls->route_id = route_id;
+        concls->route_params = route_params;
+        concls->endpoint = endpoint;
+        concls->cache_generation = 0;
+        concls->deferred_state = Kis_Net_Httpd_Connection::DEFER_NONE;
+        concls->connection = connection;
+        concls->method = string(method);
+        concls->postprocessor = NULL;
+        // printf("%s %s session = %p\n", method, url, s);
+        concls->session = s;
+        concls->httpcode = MHD_HTTP_OK;
+        concls->url = string(url);
+
+        concls->time_start = time_start;
+        concls->time_routed = TimeUsec();
+        concls->time_ready = 0;
+        concls->time_generate_start = 0;
+        concls->time_generate_end = 0;
+        concls->time_send_start = 0;
+        concls->response_size = -1;
+        concls->asset = NULL;
+
+        /* If we're doing a post, set up a post handler */
+        if (strcmp(method, "POST") == 0) {
+            concls->connection_type = Kis_Net_Httpd_Connection::CONNECTION_POST;
+
+            concls->postprocessor =
+                MHD_create_post_processor(connection, KIS_HTTPD_POSTBUFFERSZ,
+                        kishttpd->http_post_handler, (void *) concls);
+
+            if (concls->postprocessor == NULL) {
+                delete(concls);
+                return MHD_NO;
+            }
+
+        } else {
+            concls->connection_type = Kis_Net_Httpd_Connection::CONNECTION_GET;
+        }
+
+        if (endpoint != NULL)
+            __sync_fetch_and_add(&(endpoint->in_flight), 1);
+
+        *ptr = (void *) concls;
+
+        return MHD_YES;
+    }
+
+    // The request is ready to handle once any post data has arrived
+    if (concls->time_ready == 0 && 
+            (strcmp(method, "POST") != 0 || *upload_data_size == 0))
+        concls->time_ready = TimeUsec();
+
+    // Handle post
+    if (strcmp(method, "POST") == 0) {
+        if (*upload_data_size != 0) {
+            MHD_post_process(concls->postprocessor, upload_data, *upload_data_size);
+            *upload_data_size = 0;
+            return MHD_YES;
+        } else if (concls->response_stream.str().length() != 0) {
+            // Send the content
+            ret = kishttpd->SendStreamResponse(concls);
+    
+            return ret;
+        }
+    } else if (concls->deferred_state == Kis_Net_Httpd_Connection::DEFER_NONE &&
+            kishttpd->CacheLookup(concls, connection, url, &ret)) {
+        // Served from the response cache
+        return ret;
+    } else if (kishttpd->event_mode &&
+            dynamic_cast<Kis_Net_Httpd_Stream_Handler *>(handler) != NULL) {
+        // Stream responses are generated by the worker pool; we get called 
+        // again once the worker resumes the connection
+        if (concls->deferred_state == Kis_Net_Httpd_Connection::DEFER_DONE) {
+            ret = kishttpd->SendStreamResponse(concls);
+        } else if (concls->deferred_state == Kis_Net_Httpd_Connection::DEFER_NONE) {
+            if (!kishttpd->QueueDeferred(concls))
+                return send_unavailable(connection);
+
+            ret = MHD_YES;
+        } else {
+            ret = MHD_YES;
+        }
+    } else {
+        if (!kishttpd->AcquireEndpoint(concls->endpoint))
+            return send_unavailable(connection);
+
+        if (dynamic_cast<Kis_Net_Httpd_Stream_Handler *>(handler) != NULL) {
+            // Stream responses are built here rather than in the handler so
+            // cache misses can be stored and the steps timed
+            kishttpd->GenerateStreamResponse(concls);
+
+            ret = kishttpd->SendStreamResponse(concls);
+        } else {
+            // Other handlers queue their own response, so the handler counts
+            // as generating it and sending is whatever comes after
+            concls->time_generate_start = TimeUsec();
+
+            if (concls->routed) {
+                ret = 
+                    handler->Httpd_HandleRoutedRequest(kishttpd, connection, 
+                            concls->route_id, concls->route_params, url, method, 
+                            upload_data, upload_data_size);
+            } else {
+                ret = 
+                    handler->Httpd_HandleRequest(kishttpd, connection, url, method, 
+                            upload_data, upload_data_size);
+            }
+
+            concls->time_generate_end = TimeUsec();
+            concls->time_send_start = concls->time_generate_end;
+        }
+
+        kishttpd->ReleaseEndpoint(concls->endpoint);
+    }
+
+    return ret;
+}
+
+bool Kis_Net_Httpd::AcquireEndpoint(Kis_Net_Httpd_Endpoint *in_endpoint) {
+    if (in_endpoint == NULL)
+        return true;
+
+    local_locker lock(&work_mutex);
+
+    if (in_endpoint->max_concurrent != 0 &&
+            in_endpoint->active >= in_endpoint->max_concurrent) {
+        in_endpoint->rejected++;
+        return false;
+    }
+
+    in_endpoint->active++;
+
+    return true;
+}
+
+void Kis_Net_Httpd::ReleaseEndpoint(Kis_Net_Httpd_Endpoint *in_endpoint) {
+    if (in_endpoint == NULL)
+        return;
+
+    local_locker lock(&work_mutex);
+
+    in_endpoint->active--;
+    in_endpoint->served++;
+}
+
+bool Kis_Net_Httpd::QueueDeferred(Kis_Net_Httpd_Connection *in_concls) {
+    local_locker lock(&work_mutex);
+
+    Kis_Net_Httpd_Endpoint *endpoint = in_concls->endpoint;
+
+    if (max_pending_requests != 0 && pending_requests >= max_pending_requests) {
+        if (endpoint != NULL)
+            endpoint->rejected++;
+        return false;
+    }
+
+    in_concls->deferred_state = Kis_Net_Httpd_Connection::DEFER_QUEUED;
+
+    // Suspend before a worker can possibly resume it
+    MHD_suspend_connection(in_concls->connection);
+
+    pending_requests++;
+    deferred_requests++;
+
+    if (pending_requests > peak_pending_requests)
+        peak_pending_requests = pending_requests;
+
+    if (endpoint != NULL && endpoint->max_concurrent != 0 &&
+            endpoint->active >= endpoint->max_concurrent) {
+        // Wait for a request on this endpoint to finish
+        endpoint->waiting.push_back(in_concls);
+
+        if (endpoint->waiting.size() > endpoint->peak_queued)
+            endpoint->peak_queued = endpoint->waiting.size();
+
+        return true;
+    }
+
+    if (endpoint != NULL)
+        endpoint->active++;
+
+    work_queue.push_back(in_concls);
+    pthread_cond_signal(&work_cond);
+
+    return true;
+}
+
+void Kis_Net_Httpd::GenerateStreamResponse(Kis_Net_Httpd_Connection *in_concls) {
+    Kis_Net_Httpd_Stream_Handler *handler =
+        (Kis_Net_Httpd_Stream_Handler *) in_concls->httpdhandler;
+    size_t upload_data_size = 0;
+
+    in_concls->time_generate_start = TimeUsec();
+
+    try {
+        if (in_concls->routed) {
+            in_concls->httpcode = 
+                handler->Httpd_CreateRoutedResponse(this, in_concls->connection,
+                        in_concls->route_id, in_concls->route_params, 
+                        in_concls->url.c_str(), in_concls->method.c_str(), NULL,
+                        &upload_data_size, in_concls->response_stream);
+        } else {
+            handler->Httpd_CreateStreamResponse(this, in_concls->connection,
+                    in_concls->url.c_str(), in_concls->method.c_str(), NULL, 
+                    &upload_data_size, in_concls->response_stream);
+            in_concls->httpcode = MHD_HTTP_OK;
+        }
+    } catch (std::exception &e) {
+        in_concls->response_stream.str("");
+        in_concls->response_stream << "500 " << e.what();
+        in_concls->httpcode = MHD_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (in_concls->httpcode == MHD_HTTP_NOT_FOUND && 
+            in_concls->response_stream.str().length() == 0)
+        in_concls->response_stream << "404";
+
+    if (in_concls->cache_key.length() != 0 && 
+            in_concls->httpcode == MHD_HTTP_OK)
+        CacheStore(in_concls);
+
+    in_concls->time_generate_end = TimeUsec();
+}
+
+int Kis_Net_Httpd::SendStreamResponse(Kis_Net_Httpd_Connection *in_concls) {
+    string body = in_concls->response_stream.str();
+
+    in_concls->time_send_start = TimeUsec();
+    in_concls->response_size = body.length();
+
+    return SendHttpResponse(this, in_concls->connection, in_concls->url.c_str(),
+            in_concls->httpcode, body);
+}
+
+void Kis_Net_Httpd::RecordRequest(Kis_Net_Httpd_Connection *in_concls,
+        bool in_completed) {
+    Kis_Net_Httpd_Endpoint *endpoint = in_concls->endpoint;
+
+    if (endpoint == NULL)
+        return;
+
+    uint64_t now = TimeUsec();
+
+    __sync_fetch_and_add(&(endpoint->requests), 1);
+    __sync_fetch_and_sub(&(endpoint->in_flight), 1);
+
+    endpoint->route_time.Record(in_concls->time_routed - in_concls->time_start);
+
+    if (in_concls->time_ready != 0 && in_concls->time_generate_start != 0)
+        endpoint->wait_time.Record(in_concls->time_generate_start - 
+                in_concls->time_ready);
+
+    if (in_concls->time_generate_end != 0)
+        endpoint->generate_time.Record(in_concls->time_generate_end - 
+                in_concls->time_generate_start);
+
+    if (!in_completed) {
+        __sync_fetch_and_add(&(endpoint->aborted), 1);
+        return;
+    }
+
+    if (in_concls->time_send_start != 0)
+        endpoint->send_time.Record(now - in_concls->time_send_start);
+
+    endpoint->total_time.Record(now - in_concls->time_start);
+
+    if (in_concls->response_size >= 0) {
+        int status = in_concls->httpcode / 100;
+
+        if (status >= 2 && status <= 5)
+            __sync_fetch_and_add(&(endpoint->responses[status - 2]), 1);
+
+        __sync_fetch_and_add(&(endpoint->response_bytes), 
+                (uint64_t) in_concls->response_size);
+        endpoint->response_size.Record(in_concls->response_size);
+    }
+}
+
+// Collect GET arguments for the cache key; the map keeps them in a 
+// canonical order
+static int httpd_cache_key_args(void *cls, enum MHD_ValueKind kind __attribute__((unused)),
+        const char *key, const char *value) {
+    std::map<string, string> *args = (std::map<string, string> *) cls;
+
+    (*args)[key] = value == NULL ? "" : value;
+
+    return MHD_YES;
+}
+
+bool Kis_Net_Httpd::CacheLookup(Kis_Net_Httpd_Connection *in_concls,
+        struct MHD_Connection *in_connection, const char *in_url, int *ret) {
+    Kis_Net_Httpd_Endpoint *endpoint = in_concls->endpoint;
+
+    if (!cache_enabled || endpoint == NULL || !endpoint->cached)
+        return false;
+
+    if (dynamic_cast<Kis_Net_Httpd_Stream_Handler *>(in_concls->httpdhandler) == NULL)
+        return false;
+
+    std::map<string, string> args;
+    MHD_get_connection_values(in_connection, MHD_GET_ARGUMENT_KIND,
+            httpd_cache_key_args, &args);
+
+    // Arguments are length-prefixed, so no name or value can be spelled 
+    // to look like a different set of arguments
+    string key = in_url;
+    key += "?";
+
+    for (std::map<string, string>::iterator ai = args.begin(); ai != args.end(); ++ai) {
+        key += IntToString(ai->first.length()) + ":" + ai->first;
+        key += IntToString(ai->second.length()) + ":" + ai->second;
+    }
+
+    uint64_t generation = 0;
+    if (endpoint->generation != NULL)
+        generation = endpoint->generation->Get();
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    Kis_Net_Httpd_Cache_Entry *entry = NULL;
+    bool gzip_ready = false;
+
+    {
+        local_locker lock(&cache_mutex);
+
+        std::map<string, Kis_Net_Httpd_Cache_Entry *>::iterator ci = 
+            response_cache.find(key);
+
+        if (ci != response_cache.end()) {
+            long age_ms = (now.tv_sec - ci->second->created.tv_sec) * 1000 +
+                (now.tv_usec - ci->second->created.tv_usec) / 1000;
+
+            bool current = endpoint->generation != NULL && 
+                ci->second->generation == generation;
+
+            if (current || (age_ms >= 0 && age_ms <= (long) cache_max_staleness)) {
+                if (current)
+                    cache_hits++;
+                else
+                    cache_stale_hits++;
+
+                endpoint->cache_hits++;
+
+                entry = ci->second;
+                entry->Ref();
+                gzip_ready = entry->gzip_ready;
+
+                cache_lru.splice(cache_lru.begin(), cache_lru, entry->lru_pos);
+            }
+        }
+
+        if (entry == NULL) {
+            cache_misses++;
+            endpoint->cache_misses++;
+        }
+    }
+
+    if (entry != NULL) {
+        // Compress and send without the cache lock; our reference keeps the 
+        // entry around if it's replaced meanwhile
+        int encoding = NegotiateEncoding(in_connection, entry->body.length());
+        string gzip_body;
+
+        if (encoding == encoding_gzip && !gzip_ready) {
+            if (CompressBody(entry->body, encoding_gzip, gzip_body)) {
+                // Keep the gzip form with the entry so repeated hits don't 
+                // compress again
+                local_locker lock(&cache_mutex);
+
+                if (!entry->gzip_ready) {
+                    entry->gzip_body = gzip_body;
+                    entry->gzip_ready = true;
+                }
+            } else {
+                encoding = encoding_identity;
+            }
+        }
+
+        in_concls->time_send_start = TimeUsec();
+        in_concls->response_size = entry->body.length();
+        in_concls->httpcode = entry->httpcode;
+
+        if (encoding == encoding_gzip) {
+            *ret = SendEncodedResponse(in_connection, in_url, entry->httpcode,
+                    gzip_ready ? entry->gzip_body : gzip_body, encoding_gzip);
+        } else {
+            *ret = SendHttpResponse(this, in_connection, in_url, 
+                    entry->httpcode, entry->body);
+        }
+
+        entry->Unref();
+
+        return true;
+    }
+
+    in_concls->cache_key = key;
+    in_concls->cache_generation = generation;
+
+    return false;
+}
+
+void Kis_Net_Httpd::CacheStore(Kis_Net_Httpd_Connection *in_concls) {
+    Kis_Net_Httpd_Cache_Entry *entry = new Kis_Net_Httpd_Cache_Entry();
+
+    entry->body = in_concls->response_stream.str();
+    entry->httpcode = in_concls->httpcode;
+    entry->generation = in_concls->cache_generation;
+    gettimeofday(&(entry->created), NULL);
+
+    local_locker lock(&cache_mutex);
+
+    std::map<string, Kis_Net_Httpd_Cache_Entry *>::iterator ci = 
+        response_cache.find(in_concls->cache_key);
+
+    if (ci != response_cache.end()) {
+        // Don't replace a response built from newer data
+        if (ci->second->generation > in_concls->cache_generation) {
+            entry->Unref();
+            return;
+        }
+
+        // Requests still sending the old entry hold their own reference
+        entry->lru_pos = ci->second->lru_pos;
+        ci->second->Unref();
+        ci->second = entry;
+
+        cache_lru.splice(cache_lru.begin(), cache_lru, entry->lru_pos);
+
+        return;
+    }
+
+    // Make room by dropping the least recently used entry
+    if (cache_max_entries != 0 && response_cache.size() >= cache_max_entries &&
+            cache_lru.size() != 0) {
+        ci = response_cache.find(cache_lru.back());
+
+        if (ci != response_cache.end()) {
+            ci->second->Unref();
+            response_cache.erase(ci);
+        }
+
+        cache_lru.pop_back();
+        cache_evictions++;
+    }
+
+    cache_lru.push_front(in_concls->cache_key);
+    entry->lru_pos = cache_lru.begin();
+    response_cache[in_concls->cache_key] = entry;
+}
+
+void Kis_Net_Httpd::StartWorkers() {
+    local_locker lock(&work_mutex);
+
+    if (worker_tids.size() != 0)
+        return;
+
+    workers_shutdown = false;
+
+    for (unsigned int x = 0; x < num_workers; x++) {
+        pthread_t tid;
+
+        if (pthread_create(&tid, NULL, worker_thread, this) != 0) {
+            _MSG("Failed to start http worker thread: " + 
+                    string(strerror(errno)), MSGFLAG_ERROR);
+            break;
+        }
+
+        worker_tids.push_back(tid);
+    }
+}
+
+void Kis_Net_Httpd::StopWorkers() {
+    {
+        local_locker lock(&work_mutex);
+        workers_shutdown = true;
+        pthread_cond_broadcast(&work_cond);
+    }
+
+    for (unsigned int x = 0; x < worker_tids.size(); x++)
+        pthread_join(worker_tids[x], NULL);
+
+    worker_tids.clear();
+}
+
+void *Kis_Net_Httpd::worker_thread(void *in_aux) {
+    Kis_Net_Httpd *httpd = (Kis_Net_Httpd *) in_aux;
+
+    // Leave signal handling to the main thread
+    sigset_t mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while (1) {
+        Kis_Net_Httpd_Connection *concls;
+
+        pthread_mutex_lock(&(httpd->work_mutex));
+
+        while (httpd->work_queue.empty() && !httpd->workers_shutdown)
+            pthread_cond_wait(&(httpd->work_cond), &(httpd->work_mutex));
+
+        if (httpd->workers_shutdown) {
+            pthread_mutex_unlock(&(httpd->work_mutex));
+            break;
+        }
+
+        concls = httpd->work_queue.front();
+        httpd->work_queue.pop_front();
+        httpd->pending_requests--;
+        httpd->workers_busy++;
+
+        pthread_mutex_unlock(&(httpd->work_mutex));
+
+        httpd->GenerateStreamResponse(concls);
+
+        pthread_mutex_lock(&(httpd->work_mutex));
+
+        httpd->workers_busy--;
+
+        Kis_Net_Httpd_Endpoint *endpoint = concls->endpoint;
+
+        if (endpoint != NULL) {
+            endpoint->active--;
+            endpoint->served++;
+
+            // Hand the freed slot to the next waiting request
+            if (endpoint->waiting.size() > 0 &&
+                    (endpoint->max_concurrent == 0 || 
+                     endpoint->active < endpoint->max_concurrent)) {
+                endpoint->active++;
+                httpd->work_queue.push_back(endpoint->waiting.front());
+                endpoint->waiting.pop_front();
+                pthread_cond_signal(&(httpd->work_cond));
+            }
+        }
+
+        concls->deferred_state = Kis_Net_Httpd_Connection::DEFER_DONE;
+
+        pthread_mutex_unlock(&(httpd->work_mutex));
+
+        MHD_resume_connection(concls->connection);
+    }
+
+    return NULL;
+}
+
+int Kis_Net_Httpd::http_post_handler(void *coninfo_cls, enum MHD_ValueKind kind, 
+        const char *key, const char *filename, const char *content_type,
+        const char *transfer_encoding, const char *data, 
+        uint64_t off, size_t size) {
+
+    Kis_Net_Httpd_Connection *concls = (Kis_Net_Httpd_Connection *) coninfo_cls;
+
+    return (concls->httpdhandler)->Httpd_PostIterator(coninfo_cls, kind,
+            key, filename, content_type, transfer_encoding, data, off, size);
 }
 
 void Kis_Net_Httpd::http_request_completed(void *cls __attribute__((unused)), 
         struct MHD_Connection *connection __attribute__((unused)),
         void **con_cls, 
-        enum MHD_RequestTerminationCode toe __attribute__((unused))) {
+        enum MHD_RequestTerminationCode toe) {
     Kis_Net_Httpd_Connection *con_info = (Kis_Net_Httpd_Connection *) *con_cls;
 
-    if (con_info == NULL)
-        return;
+    if (con_info == NULL)
+        return;
+
+    RecordRequest(con_info, toe == MHD_REQUEST_TERMINATED_COMPLETED_OK);
+
+    if (con_info->connection_type == Kis_Net_Httpd_Connection::CONNECTION_POST &&
+            con_info->postprocessor != NULL) {
+        MHD_destroy_post_processor(con_info->postprocessor);
+    }
+
+    // The response is done with the asset body
+    if (con_info->asset != NULL)
+        con_info->httpd->ReleaseStaticAsset(con_info->asset);
+
+    delete(con_info);
+    *con_cls = NULL;
+}
+
+string Kis_Net_Httpd::GetMimeType(string ext) {
+    std::map<string, string>::iterator mi = mime_type_map.find(ext);
+    if (mi != mime_type_map.end()) {
+        return mi->second;
+    }
+
+    return "";
+}
+
+// Text assets worth compressing
+static bool httpd_compressible_ext(const string &in_ext) {
+    return in_ext == "html" || in_ext == "htm" || in_ext == "css" || 
+        in_ext == "js" || in_ext == "json" || in_ext == "svg" || 
+        in_ext == "txt" || in_ext == "xml";
+}
+
+// Does an If-None-Match header match our entity tag
+static bool httpd_etag_matches(struct MHD_Connection *connection, const string &in_etag) {
+    const char *inm = 
+        MHD_lookup_connection_value(connection, MHD_HEADER_KIND, 
+                MHD_HTTP_HEADER_IF_NONE_MATCH);
+
+    if (inm == NULL)
+        return false;
+
+    vector<string> tags = StrTokenize(inm, ",");
+
+    for (unsigned int x = 0; x < tags.size(); x++) {
+        string t = StrStrip(tags[x]);
+
+        // Weak comparison is fine for a conditional GET
+        if (t.substr(0, 2) == "W/")
+            t = t.substr(2);
+
+        if (t == "*" || t == in_etag)
+            return true;
+    }
+
+    return false;
+}
+
+// Lowercase extension of a path
+static string httpd_path_ext(const string &in_path) {
+    size_t dpos = in_path.find_last_of("./");
+
+    if (dpos != string::npos && in_path[dpos] == '.')
+        return StrLower(in_path.substr(dpos + 1));
+
+    return "";
+}
+
+static string httpd_file_etag(const struct stat &in_stat, bool in_gzip) {
+    char etag[64];
+
+    snprintf(etag, 64, "\"%lx-%lx-%lx%s\"", (unsigned long) in_stat.st_ino,
+            (unsigned long) in_stat.st_size, (unsigned long) in_stat.st_mtime,
+            in_gzip ? "-gz" : "");
+
+    return etag;
+}
+
+static string httpd_file_lastmod(const struct stat &in_stat) {
+    char lastmod[31];
+    struct tm tmstruct;
+
+    localtime_r(&(in_stat.st_ctime), &tmstruct);
+    strftime(lastmod, 31, "%a, %d %b %Y %H:%M:%S %Z", &tmstruct);
+
+    return lastmod;
+}
+
+// Resolve a url under a directory, refusing anything which ends up outside it
+static bool httpd_resolve_static(const string &in_dir, const string &in_url,
+        string &out_path) {
+    string fullfile = in_dir + "/" + in_url;
+
+    char *realpath_path = realpath(fullfile.c_str(), NULL);
+
+    if (realpath_path == NULL)
+        return false;
+
+    // Make sure we're hosted inside the data dir
+    if (strstr(realpath_path, in_dir.c_str()) != realpath_path) {
+        free(realpath_path);
+        return false;
+    }
+
+    out_path = realpath_path;
+    free(realpath_path);
+
+    return true;
+}
+
+// Read a whole file we expect to be in_size long
+static bool httpd_read_file(int fd, off_t in_size, string &out_body) {
+    out_body.resize(in_size);
+
+    size_t pos = 0;
+
+    while (pos < out_body.length()) {
+        ssize_t r = read(fd, &(out_body[pos]), out_body.length() - pos);
+
+        if (r < 0 && errno == EINTR)
+            continue;
+
+        if (r <= 0)
+            break;
+
+        pos += r;
+    }
+
+    if (pos != out_body.length()) {
+        out_body = "";
+        return false;
+    }
+
+    return true;
+}
+
+static int httpd_not_modified(struct MHD_Connection *connection, 
+        const string &in_etag, bool in_vary) {
+    struct MHD_Response *response = 
+        MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
+
+    if (response == NULL)
+        return -1;
+
+    MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, in_etag.c_str());
+    MHD_add_response_header(response, "Cache-Control", "no-cache");
+
+    if (in_vary)
+        MHD_add_response_header(response, MHD_HTTP_HEADER_VARY, "Accept-Encoding");
+
+    MHD_queue_response(connection, MHD_HTTP_NOT_MODIFIED, response);
+    MHD_destroy_response(response);
+
+    return 1;
+}
+
+static void httpd_static_headers(struct MHD_Response *response, 
+        const string &in_mime, const string &in_lastmod, const string &in_etag,
+        bool in_gzip, bool in_vary) {
+    MHD_add_response_header(response, "Last-Modified", in_lastmod.c_str());
+
+    if (in_mime != "") {
+        MHD_add_response_header(response, "Content-Type", in_mime.c_str());
+    }
+
+    MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, in_etag.c_str());
+
+    if (in_gzip)
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_ENCODING, "gzip");
+
+    if (in_vary)
+        MHD_add_response_header(response, MHD_HTTP_HEADER_VARY, "Accept-Encoding");
+
+    // The browser may keep a copy, but has to revalidate it with the ETag
+    // before using it
+    MHD_add_response_header(response, "Cache-Control", "no-cache");
+    MHD_add_response_header(response, "Pragma", "no-cache");
+    MHD_add_response_header(response, 
+            "Expires", "Sat, 01 Jan 2000 00:00:00 GMT");
+}
+
+void Kis_Net_Httpd::PreloadStaticAssets(const string &in_dir, const string &in_url) {
+    DIR *dir = opendir(in_dir.c_str());
+
+    if (dir == NULL)
+        return;
+
+    struct dirent *de;
+
+    while ((de = readdir(dir)) != NULL) {
+        // Skip dotfiles along with . and ..
+        if (de->d_name[0] == '.')
+            continue;
+
+        string name = de->d_name;
+        string path = in_dir + "/" + name;
+        string url = in_url + "/" + name;
+        struct stat buf;
+
+        // Symlinked directories are left to load on request, so a link 
+        // loop can't run away with us
+        if (lstat(path.c_str(), &buf) != 0)
+            continue;
+
+        if (S_ISDIR(buf.st_mode)) {
+            PreloadStaticAssets(path, url);
+            continue;
+        }
+
+        // Precompressed siblings are loaded with the original
+        if (name.length() > 3 && name.substr(name.length() - 3) == ".gz")
+            continue;
+
+        local_locker lock(&asset_mutex);
+
+        if (asset_map.find(url) == asset_map.end())
+            LoadStaticAsset(url);
+    }
+
+    closedir(dir);
+}
+
+Kis_Net_Httpd::static_asset *Kis_Net_Httpd::FetchStaticAsset(const string &in_url) {
+    // Odd spellings of a path aren't cached, they're resolved every time
+    if (in_url.find("/.") != string::npos || in_url.find("//") != string::npos)
+        return NULL;
+
+    local_locker lock(&asset_mutex);
+
+    CheckStaticChanges();
+
+    std::map<string, static_asset *>::iterator ai = asset_map.find(in_url);
+
+    if (ai != asset_map.end()) {
+        static_asset *asset = ai->second;
+
+        if (asset_notify_fd < 0 && !asset->stale) {
+            struct stat buf;
+
+            if (stat(asset->path.c_str(), &buf) != 0 || buf.st_ino != asset->ino ||
+                    buf.st_size != asset->size || buf.st_mtime != asset->mtime)
+                asset->stale = true;
+        }
+
+        if (!asset->stale) {
+            asset->refs++;
+            return asset;
+        }
+
+        RetireStaticAsset(ai);
+    }
+
+    // Don't try to load a file again which didn't fit last time, unless it
+    // changed
+    std::map<string, static_uncached>::iterator ui = asset_uncached.find(in_url);
+
+    if (ui != asset_uncached.end()) {
+        struct stat buf;
+
+        if (stat(ui->second.path.c_str(), &buf) == 0 && 
+                buf.st_ino == ui->second.ino && buf.st_size == ui->second.size &&
+                buf.st_mtime == ui->second.mtime)
+            return NULL;
+
+        asset_uncached.erase(ui);
+    }
+
+    static_asset *asset = LoadStaticAsset(in_url);
+
+    if (asset != NULL)
+        asset->refs++;
+
+    return asset;
+}
+
+void Kis_Net_Httpd::ReleaseStaticAsset(static_asset *in_asset) {
+    local_locker lock(&asset_mutex);
+
+    UnrefStaticAsset(in_asset);
+}
+
+Kis_Net_Httpd::static_asset *Kis_Net_Httpd::LoadStaticAsset(const string &in_url) {
+    string path;
+
+    if (!httpd_resolve_static(http_data_dir, in_url, path))
+        return NULL;
+
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+
+    struct stat buf;
+
+    if (fstat(fd, &buf) != 0 || !S_ISREG(buf.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    static_uncached uncached;
+    uncached.path = path;
+    uncached.ino = buf.st_ino;
+    uncached.size = buf.st_size;
+    uncached.mtime = buf.st_mtime;
+
+    if (asset_bytes + buf.st_size > asset_max_bytes) {
+        close(fd);
+        asset_uncached[in_url] = uncached;
+        return NULL;
+    }
+
+    static_asset *asset = new static_asset();
+
+    bool read_ok = httpd_read_file(fd, buf.st_size, asset->body);
+    close(fd);
+
+    if (!read_ok) {
+        delete(asset);
+        return NULL;
+    }
+
+    string ext = httpd_path_ext(path);
+
+    asset->path = path;
+    asset->ino = buf.st_ino;
+    asset->size = buf.st_size;
+    asset->mtime = buf.st_mtime;
+    asset->mime = GetMimeType(ext);
+    asset->lastmod = httpd_file_lastmod(buf);
+    asset->etag = httpd_file_etag(buf, false);
+    asset->gz_etag = httpd_file_etag(buf, true);
+    asset->compressible = httpd_compressible_ext(ext);
+    asset->stale = false;
+    asset->refs = 1;
+
+    if (asset->compressible && compress_enabled && 
+            (unsigned long) buf.st_size >= compress_min_size) {
+        // Prefer a precompressed sibling installed alongside the file, as 
+        // long as it isn't older than the original
+        int gzfd = open((path + ".gz").c_str(), O_RDONLY);
+
+        if (gzfd >= 0) {
+            struct stat gzbuf;
+
+            if (fstat(gzfd, &gzbuf) == 0 && S_ISREG(gzbuf.st_mode) &&
+                    gzbuf.st_mtime >= buf.st_mtime)
+                httpd_read_file(gzfd, gzbuf.st_size, asset->gz_body);
+
+            close(gzfd);
+        }
+
+        if (asset->gz_body.length() == 0 && 
+                !CompressBody(asset->body, encoding_gzip, asset->gz_body))
+            asset->gz_body = "";
+
+        if (asset->gz_body.length() >= asset->body.length())
+            asset->gz_body = "";
+    }
+
+    size_t sz = asset->body.length() + asset->gz_body.length();
+
+    if (asset_bytes + sz > asset_max_bytes) {
+        delete(asset);
+        asset_uncached[in_url] = uncached;
+        return NULL;
+    }
+
+    asset_bytes += sz;
+    asset_map[in_url] = asset;
+
+    WatchStaticDir(path.substr(0, path.rfind('/')));
+
+    return asset;
+}
+
+void Kis_Net_Httpd::RetireStaticAsset(std::map<string, static_asset *>::iterator in_asset) {
+    // Responses may still be sending from it; the last one frees it
+    static_asset *asset = in_asset->second;
+
+    asset_map.erase(in_asset);
+    UnrefStaticAsset(asset);
+}
+
+void Kis_Net_Httpd::UnrefStaticAsset(static_asset *in_asset) {
+    if (--in_asset->refs != 0)
+        return;
+
+    asset_bytes -= in_asset->body.length() + in_asset->gz_body.length();
+    delete(in_asset);
+
+    // Files which didn't fit may now
+    asset_uncached.clear();
+}
+
+void Kis_Net_Httpd::WatchStaticDir(const string &in_dir) {
+#ifdef SYS_LINUX
+    if (asset_notify_fd < 0)
+        return;
+
+    // Watching a directory again returns the same descriptor
+    int wd = inotify_add_watch(asset_notify_fd, in_dir.c_str(),
+            IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | 
+            IN_MOVED_FROM | IN_MOVED_TO);
+
+    if (wd >= 0)
+        asset_watch_map[wd] = in_dir;
+#endif
+}
+
+void Kis_Net_Httpd::CheckStaticChanges() {
+#ifdef SYS_LINUX
+    if (asset_notify_fd < 0)
+        return;
+
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    while ((len = read(asset_notify_fd, buf, sizeof(buf))) > 0) {
+        char *pos = buf;
+
+        while (pos < buf + len) {
+            struct inotify_event *ev = (struct inotify_event *) pos;
+            pos += sizeof(struct inotify_event) + ev->len;
+
+            std::map<int, string>::iterator wi = asset_watch_map.find(ev->wd);
+
+            // We lost events, or a watched directory went away; check 
+            // everything
+            if ((ev->mask & (IN_Q_OVERFLOW | IN_IGNORED)) || wi == asset_watch_map.end()) {
+                if (wi != asset_watch_map.end())
+                    asset_watch_map.erase(wi);
+
+                for (std::map<string, static_asset *>::iterator ai = asset_map.begin();
+                        ai != asset_map.end(); ++ai)
+                    ai->second->stale = true;
+
+                continue;
+            }
+
+            if (ev->len == 0)
+                continue;
+
+            string changed = wi->second + "/" + ev->name;
+
+            for (std::map<string, static_asset *>::iterator ai = asset_map.begin();
+                    ai != asset_map.end(); ++ai) {
+                if (ai->second->path == changed || ai->second->path + ".gz" == changed)
+                    ai->second->stale = true;
+            }
+        }
+    }
+#endif
+}
+
+int Kis_Net_Httpd::handle_static_file(void *cls, struct MHD_Connection *connection,
+        const char *url, const char *method, void **ptr) {
+    Kis_Net_Httpd *kishttpd = (Kis_Net_Httpd *) cls;
+
+    if (!kishttpd->http_serve_files)
+        return -1;
+
+    if (strcmp(method, "GET") != 0)
+        return -1;
+
+    string url_path = url;
+
+    if (url_path.length() == 0 || url_path[url_path.length() - 1] == '/')
+        url_path += "index.html";
+
+    struct MHD_Response *response = NULL;
+
+    static_asset *asset = kishttpd->FetchStaticAsset(url_path);
+
+    if (asset != NULL) {
+        bool gzip = asset->gz_body.length() != 0 &&
+            kishttpd->NegotiateEncoding(connection, asset->body.length()) == 
+                encoding_gzip;
+        bool vary = asset->compressible && kishttpd->compress_enabled;
+
+        const string &etag = gzip ? asset->gz_etag : asset->etag;
+        const string &body = gzip ? asset->gz_body : asset->body;
+
+        if (httpd_etag_matches(connection, etag)) {
+            kishttpd->ReleaseStaticAsset(asset);
+            return httpd_not_modified(connection, etag, vary);
+        }
+
+        // MHD sends straight from the asset body; the connection keeps our 
+        // reference to the asset until the request completes
+        response = MHD_create_response_from_buffer(body.length(), 
+                (void *) body.data(), MHD_RESPMEM_PERSISTENT);
+
+        if (response == NULL) {
+            kishttpd->ReleaseStaticAsset(asset);
+            return -1;
+        }
+
+        Kis_Net_Httpd_Connection *concls = new Kis_Net_Httpd_Connection();
+
+        concls->httpd = kishttpd;
+        concls->httpdhandler = NULL;
+        concls->routed = false;
+        concls->route_id = 0;
+        concls->endpoint = NULL;
+        concls->cache_generation = 0;
+        concls->deferred_state = Kis_Net_Httpd_Connection::DEFER_NONE;
+        concls->connection = connection;
+        concls->method = string(method);
+        concls->postprocessor = NULL;
+        concls->connection_type = Kis_Net_Httpd_Connection::CONNECTION_GET;
+        concls->session = NULL;
+        concls->httpcode = MHD_HTTP_OK;
+        concls->url = url_path;
+        concls->time_start = 0;
+        concls->time_routed = 0;
+        concls->time_ready = 0;
+        concls->time_generate_start = 0;
+        concls->time_generate_end = 0;
+        concls->time_send_start = 0;
+        concls->response_size = -1;
+        concls->asset = asset;
+
+        *ptr = concls;
+
+        httpd_static_headers(response, asset->mime, asset->lastmod, etag, 
+                gzip, vary);
+
+        MHD_queue_response(connection, MHD_HTTP_OK, response);
+        MHD_destroy_response(response);
+
+        return 1;
+    }
+
+    // Too big for the cache, or an unusual path; send it from the file
+    string path;
+
+    if (!httpd_resolve_static(kishttpd->http_data_dir, url_path, path))
+        return -1;
+
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+
+    struct stat buf;
+
+    if (fstat(fd, &buf) != 0 || (!S_ISREG(buf.st_mode))) {
+        close(fd);
+        return -1;
+    }
+
+    string ext = httpd_path_ext(path);
+    bool vary = httpd_compressible_ext(ext) && kishttpd->compress_enabled;
+    bool gzip = false;
+
+    struct stat gzbuf;
+    int gzfd = -1;
+
+    if (vary && 
+            kishttpd->NegotiateEncoding(connection, buf.st_size) == encoding_gzip) {
+        gzfd = open((path + ".gz").c_str(), O_RDONLY);
+
+        if (gzfd >= 0 && (fstat(gzfd, &gzbuf) != 0 || !S_ISREG(gzbuf.st_mode) ||
+                    gzbuf.st_mtime < buf.st_mtime)) {
+            close(gzfd);
+            gzfd = -1;
+        }
+
+        gzip = gzfd >= 0;
+    }
+
+    string etag = httpd_file_etag(buf, gzip);
 
-    if (con_info->connection_type == Kis_Net_Httpd_Connection::CONNECTION_POST) {
-        MHD_destroy_post_processor(con_info->postprocessor);
+    if (httpd_etag_matches(connection, etag)) {
+        close(fd);
+
+        if (gzfd >= 0)
+            close(gzfd);
+
+        return httpd_not_modified(connection, etag, vary);
     }
 
-    delete(con_info);
-    *con_cls = NULL;
+    // MHD owns the descriptor from here and closes it with the response; it
+    // uses sendfile where it can
+    if (gzip) {
+        close(fd);
+        fd = gzfd;
+        response = MHD_create_response_from_fd((size_t) gzbuf.st_size, fd);
+    } else {
+        response = MHD_create_response_from_fd((size_t) buf.st_size, fd);
+    }
+
+    if (response == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    httpd_static_headers(response, kishttpd->GetMimeType(ext), 
+            httpd_file_lastmod(buf), etag, gzip, vary);
+
+    MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+
+    return 1;
 }
 
-static ssize_t file_reader(void *cls, uint64_t pos, char *buf, size_t max) {
-    FILE *file = (FILE *) cls;
+#ifdef HAVE_LIBZ
+// Per-thread compressor state.  Streams are reset between responses instead
+// of being allocated for each one, and freed when the thread exits.  A 
+// thread can be sending several compressed responses at once, so it keeps
+// the idle streams of each encoding; a response takes one while it's being
+// compressed and puts it back when it's done.
+struct httpd_compressor {
+    vector<z_stream *> idle[3];
+};
+
+static pthread_key_t httpd_compressor_key;
+static pthread_once_t httpd_compressor_once = PTHREAD_ONCE_INIT;
+
+static void httpd_compressor_free(void *in_aux) {
+    httpd_compressor *c = (httpd_compressor *) in_aux;
+
+    for (unsigned int x = 0; x < 3; x++) {
+        for (unsigned int z = 0; z < c->idle[x].size(); z++) {
+            deflateEnd(c->idle[x][z]);
+            delete(c->idle[x][z]);
+        }
+    }
+
+    delete(c);
+}
 
-    fseek(file, pos, SEEK_SET);
-    return fread(buf, 1, max, file);
+static void httpd_compressor_key_init() {
+    pthread_key_create(&httpd_compressor_key, httpd_compressor_free);
 }
 
+static httpd_compressor *httpd_thread_compressor() {
+    pthread_once(&httpd_compressor_once, httpd_compressor_key_init);
+
+    httpd_compressor *c = 
+        (httpd_compressor *) pthread_getspecific(httpd_compressor_key);
+
+    if (c == NULL) {
+        c = new httpd_compressor();
+        pthread_setspecific(httpd_compressor_key, c);
+    }
 
-static void free_callback(void *cls) {
-    FILE *file = (FILE *) cls;
-    fclose(file);
+    return c;
 }
 
-string Kis_Net_Httpd::GetMimeType(string ext) {
-    std::map<string, string>::iterator mi = mime_type_map.find(ext);
-    if (mi != mime_type_map.end()) {
-        return mi->second;
+// Take a reset stream for an encoding from this thread, or make one
+static z_stream *httpd_take_stream(int in_encoding, int in_level) {
+    httpd_compressor *c = httpd_thread_compressor();
+
+    if (c->idle[in_encoding].size() != 0) {
+        z_stream *zs = c->idle[in_encoding].back();
+        c->idle[in_encoding].pop_back();
+
+        if (deflateReset(zs) == Z_OK)
+            return zs;
+
+        deflateEnd(zs);
+        delete(zs);
     }
 
-    return "";
+    z_stream *zs = new z_stream();
+    memset(zs, 0, sizeof(z_stream));
+
+    // 16 + window bits selects the gzip wrapper instead of zlib
+    if (deflateInit2(zs, in_level, Z_DEFLATED, 
+                in_encoding == Kis_Net_Httpd::encoding_gzip ? 
+                16 + MAX_WBITS : MAX_WBITS,
+                8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        delete(zs);
+        return NULL;
+    }
+
+    return zs;
 }
 
-int Kis_Net_Httpd::handle_static_file(void *cls, struct MHD_Connection *connection,
-        const char *url, const char *method) {
-    Kis_Net_Httpd *kishttpd = (Kis_Net_Httpd *) cls;
+static void httpd_return_stream(int in_encoding, z_stream *in_zs) {
+    httpd_thread_compressor()->idle[in_encoding].push_back(in_zs);
+}
 
-    if (!kishttpd->http_serve_files)
-        return -1;
+// Response compressed as MHD asks for it
+struct httpd_deflate_reader {
+    string body;
+    size_t in_pos;
+    int encoding;
+    z_stream *zs;
+    bool finished;
+};
 
-    if (strcmp(method, "GET") != 0)
-        return -1;
+static ssize_t httpd_deflate_read(void *cls, uint64_t pos __attribute__((unused)), 
+        char *buf, size_t max) {
+    httpd_deflate_reader *reader = (httpd_deflate_reader *) cls;
+    z_stream *zs = reader->zs;
 
-    string fullfile = kishttpd->http_data_dir + "/" + url;
+    if (reader->finished)
+        return MHD_CONTENT_READER_END_OF_STREAM;
 
-    if (fullfile[fullfile.size() - 1] == '/')
-        fullfile += "index.html";
+    zs->next_out = (Bytef *) buf;
+    zs->avail_out = max;
 
-    char *realpath_path;
-    const char *datadir_path;
+    // Feed the body until this block is full; once it's all been taken, 
+    // finish the stream
+    while (zs->avail_out != 0) {
+        zs->next_in = (Bytef *) reader->body.data() + reader->in_pos;
+        zs->avail_in = reader->body.length() - reader->in_pos;
 
-    datadir_path = kishttpd->http_data_dir.c_str();
-    realpath_path = realpath(fullfile.c_str(), NULL);
+        int r = deflate(zs, zs->avail_in == 0 ? Z_FINISH : Z_NO_FLUSH);
 
-    if (realpath_path == NULL) {
-        return -1;
-    } else {
-        // Make sure we're hosted inside the data dir
-        if (strstr(realpath_path, datadir_path) == realpath_path) {
+        reader->in_pos = reader->body.length() - zs->avail_in;
 
-            struct MHD_Response *response;
-            struct stat buf;
+        if (r == Z_STREAM_END) {
+            reader->finished = true;
+            break;
+        }
 
-            FILE *f = fopen(realpath_path, "rb");
-            int fd;
-            free(realpath_path);
-            
-            if (f != NULL) {
-                fd = fileno(f);
-                if (fstat(fd, &buf) != 0 || (!S_ISREG(buf.st_mode))) {
-                    fclose(f);
-                    return -1;
-                }
+        if (r != Z_OK)
+            return MHD_CONTENT_READER_END_WITH_ERROR;
+    }
 
-                response = MHD_create_response_from_callback(buf.st_size, 32 * 1024,
-                        &file_reader, f, &free_callback);
+    if (max == zs->avail_out)
+        return MHD_CONTENT_READER_END_OF_STREAM;
 
-                if (response == NULL) {
-                    fclose(f);
-                    return -1;
-                }
+    return max - zs->avail_out;
+}
 
-                char lastmod[31];
-                struct tm tmstruct;
-                localtime_r(&(buf.st_ctime), &tmstruct);
-                strftime(lastmod, 31, "%a, %d %b %Y %H:%M:%S %Z", &tmstruct);
-                MHD_add_response_header(response, "Last-Modified", lastmod);
-
-                // Smarter way to do this in the future?  Probably.
-                vector<string> ext_comps = StrTokenize(url, ".");
-                if (ext_comps.size() >= 1) {
-                    string ext = StrLower(ext_comps[ext_comps.size() - 1]);
-                    string mime = kishttpd->GetMimeType(ext);
-
-                    if (mime != "") {
-                        MHD_add_response_header(response, "Content-Type", mime.c_str());
-                    }
-                }
+static void httpd_deflate_free(void *cls) {
+    httpd_deflate_reader *reader = (httpd_deflate_reader *) cls;
 
-                // Never let the browser cache our responses.  Maybe moderate this
-                // in the future to cache for 60 seconds or something?
-                MHD_add_response_header(response, "Cache-Control", "no-cache");
-                MHD_add_response_header(response, "Pragma", "no-cache");
-                MHD_add_response_header(response, 
-                        "Expires", "Sat, 01 Jan 2000 00:00:00 GMT");
+    httpd_return_stream(reader->encoding, reader->zs);
+    delete(reader);
+}
+#endif
 
-                MHD_queue_response(connection, MHD_HTTP_OK, response);
-                MHD_destroy_response(response);
+bool Kis_Net_Httpd::CompressBody(const string &in_body, int in_encoding,
+        string &out_body) {
+#ifdef HAVE_LIBZ
+    if (in_encoding != encoding_gzip && in_encoding != encoding_deflate)
+        return false;
 
-                return 1;
-            }
+    z_stream *zs = httpd_take_stream(in_encoding, compress_level);
 
-            return -1;
-        } else {
-            return -1;
+    if (zs == NULL)
+        return false;
+
+    zs->next_in = (Bytef *) in_body.data();
+    zs->avail_in = in_body.length();
+
+    out_body.clear();
+    out_body.reserve(in_body.length() / 4);
+
+    // Stream through a fixed chunk so we never allocate the worst-case bound
+    // of the whole body
+    char chunk[32 * 1024];
+    int r;
+
+    do {
+        zs->next_out = (Bytef *) chunk;
+        zs->avail_out = sizeof(chunk);
+
+        r = deflate(zs, Z_FINISH);
+
+        if (r == Z_STREAM_ERROR) {
+            httpd_return_stream(in_encoding, zs);
+            return false;
+        }
+
+        out_body.append(chunk, sizeof(chunk) - zs->avail_out);
+    } while (r != Z_STREAM_END);
+
+    httpd_return_stream(in_encoding, zs);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+int Kis_Net_Httpd::NegotiateEncoding(struct MHD_Connection *connection, 
+        size_t in_size) {
+    if (!compress_enabled || in_size < compress_min_size)
+        return encoding_identity;
+
+    const char *accept = 
+        MHD_lookup_connection_value(connection, MHD_HEADER_KIND, 
+                MHD_HTTP_HEADER_ACCEPT_ENCODING);
+
+    if (accept == NULL)
+        return encoding_identity;
+
+    bool gzip = false, deflate = false;
+
+    vector<string> codings = StrTokenize(accept, ",");
+
+    for (unsigned int x = 0; x < codings.size(); x++) {
+        vector<string> params = StrTokenize(codings[x], ";");
+
+        if (params.size() == 0)
+            continue;
+
+        string name = StrLower(StrStrip(params[0]));
+
+        // Skip codings the client explicitly refuses with q=0
+        bool refused = false;
+        for (unsigned int p = 1; p < params.size(); p++) {
+            string param = StrStrip(params[p]);
+            float q;
+
+            if (param.length() > 2 && (param[0] == 'q' || param[0] == 'Q') && 
+                    param[1] == '=' && sscanf(param.c_str() + 2, "%f", &q) == 1 &&
+                    q <= 0)
+                refused = true;
         }
+
+        if (refused)
+            continue;
+
+        if (name == "gzip" || name == "x-gzip" || name == "*")
+            gzip = true;
+        else if (name == "deflate")
+            deflate = true;
     }
 
-    return -1;
+    if (gzip)
+        return encoding_gzip;
+
+    if (deflate)
+        return encoding_deflate;
+
+    return encoding_identity;
 }
 
 int Kis_Net_Httpd::SendHttpResponse(Kis_Net_Httpd *httpd,
         struct MHD_Connection *connection, 
         const char *url, int httpcode, string responsestr) {
 
+    int encoding = httpd->NegotiateEncoding(connection, responsestr.length());
+
+    if (encoding != encoding_identity) {
+        int ret = httpd->SendCompressedResponse(connection, url, httpcode, 
+                responsestr, encoding);
+
+        if (ret >= 0)
+            return ret;
+    }
+
+    return httpd->SendEncodedResponse(connection, url, httpcode, responsestr,
+            encoding_identity);
+}
+
+int Kis_Net_Httpd::SendCompressedResponse(struct MHD_Connection *connection,
+        const char *url, int httpcode, string &io_body, int encoding) {
+#ifdef HAVE_LIBZ
+    if (encoding != encoding_gzip && encoding != encoding_deflate)
+        return -1;
+
+    z_stream *zs = httpd_take_stream(encoding, compress_level);
+
+    if (zs == NULL)
+        return -1;
+
+    httpd_deflate_reader *reader = new httpd_deflate_reader();
+    reader->in_pos = 0;
+    reader->encoding = encoding;
+    reader->zs = zs;
+    reader->finished = false;
+
+    // The compressed length isn't known until it's sent
+    struct MHD_Response *response =
+        MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 32 * 1024,
+                &httpd_deflate_read, reader, &httpd_deflate_free);
+
+    if (response == NULL) {
+        httpd_deflate_free(reader);
+        return -1;
+    }
+
+    reader->body.swap(io_body);
+
+    AddResponseHeaders(response, url, encoding);
+
+    int ret = MHD_queue_response(connection, httpcode, response);
+
+    MHD_destroy_response(response);
+
+    return ret;
+#else
+    return -1;
+#endif
+}
+
+int Kis_Net_Httpd::SendEncodedResponse(struct MHD_Connection *connection,
+        const char *url, int httpcode, const string &body, int encoding) {
+
     struct MHD_Response *response = 
-        MHD_create_response_from_buffer(responsestr.length(),
-                (void *) responsestr.c_str(), MHD_RESPMEM_MUST_COPY);
+        MHD_create_response_from_buffer(body.length(),
+                (void *) body.data(), MHD_RESPMEM_MUST_COPY);
+
+    AddResponseHeaders(response, url, encoding);
+
+    int ret = MHD_queue_response(connection, httpcode, response);
+
+    MHD_destroy_response(response);
+
+    return ret;
+}
 
+void Kis_Net_Httpd::AddResponseHeaders(struct MHD_Response *response, 
+        const char *url, int encoding) {
     char lastmod[31];
     struct tm tmstruct;
     time_t now;
@@ -679,17 +2950,19 @@ int Kis_Net_Httpd::SendHttpResponse(Kis_Net_Httpd *httpd,
     if (ext_comps.size() >= 1) {
         string ext = StrLower(ext_comps[ext_comps.size() - 1]);
 
-        string mime = httpd->GetMimeType(ext);
+        string mime = GetMimeType(ext);
         if (mime != "") {
             MHD_add_response_header(response, "Content-Type", mime.c_str());
         }
     }
 
-    int ret = MHD_queue_response(connection, httpcode, response);
-
-    MHD_destroy_response(response);
+    if (encoding == encoding_gzip)
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_ENCODING, "gzip");
+    else if (encoding == encoding_deflate)
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_ENCODING, "deflate");
 
-    return ret;
+    if (compress_enabled)
+        MHD_add_response_header(response, MHD_HTTP_HEADER_VARY, "Accept-Encoding");
 }
 
 Kis_Net_Httpd_Handler::Kis_Net_Httpd_Handler(GlobalRegistry *in_globalreg) {
@@ -700,6 +2973,9 @@ Kis_Net_Httpd_Handler::Kis_Net_Httpd_Handler(GlobalRegistry *in_globalreg) {
 }
 
 Kis_Net_Httpd_Handler::~Kis_Net_Httpd_Handler() {
+    if (http_globalreg == NULL)
+        return;
+
     httpd = (Kis_Net_Httpd *) http_globalreg->FetchGlobal("HTTPD_SERVER");
 
     if (httpd != NULL)
@@ -708,12 +2984,50 @@ Kis_Net_Httpd_Handler::~Kis_Net_Httpd_Handler() {
 
 void Kis_Net_Httpd_Handler::Bind_Httpd_Server(GlobalRegistry *in_globalreg) {
     if (in_globalreg != NULL) {
+        http_globalreg = in_globalreg;
         httpd = (Kis_Net_Httpd *) in_globalreg->FetchGlobal("HTTPD_SERVER");
         if (httpd != NULL)
             httpd->RegisterHandler(this);
     }
 }
 
+bool Kis_Net_Httpd_Handler::Httpd_RegisterRoute(string in_method, 
+        string in_pattern, int in_route_id) {
+    if (httpd == NULL)
+        return false;
+
+    return httpd->RegisterRoute(this, in_method, in_pattern, in_route_id);
+}
+
+bool Kis_Net_Httpd_Handler::Httpd_RegisterCachedRoute(string in_method,
+        string in_pattern, int in_route_id, 
+        Kis_Net_Httpd_Generation *in_generation) {
+    if (!Httpd_RegisterRoute(in_method, in_pattern, in_route_id))
+        return false;
+
+    return httpd->CacheRoute(in_method, in_pattern, in_generation);
+}
+
+int Kis_Net_Httpd_Stream_Handler::Httpd_HandleRoutedRequest(Kis_Net_Httpd *httpd,
+        struct MHD_Connection *connection, int route_id,
+        Kis_Net_Httpd_Route_Params &params,
+        const char *url, const char *method, const char *upload_data,
+        size_t *upload_data_size) {
+
+    std::stringstream stream;
+    int ret, code;
+
+    code = Httpd_CreateRoutedResponse(httpd, connection, route_id, params, 
+            url, method, upload_data, upload_data_size, stream);
+
+    if (code == MHD_HTTP_NOT_FOUND && stream.str().length() == 0)
+        stream << "404";
+
+    ret = httpd->SendHttpResponse(httpd, connection, url, code, stream.str());
+
+    return ret;
+}
+
 int Kis_Net_Httpd_Stream_Handler::Httpd_HandleRequest(Kis_Net_Httpd *httpd, 
         struct MHD_Connection *connection,
         const char *url, const char *method, const char *upload_data,
@@ -731,7 +3045,6 @@ int Kis_Net_Httpd_Stream_Handler::Httpd_HandleRequest(Kis_Net_Httpd *httpd,
 }
 
 bool Kis_Net_Httpd::HasValidSession(struct MHD_Connection *connection) {
-    Kis_Net_Httpd_Session *s;
     const char *cookieval;
 
     cookieval = MHD_lookup_connection_value (connection,
@@ -740,25 +3053,11 @@ bool Kis_Net_Httpd::HasValidSession(struct MHD_Connection *connection) {
     if (cookieval == NULL)
         return false;
 
-    map<string, Kis_Net_Httpd_Session *>::iterator si = session_map.find(cookieval);
-
-    if (si == session_map.end())
-        return false;
-
-    s = si->second;
-
-    // Does the session never expire?
-    if (s->session_lifetime == 0)
-        return true;
-
-    // Has the session expired?
-    if (s->session_seen + s->session_lifetime < globalreg->timestamp.tv_sec) {
-        DelSession(si);
-        return false;
-    }
+    unsigned int epoch = session_table.ReadLock();
+    bool valid = TouchSession(cookieval) != NULL;
+    session_table.ReadUnlock(epoch);
 
-    // We're good
-    return true;
+    return valid;
 }
 
 bool Kis_Net_Httpd::HasValidSession(Kis_Net_Httpd_Connection *connection) {
@@ -817,19 +3116,6 @@ void Kis_Net_Httpd::CreateSession(struct MHD_Response *response, time_t in_lifet
     AddSession(s);
 }
 
-bool Kis_Net_Httpd_No_Files_Handler::Httpd_VerifyPath(const char *path, 
-        const char *method) {
-
-    if (strcmp(method, "GET") != 0)
-        return false;
-
-    if (strcmp(path, "/index.html") == 0 ||
-            strcmp(path, "/") == 0)
-        return true;
-
-    return false;
-}
-
 
 void Kis_Net_Httpd_No_Files_Handler::Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd __attribute__((unused)),
         struct MHD_Connection *connection __attribute__((unused)),
@@ -855,3 +3141,538 @@ void Kis_Net_Httpd_No_Files_Handler::Httpd_CreateStreamResponse(Kis_Net_Httpd *h
     stream << "</html>";
 }
 
+
+TrackerElement *Kis_Net_Httpd::FetchQueueStats() {
+    EntryTracker *entrytracker = globalreg->entrytracker;
+
+    TrackerElement *stats =
+        entrytracker->RegisterAndGetField("kismet.httpd.queue", TrackerMap,
+                "http server queue state");
+
+    TrackerElement *e;
+
+    local_locker lock(&work_mutex);
+
+    e = entrytracker->RegisterAndGetField("kismet.httpd.queue.mode", 
+            TrackerString, "http server mode (thread, event)");
+    e->set(string(event_mode ? "event" : "thread"));
+    stats->add_map(e);
+
+    e = entrytracker->RegisterAndGetField("kismet.httpd.queue.workers",
+            TrackerUInt32, "worker threads");
+    e->set((uint32_t) worker_tids.size());
+    stats->add_map(e);
+
+    e = entrytracker->RegisterAndGetField("kismet.httpd.queue.workers_busy",
+            TrackerUInt32, "worker threads generating a response");
+    e->set((uint32_t) workers_busy);
+    stats->add_map(e);
+
+    e = entrytracker->RegisterAndGetField("kismet.httpd.queue.depth",
+            TrackerUInt32, "deferred requests waiting for a worker or endpoint");
+    e->set((uint32_t) pending_requests);
+    stats->add_map(e);
+
+    e = entrytracker->RegisterAndGetField("kismet.httpd.queue.peak_depth",
+            TrackerUInt32, "highest queue depth seen");
+    e->set((uint32_t) peak_pending_requests);
+    stats->add_map(e);
+
+    e = entrytracker->RegisterAndGetField("kismet.httpd.queue.max_depth",
+            TrackerUInt32, "queue depth at which requests are refused, 0 for none");
+    e->set((uint32_t) max_pending_requests);
+    stats->add_map(e);
+
+    e = entrytracker->RegisterAndGetField("kismet.httpd.queue.deferred",
+            TrackerUInt64, "requests handed to the worker pool");
+    e->set((uint64_t) deferred_requests);
+    stats->add_map(e);
+
+    TrackerElement *endpoints =
+        entrytracker->RegisterAndGetField("kismet.httpd.queue.endpoints",
+                TrackerVector, "registered endpoints");
+    stats->add_map(endpoints);
+
+    for (std::map<string, Kis_Net_Httpd_Endpoint *>::iterator i = endpoint_map.begin();
+            i != endpoint_map.end(); ++i) {
+        Kis_Net_Httpd_Endpoint *ep = i->second;
+
+        TrackerElement *epmap = 
+            entrytracker->RegisterAndGetField("kismet.httpd.endpoint", 
+                    TrackerMap, "endpoint queue state");
+        endpoints->add_vector(epmap);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.method",
+                TrackerString, "HTTP method");
+        e->set(ep->method);
+        epmap->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.pattern",
+                TrackerString, "route pattern");
+        e->set(ep->pattern);
+        epmap->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.limit",
+                TrackerUInt32, "concurrent request limit, 0 for none");
+        e->set((uint32_t) ep->max_concurrent);
+        epmap->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.active",
+                TrackerUInt32, "requests being handled");
+        e->set((uint32_t) ep->active);
+        epmap->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.queued",
+                TrackerUInt32, "requests waiting on the concurrency limit");
+        e->set((uint32_t) ep->waiting.size());
+        epmap->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.peak_queued",
+                TrackerUInt32, "highest number of waiting requests seen");
+        e->set((uint32_t) ep->peak_queued);
+        epmap->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.served",
+                TrackerUInt64, "requests handled");
+        e->set((uint64_t) ep->served);
+        epmap->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.rejected",
+                TrackerUInt64, "requests refused because the endpoint or queue was full");
+        e->set((uint64_t) ep->rejected);
+        epmap->add_map(e);
+    }
+
+    return stats;
+}
+
+TrackerElement *Kis_Net_Httpd::FetchCacheStats() {
+    EntryTracker *entrytracker = globalreg->entrytracker;
+
+    TrackerElement *stats =
+        entrytracker->RegisterAndGetField("kismet.httpd.cache", TrackerMap,
+                "http response cache state");
+
+    TrackerElement *e;
+
+    {
+        local_locker lock(&controller_mutex);
+        local_locker clock(&cache_mutex);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.cache.enabled",
+                TrackerUInt8, "response cache enabled");
+        e->set((uint8_t) cache_enabled);
+        stats->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.cache.max_staleness",
+                TrackerUInt32, "ms a cached response may be served after its data changed");
+        e->set((uint32_t) cache_max_staleness);
+        stats->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.cache.entries",
+                TrackerUInt32, "cached responses");
+        e->set((uint32_t) response_cache.size());
+        stats->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.cache.max_entries",
+                TrackerUInt32, "maximum cached responses");
+        e->set((uint32_t) cache_max_entries);
+        stats->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.cache.hits",
+                TrackerUInt64, "requests served from a current cached response");
+        e->set((uint64_t) cache_hits);
+        stats->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.cache.stale_hits",
+                TrackerUInt64, "requests served from a cached response within max staleness");
+        e->set((uint64_t) cache_stale_hits);
+        stats->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.cache.misses",
+                TrackerUInt64, "requests to cached endpoints which were regenerated");
+        e->set((uint64_t) cache_misses);
+        stats->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.cache.evictions",
+                TrackerUInt64, "cached responses dropped to make room");
+        e->set((uint64_t) cache_evictions);
+        stats->add_map(e);
+
+        TrackerElement *endpoints =
+            entrytracker->RegisterAndGetField("kismet.httpd.cache.endpoints",
+                    TrackerVector, "cached endpoints");
+        stats->add_map(endpoints);
+
+        for (std::map<string, Kis_Net_Httpd_Endpoint *>::iterator i = 
+                endpoint_map.begin(); i != endpoint_map.end(); ++i) {
+            Kis_Net_Httpd_Endpoint *ep = i->second;
+
+            if (!ep->cached)
+                continue;
+
+            TrackerElement *epmap = 
+                entrytracker->RegisterAndGetField("kismet.httpd.endpoint", 
+                        TrackerMap, "endpoint queue state");
+            endpoints->add_vector(epmap);
+
+            e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.method",
+                    TrackerString, "HTTP method");
+            e->set(ep->method);
+            epmap->add_map(e);
+
+            e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.pattern",
+                    TrackerString, "route pattern");
+            e->set(ep->pattern);
+            epmap->add_map(e);
+
+            e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.generation",
+                    TrackerUInt64, "current generation of the data behind the endpoint");
+            e->set((uint64_t) (ep->generation == NULL ? 0 : ep->generation->Get()));
+            epmap->add_map(e);
+
+            e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.cache_hits",
+                    TrackerUInt64, "requests served from the cache");
+            e->set((uint64_t) ep->cache_hits);
+            epmap->add_map(e);
+
+            e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.cache_misses",
+                    TrackerUInt64, "requests regenerated");
+            e->set((uint64_t) ep->cache_misses);
+            epmap->add_map(e);
+        }
+    }
+
+    return stats;
+}
+
+uint64_t Kis_Net_Httpd::TimeUsec() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Count, total, max, and percentiles of a histogram as a tracked map
+static TrackerElement *httpd_histogram_summary(EntryTracker *entrytracker,
+        string in_name, string in_desc, Kis_Net_Httpd_Histogram *in_hist) {
+    TrackerElement *hmap = 
+        entrytracker->RegisterAndGetField(in_name, TrackerMap, in_desc);
+
+    TrackerElement *e;
+
+    e = entrytracker->RegisterAndGetField("kismet.httpd.histogram.count",
+            TrackerUInt64, "values recorded");
+    e->set((uint64_t) in_hist->FetchCount());
+    hmap->add_map(e);
+
+    e = entrytracker->RegisterAndGetField("kismet.httpd.histogram.sum",
+            TrackerUInt64, "total of values recorded");
+    e->set((uint64_t) in_hist->FetchSum());
+    hmap->add_map(e);
+
+    e = entrytracker->RegisterAndGetField("kismet.httpd.histogram.max",
+            TrackerUInt64, "largest value recorded");
+    e->set((uint64_t) in_hist->FetchMax());
+    hmap->add_map(e);
+
+    e = entrytracker->RegisterAndGetField("kismet.httpd.histogram.p50",
+            TrackerUInt64, "median value");
+    e->set((uint64_t) in_hist->Percentile(0.5));
+    hmap->add_map(e);
+
+    e = entrytracker->RegisterAndGetField("kismet.httpd.histogram.p90",
+            TrackerUInt64, "90th percentile value");
+    e->set((uint64_t) in_hist->Percentile(0.9));
+    hmap->add_map(e);
+
+    e = entrytracker->RegisterAndGetField("kismet.httpd.histogram.p99",
+            TrackerUInt64, "99th percentile value");
+    e->set((uint64_t) in_hist->Percentile(0.99));
+    hmap->add_map(e);
+
+    e = entrytracker->RegisterAndGetField("kismet.httpd.histogram.p999",
+            TrackerUInt64, "99.9th percentile value");
+    e->set((uint64_t) in_hist->Percentile(0.999));
+    hmap->add_map(e);
+
+    return hmap;
+}
+
+TrackerElement *Kis_Net_Httpd::FetchRequestStats() {
+    EntryTracker *entrytracker = globalreg->entrytracker;
+
+    TrackerElement *stats =
+        entrytracker->RegisterAndGetField("kismet.httpd.stats", TrackerMap,
+                "http request metrics");
+
+    TrackerElement *endpoints =
+        entrytracker->RegisterAndGetField("kismet.httpd.stats.endpoints",
+                TrackerVector, "endpoints which have been requested");
+    stats->add_map(endpoints);
+
+    TrackerElement *e;
+
+    local_locker lock(&controller_mutex);
+
+    for (std::map<string, Kis_Net_Httpd_Endpoint *>::iterator i = 
+            endpoint_map.begin(); i != endpoint_map.end(); ++i) {
+        Kis_Net_Httpd_Endpoint *ep = i->second;
+
+        uint64_t requests = __sync_fetch_and_add(&(ep->requests), 0);
+        unsigned int in_flight = __sync_fetch_and_add(&(ep->in_flight), 0);
+
+        if (requests == 0 && in_flight == 0)
+            continue;
+
+        TrackerElement *epmap = 
+            entrytracker->RegisterAndGetField("kismet.httpd.endpoint", 
+                    TrackerMap, "endpoint queue state");
+        endpoints->add_vector(epmap);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.method",
+                TrackerString, "HTTP method");
+        e->set(ep->method);
+        epmap->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.pattern",
+                TrackerString, "route pattern");
+        e->set(ep->pattern);
+        epmap->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.requests",
+                TrackerUInt64, "requests completed");
+        e->set((uint64_t) requests);
+        epmap->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.in_flight",
+                TrackerUInt32, "requests being routed, handled, or sent");
+        e->set((uint32_t) in_flight);
+        epmap->add_map(e);
+
+        const char *status_names[] = {
+            "kismet.httpd.endpoint.responses_2xx", 
+            "kismet.httpd.endpoint.responses_3xx",
+            "kismet.httpd.endpoint.responses_4xx", 
+            "kismet.httpd.endpoint.responses_5xx" 
+        };
+
+        for (unsigned int x = 0; x < 4; x++) {
+            e = entrytracker->RegisterAndGetField(status_names[x],
+                    TrackerUInt64, "responses by status class");
+            e->set((uint64_t) __sync_fetch_and_add(&(ep->responses[x]), 0));
+            epmap->add_map(e);
+        }
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.aborted",
+                TrackerUInt64, "requests whose connection closed before the response was sent");
+        e->set((uint64_t) __sync_fetch_and_add(&(ep->aborted), 0));
+        epmap->add_map(e);
+
+        e = entrytracker->RegisterAndGetField("kismet.httpd.endpoint.response_bytes",
+                TrackerUInt64, "response body bytes, before compression");
+        e->set((uint64_t) __sync_fetch_and_add(&(ep->response_bytes), 0));
+        epmap->add_map(e);
+
+        epmap->add_map(httpd_histogram_summary(entrytracker,
+                    "kismet.httpd.endpoint.route_usec", 
+                    "microseconds spent routing the request", &(ep->route_time)));
+        epmap->add_map(httpd_histogram_summary(entrytracker,
+                    "kismet.httpd.endpoint.wait_usec", 
+                    "microseconds waiting for a worker or endpoint slot", 
+                    &(ep->wait_time)));
+        epmap->add_map(httpd_histogram_summary(entrytracker,
+                    "kismet.httpd.endpoint.generate_usec", 
+                    "microseconds generating and serializing the response", 
+                    &(ep->generate_time)));
+        epmap->add_map(httpd_histogram_summary(entrytracker,
+                    "kismet.httpd.endpoint.send_usec", 
+                    "microseconds compressing and sending the response", 
+                    &(ep->send_time)));
+        epmap->add_map(httpd_histogram_summary(entrytracker,
+                    "kismet.httpd.endpoint.total_usec", 
+                    "microseconds from request to response sent", 
+                    &(ep->total_time)));
+        epmap->add_map(httpd_histogram_summary(entrytracker,
+                    "kismet.httpd.endpoint.response_size", 
+                    "response body bytes, before compression", 
+                    &(ep->response_size)));
+    }
+
+    return stats;
+}
+
+// Quote a Prometheus label value
+static string httpd_prometheus_label(const string &in_value) {
+    string ret;
+
+    for (unsigned int x = 0; x < in_value.length(); x++) {
+        if (in_value[x] == '\\' || in_value[x] == '"')
+            ret += '\\';
+
+        if (in_value[x] == '\n') {
+            ret += "\\n";
+            continue;
+        }
+
+        ret += in_value[x];
+    }
+
+    return ret;
+}
+
+// Write a histogram as Prometheus cumulative buckets.  Each limit counts the
+// buckets which lie entirely below it, so values near a limit may be counted
+// in the next one up.
+static void httpd_prometheus_histogram(std::ostream &stream, const string &in_name,
+        const string &in_labels, Kis_Net_Httpd_Histogram *in_hist, 
+        const double *in_limits, unsigned int in_num_limits, double in_scale) {
+    uint64_t cumulative = 0;
+    unsigned int b = 0;
+    char num[32];
+
+    for (unsigned int l = 0; l < in_num_limits; l++) {
+        while (b < Kis_Net_Httpd_Histogram::NUM_BUCKETS &&
+                Kis_Net_Httpd_Histogram::BucketUpper(b) * in_scale <= in_limits[l]) {
+            cumulative += in_hist->FetchBucket(b);
+            b++;
+        }
+
+        snprintf(num, 32, "%.10g", in_limits[l]);
+
+        stream << in_name << "_bucket{" << in_labels << ",le=\"" << 
+            num << "\"} " << cumulative << "\n";
+    }
+
+    uint64_t count = in_hist->FetchCount();
+
+    // Counters are read one at a time; don't let +Inf fall behind
+    if (count < cumulative)
+        count = cumulative;
+
+    stream << in_name << "_bucket{" << in_labels << ",le=\"+Inf\"} " << 
+        count << "\n";
+    snprintf(num, 32, "%.10g", in_hist->FetchSum() * in_scale);
+
+    stream << in_name << "_sum{" << in_labels << "} " << num << "\n";
+    stream << in_name << "_count{" << in_labels << "} " << count << "\n";
+}
+
+void Kis_Net_Httpd::WritePrometheusStats(std::ostream &stream) {
+    const double latency_limits[] = {
+        0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 
+        0.1, 0.25, 0.5, 1, 2.5, 5, 10
+    };
+
+    const double size_limits[] = {
+        256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304, 16777216
+    };
+
+    stream << "# HELP kismet_httpd_requests_total Requests completed\n";
+    stream << "# TYPE kismet_httpd_requests_total counter\n";
+    stream << "# HELP kismet_httpd_requests_in_flight Requests being routed, "
+        "handled, or sent\n";
+    stream << "# TYPE kismet_httpd_requests_in_flight gauge\n";
+    stream << "# HELP kismet_httpd_responses_total Responses by status class\n";
+    stream << "# TYPE kismet_httpd_responses_total counter\n";
+    stream << "# HELP kismet_httpd_aborted_total Requests whose connection "
+        "closed before the response was sent\n";
+    stream << "# TYPE kismet_httpd_aborted_total counter\n";
+    stream << "# HELP kismet_httpd_response_bytes_total Response body bytes, "
+        "before compression\n";
+    stream << "# TYPE kismet_httpd_response_bytes_total counter\n";
+    stream << "# HELP kismet_httpd_request_duration_seconds Time spent in each "
+        "step of a request\n";
+    stream << "# TYPE kismet_httpd_request_duration_seconds histogram\n";
+    stream << "# HELP kismet_httpd_response_size_bytes Response body sizes, "
+        "before compression\n";
+    stream << "# TYPE kismet_httpd_response_size_bytes histogram\n";
+
+    local_locker lock(&controller_mutex);
+
+    for (std::map<string, Kis_Net_Httpd_Endpoint *>::iterator i = 
+            endpoint_map.begin(); i != endpoint_map.end(); ++i) {
+        Kis_Net_Httpd_Endpoint *ep = i->second;
+
+        uint64_t requests = __sync_fetch_and_add(&(ep->requests), 0);
+        unsigned int in_flight = __sync_fetch_and_add(&(ep->in_flight), 0);
+
+        if (requests == 0 && in_flight == 0)
+            continue;
+
+        string labels = "method=\"" + httpd_prometheus_label(ep->method) + 
+            "\",route=\"" + httpd_prometheus_label(ep->pattern) + "\"";
+
+        stream << "kismet_httpd_requests_total{" << labels << "} " << 
+            requests << "\n";
+        stream << "kismet_httpd_requests_in_flight{" << labels << "} " << 
+            in_flight << "\n";
+
+        for (unsigned int x = 0; x < 4; x++) {
+            stream << "kismet_httpd_responses_total{" << labels << ",code=\"" <<
+                (x + 2) << "xx\"} " << 
+                __sync_fetch_and_add(&(ep->responses[x]), 0) << "\n";
+        }
+
+        stream << "kismet_httpd_aborted_total{" << labels << "} " << 
+            __sync_fetch_and_add(&(ep->aborted), 0) << "\n";
+        stream << "kismet_httpd_response_bytes_total{" << labels << "} " << 
+            __sync_fetch_and_add(&(ep->response_bytes), 0) << "\n";
+
+        Kis_Net_Httpd_Histogram *phases[] = {
+            &(ep->route_time), &(ep->wait_time), &(ep->generate_time),
+            &(ep->send_time), &(ep->total_time)
+        };
+        const char *phase_names[] = {
+            "route", "wait", "generate", "send", "total"
+        };
+
+        for (unsigned int x = 0; x < 5; x++) {
+            httpd_prometheus_histogram(stream, 
+                    "kismet_httpd_request_duration_seconds",
+                    labels + ",phase=\"" + phase_names[x] + "\"", phases[x],
+                    latency_limits, 
+                    sizeof(latency_limits) / sizeof(double), 0.000001);
+        }
+
+        httpd_prometheus_histogram(stream, "kismet_httpd_response_size_bytes",
+                labels, &(ep->response_size), size_limits,
+                sizeof(size_limits) / sizeof(double), 1);
+    }
+}
+
+int Kis_Net_Httpd_Stats_Handler::Httpd_CreateRoutedResponse(
+        Kis_Net_Httpd *httpd,
+        struct MHD_Connection *connection __attribute__((unused)),
+        int route_id,
+        Kis_Net_Httpd_Route_Params &params __attribute__((unused)),
+        const char *url __attribute__((unused)), 
+        const char *method __attribute__((unused)), 
+        const char *upload_data __attribute__((unused)),
+        size_t *upload_data_size __attribute__((unused)), 
+        std::stringstream &stream) {
+
+    TrackerElement *stats = NULL;
+
+    if (route_id == route_prometheus) {
+        httpd->WritePrometheusStats(stream);
+        return MHD_HTTP_OK;
+    }
+
+    if ((route_id & ~route_msgpack) == route_cache)
+        stats = httpd->FetchCacheStats();
+    else if ((route_id & ~route_msgpack) == route_stats)
+        stats = httpd->FetchRequestStats();
+    else
+        stats = httpd->FetchQueueStats();
+
+    TrackerElementScopeLinker slink(stats);
+
+    if (route_id & route_msgpack)
+        MsgpackAdapter::Pack(http_globalreg, stream, stats);
+    else
+        JsonAdapter::Pack(http_globalreg, stream, stats);
+
+    return MHD_HTTP_OK;
+}
@@ -22,15 +22,20 @@
 #include <time.h>
 #include <list>
 #include <map>
+#include <deque>
 #include <vector>
 #include <algorithm>
 #include <string>
 #include <sstream>
 #include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
 #include <microhttpd.h>
 
 #include "globalregistry.h"
+#include "macaddr.h"
 #include "msgpack_adapter.h"
+#include "trackedelement.h"
 
 #ifndef __KIS_NET_MICROHTTPD__
 #define __KIS_NET_MICROHTTPD__
@@ -38,25 +43,160 @@
 class Kis_Net_Httpd;
 class Kis_Net_Httpd_Session;
 class Kis_Net_Httpd_Connection;
+class Kis_Net_Httpd_Endpoint;
+class Kis_Net_Httpd_Static_Asset;
+
+// Change counter for the data behind cached REST responses.  Producers bump
+// it whenever that data changes; a cached response built at an older 
+// generation is only served while it is within the max staleness.
+class Kis_Net_Httpd_Generation {
+public:
+    Kis_Net_Httpd_Generation() {
+        generation = 0;
+    }
+
+    void Bump() {
+        __sync_add_and_fetch(&generation, 1);
+    }
+
+    uint64_t Get() {
+        return __sync_add_and_fetch(&generation, 0);
+    }
+
+protected:
+    uint64_t generation;
+};
+
+// Log-linear histogram of non-negative values, in the style of an HDR 
+// histogram.  Each power of two is split into four linear sub-buckets, so a
+// value is placed to within 25% using a fixed array of counters, and
+// recording is a few atomic adds with no lock.  Values past 2^40 are counted
+// in the last bucket.
+class Kis_Net_Httpd_Histogram {
+public:
+    const static unsigned int NUM_BUCKETS = 156;
+
+    Kis_Net_Httpd_Histogram();
+
+    void Record(uint64_t in_value) {
+        __sync_fetch_and_add(&(buckets[Bucket(in_value)]), 1);
+        __sync_fetch_and_add(&count, 1);
+        __sync_fetch_and_add(&sum, in_value);
+
+        uint64_t cur = max;
+        while (in_value > cur && 
+                !__sync_bool_compare_and_swap(&max, cur, in_value))
+            cur = max;
+    }
+
+    uint64_t FetchCount() { return __sync_fetch_and_add(&count, 0); }
+    uint64_t FetchSum() { return __sync_fetch_and_add(&sum, 0); }
+    uint64_t FetchMax() { return __sync_fetch_and_add(&max, 0); }
+    uint64_t FetchBucket(unsigned int in_bucket) {
+        return __sync_fetch_and_add(&(buckets[in_bucket]), 0);
+    }
+
+    // Estimate a quantile (0 to 1) as the middle of the bucket it falls in.
+    // Buckets are read one at a time, so values recorded meanwhile may or
+    // may not be counted.
+    uint64_t Percentile(double in_quantile);
+
+    // Bucket for a value, and the range of values [lower, upper) in a bucket
+    static unsigned int Bucket(uint64_t in_value) {
+        if (in_value < 4)
+            return in_value;
+
+        if (in_value >= (1ULL << 40))
+            return NUM_BUCKETS - 1;
+
+        unsigned int msb = 63 - __builtin_clzll(in_value);
+
+        return (msb - 1) * 4 + ((in_value >> (msb - 2)) & 3);
+    }
+
+    static uint64_t BucketLower(unsigned int in_bucket);
+    static uint64_t BucketUpper(unsigned int in_bucket);
+
+protected:
+    uint64_t buckets[NUM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+// Parameter captured from a routed URL.  The raw segment is always available;
+// the parsed value matching the capture type is filled in.
+class Kis_Net_Httpd_Route_Param {
+public:
+    Kis_Net_Httpd_Route_Param() {
+        int_value = 0;
+        uint_value = 0;
+    }
+
+    // Raw path segment
+    string value;
+
+    // int and uint captures
+    int64_t int_value;
+    uint64_t uint_value;
+
+    // mac captures
+    mac_addr mac_value;
+
+    // Tail captures, the remaining path segments
+    vector<string> path_value;
+};
+
+typedef std::map<string, Kis_Net_Httpd_Route_Param> Kis_Net_Httpd_Route_Params;
 
 // Basic request handler from MHD
 class Kis_Net_Httpd_Handler {
 public:
-    Kis_Net_Httpd_Handler() { }
+    Kis_Net_Httpd_Handler() : http_globalreg(NULL), httpd(NULL) { }
     Kis_Net_Httpd_Handler(GlobalRegistry *in_globalreg);
     virtual ~Kis_Net_Httpd_Handler();
 
     // Bind a http server if we need to do that later in the instantiation
     void Bind_Httpd_Server(GlobalRegistry *in_globalreg);
 
+    // Register a route for this handler with the bound http server; see
+    // Kis_Net_Httpd_Route_Table for the pattern format.  The route id is 
+    // handed back to the handler with the captured parameters.
+    // Returns false if there is no server or the pattern is invalid.
+    bool Httpd_RegisterRoute(string in_method, string in_pattern, 
+            int in_route_id = 0);
+
+    // Register a route whose responses may be cached.  Cached responses are
+    // valid until the generation changes, and are served for up to the max
+    // staleness after that.  A NULL generation caches by age alone.  Only
+    // meaningful for stream handlers.
+    bool Httpd_RegisterCachedRoute(string in_method, string in_pattern,
+            int in_route_id, Kis_Net_Httpd_Generation *in_generation);
+
     // Handle a request
     virtual int Httpd_HandleRequest(Kis_Net_Httpd *httpd,
             struct MHD_Connection *connection,
             const char *url, const char *method, const char *upload_data,
             size_t *upload_data_size) = 0;
 
-    // Can this handler process this request?
-    virtual bool Httpd_VerifyPath(const char *path, const char *method) = 0;
+    // Can this handler process this request?  Only consulted for handlers 
+    // which don't register routes.
+    virtual bool Httpd_VerifyPath(const char *path __attribute__((unused)), 
+            const char *method __attribute__((unused))) {
+        return false;
+    }
+
+    // Handle a request which matched a route registered by this handler.  By
+    // default routed requests are handled like any other request.
+    virtual int Httpd_HandleRoutedRequest(Kis_Net_Httpd *httpd,
+            struct MHD_Connection *connection,
+            int route_id __attribute__((unused)), 
+            Kis_Net_Httpd_Route_Params &params __attribute__((unused)),
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size) {
+        return Httpd_HandleRequest(httpd, connection, url, method, 
+                upload_data, upload_data_size);
+    }
 
     // Post handler.  By default does nothing and bails on the post data.
     // Override this to do useful post interpreting.
@@ -94,34 +234,115 @@ public:
         Kis_Net_Httpd_Handler(in_globalreg) { };
     virtual ~Kis_Net_Httpd_Stream_Handler() { };
 
-    virtual bool Httpd_VerifyPath(const char *path, const char *method) = 0;
-
     virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
             struct MHD_Connection *connection,
             const char *url, const char *method, const char *upload_data,
             size_t *upload_data_size, std::stringstream &stream) = 0;
 
+    // Generate the response to a routed request, and return the HTTP 
+    // response code.  By default this ignores the route and generates the 
+    // normal stream response.
+    virtual int Httpd_CreateRoutedResponse(Kis_Net_Httpd *httpd,
+            struct MHD_Connection *connection, 
+            int route_id __attribute__((unused)), 
+            Kis_Net_Httpd_Route_Params &params __attribute__((unused)),
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size, std::stringstream &stream) {
+        Httpd_CreateStreamResponse(httpd, connection, url, method, upload_data,
+                upload_data_size, stream);
+        return MHD_HTTP_OK;
+    }
+
     virtual int Httpd_HandleRequest(Kis_Net_Httpd *httpd, 
             struct MHD_Connection *connection,
             const char *url, const char *method, const char *upload_data,
             size_t *upload_data_size);
+
+    virtual int Httpd_HandleRoutedRequest(Kis_Net_Httpd *httpd,
+            struct MHD_Connection *connection, int route_id,
+            Kis_Net_Httpd_Route_Params &params,
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size);
 };
 
 // Fallback handler to report that we can't serve static files
 class Kis_Net_Httpd_No_Files_Handler : public Kis_Net_Httpd_Stream_Handler {
 public:
-    virtual bool Httpd_VerifyPath(const char *path, const char *method);
-
     virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
             struct MHD_Connection *connection,
             const char *url, const char *method, const char *upload_data,
             size_t *upload_data_size, std::stringstream &stream);
 };
 
+// Worker pool, endpoint queue, response cache, and request metrics
+class Kis_Net_Httpd_Stats_Handler : public Kis_Net_Httpd_Stream_Handler {
+public:
+    Kis_Net_Httpd_Stats_Handler(GlobalRegistry *in_globalreg) :
+        Kis_Net_Httpd_Stream_Handler(in_globalreg) { }
+
+    enum httpd_route {
+        route_queue, route_cache, route_stats, route_prometheus,
+
+        route_msgpack = 0x100
+    };
+
+    virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd __attribute__((unused)),
+            struct MHD_Connection *connection __attribute__((unused)),
+            const char *url __attribute__((unused)), 
+            const char *method __attribute__((unused)), 
+            const char *upload_data __attribute__((unused)),
+            size_t *upload_data_size __attribute__((unused)), 
+            std::stringstream &stream __attribute__((unused))) { }
+
+    virtual int Httpd_CreateRoutedResponse(Kis_Net_Httpd *httpd,
+            struct MHD_Connection *connection, int route_id,
+            Kis_Net_Httpd_Route_Params &params,
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size, std::stringstream &stream);
+};
+
 #define KIS_SESSION_COOKIE      "KISMET"
 #define KIS_HTTPD_POSTBUFFERSZ  (1024 * 32)
 
 // Connection data, used for processing POST requests
+// Static file from the data dir, held in memory with everything needed to
+// answer a request worked out ahead of time.  The data dir is loaded when the
+// server starts and anything new is loaded on first request; assets are 
+// dropped and reloaded when the file changes.  Responses send straight from
+// the asset bodies and the connection holds a reference until the request
+// completes, so a replaced asset counts against the cache size until the 
+// last response sending it is done.  Files which don't fit are sent from the
+// file with sendfile.
+class Kis_Net_Httpd_Static_Asset {
+public:
+    // Resolved path
+    string path;
+
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+
+    string mime;
+    string lastmod;
+    string etag, gz_etag;
+
+    // Content-Encoding matters for this type
+    bool compressible;
+
+    string body;
+
+    // Precompressed .gz sibling or compressed at load, empty if there isn't
+    // one
+    string gz_body;
+
+    // File changed, reload on the next request
+    bool stale;
+
+    // The asset map and each connection sending from it, guarded by the 
+    // httpd asset_mutex
+    unsigned int refs;
+};
+
 class Kis_Net_Httpd_Connection {
 public:
     const static int CONNECTION_GET = 0;
@@ -147,12 +368,62 @@ public:
     // Handler
     Kis_Net_Httpd_Handler *httpdhandler;    
 
-    // Session
+    // Route matched by the handler, if any, and captured parameters
+    bool routed;
+    int route_id;
+    Kis_Net_Httpd_Route_Params route_params;
+
+    // Endpoint of the matched route; NULL for legacy handlers
+    Kis_Net_Httpd_Endpoint *endpoint;
+
+    // Response cache key and the generation the response is being built
+    // from, if the endpoint is cached and the lookup missed
+    string cache_key;
+    uint64_t cache_generation;
+
+    // Deferred responses, generated by the worker pool in event mode while
+    // the MHD connection is suspended
+    const static int DEFER_NONE = 0;
+    const static int DEFER_QUEUED = 1;
+    const static int DEFER_DONE = 2;
+    int deferred_state;
+
+    struct MHD_Connection *connection;
+    string method;
+
+    // Session, if the request had a valid one.  Sessions can be reclaimed 
+    // at any time after the lookup, so only test this against NULL.
     Kis_Net_Httpd_Session *session;
+
+    // Request timing for the endpoint metrics, in microseconds on the 
+    // monotonic clock; 0 for steps the request didn't go through
+    uint64_t time_start;
+    uint64_t time_routed;
+    uint64_t time_ready;
+    uint64_t time_generate_start;
+    uint64_t time_generate_end;
+    uint64_t time_send_start;
+
+    // Size of the response body before compression, or -1 if the handler
+    // sent the response itself
+    int64_t response_size;
+
+    // Static asset the response sends from; the reference is released when
+    // the request completes
+    Kis_Net_Httpd_Static_Asset *asset;
 };
 
 class Kis_Net_Httpd_Session {
 public:
+    Kis_Net_Httpd_Session() {
+        session_created = 0;
+        session_seen = 0;
+        session_lifetime = 0;
+        session_logged = 0;
+        session_removed = 0;
+        session_next = NULL;
+    }
+
     // Session ID
     string sessionid;
 
@@ -164,6 +435,245 @@ public:
 
     // Amount of time session is valid for after last active
     time_t session_lifetime;
+
+    // Last seen time written to the session log
+    time_t session_logged;
+
+    // Removed from the session table, waiting to be reclaimed
+    int session_removed;
+
+    // Next session in the table bucket
+    Kis_Net_Httpd_Session *session_next;
+};
+
+// Concurrent session table.
+//
+// Lookups are lock-free:  sessions hang off a fixed array of bucket lists 
+// which readers walk inside a read section, without taking a lock.  Writers
+// are serialized with a mutex; a removed session is unlinked straight away,
+// but only freed by Reclaim once every read section which could still see it
+// has ended.  Read sections are counted per epoch; Reclaim advances the epoch
+// and waits for the sections counted under the previous one.
+class Kis_Net_Httpd_Session_Table {
+public:
+    Kis_Net_Httpd_Session_Table(unsigned int in_buckets);
+    ~Kis_Net_Httpd_Session_Table();
+
+    // Enter and leave a read section.  Sessions found inside a read section
+    // stay valid until it ends.
+    unsigned int ReadLock();
+    void ReadUnlock(unsigned int in_epoch);
+
+    // Find a session; must be called inside a read section
+    Kis_Net_Httpd_Session *Find(const string &in_key);
+
+    // Add a session; the table owns it from here on.  Returns false if the
+    // key is already in use.
+    bool Insert(Kis_Net_Httpd_Session *in_session);
+
+    // Remove a session.  Returns false if it wasn't in the table.
+    bool Remove(const string &in_key);
+
+    // Free removed sessions which no reader can still see.  Only one thread
+    // may reclaim at a time.
+    void Reclaim();
+
+    // Copy the current sessions
+    void Snapshot(std::vector<Kis_Net_Httpd_Session> *ret_sessions);
+
+    unsigned int Size();
+
+protected:
+    unsigned int Hash(const string &in_key);
+
+    unsigned int num_buckets;
+    Kis_Net_Httpd_Session **buckets;
+
+    pthread_mutex_t write_mutex;
+
+    // Removed sessions not yet freed, guarded by the write mutex
+    std::vector<Kis_Net_Httpd_Session *> retired;
+
+    unsigned int num_sessions;
+
+    unsigned int epoch;
+    unsigned int readers[2];
+};
+
+// Registered endpoint (method and route pattern), tracking the concurrency
+// limit and queue state of requests to it.  Guarded by the httpd work mutex,
+// except for the request metrics, which are only updated atomically.
+class Kis_Net_Httpd_Endpoint {
+public:
+    Kis_Net_Httpd_Endpoint() {
+        max_concurrent = 0;
+        active = 0;
+        peak_queued = 0;
+        served = 0;
+        rejected = 0;
+        cached = false;
+        generation = NULL;
+        cache_hits = 0;
+        cache_misses = 0;
+        requests = 0;
+        in_flight = 0;
+        aborted = 0;
+        response_bytes = 0;
+
+        for (unsigned int x = 0; x < 4; x++)
+            responses[x] = 0;
+    }
+
+    string method;
+    string pattern;
+
+    // Maximum number of requests handled at once, or 0 for no limit
+    unsigned int max_concurrent;
+
+    // Requests currently being handled
+    unsigned int active;
+
+    // Deferred requests waiting for a free slot
+    std::deque<Kis_Net_Httpd_Connection *> waiting;
+    unsigned int peak_queued;
+
+    uint64_t served;
+    uint64_t rejected;
+
+    // Response caching; guarded by the httpd cache mutex
+    bool cached;
+    Kis_Net_Httpd_Generation *generation;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+
+    // Request metrics.  Requests are counted when they complete; in flight
+    // covers requests from routing until the response has been sent.
+    uint64_t requests;
+    unsigned int in_flight;
+
+    // Completed responses by status class (2xx to 5xx), requests whose 
+    // connection ended before the response was sent, and body bytes
+    uint64_t responses[4];
+    uint64_t aborted;
+    uint64_t response_bytes;
+
+    // Time spent, in microseconds, routing the request, waiting for a 
+    // worker or a free slot on the endpoint, generating the response, and
+    // sending it, and the whole request
+    Kis_Net_Httpd_Histogram route_time;
+    Kis_Net_Httpd_Histogram wait_time;
+    Kis_Net_Httpd_Histogram generate_time;
+    Kis_Net_Httpd_Histogram send_time;
+    Kis_Net_Httpd_Histogram total_time;
+
+    // Response body sizes
+    Kis_Net_Httpd_Histogram response_size;
+};
+
+// Cached response body.  Entries are never changed once cached, apart from
+// adding the gzip form; a newer response replaces the entry, and requests 
+// sending an entry hold a reference so they can send it without holding the
+// cache lock.
+class Kis_Net_Httpd_Cache_Entry {
+public:
+    Kis_Net_Httpd_Cache_Entry() {
+        refs = 1;
+        gzip_ready = false;
+    }
+
+    void Ref() {
+        __sync_add_and_fetch(&refs, 1);
+    }
+
+    void Unref() {
+        if (__sync_sub_and_fetch(&refs, 1) == 0)
+            delete(this);
+    }
+
+    string body;
+
+    // gzip encoding of the body, made the first time a client accepts it.
+    // Only set once, under cache_mutex, before gzip_ready.
+    string gzip_body;
+    bool gzip_ready;
+
+    int httpcode;
+    uint64_t generation;
+    struct timeval created;
+
+    // Position in the eviction order
+    std::list<string>::iterator lru_pos;
+
+protected:
+    int refs;
+};
+
+// REST route table.
+//
+// Handlers register path patterns once, and dispatch is a walk of a trie of
+// path segments, so the cost of routing a request depends only on the depth of
+// the URL, not on how many handlers exist or what they track.
+//
+// Patterns are made of literal segments and typed captures, for example
+//   /devices/by-key/{key:uint}/{format}/{path:*}
+// Capture types are string (the default), int, uint, mac, and * (the remaining
+// segments, possibly none, which must be the last segment of the pattern).  A
+// typed capture only matches a segment which parses as that type.  Literal 
+// segments are tried before captures.
+class Kis_Net_Httpd_Route_Table {
+public:
+    Kis_Net_Httpd_Route_Table();
+    ~Kis_Net_Httpd_Route_Table();
+
+    // Returns false if the pattern is malformed
+    bool AddRoute(Kis_Net_Httpd_Handler *in_handler, string in_method,
+            string in_pattern, int in_route_id, 
+            Kis_Net_Httpd_Endpoint *in_endpoint = NULL);
+
+    void RemoveHandler(Kis_Net_Httpd_Handler *in_handler);
+
+    // Find the handler for a request and capture the parameters.
+    // Returns NULL if no route matches.
+    Kis_Net_Httpd_Handler *Match(const char *in_url, const char *in_method,
+            int *ret_route_id, Kis_Net_Httpd_Route_Params *ret_params,
+            Kis_Net_Httpd_Endpoint **ret_endpoint = NULL);
+
+protected:
+    enum capture_type {
+        capture_string, capture_int, capture_uint, capture_mac, capture_tail
+    };
+
+    struct route_target {
+        Kis_Net_Httpd_Handler *handler;
+        int route_id;
+        Kis_Net_Httpd_Endpoint *endpoint;
+    };
+
+    struct route_node;
+
+    struct capture_edge {
+        string name;
+        capture_type type;
+        route_node *child;
+    };
+
+    struct route_node {
+        std::map<string, route_node *> literals;
+        std::vector<capture_edge> captures;
+        std::map<string, route_target> methods;
+    };
+
+    void DeleteNode(route_node *in_node);
+    void RemoveHandler(route_node *in_node, Kis_Net_Httpd_Handler *in_handler);
+
+    bool MatchNode(route_node *in_node, const std::vector<string> &in_segments,
+            unsigned int in_pos, const char *in_method, route_target **ret_target,
+            Kis_Net_Httpd_Route_Params *ret_params);
+
+    static bool CaptureSegment(capture_type in_type, const string &in_segment,
+            Kis_Net_Httpd_Route_Param *ret_param);
+
+    route_node *root;
 };
 
 class Kis_Net_Httpd : public LifetimeGlobal {
@@ -177,10 +687,20 @@ public:
     bool HttpdRunning() { return running; }
     unsigned int FetchPort() { return http_port; };
     bool FetchUsingSSL() { return use_ssl; };
+    bool FetchEventMode() { return event_mode; };
 
     void RegisterHandler(Kis_Net_Httpd_Handler *in_handler);
     void RemoveHandler(Kis_Net_Httpd_Handler *in_handler);
 
+    // Register a route for a handler; routed handlers are no longer probed 
+    // via Httpd_VerifyPath
+    bool RegisterRoute(Kis_Net_Httpd_Handler *in_handler, string in_method,
+            string in_pattern, int in_route_id);
+
+    // Enable response caching for a registered route
+    bool CacheRoute(string in_method, string in_pattern, 
+            Kis_Net_Httpd_Generation *in_generation);
+
     void RegisterMimeType(string suffix, string mimetype);
     string GetMimeType(string suffix);
 
@@ -188,11 +708,41 @@ public:
     bool HasValidSession(Kis_Net_Httpd_Connection *connection);
     void CreateSession(struct MHD_Response *response, time_t in_lifetime);
 
-    // Generic response sender
+    // Snapshot of the worker pool and per-endpoint queue state, as a tracked
+    // map for serialization
+    TrackerElement *FetchQueueStats();
+
+    // Response cache counters and per-endpoint hit rates
+    TrackerElement *FetchCacheStats();
+
+    // Per-endpoint request counts, latency and response sizes
+    TrackerElement *FetchRequestStats();
+
+    // The same metrics in the Prometheus text format
+    void WritePrometheusStats(std::ostream &stream);
+
+    // Microseconds on the monotonic clock, for request timing
+    static uint64_t TimeUsec();
+
+    // Generic response sender; compresses the response if the client 
+    // accepts it
     static int SendHttpResponse(Kis_Net_Httpd *httpd,
             struct MHD_Connection *connection, 
             const char *url, int httpcode, string responsestr);
 
+    // Content codings we can produce
+    enum http_encoding {
+        encoding_identity, encoding_gzip, encoding_deflate
+    };
+
+    // Pick the content coding for a response of a given size from the 
+    // client Accept-Encoding header
+    int NegotiateEncoding(struct MHD_Connection *connection, size_t in_size);
+
+    // Compress a body; compressor state is kept per thread and reused.
+    // Returns false if compression isn't available or failed.
+    bool CompressBody(const string &in_body, int in_encoding, string &out_body);
+
     // Catch MHD panics and try to close more elegantly
     static void MHD_Panic(void *cls, const char *file, unsigned int line,
             const char *reason);
@@ -208,6 +758,11 @@ protected:
     struct MHD_Daemon *microhttpd;
     std::vector<Kis_Net_Httpd_Handler *> handler_vec;
 
+    // Routed handlers are found via the route table; handlers which haven't
+    // registered any routes are probed with Httpd_VerifyPath
+    Kis_Net_Httpd_Route_Table route_table;
+    std::vector<Kis_Net_Httpd_Handler *> unrouted_handler_vec;
+
     bool use_ssl;
     char *cert_pem, *cert_key;
     string pem_path, key_path;
@@ -218,6 +773,142 @@ protected:
 
     pthread_mutex_t controller_mutex;
 
+    // Endpoints by "method pattern", and concurrency limits from the config
+    // by pattern
+    std::map<string, Kis_Net_Httpd_Endpoint *> endpoint_map;
+    std::map<string, unsigned int> endpoint_limit_map;
+    unsigned int endpoint_default_limit;
+
+    // Event mode runs MHD on its internal epoll loop with a small pool of
+    // IO threads; stream responses are generated by a fixed pool of workers
+    // while the connection is suspended, so a slow handler never holds up
+    // the event loop.  Thread mode is the classic thread-per-connection.
+    bool event_mode;
+    unsigned int io_threads;
+    unsigned int max_connections;
+
+    unsigned int num_workers;
+    std::vector<pthread_t> worker_tids;
+    bool workers_shutdown;
+
+    // Work queue and endpoint state
+    pthread_mutex_t work_mutex;
+    pthread_cond_t work_cond;
+    std::deque<Kis_Net_Httpd_Connection *> work_queue;
+
+    // Deferred requests queued or waiting on an endpoint, and the limit on
+    // how many can be pending before new ones are refused
+    unsigned int pending_requests;
+    unsigned int peak_pending_requests;
+    unsigned int max_pending_requests;
+    unsigned int workers_busy;
+    uint64_t deferred_requests;
+
+    // Take a slot on an endpoint for a request handled in the MHD thread;
+    // returns false if the endpoint is at its limit
+    bool AcquireEndpoint(Kis_Net_Httpd_Endpoint *in_endpoint);
+    void ReleaseEndpoint(Kis_Net_Httpd_Endpoint *in_endpoint);
+
+    // Suspend a connection and queue it for the workers; returns false if 
+    // the pending queue is full
+    bool QueueDeferred(Kis_Net_Httpd_Connection *in_concls);
+
+    void StartWorkers();
+    void StopWorkers();
+
+    static void *worker_thread(void *in_aux);
+
+    // Build a stream handler response into the connection response stream,
+    // and cache it if the endpoint is cached
+    void GenerateStreamResponse(Kis_Net_Httpd_Connection *in_concls);
+
+    // Send a generated response and note it for the endpoint metrics
+    int SendStreamResponse(Kis_Net_Httpd_Connection *in_concls);
+
+    // Add a finished request to its endpoint metrics
+    static void RecordRequest(Kis_Net_Httpd_Connection *in_concls,
+            bool in_completed);
+
+    // Response cache of rendered bodies, keyed by path and query string
+    bool cache_enabled;
+    unsigned int cache_max_staleness;
+    unsigned int cache_max_entries;
+
+    pthread_mutex_t cache_mutex;
+    std::map<string, Kis_Net_Httpd_Cache_Entry *> response_cache;
+
+    // Cache keys, most recently used first
+    std::list<string> cache_lru;
+
+    uint64_t cache_hits;
+    uint64_t cache_stale_hits;
+    uint64_t cache_misses;
+    uint64_t cache_evictions;
+
+    // Queue a response body which is already in its final encoding
+    int SendEncodedResponse(struct MHD_Connection *connection, const char *url,
+            int httpcode, const string &body, int encoding);
+
+    // Queue a response body compressed a block at a time as MHD sends it, 
+    // instead of compressing all of it up front.  Takes the contents of 
+    // io_body.  Returns -1 if compression isn't available.
+    int SendCompressedResponse(struct MHD_Connection *connection, 
+            const char *url, int httpcode, string &io_body, int encoding);
+
+    // Last-Modified, Content-Type and coding headers of a generated response
+    void AddResponseHeaders(struct MHD_Response *response, const char *url, 
+            int encoding);
+
+    // Response compression
+    bool compress_enabled;
+    unsigned int compress_min_size;
+    int compress_level;
+
+    // Static files from the data dir which fit in the cache; see 
+    // Kis_Net_Httpd_Static_Asset
+    typedef Kis_Net_Httpd_Static_Asset static_asset;
+
+    // Files which didn't fit in the cache, by url, along with the file they
+    // were; they're sent from the file until it changes or the cache frees
+    // up space, instead of being loaded again on each request
+    struct static_uncached {
+        string path;
+        ino_t ino;
+        off_t size;
+        time_t mtime;
+    };
+
+    pthread_mutex_t asset_mutex;
+    std::map<string, static_asset *> asset_map;
+    std::map<string, static_uncached> asset_uncached;
+    size_t asset_bytes;
+    unsigned int asset_max_bytes;
+
+    // Change notification for the directories holding cached assets; 
+    // without inotify, cached assets are checked with stat on each request
+    int asset_notify_fd;
+    std::map<int, string> asset_watch_map;
+
+    // Load everything under the data dir
+    void PreloadStaticAssets(const string &in_dir, const string &in_url);
+
+    // Find the asset for a url, loading it if it isn't cached or has
+    // changed.  Returns NULL if the file can't be cached.  The result holds
+    // a reference, and stays valid unlocked until it's released.
+    static_asset *FetchStaticAsset(const string &in_url);
+    void ReleaseStaticAsset(static_asset *in_asset);
+    static_asset *LoadStaticAsset(const string &in_url);
+    void RetireStaticAsset(std::map<string, static_asset *>::iterator in_asset);
+    void UnrefStaticAsset(static_asset *in_asset);
+    void WatchStaticDir(const string &in_dir);
+    void CheckStaticChanges();
+
+    // Serve a cached response if there is a usable one; otherwise set up
+    // the connection so the generated response gets stored
+    bool CacheLookup(Kis_Net_Httpd_Connection *in_concls, 
+            struct MHD_Connection *in_connection, const char *in_url, int *ret);
+    void CacheStore(Kis_Net_Httpd_Connection *in_concls);
+
     // Handle the requests and dispatch to controllers
     static int http_request_handler(void *cls, struct MHD_Connection *connection,
             const char *url, const char *method, const char *version,
@@ -227,7 +918,7 @@ protected:
             void **con_cls, enum MHD_RequestTerminationCode toe);
 
     static int handle_static_file(void *cls, struct MHD_Connection *connection,
-            const char *url, const char *method);
+            const char *url, const char *method, void **ptr);
 
     static int http_post_handler(void *coninfo_cls, enum MHD_ValueKind kind, 
             const char *key, const char *filename, const char *content_type,
@@ -238,14 +929,38 @@ protected:
 
     void AddSession(Kis_Net_Httpd_Session *in_session);
     void DelSession(string in_key);
-    void DelSession(map<string, Kis_Net_Httpd_Session *>::iterator in_itr);
-    void WriteSessions();
 
-    map<string, Kis_Net_Httpd_Session *> session_map;
+    // Look up the session for a cookie and mark it seen; expired sessions 
+    // are removed.  Returns NULL if there is no valid session.  Must be 
+    // called inside a session table read section.
+    Kis_Net_Httpd_Session *TouchSession(const char *in_key);
+
+    // Sessions are persisted as an append-only log of session= and expire=
+    // lines, written by a background flusher; the log is compacted to a 
+    // snapshot of the live sessions when it grows well past their number
+    void LoadSessions();
+    void QueueSessionLog(const string &in_line);
+    void FlushSessionLog();
+    void CompactSessionLog();
+
+    static void *session_flush_thread(void *in_aux);
+
+    Kis_Net_Httpd_Session_Table session_table;
 
     bool store_sessions;
     string sessiondb_file;
-    ConfigFile *session_db;
+
+    pthread_mutex_t session_log_mutex;
+    pthread_cond_t session_log_cond;
+    std::vector<string> session_log_pending;
+    bool session_flush_shutdown;
+    bool session_flush_running;
+    pthread_t session_flush_tid;
+    unsigned int session_flush_interval;
+
+    // Only touched by the flusher
+    FILE *session_log;
+    unsigned int session_log_lines;
 
 };
 
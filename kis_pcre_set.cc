@@ -0,0 +1,383 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#ifdef HAVE_LIBPCRE
+
+#include <ctype.h>
+#include <string.h>
+#include <sstream>
+#include <algorithm>
+
+#include "util.h"
+#include "kis_pcre_set.h"
+
+Kis_Pcre_Set::Kis_Pcre_Set() {
+    dirty = true;
+    num_classes = 1;
+    memset(byte_class, 0, sizeof(byte_class));
+}
+
+Kis_Pcre_Set::~Kis_Pcre_Set() {
+    for (unsigned int i = 0; i < pattern_vec.size(); i++) {
+        pcre_free(pattern_vec[i].re);
+        if (pattern_vec[i].study != NULL)
+            pcre_free(pattern_vec[i].study);
+    }
+}
+
+int Kis_Pcre_Set::AddPattern(const string &in_pattern, string *ret_error) {
+    pcre_pattern p;
+    const char *error, *study_err;
+    int erroffset;
+
+    p.pattern = in_pattern;
+
+    p.re = pcre_compile(in_pattern.c_str(), 0, &error, &erroffset, NULL);
+    if (p.re == NULL) {
+        ostringstream osstr;
+        osstr << "Could not parse PCRE expression: " << error << 
+            " at " << erroffset;
+        *ret_error = osstr.str();
+        return -1;
+    }
+
+    // A NULL study just means there's nothing to optimize
+    study_err = NULL;
+    p.study = pcre_study(p.re, 0, &study_err);
+    if (study_err != NULL) {
+        *ret_error = "Could not parse PCRE expression, study/optimization "
+            "failure: " + string(study_err);
+        pcre_free(p.re);
+        return -1;
+    }
+
+    pattern_vec.push_back(p);
+
+    string literal = StrLower(RequiredLiteral(in_pattern));
+
+    // Single characters match too often to be worth filtering on
+    if (literal.length() < 2) {
+        unfiltered_vec.push_back(pattern_vec.size() - 1);
+        literal = "";
+    }
+
+    literal_vec.push_back(literal);
+
+    dirty = true;
+    cache_map.clear();
+
+    return pattern_vec.size() - 1;
+}
+
+string Kis_Pcre_Set::RequiredLiteral(const string &in_pattern) {
+    string best, cur;
+    // Was the last atom a literal character on the end of cur
+    bool last_literal = false;
+    size_t i = 0;
+    size_t len = in_pattern.length();
+
+    while (i < len) {
+        char c = in_pattern[i];
+
+        if (c == '\\') {
+            if (i + 1 >= len)
+                return "";
+
+            char e = in_pattern[i + 1];
+            i += 2;
+
+            if (isalnum((unsigned char) e)) {
+                // Classes and assertions break the literal; anything else
+                // (hex, octal, backrefs, \Q quoting, properties) we don't
+                // try to interpret
+                if (strchr("dDwWsSbBAzZGhHvVR", e) == NULL)
+                    return "";
+
+                if (cur.length() > best.length())
+                    best = cur;
+                cur = "";
+                last_literal = false;
+                continue;
+            }
+
+            cur += e;
+            last_literal = true;
+            continue;
+        }
+
+        if (c == '[') {
+            // Skip the class; a ] first in the class is literal
+            i++;
+            if (i < len && in_pattern[i] == '^')
+                i++;
+            if (i < len && in_pattern[i] == ']')
+                i++;
+            while (i < len && in_pattern[i] != ']') {
+                if (in_pattern[i] == '\\')
+                    i++;
+                i++;
+            }
+            i++;
+
+            if (cur.length() > best.length())
+                best = cur;
+            cur = "";
+            last_literal = false;
+            continue;
+        }
+
+        if (c == '(') {
+            // Option settings like (?i) are fine (matching is case folded
+            // anyway), but extended mode changes what's literal
+            if (i + 1 < len && in_pattern[i + 1] == '?') {
+                size_t o = i + 2;
+                while (o < len && (isalpha((unsigned char) in_pattern[o]) ||
+                            in_pattern[o] == '-')) {
+                    if (in_pattern[o] == 'x')
+                        return "";
+                    o++;
+                }
+            }
+
+            // Skip the group, which may not be required or may alternate
+            int depth = 0;
+            while (i < len) {
+                if (in_pattern[i] == '\\') {
+                    i += 2;
+                    continue;
+                }
+
+                if (in_pattern[i] == '[') {
+                    i++;
+                    if (i < len && in_pattern[i] == '^')
+                        i++;
+                    if (i < len && in_pattern[i] == ']')
+                        i++;
+                    while (i < len && in_pattern[i] != ']') {
+                        if (in_pattern[i] == '\\')
+                            i++;
+                        i++;
+                    }
+                } else if (in_pattern[i] == '(') {
+                    depth++;
+                } else if (in_pattern[i] == ')') {
+                    if (--depth == 0)
+                        break;
+                }
+
+                i++;
+            }
+            i++;
+
+            if (cur.length() > best.length())
+                best = cur;
+            cur = "";
+            last_literal = false;
+            continue;
+        }
+
+        // Alternatives at the top level don't share a required literal
+        if (c == '|')
+            return "";
+
+        if (c == '?' || c == '*' || 
+                (c == '{' && i + 1 < len && in_pattern[i + 1] == '0')) {
+            // The last atom is optional
+            if (last_literal)
+                cur.erase(cur.length() - 1);
+        }
+
+        if (c == '{' && i + 1 < len && isdigit((unsigned char) in_pattern[i + 1])) {
+            while (i < len && in_pattern[i] != '}')
+                i++;
+            i++;
+
+            if (cur.length() > best.length())
+                best = cur;
+            cur = "";
+            last_literal = false;
+            continue;
+        }
+
+        if (c == '?' || c == '*' || c == '+' || c == '.' || 
+                c == '^' || c == '$') {
+            if (cur.length() > best.length())
+                best = cur;
+            cur = "";
+            last_literal = false;
+            i++;
+            continue;
+        }
+
+        cur += c;
+        last_literal = true;
+        i++;
+    }
+
+    if (cur.length() > best.length())
+        best = cur;
+
+    return best;
+}
+
+void Kis_Pcre_Set::Compile() {
+    // Byte classes from the literals, folding case
+    memset(byte_class, 0, sizeof(byte_class));
+    num_classes = 1;
+
+    for (unsigned int p = 0; p < literal_vec.size(); p++) {
+        for (unsigned int c = 0; c < literal_vec[p].length(); c++) {
+            uint8_t b = (uint8_t) literal_vec[p][c];
+
+            if (byte_class[b] == 0) {
+                byte_class[b] = num_classes;
+                if (b >= 'a' && b <= 'z')
+                    byte_class[b - 'a' + 'A'] = num_classes;
+                num_classes++;
+            }
+        }
+    }
+
+    // Build the trie, with -1 for missing transitions
+    dfa.assign(num_classes, -1);
+    dfa_out.assign(1, vector<int>());
+
+    for (unsigned int p = 0; p < literal_vec.size(); p++) {
+        if (literal_vec[p].length() == 0)
+            continue;
+
+        int state = 0;
+
+        for (unsigned int c = 0; c < literal_vec[p].length(); c++) {
+            unsigned int cls = byte_class[(uint8_t) literal_vec[p][c]];
+            int next = dfa[state * num_classes + cls];
+
+            if (next < 0) {
+                next = dfa_out.size();
+                dfa[state * num_classes + cls] = next;
+                dfa.resize(dfa.size() + num_classes, -1);
+                dfa_out.push_back(vector<int>());
+            }
+
+            state = next;
+        }
+
+        dfa_out[state].push_back(p);
+    }
+
+    // Fill in the failure transitions breadth first, so every state has a
+    // transition for every class, and collect the outputs of the suffixes
+    vector<int> fail(dfa_out.size(), 0);
+    vector<int> queue;
+
+    for (unsigned int cls = 0; cls < num_classes; cls++) {
+        int next = dfa[cls];
+
+        if (next < 0) {
+            dfa[cls] = 0;
+        } else {
+            fail[next] = 0;
+            queue.push_back(next);
+        }
+    }
+
+    for (unsigned int q = 0; q < queue.size(); q++) {
+        int state = queue[q];
+
+        dfa_out[state].insert(dfa_out[state].end(), 
+                dfa_out[fail[state]].begin(), dfa_out[fail[state]].end());
+
+        for (unsigned int cls = 0; cls < num_classes; cls++) {
+            int next = dfa[state * num_classes + cls];
+
+            if (next < 0) {
+                dfa[state * num_classes + cls] = dfa[fail[state] * num_classes + cls];
+            } else {
+                fail[next] = dfa[fail[state] * num_classes + cls];
+                queue.push_back(next);
+            }
+        }
+    }
+
+    dirty = false;
+}
+
+int Kis_Pcre_Set::Match(const string &in_text, vector<int> *ret_ids) {
+    if (dirty)
+        Compile();
+
+    vector<int> candidates = unfiltered_vec;
+
+    int state = 0;
+    for (unsigned int i = 0; i < in_text.length(); i++) {
+        state = dfa[state * num_classes + byte_class[(uint8_t) in_text[i]]];
+
+        if (dfa_out[state].size() != 0)
+            candidates.insert(candidates.end(), dfa_out[state].begin(),
+                    dfa_out[state].end());
+    }
+
+    sort(candidates.begin(), candidates.end());
+    candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+
+    int num = 0;
+
+    for (unsigned int c = 0; c < candidates.size(); c++) {
+        int ovector[128];
+        pcre_pattern &p = pattern_vec[candidates[c]];
+
+        if (pcre_exec(p.re, p.study, in_text.c_str(), in_text.length(), 
+                    0, 0, ovector, 128) >= 0) {
+            ret_ids->push_back(candidates[c]);
+            num++;
+        }
+    }
+
+    return num;
+}
+
+int Kis_Pcre_Set::MatchCached(const string &in_text, uint32_t in_csum,
+        vector<int> *ret_ids) {
+    map<uint32_t, cache_rec>::iterator ci = cache_map.find(in_csum);
+
+    // Checksums can collide, so make sure it's the same text
+    if (ci != cache_map.end() && ci->second.text == in_text) {
+        ret_ids->insert(ret_ids->end(), ci->second.ids.begin(), 
+                ci->second.ids.end());
+        return ci->second.ids.size();
+    }
+
+    // Keep the cache from growing without bound on changing text
+    if (cache_map.size() > 4096)
+        cache_map.clear();
+
+    cache_rec &rec = cache_map[in_csum];
+    rec.text = in_text;
+    rec.ids.clear();
+
+    Match(in_text, &(rec.ids));
+
+    ret_ids->insert(ret_ids->end(), rec.ids.begin(), rec.ids.end());
+
+    return rec.ids.size();
+}
+
+#endif
+
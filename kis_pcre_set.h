@@ -0,0 +1,104 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_PCRE_SET_H__
+#define __KIS_PCRE_SET_H__
+
+#include "config.h"
+
+#ifdef HAVE_LIBPCRE
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <pcre.h>
+
+// A set of PCREs matched together.  Each pattern contributes the longest
+// literal it can't match without (when it has one), and the literals are
+// compiled into one case-folded Aho-Corasick DFA; a single pass over the
+// text finds the patterns whose literal is present, and only those (plus
+// patterns without a usable literal) are run through PCRE to confirm.
+// Matching hundreds of watch-list patterns against an SSID then costs one
+// scan and a few PCRE runs instead of a PCRE run per pattern.
+//
+// Results can be cached by a checksum of the text, such as the ssid_csum
+// the 802.11 dissector computes, so the same SSID seen over and over is only
+// matched once.
+//
+// Not thread safe; callers sharing a set across threads must lock it.
+class Kis_Pcre_Set {
+public:
+    Kis_Pcre_Set();
+    ~Kis_Pcre_Set();
+
+    // Compile and add a pattern.  Returns the pattern id (the order patterns
+    // were added in), or -1 with the PCRE error in ret_error.
+    int AddPattern(const string &in_pattern, string *ret_error);
+
+    unsigned int size() { return pattern_vec.size(); }
+
+    // Find all patterns matching the text and put their ids, in order, in
+    // ret_ids.  Returns the number of patterns matched.
+    int Match(const string &in_text, vector<int> *ret_ids);
+
+    // As Match, remembering the result for the checksum of the text
+    int MatchCached(const string &in_text, uint32_t in_csum, 
+            vector<int> *ret_ids);
+
+    // Longest literal a pattern requires, or "" if there isn't a simple one
+    // (alternation at the top level, or escapes we don't interpret)
+    static string RequiredLiteral(const string &in_pattern);
+
+protected:
+    struct pcre_pattern {
+        string pattern;
+        pcre *re;
+        pcre_extra *study;
+    };
+
+    vector<pcre_pattern> pattern_vec;
+
+    // Literal for each pattern, lowercased, and patterns which always have
+    // to be run
+    vector<string> literal_vec;
+    vector<int> unfiltered_vec;
+
+    // DFA over byte classes; bytes not in any literal share class 0, and
+    // upper case shares the class of lower case.  Rebuilt on the next match
+    // after patterns are added.
+    bool dirty;
+    unsigned int num_classes;
+    uint8_t byte_class[256];
+    vector<int> dfa;
+    vector<vector<int> > dfa_out;
+
+    void Compile();
+
+    struct cache_rec {
+        string text;
+        vector<int> ids;
+    };
+
+    map<uint32_t, cache_rec> cache_map;
+};
+
+#endif
+
+#endif
+
@@ -0,0 +1,290 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_SIGNAL_STATS_H__
+#define __KIS_SIGNAL_STATS_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "packet.h"
+
+// Histogram of signal levels in 2 unit bins from -128 to 127, which covers
+// dBm and the RSSI scales in use, for percentiles of the signal.  Adding a
+// sample is one increment; when a bin fills every bin is halved, which
+// keeps the shape and lets newer samples count for more.  Two histograms 
+// merge by adding the bins.
+class kis_signal_histogram {
+public:
+    enum {
+        num_bins = 128,
+        bin_width = 2,
+        min_value = -128
+    };
+
+    kis_signal_histogram() {
+        clear();
+    }
+
+    void clear() {
+        memset(bins, 0, sizeof(bins));
+        total = 0;
+    }
+
+    void add(int in_value) {
+        unsigned int b = bin(in_value);
+
+        if (bins[b] == 0xFFFF)
+            halve();
+
+        bins[b]++;
+        total++;
+    }
+
+    void merge(const kis_signal_histogram &in_hist) {
+        uint32_t sum[num_bins];
+        uint32_t max = 0;
+
+        for (unsigned int b = 0; b < num_bins; b++) {
+            sum[b] = (uint32_t) bins[b] + in_hist.bins[b];
+            if (sum[b] > max)
+                max = sum[b];
+        }
+
+        unsigned int shift = 0;
+        while ((max >> shift) > 0xFFFF)
+            shift++;
+
+        total = 0;
+
+        for (unsigned int b = 0; b < num_bins; b++) {
+            // Round up so no bin with samples is emptied
+            bins[b] = (uint16_t) ((sum[b] + (1 << shift) - 1) >> shift);
+            total += bins[b];
+        }
+    }
+
+    uint32_t get_total() const {
+        return total;
+    }
+
+    // Signal level below which in_quantile (0 to 1) of the samples fall,
+    // interpolated within the bin; 0 if there are no samples
+    double percentile(double in_quantile) const {
+        if (total == 0)
+            return 0;
+
+        double target = in_quantile * total;
+        double cumulative = 0;
+
+        for (unsigned int b = 0; b < num_bins; b++) {
+            if (bins[b] == 0)
+                continue;
+
+            // Samples are whole numbers, so a bin's samples spread over the 
+            // bin starting half a unit below its first value
+            if (cumulative + bins[b] >= target) {
+                return min_value + (double) b * bin_width - 0.5 +
+                    bin_width * (target - cumulative) / bins[b];
+            }
+
+            cumulative += bins[b];
+        }
+
+        return min_value + num_bins * bin_width;
+    }
+
+protected:
+    uint16_t bins[num_bins];
+    uint32_t total;
+
+    static unsigned int bin(int in_value) {
+        if (in_value < min_value)
+            in_value = min_value;
+        if (in_value >= min_value + num_bins * bin_width)
+            in_value = min_value + num_bins * bin_width - 1;
+
+        return (in_value - min_value) / bin_width;
+    }
+
+    void halve() {
+        total = 0;
+
+        for (unsigned int b = 0; b < num_bins; b++) {
+            bins[b] = (bins[b] + 1) / 2;
+            total += bins[b];
+        }
+    }
+};
+
+// Running signal statistics for a device, channel, or source: last, min and
+// max of signal and noise in dBm and RSSI, the rates, carriers and 
+// encodings seen, and a histogram of the signal for percentiles.  Zero 
+// means unset for the signal values, as it always has.
+//
+// The histogram holds dBm once any dBm signal has been seen, and RSSI 
+// otherwise; records shouldn't mix the two.
+class kis_signal_agg {
+public:
+    enum hist_type {
+        hist_none, hist_dbm, hist_rssi
+    };
+
+    kis_signal_agg() {
+        last_signal_dbm = min_signal_dbm = max_signal_dbm = 0;
+        last_noise_dbm = min_noise_dbm = max_noise_dbm = 0;
+        last_signal_rssi = min_signal_rssi = max_signal_rssi = 0;
+        last_noise_rssi = min_noise_rssi = max_noise_rssi = 0;
+
+        maxseenrate = 0;
+        encodingset = 0;
+        carrierset = 0;
+
+        signal_hist_type = hist_none;
+    }
+
+    // Add a packet's signal.  Returns true if the signal is a new maximum.
+    bool add(const kis_layer1_packinfo &lay1) {
+        bool peak = false;
+
+        if (lay1.signal_type == kis_l1_signal_type_dbm) {
+            if (lay1.signal_dbm != 0) {
+                last_signal_dbm = lay1.signal_dbm;
+                update_min(&min_signal_dbm, lay1.signal_dbm);
+                peak = update_max(&max_signal_dbm, lay1.signal_dbm);
+
+                if (signal_hist_type != hist_dbm) {
+                    signal_hist.clear();
+                    signal_hist_type = hist_dbm;
+                }
+
+                signal_hist.add(lay1.signal_dbm);
+            }
+
+            if (lay1.noise_dbm != 0) {
+                last_noise_dbm = lay1.noise_dbm;
+                update_min(&min_noise_dbm, lay1.noise_dbm);
+                update_max(&max_noise_dbm, lay1.noise_dbm);
+            }
+        } else if (lay1.signal_type == kis_l1_signal_type_rssi) {
+            if (lay1.signal_rssi != 0) {
+                last_signal_rssi = lay1.signal_rssi;
+                update_min(&min_signal_rssi, lay1.signal_rssi);
+                peak = update_max(&max_signal_rssi, lay1.signal_rssi);
+
+                if (signal_hist_type != hist_dbm) {
+                    signal_hist_type = hist_rssi;
+                    signal_hist.add(lay1.signal_rssi);
+                }
+            }
+
+            if (lay1.noise_rssi != 0) {
+                last_noise_rssi = lay1.noise_rssi;
+                update_min(&min_noise_rssi, lay1.noise_rssi);
+                update_max(&max_noise_rssi, lay1.noise_rssi);
+            }
+        }
+
+        carrierset |= (uint64_t) lay1.carrier;
+        encodingset |= (uint64_t) lay1.encoding;
+
+        if (maxseenrate < lay1.datarate)
+            maxseenrate = lay1.datarate;
+
+        return peak;
+    }
+
+    // Combine the statistics of another record, such as another source's
+    // view of the same device.  The last values are taken from the merged
+    // record where it has them.
+    void merge(const kis_signal_agg &in_agg) {
+        merge_last(&last_signal_dbm, in_agg.last_signal_dbm);
+        update_min(&min_signal_dbm, in_agg.min_signal_dbm);
+        update_max(&max_signal_dbm, in_agg.max_signal_dbm);
+
+        merge_last(&last_noise_dbm, in_agg.last_noise_dbm);
+        update_min(&min_noise_dbm, in_agg.min_noise_dbm);
+        update_max(&max_noise_dbm, in_agg.max_noise_dbm);
+
+        merge_last(&last_signal_rssi, in_agg.last_signal_rssi);
+        update_min(&min_signal_rssi, in_agg.min_signal_rssi);
+        update_max(&max_signal_rssi, in_agg.max_signal_rssi);
+
+        merge_last(&last_noise_rssi, in_agg.last_noise_rssi);
+        update_min(&min_noise_rssi, in_agg.min_noise_rssi);
+        update_max(&max_noise_rssi, in_agg.max_noise_rssi);
+
+        carrierset |= in_agg.carrierset;
+        encodingset |= in_agg.encodingset;
+
+        if (maxseenrate < in_agg.maxseenrate)
+            maxseenrate = in_agg.maxseenrate;
+
+        if (in_agg.signal_hist_type == hist_none)
+            return;
+
+        if (signal_hist_type == in_agg.signal_hist_type) {
+            signal_hist.merge(in_agg.signal_hist);
+        } else if (signal_hist_type == hist_none || 
+                in_agg.signal_hist_type == hist_dbm) {
+            signal_hist = in_agg.signal_hist;
+            signal_hist_type = in_agg.signal_hist_type;
+        }
+    }
+
+    double signal_percentile(double in_quantile) const {
+        return signal_hist.percentile(in_quantile);
+    }
+
+    int last_signal_dbm, min_signal_dbm, max_signal_dbm;
+    int last_noise_dbm, min_noise_dbm, max_noise_dbm;
+
+    int last_signal_rssi, min_signal_rssi, max_signal_rssi;
+    int last_noise_rssi, min_noise_rssi, max_noise_rssi;
+
+    double maxseenrate;
+    uint64_t encodingset, carrierset;
+
+    hist_type signal_hist_type;
+    kis_signal_histogram signal_hist;
+
+protected:
+    static void update_min(int *io_value, int in_value) {
+        if (in_value != 0 && (*io_value == 0 || in_value < *io_value))
+            *io_value = in_value;
+    }
+
+    static bool update_max(int *io_value, int in_value) {
+        if (in_value != 0 && (*io_value == 0 || in_value > *io_value)) {
+            *io_value = in_value;
+            return true;
+        }
+
+        return false;
+    }
+
+    static void merge_last(int *io_value, int in_value) {
+        if (in_value != 0)
+            *io_value = in_value;
+    }
+};
+
+#endif
+
@@ -0,0 +1,1123 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+#include "util.h"
+#include "configfile.h"
+#include "messagebus.h"
+#include "entrytracker.h"
+#include "msgpack_adapter.h"
+#include "json_adapter.h"
+#include "kis_timeseries.h"
+
+// Segment files start with a 32 byte header naming the segment, then blocks
+// of points, each a 40 byte header followed by the payload and padded to 8
+// bytes.  All integers are little-endian.
+#define TIMESERIES_FILE_MAGIC       "KTSF"
+#define TIMESERIES_BLOCK_MAGIC      "KTSB"
+#define TIMESERIES_VERSION          2
+#define TIMESERIES_HEADER_LEN       32
+#define TIMESERIES_BLOCK_HEADER_LEN 40
+
+// Blocks are kept small so each covers a narrow range of series, and a query
+// for one series decodes few points it doesn't want
+#define TIMESERIES_BLOCK_POINTS     1024
+
+// Span of a query without a start time
+#define TIMESERIES_DEFAULT_SPAN     (60 * 60 * 24 * 7)
+
+static void timeseries_put32(uint8_t *out, uint32_t v) {
+    for (unsigned int i = 0; i < 4; i++)
+        out[i] = (v >> (8 * i)) & 0xFF;
+}
+
+static uint32_t timeseries_get32(const uint8_t *in) {
+    uint32_t v = 0;
+    for (unsigned int i = 0; i < 4; i++)
+        v |= ((uint32_t) in[i]) << (8 * i);
+    return v;
+}
+
+static void timeseries_put64(uint8_t *out, uint64_t v) {
+    for (unsigned int i = 0; i < 8; i++)
+        out[i] = (v >> (8 * i)) & 0xFF;
+}
+
+static uint64_t timeseries_get64(const uint8_t *in) {
+    uint64_t v = 0;
+    for (unsigned int i = 0; i < 8; i++)
+        v |= ((uint64_t) in[i]) << (8 * i);
+    return v;
+}
+
+static void timeseries_put_varint(string *out, uint64_t v) {
+    while (v >= 0x80) {
+        out->push_back((char) ((v & 0x7F) | 0x80));
+        v >>= 7;
+    }
+
+    out->push_back((char) v);
+}
+
+static bool timeseries_get_varint(const uint8_t **pos, const uint8_t *end,
+        uint64_t *ret_v) {
+    uint64_t v = 0;
+
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+        if (*pos >= end)
+            return false;
+
+        uint8_t b = *((*pos)++);
+        v |= ((uint64_t) (b & 0x7F)) << shift;
+
+        if ((b & 0x80) == 0) {
+            *ret_v = v;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static uint64_t timeseries_zigzag(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t timeseries_unzigzag(uint64_t v) {
+    return (int64_t) (v >> 1) ^ -((int64_t) (v & 1));
+}
+
+// Make a directory and any missing parents
+static int timeseries_mkdir(string in_path) {
+    for (size_t p = 1; p <= in_path.length(); p++) {
+        if (p != in_path.length() && in_path[p] != '/')
+            continue;
+
+        string sub = in_path.substr(0, p);
+
+        if (mkdir(sub.c_str(), S_IRWXU) < 0 && errno != EEXIST)
+            return -1;
+    }
+
+    return 0;
+}
+
+TimeseriesStore::TimeseriesStore(GlobalRegistry *in_globalreg) :
+    Kis_Net_Httpd_Stream_Handler(in_globalreg) {
+
+    globalreg = in_globalreg;
+
+    enabled = false;
+    timer_id = -1;
+
+    next_series = 1;
+    series_file = NULL;
+
+    active_fd = -1;
+    active_map = NULL;
+    active_size = 0;
+    active_offset = 0;
+    active_seq = 0;
+    segments_dropped = false;
+
+    pthread_mutex_init(&series_mutex, NULL);
+    pthread_mutex_init(&pending_mutex, NULL);
+    pthread_mutex_init(&store_mutex, NULL);
+    pthread_mutex_init(&source_mutex, NULL);
+
+    globalreg->InsertGlobal("TIMESERIES_STORE", this);
+
+    points_id =
+        globalreg->entrytracker->RegisterField("kismet.timeseries.points",
+                TrackerMap, "time series points");
+    series_name_id =
+        globalreg->entrytracker->RegisterField("kismet.timeseries.series",
+                TrackerString, "series name");
+    time_vec_id =
+        globalreg->entrytracker->RegisterField("kismet.timeseries.time_vec",
+                TrackerVector, "point times");
+    value_vec_id =
+        globalreg->entrytracker->RegisterField("kismet.timeseries.value_vec",
+                TrackerVector, "point values");
+    time_entry_id =
+        globalreg->entrytracker->RegisterField("kismet.timeseries.time",
+                TrackerInt64, "point time");
+    value_entry_id =
+        globalreg->entrytracker->RegisterField("kismet.timeseries.value",
+                TrackerInt64, "point value");
+
+    globalreg->entrytracker->RegisterContainerEntry(time_vec_id, time_entry_id);
+    globalreg->entrytracker->RegisterContainerEntry(value_vec_id, value_entry_id);
+
+    Httpd_RegisterRoute("GET", "/timeseries/points.msgpack",
+            route_points | route_msgpack);
+    Httpd_RegisterRoute("GET", "/timeseries/points.json", route_points);
+
+    string dir = globalreg->kismet_config->FetchOpt("timeseries_dir");
+
+    if (dir == "") {
+        _MSG("No timeseries_dir in the config file, history will only be "
+                "kept for the past day", MSGFLAG_INFO);
+        return;
+    }
+
+    store_dir = globalreg->kismet_config->ExpandLogPath(dir, "", "", 0, 1);
+
+    // Segments are sized in KB, and at least a megabyte so a full block
+    // always fits
+    segment_size =
+        (size_t) globalreg->kismet_config->FetchOptUInt("timeseries_segment_size",
+                8192) * 1024;
+    if (segment_size < 1024 * 1024)
+        segment_size = 1024 * 1024;
+
+    max_segments =
+        globalreg->kismet_config->FetchOptUInt("timeseries_max_segments", 64);
+    if (max_segments < 2)
+        max_segments = 2;
+
+    flush_interval =
+        globalreg->kismet_config->FetchOptInt("timeseries_flush_interval", 60);
+    if (flush_interval < 1)
+        flush_interval = 1;
+
+    if (timeseries_mkdir(store_dir) < 0) {
+        _MSG("Failed to create timeseries_dir '" + store_dir + "': " +
+                string(strerror(errno)) + ", history will only be kept for the "
+                "past day", MSGFLAG_ERROR);
+        return;
+    }
+
+    LoadSeries();
+
+    if (series_file == NULL)
+        return;
+
+    {
+        local_locker lock(&store_mutex);
+
+        ScanSegments();
+
+        if (active_map == NULL) {
+            _MSG("Failed to open a time series segment in '" + store_dir +
+                    "', history will only be kept for the past day",
+                    MSGFLAG_ERROR);
+            return;
+        }
+    }
+
+    enabled = true;
+
+    timer_id =
+        globalreg->timetracker->RegisterTimer(SERVER_TIMESLICES_SEC * flush_interval,
+                NULL, 1, this);
+
+    _MSG("Keeping time series history in '" + store_dir + "', " +
+            IntToString(block_vec.size()) + " blocks in " +
+            IntToString(segment_vec.size()) + " segments", MSGFLAG_INFO);
+}
+
+TimeseriesStore::~TimeseriesStore() {
+    globalreg->RemoveGlobal("TIMESERIES_STORE");
+
+    if (enabled) {
+        globalreg->timetracker->RemoveTimer(timer_id);
+
+        // Keep what we have of the current hour
+        FlushSources(globalreg->timestamp.tv_sec, true);
+    }
+
+    {
+        local_locker lock(&source_mutex);
+
+        for (std::set<kis_tracked_rrd_history_source *>::iterator si = 
+                source_set.begin(); si != source_set.end(); ++si)
+            (*si)->detach_history();
+
+        source_set.clear();
+    }
+
+    if (enabled)
+        Flush();
+
+    CloseSegment();
+
+    if (series_file != NULL)
+        fclose(series_file);
+
+    pthread_mutex_destroy(&series_mutex);
+    pthread_mutex_destroy(&pending_mutex);
+    pthread_mutex_destroy(&store_mutex);
+    pthread_mutex_destroy(&source_mutex);
+}
+
+void TimeseriesStore::LoadSeries() {
+    string path = store_dir + "/series";
+    FILE *sf;
+
+    // One series per line, as the id and then the name
+    if ((sf = fopen(path.c_str(), "r")) != NULL) {
+        char line[1024];
+
+        while (fgets(line, sizeof(line), sf) != NULL) {
+            unsigned int id;
+            int pos;
+
+            if (sscanf(line, "%u %n", &id, &pos) != 1 || id == 0)
+                continue;
+
+            string name = string(line + pos);
+
+            if (name.length() > 0 && name[name.length() - 1] == '\n')
+                name = name.substr(0, name.length() - 1);
+
+            if (name == "")
+                continue;
+
+            series_map[name] = id;
+
+            // We don't know when these were last written, so they're kept
+            // until everything written before now has been dropped
+            series_last[id] = time(0);
+
+            if (id >= next_series)
+                next_series = id + 1;
+        }
+
+        fclose(sf);
+    }
+
+    if ((series_file = fopen(path.c_str(), "a")) == NULL) {
+        _MSG("Failed to open time series names '" + path + "': " +
+                string(strerror(errno)) + ", history will only be kept for the "
+                "past day", MSGFLAG_ERROR);
+    }
+}
+
+uint32_t TimeseriesStore::FetchSeries(string in_name) {
+    if (!enabled)
+        return 0;
+
+    local_locker lock(&series_mutex);
+
+    map<string, uint32_t>::iterator smi = series_map.find(in_name);
+
+    if (smi != series_map.end())
+        return smi->second;
+
+    uint32_t id = next_series++;
+
+    series_map[in_name] = id;
+    series_last[id] = globalreg->timestamp.tv_sec;
+
+    if (series_file != NULL)
+        fprintf(series_file, "%u %s\n", id, in_name.c_str());
+
+    return id;
+}
+
+void TimeseriesStore::PruneSeries(time_t in_cutoff) {
+    std::set<uint32_t> live;
+
+    {
+        local_locker lock(&source_mutex);
+
+        for (std::set<kis_tracked_rrd_history_source *>::iterator si = 
+                source_set.begin(); si != source_set.end(); ++si)
+            live.insert((*si)->fetch_history_series());
+    }
+
+    local_locker lock(&series_mutex);
+
+    unsigned int pruned = 0;
+
+    for (map<string, uint32_t>::iterator smi = series_map.begin(); 
+            smi != series_map.end(); ) {
+        map<uint32_t, time_t>::iterator li = series_last.find(smi->second);
+
+        if (live.find(smi->second) != live.end() || 
+                (li != series_last.end() && li->second >= in_cutoff)) {
+            ++smi;
+            continue;
+        }
+
+        if (li != series_last.end())
+            series_last.erase(li);
+
+        series_map.erase(smi++);
+        pruned++;
+    }
+
+    if (pruned == 0)
+        return;
+
+    // Write the remaining names to a new log and swap it in
+    string path = store_dir + "/series";
+    string tmp_path = path + ".new";
+    FILE *sf;
+
+    if ((sf = fopen(tmp_path.c_str(), "w")) == NULL) {
+        _MSG("Failed to rewrite time series names '" + tmp_path + "': " +
+                string(strerror(errno)), MSGFLAG_ERROR);
+        return;
+    }
+
+    for (map<string, uint32_t>::iterator smi = series_map.begin(); 
+            smi != series_map.end(); ++smi)
+        fprintf(sf, "%u %s\n", smi->second, smi->first.c_str());
+
+    if (fclose(sf) != 0 || rename(tmp_path.c_str(), path.c_str()) < 0) {
+        _MSG("Failed to rewrite time series names '" + path + "': " +
+                string(strerror(errno)), MSGFLAG_ERROR);
+        unlink(tmp_path.c_str());
+        return;
+    }
+
+    if (series_file != NULL)
+        fclose(series_file);
+
+    if ((series_file = fopen(path.c_str(), "a")) == NULL) {
+        _MSG("Failed to open time series names '" + path + "': " +
+                string(strerror(errno)) + ", new series will not be kept past "
+                "a restart", MSGFLAG_ERROR);
+    }
+}
+
+void TimeseriesStore::RegisterSource(kis_tracked_rrd_history_source *in_source) {
+    local_locker lock(&source_mutex);
+    source_set.insert(in_source);
+}
+
+void TimeseriesStore::RemoveSource(kis_tracked_rrd_history_source *in_source) {
+    local_locker lock(&source_mutex);
+    source_set.erase(in_source);
+}
+
+void TimeseriesStore::FlushSources(time_t in_now, bool in_open) {
+    local_locker lock(&source_mutex);
+
+    for (std::set<kis_tracked_rrd_history_source *>::iterator si = 
+            source_set.begin(); si != source_set.end(); ++si)
+        (*si)->flush_history(in_now, in_open);
+}
+
+void TimeseriesStore::AddPoint(uint32_t in_series, time_t in_time,
+        int64_t in_value) {
+    if (!enabled || in_series == 0)
+        return;
+
+    ts_point p;
+    p.series = in_series;
+    p.time = in_time;
+    p.value = in_value;
+
+    local_locker lock(&pending_mutex);
+    pending_vec.push_back(p);
+}
+
+int TimeseriesStore::timetracker_event(int event_id __attribute__((unused))) {
+    FlushSources(globalreg->timestamp.tv_sec, false);
+    Flush();
+    return 1;
+}
+
+void TimeseriesStore::Flush() {
+    {
+        local_locker lock(&series_mutex);
+
+        if (series_file != NULL)
+            fflush(series_file);
+    }
+
+    vector<ts_point> flush_vec;
+
+    {
+        local_locker lock(&pending_mutex);
+        flush_vec.swap(pending_vec);
+    }
+
+    if (flush_vec.size() == 0)
+        return;
+
+    // Blocks cover as few series as possible so queries skip most of them
+    std::stable_sort(flush_vec.begin(), flush_vec.end());
+
+    {
+        local_locker lock(&series_mutex);
+
+        for (size_t p = 0; p < flush_vec.size(); p++) {
+            time_t &last = series_last[flush_vec[p].series];
+
+            if (flush_vec[p].time > last)
+                last = flush_vec[p].time;
+        }
+    }
+
+    time_t cutoff = globalreg->timestamp.tv_sec;
+    bool prune = false;
+
+    {
+        local_locker lock(&store_mutex);
+
+        for (size_t p = 0; p < flush_vec.size(); p += TIMESERIES_BLOCK_POINTS) {
+            size_t end = p + TIMESERIES_BLOCK_POINTS;
+            if (end > flush_vec.size())
+                end = flush_vec.size();
+
+            vector<ts_point> block_points(flush_vec.begin() + p,
+                    flush_vec.begin() + end);
+
+            if (!WriteBlock(&block_points)) {
+                _MSG("Failed to write time series points to '" + store_dir +
+                        "', " + IntToString(flush_vec.size() - p) +
+                        " points lost", MSGFLAG_ERROR);
+                break;
+            }
+        }
+
+        if (active_map != NULL)
+            msync(active_map, active_offset, MS_ASYNC);
+
+        // Series whose points were all in the dropped segments can go
+        if (segments_dropped) {
+            segments_dropped = false;
+            prune = true;
+
+            for (unsigned int b = 0; b < block_vec.size(); b++) {
+                if (block_vec[b].min_time < cutoff)
+                    cutoff = block_vec[b].min_time;
+            }
+        }
+    }
+
+    if (prune)
+        PruneSeries(cutoff);
+}
+
+void TimeseriesStore::EncodeBlock(vector<ts_point> *in_points,
+        string *ret_payload, time_t *ret_min_time, time_t *ret_max_time) {
+    string series_col, time_col, value_col;
+
+    std::sort(in_points->begin(), in_points->end());
+
+    time_t min_time = 0, max_time = 0;
+
+    for (size_t p = 0; p < in_points->size(); p++) {
+        if (p == 0 || (*in_points)[p].time < min_time)
+            min_time = (*in_points)[p].time;
+        if (p == 0 || (*in_points)[p].time > max_time)
+            max_time = (*in_points)[p].time;
+    }
+
+    uint32_t last_series = 0;
+    time_t last_time = 0;
+    int64_t last_delta = 0;
+    uint64_t last_value = 0;
+
+    for (size_t p = 0; p < in_points->size(); p++) {
+        ts_point *pt = &((*in_points)[p]);
+
+        if (p == 0 || pt->series != last_series) {
+            timeseries_put_varint(&series_col, pt->series - last_series);
+            timeseries_put_varint(&time_col,
+                    timeseries_zigzag((int64_t) (pt->time - min_time)));
+
+            last_delta = 0;
+            last_value = 0;
+        } else {
+            int64_t delta = (int64_t) (pt->time - last_time);
+
+            timeseries_put_varint(&series_col, 0);
+            timeseries_put_varint(&time_col, timeseries_zigzag(delta - last_delta));
+
+            last_delta = delta;
+        }
+
+        timeseries_put_varint(&value_col, ((uint64_t) pt->value) ^ last_value);
+
+        last_series = pt->series;
+        last_time = pt->time;
+        last_value = (uint64_t) pt->value;
+    }
+
+    ret_payload->clear();
+    timeseries_put_varint(ret_payload, series_col.length());
+    timeseries_put_varint(ret_payload, time_col.length());
+    ret_payload->append(series_col);
+    ret_payload->append(time_col);
+    ret_payload->append(value_col);
+
+    *ret_min_time = min_time;
+    *ret_max_time = max_time;
+}
+
+bool TimeseriesStore::DecodeBlock(const uint8_t *in_payload, size_t in_len,
+        unsigned int in_count, time_t in_min_time, vector<ts_point> *ret_points) {
+    const uint8_t *pos = in_payload;
+    const uint8_t *end = in_payload + in_len;
+    uint64_t series_len, time_len;
+
+    if (!timeseries_get_varint(&pos, end, &series_len) ||
+            !timeseries_get_varint(&pos, end, &time_len))
+        return false;
+
+    if (series_len > (uint64_t) (end - pos) ||
+            time_len > (uint64_t) (end - pos) - series_len)
+        return false;
+
+    const uint8_t *series_pos = pos;
+    const uint8_t *series_end = series_pos + series_len;
+    const uint8_t *time_pos = series_end;
+    const uint8_t *time_end = time_pos + time_len;
+    const uint8_t *value_pos = time_end;
+    const uint8_t *value_end = end;
+
+    uint32_t last_series = 0;
+    time_t last_time = 0;
+    int64_t last_delta = 0;
+    uint64_t last_value = 0;
+
+    for (unsigned int p = 0; p < in_count; p++) {
+        uint64_t s, t, v;
+
+        if (!timeseries_get_varint(&series_pos, series_end, &s) ||
+                !timeseries_get_varint(&time_pos, time_end, &t) ||
+                !timeseries_get_varint(&value_pos, value_end, &v))
+            return false;
+
+        ts_point pt;
+
+        if (p == 0 || s != 0) {
+            pt.series = last_series + (uint32_t) s;
+            pt.time = in_min_time + (time_t) timeseries_unzigzag(t);
+
+            last_delta = 0;
+            last_value = 0;
+        } else {
+            pt.series = last_series;
+
+            last_delta += timeseries_unzigzag(t);
+            pt.time = last_time + (time_t) last_delta;
+        }
+
+        last_value ^= v;
+        pt.value = (int64_t) last_value;
+
+        last_series = pt.series;
+        last_time = pt.time;
+
+        ret_points->push_back(pt);
+    }
+
+    return series_pos == series_end && time_pos == time_end &&
+        value_pos == value_end;
+}
+
+string TimeseriesStore::SegmentPath(uint32_t in_seq) {
+    char name[32];
+    snprintf(name, sizeof(name), "segment-%08u.kts", in_seq);
+    return store_dir + "/" + string(name);
+}
+
+size_t TimeseriesStore::ScanSegment(uint32_t in_seq, const uint8_t *in_map,
+        size_t in_size) {
+    if (in_size < TIMESERIES_HEADER_LEN ||
+            memcmp(in_map, TIMESERIES_FILE_MAGIC, 4) != 0 ||
+            timeseries_get32(in_map + 4) != TIMESERIES_VERSION ||
+            timeseries_get32(in_map + 8) != in_seq)
+        return 0;
+
+    size_t offset = TIMESERIES_HEADER_LEN;
+
+    while (offset + TIMESERIES_BLOCK_HEADER_LEN <= in_size) {
+        const uint8_t *hdr = in_map + offset;
+
+        if (memcmp(hdr, TIMESERIES_BLOCK_MAGIC, 4) != 0)
+            break;
+
+        uint32_t length = timeseries_get32(hdr + 4);
+
+        if (length > in_size - offset - TIMESERIES_BLOCK_HEADER_LEN)
+            break;
+
+        if (Adler32Checksum((const char *) hdr + TIMESERIES_BLOCK_HEADER_LEN,
+                    length) != timeseries_get32(hdr + 8))
+            break;
+
+        ts_block b;
+        b.seq = in_seq;
+        b.offset = offset;
+        b.length = length;
+        b.count = timeseries_get32(hdr + 12);
+        b.min_time = (time_t) timeseries_get64(hdr + 16);
+        b.max_time = (time_t) timeseries_get64(hdr + 24);
+        b.min_series = timeseries_get32(hdr + 32);
+        b.max_series = timeseries_get32(hdr + 36);
+
+        block_vec.push_back(b);
+
+        offset += (TIMESERIES_BLOCK_HEADER_LEN + length + 7) & ~((size_t) 7);
+    }
+
+    return offset;
+}
+
+void TimeseriesStore::ScanSegments() {
+    DIR *dir;
+    struct dirent *de;
+    vector<uint32_t> seq_vec;
+
+    if ((dir = opendir(store_dir.c_str())) != NULL) {
+        while ((de = readdir(dir)) != NULL) {
+            unsigned int seq;
+            char ext[8];
+
+            if (sscanf(de->d_name, "segment-%u.%7s", &seq, ext) == 2 &&
+                    strcmp(ext, "kts") == 0)
+                seq_vec.push_back(seq);
+        }
+
+        closedir(dir);
+    }
+
+    std::sort(seq_vec.begin(), seq_vec.end());
+
+    uint32_t last_seq = 0;
+    size_t last_end = 0, last_size = 0;
+
+    for (unsigned int s = 0; s < seq_vec.size(); s++) {
+        string path = SegmentPath(seq_vec[s]);
+        struct stat sb;
+        int fd;
+
+        if ((fd = open(path.c_str(), O_RDONLY)) < 0)
+            continue;
+
+        if (fstat(fd, &sb) < 0 || sb.st_size < TIMESERIES_HEADER_LEN) {
+            close(fd);
+            continue;
+        }
+
+        uint8_t *map =
+            (uint8_t *) mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (map == MAP_FAILED)
+            continue;
+
+        size_t end = ScanSegment(seq_vec[s], map, sb.st_size);
+
+        munmap(map, sb.st_size);
+
+        if (end == 0) {
+            _MSG("Ignoring time series segment '" + path + "' which isn't a "
+                    "valid segment", MSGFLAG_ERROR);
+            continue;
+        }
+
+        segment_vec.push_back(seq_vec[s]);
+
+        last_seq = seq_vec[s];
+        last_end = end;
+        last_size = sb.st_size;
+    }
+
+    // Keep appending to the last segment if there's room left in it;
+    // anything past the last valid block is overwritten
+    if (segment_vec.size() != 0 && last_size == segment_size &&
+            last_end + (segment_size / 16) < last_size) {
+        if (OpenSegment(last_seq, last_end))
+            return;
+    }
+
+    NewSegment();
+}
+
+bool TimeseriesStore::OpenSegment(uint32_t in_seq, size_t in_offset) {
+    string path = SegmentPath(in_seq);
+    struct stat sb;
+    int fd;
+
+    if ((fd = open(path.c_str(), O_RDWR)) < 0)
+        return false;
+
+    if (fstat(fd, &sb) < 0) {
+        close(fd);
+        return false;
+    }
+
+    uint8_t *map =
+        (uint8_t *) mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    active_fd = fd;
+    active_map = map;
+    active_size = sb.st_size;
+    active_offset = in_offset;
+    active_seq = in_seq;
+
+    return true;
+}
+
+bool TimeseriesStore::NewSegment() {
+    CloseSegment();
+
+    uint32_t seq = segment_vec.size() == 0 ? 1 : segment_vec.back() + 1;
+    string path = SegmentPath(seq);
+    int fd;
+
+    if ((fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                    S_IRUSR | S_IWUSR)) < 0) {
+        _MSG("Failed to create time series segment '" + path + "': " +
+                string(strerror(errno)), MSGFLAG_ERROR);
+        return false;
+    }
+
+    // Reserve the space up front where the platform and filesystem allow 
+    // it, so running out of disk fails here instead of faulting on a write 
+    // to the map
+#ifdef HAVE_POSIX_FALLOCATE
+    int r = posix_fallocate(fd, 0, segment_size);
+#else
+    // Only sized, not reserved
+    int r = -1;
+#endif
+
+    if (r == ENOSPC || (r != 0 && ftruncate(fd, segment_size) < 0)) {
+        _MSG("Failed to size time series segment '" + path + "': " +
+                string(strerror(r == ENOSPC ? r : errno)), MSGFLAG_ERROR);
+        close(fd);
+        unlink(path.c_str());
+        return false;
+    }
+
+    uint8_t *map =
+        (uint8_t *) mmap(NULL, segment_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED) {
+        close(fd);
+        unlink(path.c_str());
+        return false;
+    }
+
+    memset(map, 0, TIMESERIES_HEADER_LEN);
+    memcpy(map, TIMESERIES_FILE_MAGIC, 4);
+    timeseries_put32(map + 4, TIMESERIES_VERSION);
+    timeseries_put32(map + 8, seq);
+    timeseries_put64(map + 16, (uint64_t) time(0));
+
+    active_fd = fd;
+    active_map = map;
+    active_size = segment_size;
+    active_offset = TIMESERIES_HEADER_LEN;
+    active_seq = seq;
+
+    segment_vec.push_back(seq);
+
+    // Drop the oldest segments past the retention limit, and the blocks
+    // indexed in them
+    while (segment_vec.size() > max_segments) {
+        uint32_t old_seq = segment_vec[0];
+
+        unlink(SegmentPath(old_seq).c_str());
+        segment_vec.erase(segment_vec.begin());
+        segments_dropped = true;
+
+        size_t b = 0;
+        while (b < block_vec.size() && block_vec[b].seq == old_seq)
+            b++;
+        block_vec.erase(block_vec.begin(), block_vec.begin() + b);
+    }
+
+    return true;
+}
+
+void TimeseriesStore::CloseSegment() {
+    if (active_map != NULL) {
+        msync(active_map, active_size, MS_SYNC);
+        munmap(active_map, active_size);
+        active_map = NULL;
+    }
+
+    if (active_fd >= 0) {
+        close(active_fd);
+        active_fd = -1;
+    }
+}
+
+bool TimeseriesStore::WriteBlock(vector<ts_point> *in_points) {
+    string payload;
+    time_t min_time, max_time;
+
+    if (in_points->size() == 0)
+        return true;
+
+    // Sorts the points, so the series range is the ends
+    EncodeBlock(in_points, &payload, &min_time, &max_time);
+
+    uint32_t min_series = in_points->front().series;
+    uint32_t max_series = in_points->back().series;
+
+    size_t rec_len =
+        (TIMESERIES_BLOCK_HEADER_LEN + payload.length() + 7) & ~((size_t) 7);
+
+    if (active_map == NULL || active_offset + rec_len > active_size) {
+        if (!NewSegment())
+            return false;
+
+        if (active_offset + rec_len > active_size)
+            return false;
+    }
+
+    uint8_t *hdr = active_map + active_offset;
+
+    memcpy(hdr + TIMESERIES_BLOCK_HEADER_LEN, payload.data(), payload.length());
+
+    timeseries_put32(hdr + 4, payload.length());
+    timeseries_put32(hdr + 8,
+            Adler32Checksum(payload.data(), payload.length()));
+    timeseries_put32(hdr + 12, in_points->size());
+    timeseries_put64(hdr + 16, (uint64_t) min_time);
+    timeseries_put64(hdr + 24, (uint64_t) max_time);
+    timeseries_put32(hdr + 32, min_series);
+    timeseries_put32(hdr + 36, max_series);
+
+    // The magic goes in last; until then a scan stops here
+    memcpy(hdr, TIMESERIES_BLOCK_MAGIC, 4);
+
+    ts_block b;
+    b.seq = active_seq;
+    b.offset = active_offset;
+    b.length = payload.length();
+    b.count = in_points->size();
+    b.min_time = min_time;
+    b.max_time = max_time;
+    b.min_series = min_series;
+    b.max_series = max_series;
+
+    block_vec.push_back(b);
+
+    active_offset += rec_len;
+
+    // A segment reopened after a crash may have a partial block past the
+    // last good one; make sure it can't be read as following this one
+    if (active_offset + TIMESERIES_BLOCK_HEADER_LEN <= active_size)
+        memset(active_map + active_offset, 0, 4);
+
+    return true;
+}
+
+void TimeseriesStore::FetchPoints(string in_name, time_t in_start,
+        time_t in_end, vector<pair<time_t, int64_t> > *ret_points) {
+    if (!enabled)
+        return;
+
+    uint32_t series;
+
+    {
+        local_locker lock(&series_mutex);
+
+        map<string, uint32_t>::iterator smi = series_map.find(in_name);
+
+        if (smi == series_map.end())
+            return;
+
+        series = smi->second;
+    }
+
+    // Find the blocks holding the series and open their segments, then read
+    // them without the store; an open segment stays readable even if it's 
+    // dropped meanwhile, and written blocks never change
+    vector<ts_block> read_vec;
+    map<uint32_t, int> fd_map;
+
+    {
+        local_locker lock(&store_mutex);
+
+        for (unsigned int b = 0; b < block_vec.size(); b++) {
+            ts_block *blk = &(block_vec[b]);
+
+            if (blk->max_time < in_start || blk->min_time > in_end ||
+                    series < blk->min_series || series > blk->max_series)
+                continue;
+
+            if (fd_map.find(blk->seq) == fd_map.end()) {
+                int fd = open(SegmentPath(blk->seq).c_str(), O_RDONLY);
+
+                if (fd < 0)
+                    continue;
+
+                fd_map[blk->seq] = fd;
+            }
+
+            read_vec.push_back(*blk);
+        }
+    }
+
+    vector<ts_point> block_points;
+
+    for (map<uint32_t, int>::iterator fi = fd_map.begin(); fi != fd_map.end(); ++fi) {
+        struct stat sb;
+        uint8_t *map = NULL;
+
+        if (fstat(fi->second, &sb) == 0) {
+            map = (uint8_t *) mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, 
+                    fi->second, 0);
+
+            if (map == MAP_FAILED)
+                map = NULL;
+        }
+
+        close(fi->second);
+
+        if (map == NULL)
+            continue;
+
+        for (unsigned int b = 0; b < read_vec.size(); b++) {
+            ts_block *blk = &(read_vec[b]);
+
+            if (blk->seq != fi->first)
+                continue;
+
+            if (blk->offset + TIMESERIES_BLOCK_HEADER_LEN + blk->length > 
+                    (size_t) sb.st_size)
+                continue;
+
+            block_points.clear();
+
+            if (!DecodeBlock(map + blk->offset + TIMESERIES_BLOCK_HEADER_LEN,
+                        blk->length, blk->count, blk->min_time, &block_points))
+                continue;
+
+            for (unsigned int p = 0; p < block_points.size(); p++) {
+                if (block_points[p].series == series &&
+                        block_points[p].time >= in_start &&
+                        block_points[p].time <= in_end)
+                    ret_points->push_back(make_pair(block_points[p].time,
+                                block_points[p].value));
+            }
+        }
+
+        munmap(map, sb.st_size);
+    }
+
+    {
+        local_locker lock(&pending_mutex);
+
+        for (unsigned int p = 0; p < pending_vec.size(); p++) {
+            if (pending_vec[p].series == series &&
+                    pending_vec[p].time >= in_start &&
+                    pending_vec[p].time <= in_end)
+                ret_points->push_back(make_pair(pending_vec[p].time,
+                            pending_vec[p].value));
+        }
+    }
+
+    std::stable_sort(ret_points->begin(), ret_points->end());
+}
+
+int TimeseriesStore::Httpd_CreateRoutedResponse(
+        Kis_Net_Httpd *httpd __attribute__((unused)),
+        struct MHD_Connection *connection, int route_id,
+        Kis_Net_Httpd_Route_Params &params __attribute__((unused)),
+        const char *path __attribute__((unused)),
+        const char *method __attribute__((unused)),
+        const char *upload_data __attribute__((unused)),
+        size_t *upload_data_size __attribute__((unused)),
+        std::stringstream &stream) {
+
+    if ((route_id & ~route_msgpack) != route_points)
+        return MHD_HTTP_NOT_FOUND;
+
+    // ?series=name[&start=ts][&end=ts], defaulting to the week up to now
+    const char *series_arg =
+        MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "series");
+    const char *start_arg =
+        MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "start");
+    const char *end_arg =
+        MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "end");
+
+    long long start, end = globalreg->timestamp.tv_sec;
+
+    if (series_arg == NULL || series_arg[0] == '\0')
+        return MHD_HTTP_BAD_REQUEST;
+
+    if (start_arg != NULL && sscanf(start_arg, "%lld", &start) != 1)
+        return MHD_HTTP_BAD_REQUEST;
+
+    if (end_arg != NULL && sscanf(end_arg, "%lld", &end) != 1)
+        return MHD_HTTP_BAD_REQUEST;
+
+    if (start_arg == NULL)
+        start = end - TIMESERIES_DEFAULT_SPAN;
+
+    vector<pair<time_t, int64_t> > points;
+    FetchPoints(string(series_arg), (time_t) start, (time_t) end, &points);
+
+    TrackerElement *wrapper =
+        globalreg->entrytracker->GetTrackedInstance(points_id);
+    TrackerElementScopeLinker slink(wrapper);
+
+    TrackerElement *name =
+        globalreg->entrytracker->GetTrackedInstance(series_name_id);
+    name->set(string(series_arg));
+    wrapper->add_map(name);
+
+    TrackerElement *time_vec =
+        globalreg->entrytracker->GetTrackedInstance(time_vec_id);
+    wrapper->add_map(time_vec);
+
+    TrackerElement *value_vec =
+        globalreg->entrytracker->GetTrackedInstance(value_vec_id);
+    wrapper->add_map(value_vec);
+
+    for (unsigned int p = 0; p < points.size(); p++) {
+        TrackerElement *te = new TrackerElement(TrackerInt64, time_entry_id);
+        te->set((int64_t) points[p].first);
+        time_vec->add_vector(te);
+
+        TrackerElement *ve = new TrackerElement(TrackerInt64, value_entry_id);
+        ve->set(points[p].second);
+        value_vec->add_vector(ve);
+    }
+
+    if (route_id & route_msgpack)
+        MsgpackAdapter::Pack(globalreg, stream, wrapper);
+    else
+        JsonAdapter::Pack(globalreg, stream, wrapper);
+
+    return MHD_HTTP_OK;
+}
+
@@ -0,0 +1,222 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_TIMESERIES_H__
+#define __KIS_TIMESERIES_H__
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+
+#include "globalregistry.h"
+#include "timetracker.h"
+#include "kis_net_microhttpd.h"
+#include "devicetracker_component.h"
+
+// Long-horizon history for RRDs.  A kis_tracked_rrd only remembers the past
+// day; RRDs hooked to the store hand it each hour of their day view as the
+// hour rolls over, and the store keeps those points on disk for as long as
+// its retention allows.  The store also collects the last hour of RRDs which
+// have gone quiet at each flush, and the open hour of every RRD when it shuts
+// down.
+//
+// Points are appended to memory-mapped segment files as compressed blocks.
+// Each flush is sorted by series and time and cut into blocks, so a block 
+// holds the points of a narrow range of series, stored as three columns:
+//
+//   series ids     varint deltas from the previous point's series
+//   timestamps     zigzag varints; the first point of a series relative to
+//                  the start of the block, after that the delta of the delta
+//                  from the previous point of the series
+//   values         varint of the value xor the previous value of the series
+//
+// Hourly points of a quiet series cost a few bytes each: a zero series
+// delta, a zero delta-of-delta, and a small xor.
+//
+// Each block has a header with its length, checksum, point count, and time 
+// and series ranges; the header is written after the block so a block is 
+// only found once it's complete, and a startup scan of the segments stops at
+// the first block which doesn't check out.  Only the block index is kept in
+// memory, and queries decode only the blocks which hold the series and 
+// overlap the requested time.
+//
+// Series names live in their own append-only log so they survive the oldest
+// segments being dropped.  Once none of a series' points are left and no RRD
+// is writing it, the name is forgotten and the log rewritten without it.
+class TimeseriesStore : public LifetimeGlobal, public TimetrackerEvent,
+    public Kis_Net_Httpd_Stream_Handler, public kis_tracked_rrd_history {
+public:
+    TimeseriesStore(GlobalRegistry *in_globalreg);
+    virtual ~TimeseriesStore();
+
+    bool FetchEnabled() { return enabled; }
+
+    // Id of a named series, created if it's new.  Returns 0 if the store is
+    // disabled.
+    uint32_t FetchSeries(string in_name);
+
+    // Queue a point; queued points are written out every flush interval
+    virtual void AddPoint(uint32_t in_series, time_t in_time, int64_t in_value);
+
+    // Points of a series from in_start to in_end inclusive, sorted by time.
+    // Includes points which haven't been written out yet.  Blocks are read 
+    // without holding the store, so queries don't hold up flushes.
+    void FetchPoints(string in_name, time_t in_start, time_t in_end,
+            vector<pair<time_t, int64_t> > *ret_points);
+
+    // Write out the queued points
+    void Flush();
+
+    // Timetracker API, collects the hours of quiet RRDs and flushes the 
+    // queued points
+    virtual int timetracker_event(int event_id);
+
+    virtual void RegisterSource(kis_tracked_rrd_history_source *in_source);
+    virtual void RemoveSource(kis_tracked_rrd_history_source *in_source);
+
+    // HTTP API
+    virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd __attribute__((unused)),
+            struct MHD_Connection *connection __attribute__((unused)),
+            const char *url __attribute__((unused)), 
+            const char *method __attribute__((unused)), 
+            const char *upload_data __attribute__((unused)),
+            size_t *upload_data_size __attribute__((unused)), 
+            std::stringstream &stream __attribute__((unused))) { }
+
+    virtual int Httpd_CreateRoutedResponse(Kis_Net_Httpd *httpd,
+            struct MHD_Connection *connection, int route_id,
+            Kis_Net_Httpd_Route_Params &params,
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size, std::stringstream &stream);
+
+    enum timeseries_route {
+        route_points,
+
+        route_msgpack = 0x100
+    };
+
+    struct ts_point {
+        uint32_t series;
+        time_t time;
+        int64_t value;
+
+        bool operator<(const ts_point &op) const {
+            if (series != op.series)
+                return series < op.series;
+            return time < op.time;
+        }
+    };
+
+    // Block coding, exposed for tools which read segments directly.  Points
+    // are sorted in place.
+    static void EncodeBlock(vector<ts_point> *in_points, string *ret_payload,
+            time_t *ret_min_time, time_t *ret_max_time);
+    static bool DecodeBlock(const uint8_t *in_payload, size_t in_len,
+            unsigned int in_count, time_t in_min_time,
+            vector<ts_point> *ret_points);
+
+protected:
+    GlobalRegistry *globalreg;
+
+    bool enabled;
+
+    string store_dir;
+    size_t segment_size;
+    unsigned int max_segments;
+    int flush_interval;
+
+    int timer_id;
+
+    int points_id, series_name_id, time_vec_id, value_vec_id, time_entry_id,
+        value_entry_id;
+
+    // Series names and the time of the last point written to each, guarded
+    // by series_mutex
+    pthread_mutex_t series_mutex;
+    map<string, uint32_t> series_map;
+    map<uint32_t, time_t> series_last;
+    uint32_t next_series;
+    FILE *series_file;
+
+    void LoadSeries();
+
+    // Forget the series with no points since in_cutoff and no RRD writing 
+    // them, and rewrite the series log
+    void PruneSeries(time_t in_cutoff);
+
+    // RRDs writing to the store, guarded by source_mutex
+    pthread_mutex_t source_mutex;
+    std::set<kis_tracked_rrd_history_source *> source_set;
+
+    void FlushSources(time_t in_now, bool in_open);
+
+    // Points waiting for the next flush, guarded by pending_mutex
+    pthread_mutex_t pending_mutex;
+    vector<ts_point> pending_vec;
+
+    // Segments and the block index, guarded by store_mutex
+    pthread_mutex_t store_mutex;
+
+    struct ts_block {
+        uint32_t seq;
+        size_t offset;
+        uint32_t length;
+        uint32_t count;
+        time_t min_time;
+        time_t max_time;
+        uint32_t min_series;
+        uint32_t max_series;
+    };
+
+    // Segment sequence numbers, oldest first
+    vector<uint32_t> segment_vec;
+    vector<ts_block> block_vec;
+
+    // Segment being appended to
+    int active_fd;
+    uint8_t *active_map;
+    size_t active_size;
+    size_t active_offset;
+    uint32_t active_seq;
+
+    // Segments were dropped by the retention limit since the last flush
+    bool segments_dropped;
+
+    string SegmentPath(uint32_t in_seq);
+
+    // Index the blocks of a segment; returns the offset past the last valid
+    // block, or 0 if the segment isn't one of ours
+    size_t ScanSegment(uint32_t in_seq, const uint8_t *in_map, size_t in_size);
+
+    void ScanSegments();
+    bool OpenSegment(uint32_t in_seq, size_t in_offset);
+    bool NewSegment();
+    void CloseSegment();
+
+    bool WriteBlock(vector<ts_point> *in_points);
+};
+
+#endif
+
@@ -81,6 +81,7 @@
 #include "system_monitor.h"
 #include "channeltracker2.h"
 #include "kis_httpd_websession.h"
+#include "kis_httpd_eventstream.h"
 #include "messagebus_restclient.h"
 
 #include "gps_manager.h"
@@ -101,6 +102,8 @@
 #include "ipc_remote2.h"
 
 #include "statealert.h"
+#include "alertrules.h"
+#include "kis_timeseries.h"
 
 #include "manuf.h"
 
@@ -921,6 +924,9 @@ int main(int argc, char *argv[], char *envp[]) {
     // Add login session
     globalregistry->RegisterLifetimeGlobal((LifetimeGlobal *) new Kis_Httpd_Websession(globalregistry));
 
+    // Add long-term RRD history, before the trackers which record to it
+    globalregistry->RegisterLifetimeGlobal((LifetimeGlobal *) new TimeseriesStore(globalregistry));
+
     // Add channel tracking
     globalregistry->RegisterLifetimeGlobal((LifetimeGlobal *) new Channeltracker_V2(globalregistry));
 
@@ -1119,6 +1125,11 @@ int main(int argc, char *argv[], char *envp[]) {
     if (globalregistry->fatal_condition)
         CatchShutdown(-1);
 
+    // Alerts defined by config rules
+    globalregistry->RegisterLifetimeGlobal((LifetimeGlobal *) new AlertRules(globalregistry));
+    if (globalregistry->fatal_condition)
+        CatchShutdown(-1);
+
     // Kick the plugin system one last time.  This will try to kick any plugins
     // that aren't activated yet, and then bomb out if we can't turn them on at
     // all.
@@ -1131,6 +1142,9 @@ int main(int argc, char *argv[], char *envp[]) {
     // Add system monitor 
     globalregistry->RegisterLifetimeGlobal((LifetimeGlobal *) new Systemmonitor(globalregistry));
 
+    // Add the event stream push channel
+    globalregistry->RegisterLifetimeGlobal((LifetimeGlobal *) new Kis_Httpd_Eventstream(globalregistry));
+
     // Start the http server as the last thing before we start sources
     globalregistry->httpd_server->StartHttpd();
 
@@ -53,6 +53,11 @@ RestMessageClient::RestMessageClient(GlobalRegistry *in_globalreg, void *in_aux)
     pthread_mutex_init(&msg_mutex, NULL);
 
 	globalreg->messagebus->RegisterClient(this, MSGFLAG_ALL);
+
+    Httpd_RegisterRoute("GET", "/messagebus/all_messages.msgpack");
+    Httpd_RegisterRoute("GET", "/messagebus/all_messages.json");
+    Httpd_RegisterRoute("GET", "/messagebus/last-time/{timestamp:int}/messages.msgpack");
+    Httpd_RegisterRoute("GET", "/messagebus/last-time/{timestamp:int}/messages.json");
 }
 
 RestMessageClient::~RestMessageClient() {
@@ -90,37 +95,6 @@ void RestMessageClient::ProcessMessage(string in_msg, int in_flags) {
     }
 }
 
-bool RestMessageClient::Httpd_VerifyPath(const char *path, const char *method) {
-    if (strcmp(method, "GET") != 0) {
-        return false;
-    }
-
-    // Split URL and process
-    vector<string> tokenurl = StrTokenize(path, "/");
-    if (tokenurl.size() < 3)
-        return false;
-
-    if (tokenurl[1] == "messagebus") {
-        if (tokenurl[2] == "all_messages.msgpack") {
-            return true;
-        } else if (tokenurl[2] == "all_messages.json") {
-            return true;
-        } else if (tokenurl[2] == "last-time") {
-            if (tokenurl.size() < 5)
-                return false;
-
-            if (tokenurl[4] == "messages.msgpack")
-                return true;
-            else if (tokenurl[4] == "messages.json")
-                return true;
-            else
-                return false;
-        }
-    }
-
-    return false;
-}
-
 void RestMessageClient::Httpd_CreateStreamResponse(
         Kis_Net_Httpd *httpd __attribute__((unused)),
         struct MHD_Connection *connection,
@@ -96,7 +96,6 @@ public:
 	virtual ~RestMessageClient();
     void ProcessMessage(string in_msg, int in_flags);
 
-    virtual bool Httpd_VerifyPath(const char *path, const char *method);
 
     virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
             struct MHD_Connection *connection,
@@ -19,6 +19,7 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <list>
 #include <map>
@@ -27,6 +28,7 @@
 #include <string>
 #include <msgpack.hpp>
 
+#include "util.h"
 #include "globalregistry.h"
 #include "trackedelement.h"
 #include "macaddr.h"
@@ -35,16 +37,42 @@
 #include "devicetracker_component.h"
 #include "msgpack_adapter.h"
 
-void MsgpackAdapter::Packer(GlobalRegistry *globalreg, TrackerElement *v,
-        msgpack::packer<std::stringstream> &o) {
+// Map member keys are packed together with the [type, value] array header
+// of the member, since the type of a field doesn't change
+static string msgpack_plan_key(GlobalRegistry *globalreg, int in_id, 
+        TrackerType in_type) {
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> o(&buffer);
 
-    v->link();
+    o.pack(globalreg->entrytracker->GetFieldName(in_id));
+    o.pack_array(2);
+    o.pack((int) in_type);
 
-    v->pre_serialize();
+    return string(buffer.data(), buffer.size());
+}
+
+static TrackerElementPlanCache msgpack_plan_cache(msgpack_plan_key);
+
+// Pack the value half of the [type, value] pair
+static void msgpack_pack_value(GlobalRegistry *globalreg, TrackerElement *v,
+        msgpack::packer<msgpack::sbuffer> &o);
+
+void MsgpackAdapter::Packer(GlobalRegistry *globalreg, TrackerElement *v,
+        msgpack::packer<msgpack::sbuffer> &o) {
 
     o.pack_array(2);
     o.pack((int) v->get_type());
 
+    msgpack_pack_value(globalreg, v, o);
+}
+
+static void msgpack_pack_value(GlobalRegistry *globalreg, TrackerElement *v,
+        msgpack::packer<msgpack::sbuffer> &o) {
+
+    v->link();
+
+    v->pre_serialize();
+
     vector<TrackerElement *> *tvec;
     unsigned int x;
 
@@ -62,6 +90,11 @@ void MsgpackAdapter::Packer(GlobalRegistry *globalreg, TrackerElement *v,
 
     mac_addr mac;
 
+    TrackerElementPlanCache::plan *plan;
+    TrackerElementPlanCache::plan_field *plan_field;
+    unsigned int plan_pos;
+    bool plan_missed;
+
     switch (v->get_type()) {
         case TrackerString:
             o.pack(GetTrackerValue<string>(v));
@@ -111,19 +144,45 @@ void MsgpackAdapter::Packer(GlobalRegistry *globalreg, TrackerElement *v,
 
             o.pack_array(v->size());
             for (x = 0; x < tvec->size(); x++) {
-                Packer(globalreg, (*tvec)[x], o);
+                MsgpackAdapter::Packer(globalreg, (*tvec)[x], o);
             }
 
             break;
         case TrackerMap:
             tmap = v->get_map();
+
+            // Field names and value headers come pre-packed from the plan for
+            // this type
+            plan = msgpack_plan_cache.GetPlan(v->get_id());
+            plan_pos = 0;
+            plan_missed = false;
+
             o.pack_map(tmap->size());
             for (map_iter = tmap->begin(); map_iter != tmap->end(); 
                     ++map_iter) {
-                o.pack(globalreg->entrytracker->GetFieldName(map_iter->first));
-                Packer(globalreg, map_iter->second, o);
+                plan_field = TrackerElementPlanCache::Advance(plan, plan_pos,
+                        map_iter->first);
+
+                if (plan_field != NULL && 
+                        plan_field->type == map_iter->second->get_type()) {
+                    // pack_str_body appends raw bytes to the output
+                    o.pack_str_body(plan_field->key.data(), 
+                            plan_field->key.length());
+                    msgpack_pack_value(globalreg, map_iter->second, o);
+                } else {
+                    if (plan_field == NULL)
+                        plan_missed = true;
+
+                    o.pack(globalreg->entrytracker->GetFieldName(map_iter->first));
+                    MsgpackAdapter::Packer(globalreg, map_iter->second, o);
+                }
                 // o.pack(map_iter->second);
             }
+
+            // Only take the plan cache lock when this record has members
+            // the plan doesn't know about yet
+            if (plan_missed)
+                msgpack_plan_cache.ExtendPlan(globalreg, v);
             break;
         case TrackerIntMap:
             tmap = v->get_intmap();
@@ -131,7 +190,7 @@ void MsgpackAdapter::Packer(GlobalRegistry *globalreg, TrackerElement *v,
             for (map_iter = tmap->begin(); map_iter != tmap->end(); 
                     ++map_iter) {
                 o.pack(map_iter->first);
-                Packer(globalreg, map_iter->second, o);
+                MsgpackAdapter::Packer(globalreg, map_iter->second, o);
                 //o.pack(map_iter->second);
             }
             break;
@@ -145,7 +204,7 @@ void MsgpackAdapter::Packer(GlobalRegistry *globalreg, TrackerElement *v,
                 // not a vector of mac+mask
                 o.pack(mac_map_iter->first.MacFull2String());
                 // o.pack(mac_map_iter->second);
-                Packer(globalreg, mac_map_iter->second, o);
+                MsgpackAdapter::Packer(globalreg, mac_map_iter->second, o);
             }
             break;
         case TrackerStringMap:
@@ -156,7 +215,7 @@ void MsgpackAdapter::Packer(GlobalRegistry *globalreg, TrackerElement *v,
                     ++string_map_iter) {
                 o.pack(string_map_iter->first);
                 // o.pack(string_map_iter->second);
-                Packer(globalreg, string_map_iter->second, o);
+                MsgpackAdapter::Packer(globalreg, string_map_iter->second, o);
             }
             break;
         case TrackerDoubleMap:
@@ -167,7 +226,7 @@ void MsgpackAdapter::Packer(GlobalRegistry *globalreg, TrackerElement *v,
                     ++double_map_iter) {
                 o.pack(double_map_iter->first);
                 // o.pack(double_map_iter->second);
-                Packer(globalreg, double_map_iter->second, o);
+                MsgpackAdapter::Packer(globalreg, double_map_iter->second, o);
             }
             break;
 
@@ -185,8 +244,12 @@ void MsgpackAdapter::Pack(GlobalRegistry *globalreg, std::stringstream &stream,
     msgpack::pack(stream, (TrackerElement *) c);
     */
 
-    msgpack::packer<std::stringstream> packer(&stream);
+    // Pack into a flat buffer and hand the stream the whole record at once,
+    // instead of writing each tiny element to the stream
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> packer(&buffer);
     Packer(globalreg, (TrackerElement *) c, packer);
+    stream.write(buffer.data(), buffer.size());
 }
 
 void MsgpackAdapter::Pack(GlobalRegistry *globalreg, std::stringstream &stream,
@@ -196,8 +259,10 @@ void MsgpackAdapter::Pack(GlobalRegistry *globalreg, std::stringstream &stream,
     msgpack::pack(stream, e);
     */
 
-    msgpack::packer<std::stringstream> packer(&stream);
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> packer(&buffer);
     Packer(globalreg, e, packer);
+    stream.write(buffer.data(), buffer.size());
 }
 
 void MsgpackAdapter::AsStringVector(msgpack::object &obj, 
@@ -210,3 +275,374 @@ void MsgpackAdapter::AsStringVector(msgpack::object &obj,
 }
 
 
+
+// Coerce numeric msgpack objects; msgpack picks the smallest encoding so a 
+// signed field may arrive as a positive int and a double as an integer
+static int64_t UnpackerAsInt(const msgpack::object &o) {
+    switch (o.type) {
+        case msgpack::type::POSITIVE_INTEGER:
+            return (int64_t) o.via.u64;
+        case msgpack::type::NEGATIVE_INTEGER:
+            return o.via.i64;
+        case msgpack::type::FLOAT:
+            return (int64_t) o.via.f64;
+        case msgpack::type::BOOLEAN:
+            return o.via.boolean;
+        default:
+            throw msgpack::type_error();
+    }
+}
+
+static uint64_t UnpackerAsUInt(const msgpack::object &o) {
+    switch (o.type) {
+        case msgpack::type::POSITIVE_INTEGER:
+            return o.via.u64;
+        case msgpack::type::NEGATIVE_INTEGER:
+            return (uint64_t) o.via.i64;
+        case msgpack::type::FLOAT:
+            return (uint64_t) o.via.f64;
+        case msgpack::type::BOOLEAN:
+            return o.via.boolean;
+        default:
+            throw msgpack::type_error();
+    }
+}
+
+static double UnpackerAsDouble(const msgpack::object &o) {
+    switch (o.type) {
+        case msgpack::type::POSITIVE_INTEGER:
+            return (double) o.via.u64;
+        case msgpack::type::NEGATIVE_INTEGER:
+            return (double) o.via.i64;
+        case msgpack::type::FLOAT:
+            return o.via.f64;
+        default:
+            throw msgpack::type_error();
+    }
+}
+
+static void UnpackerAsString(const msgpack::object &o, string &out) {
+    if (o.type == msgpack::type::STR)
+        out.assign(o.via.str.ptr, o.via.str.size);
+    else if (o.type == msgpack::type::BIN)
+        out.assign(o.via.bin.ptr, o.via.bin.size);
+    else
+        throw msgpack::type_error();
+}
+
+// Split a [type, value] pair
+static TrackerType UnpackerTypePair(const msgpack::object &o, 
+        const msgpack::object **val) {
+    if (o.type != msgpack::type::ARRAY || o.via.array.size != 2)
+        throw msgpack::type_error();
+
+    int64_t t = UnpackerAsInt(o.via.array.ptr[0]);
+
+    if (t < TrackerString || t > TrackerDoubleMap)
+        throw std::runtime_error("unknown tracked element type " + IntToString(t));
+
+    *val = &(o.via.array.ptr[1]);
+
+    return (TrackerType) t;
+}
+
+MsgpackAdapter::Unpacker::Unpacker(GlobalRegistry *in_globalreg) {
+    globalreg = in_globalreg;
+    entrytracker = globalreg->entrytracker;
+}
+
+int MsgpackAdapter::Unpacker::FieldId(const msgpack::object &in_key) {
+    UnpackerAsString(in_key, name_scratch);
+
+    map<string, int>::iterator i = field_cache.find(name_scratch);
+
+    if (i != field_cache.end())
+        return i->second;
+
+    int id = entrytracker->GetFieldId(name_scratch);
+    field_cache[name_scratch] = id;
+
+    return id;
+}
+
+TrackerElement *MsgpackAdapter::Unpacker::NewElement(int in_id, 
+        const msgpack::object &in_obj) {
+    const msgpack::object *val;
+    TrackerType t = UnpackerTypePair(in_obj, &val);
+
+    TrackerElement *e = NULL;
+    
+    if (in_id >= 0)
+        e = entrytracker->GetTrackedInstance(in_id);
+
+    // Unknown or a different type on the wire, fall back to a plain element
+    if (e != NULL && e->get_type() != t) {
+        delete(e);
+        e = NULL;
+    }
+
+    if (e == NULL)
+        e = new TrackerElement(t, in_id);
+
+    return e;
+}
+
+void MsgpackAdapter::Unpacker::Unpack(const msgpack::object &in_obj,
+        TrackerElement *in_target) {
+    const msgpack::object *val;
+    TrackerType t = UnpackerTypePair(in_obj, &val);
+
+    if (t != in_target->get_type()) {
+        throw std::runtime_error("cannot unpack " + TrackerElement::type_to_string(t) +
+                " into element of type " + 
+                TrackerElement::type_to_string(in_target->get_type()));
+    }
+
+    UnpackValue(t, *val, in_target);
+}
+
+TrackerElement *MsgpackAdapter::Unpacker::Unpack(const msgpack::object &in_obj,
+        int in_id) {
+    TrackerElement *e = NewElement(in_id, in_obj);
+
+    try {
+        Unpack(in_obj, e);
+    } catch (...) {
+        delete(e);
+        throw;
+    }
+
+    return e;
+}
+
+void MsgpackAdapter::Unpacker::UnpackValue(TrackerType in_type, 
+        const msgpack::object &v, TrackerElement *e) {
+
+    TrackerElement *c;
+    int entry_id;
+
+    switch (in_type) {
+        case TrackerString:
+            UnpackerAsString(v, name_scratch);
+            e->set(name_scratch);
+            break;
+        case TrackerInt8:
+            e->set((int8_t) UnpackerAsInt(v));
+            break;
+        case TrackerUInt8:
+            e->set((uint8_t) UnpackerAsUInt(v));
+            break;
+        case TrackerInt16:
+            e->set((int16_t) UnpackerAsInt(v));
+            break;
+        case TrackerUInt16:
+            e->set((uint16_t) UnpackerAsUInt(v));
+            break;
+        case TrackerInt32:
+            e->set((int32_t) UnpackerAsInt(v));
+            break;
+        case TrackerUInt32:
+            e->set((uint32_t) UnpackerAsUInt(v));
+            break;
+        case TrackerInt64:
+            e->set((int64_t) UnpackerAsInt(v));
+            break;
+        case TrackerUInt64:
+            e->set((uint64_t) UnpackerAsUInt(v));
+            break;
+        case TrackerFloat:
+            e->set((float) UnpackerAsDouble(v));
+            break;
+        case TrackerDouble:
+            e->set((double) UnpackerAsDouble(v));
+            break;
+        case TrackerMac:
+            // Packed as [mac, mask]
+            if (v.type != msgpack::type::ARRAY || v.via.array.size != 2)
+                throw msgpack::type_error();
+            UnpackerAsString(v.via.array.ptr[0], mac_scratch);
+            UnpackerAsString(v.via.array.ptr[1], name_scratch);
+            mac_scratch += "/";
+            mac_scratch += name_scratch;
+            e->set(mac_addr(mac_scratch.c_str()));
+            break;
+        case TrackerUuid:
+            UnpackerAsString(v, name_scratch);
+            e->set(uuid(name_scratch));
+            break;
+        case TrackerVector: {
+            if (v.type != msgpack::type::ARRAY)
+                throw msgpack::type_error();
+
+            TrackerElement::tracked_vector *tvec = e->get_vector();
+
+            // Fixed-size vectors (like RRD slots) already exist in a freshly
+            // built component; fill them in place
+            if (tvec->size() == v.via.array.size) {
+                for (unsigned int x = 0; x < v.via.array.size; x++) 
+                    Unpack(v.via.array.ptr[x], (*tvec)[x]);
+                break;
+            }
+
+            e->clear_vector();
+
+            entry_id = entrytracker->GetContainerEntryId(e->get_id());
+
+            for (unsigned int x = 0; x < v.via.array.size; x++) {
+                c = NewElement(entry_id, v.via.array.ptr[x]);
+                e->add_vector(c);
+                Unpack(v.via.array.ptr[x], c);
+            }
+
+            break;
+        }
+        case TrackerMap:
+            if (v.type != msgpack::type::MAP)
+                throw msgpack::type_error();
+
+            for (unsigned int x = 0; x < v.via.map.size; x++) {
+                const msgpack::object_kv &kv = v.via.map.ptr[x];
+
+                int id = FieldId(kv.key);
+
+                // Not a field this server knows about
+                if (id < 0)
+                    continue;
+
+                c = e->get_map_value(id);
+
+                if (c == NULL) {
+                    c = NewElement(id, kv.val);
+                    e->add_map(c);
+                }
+
+                Unpack(kv.val, c);
+            }
+            break;
+        case TrackerIntMap:
+            if (v.type != msgpack::type::MAP)
+                throw msgpack::type_error();
+
+            entry_id = entrytracker->GetContainerEntryId(e->get_id());
+
+            for (unsigned int x = 0; x < v.via.map.size; x++) {
+                const msgpack::object_kv &kv = v.via.map.ptr[x];
+                int k = (int) UnpackerAsInt(kv.key);
+
+                TrackerElement::int_map_iterator i = e->int_find(k);
+
+                if (i != e->int_end()) {
+                    c = i->second;
+                } else {
+                    c = NewElement(entry_id, kv.val);
+                    e->add_intmap(k, c);
+                }
+
+                Unpack(kv.val, c);
+            }
+            break;
+        case TrackerMacMap:
+            if (v.type != msgpack::type::MAP)
+                throw msgpack::type_error();
+
+            entry_id = entrytracker->GetContainerEntryId(e->get_id());
+
+            for (unsigned int x = 0; x < v.via.map.size; x++) {
+                const msgpack::object_kv &kv = v.via.map.ptr[x];
+
+                // Keys are the full mac/mask string
+                UnpackerAsString(kv.key, mac_scratch);
+                mac_addr k(mac_scratch.c_str());
+
+                TrackerElement::mac_map_iterator i = e->mac_find(k);
+
+                if (i != e->mac_end()) {
+                    c = i->second;
+                } else {
+                    c = NewElement(entry_id, kv.val);
+                    e->add_macmap(k, c);
+                }
+
+                Unpack(kv.val, c);
+            }
+            break;
+        case TrackerStringMap:
+            if (v.type != msgpack::type::MAP)
+                throw msgpack::type_error();
+
+            entry_id = entrytracker->GetContainerEntryId(e->get_id());
+
+            for (unsigned int x = 0; x < v.via.map.size; x++) {
+                const msgpack::object_kv &kv = v.via.map.ptr[x];
+
+                UnpackerAsString(kv.key, mac_scratch);
+
+                TrackerElement::string_map_iterator i = e->string_find(mac_scratch);
+
+                if (i != e->string_end()) {
+                    c = i->second;
+                } else {
+                    c = NewElement(entry_id, kv.val);
+                    e->add_stringmap(mac_scratch, c);
+                }
+
+                Unpack(kv.val, c);
+            }
+            break;
+        case TrackerDoubleMap:
+            if (v.type != msgpack::type::MAP)
+                throw msgpack::type_error();
+
+            entry_id = entrytracker->GetContainerEntryId(e->get_id());
+
+            for (unsigned int x = 0; x < v.via.map.size; x++) {
+                const msgpack::object_kv &kv = v.via.map.ptr[x];
+                double k = UnpackerAsDouble(kv.key);
+
+                TrackerElement::double_map_iterator i = e->double_find(k);
+
+                if (i != e->double_end()) {
+                    c = i->second;
+                } else {
+                    c = NewElement(entry_id, kv.val);
+                    e->add_doublemap(k, c);
+                }
+
+                Unpack(kv.val, c);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void MsgpackAdapter::Unpacker::Feed(const char *in_data, size_t in_len) {
+    stream_unpacker.reserve_buffer(in_len);
+    memcpy(stream_unpacker.buffer(), in_data, in_len);
+    stream_unpacker.buffer_consumed(in_len);
+}
+
+bool MsgpackAdapter::Unpacker::Next(TrackerElement *in_target) {
+    if (!stream_unpacker.next(stream_result))
+        return false;
+
+    Unpack(stream_result.get(), in_target);
+
+    return true;
+}
+
+TrackerElement *MsgpackAdapter::Unpacker::Next(int in_id) {
+    if (!stream_unpacker.next(stream_result))
+        return NULL;
+
+    return Unpack(stream_result.get(), in_id);
+}
+
+TrackerElement *MsgpackAdapter::Unpack(GlobalRegistry *globalreg, 
+        const char *in_data, size_t in_len, int in_id) {
+    msgpack::unpacked result;
+    msgpack::unpack(result, in_data, in_len);
+
+    Unpacker unpacker(globalreg);
+    return unpacker.Unpack(result.get(), in_id);
+}
@@ -33,12 +33,14 @@
 #include "globalregistry.h"
 #include "trackedelement.h"
 
+class EntryTracker;
+
 namespace MsgpackAdapter {
 
 typedef map<string, msgpack::object> MsgpackStrMap;
 
 void Packer(GlobalRegistry *globalreg, TrackerElement *v, 
-        msgpack::packer<std::stringstream> &packer);
+        msgpack::packer<msgpack::sbuffer> &packer);
 
 void Pack(GlobalRegistry *globalreg, std::stringstream &stream, 
         tracker_component *c);
@@ -58,6 +60,66 @@ public:
 // Convert to std::vector<std::string>.  MAY THROW EXCEPTIONS.
 void AsStringVector(msgpack::object &obj, std::vector<std::string> &vec);
 
+// Rebuild a TrackerElement tree from the [type, value] form written by Packer.
+//
+// Named map keys are resolved to field ids through the entrytracker, and any
+// field not already present in the target is created via the registered 
+// builder, so complex components (devices, phy records, RRDs) come back as 
+// their real classes instead of generic maps.  Anonymous entries of vectors
+// and keyed maps are built from the container entry id registered with the
+// entrytracker.  Fields which are unknown to this server are skipped.
+//
+// Decoded values are merged into the target; the common case is a freshly 
+// built component from the appropriate builder.
+//
+// Field name resolution is cached per unpacker, so an unpacker should be 
+// re-used across many records (such as a whole device list).
+//
+// Unpacking MAY THROW EXCEPTIONS on malformed or mismatched data.
+class Unpacker {
+public:
+    Unpacker(GlobalRegistry *in_globalreg);
+
+    // Merge a decoded object into an existing element
+    void Unpack(const msgpack::object &in_obj, TrackerElement *in_target);
+
+    // Build a new element of field id in_id from a decoded object
+    TrackerElement *Unpack(const msgpack::object &in_obj, int in_id);
+
+    // Streaming interface - feed raw bytes as they arrive, then pull 
+    // complete objects out with Next().  Next() returns false (or NULL) when
+    // more data is needed.
+    void Feed(const char *in_data, size_t in_len);
+    bool Next(TrackerElement *in_target);
+    TrackerElement *Next(int in_id);
+
+protected:
+    void UnpackValue(TrackerType in_type, const msgpack::object &in_val,
+            TrackerElement *in_target);
+
+    // Make a new element for a field or container entry, preferring the 
+    // registered builder
+    TrackerElement *NewElement(int in_id, const msgpack::object &in_obj);
+
+    int FieldId(const msgpack::object &in_key);
+
+    GlobalRegistry *globalreg;
+    EntryTracker *entrytracker;
+
+    // Name to id cache and scratch buffers to avoid allocating per field
+    map<string, int> field_cache;
+    string name_scratch;
+    string mac_scratch;
+
+    msgpack::unpacker stream_unpacker;
+    msgpack::unpacked stream_result;
+};
+
+// Unpack a single buffer into a new element of field id in_id.  
+// MAY THROW EXCEPTIONS.
+TrackerElement *Unpack(GlobalRegistry *globalreg, const char *in_data, 
+        size_t in_len, int in_id);
+
 }
 
 #endif
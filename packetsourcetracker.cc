@@ -37,6 +37,7 @@
 #include "trackedelement.h"
 #include "entrytracker.h"
 #include "msgpack_adapter.h"
+#include "channeltracker2.h"
 
 // Kluged in tracker_component for reporting sources and states
 class kis_tracked_oldsource : public tracker_component {
@@ -305,6 +306,12 @@ int pst_opentimer(TIMEEVENT_PARMS) {
 	return 1;
 }
 
+int pst_adaptivehoptimer(TIMEEVENT_PARMS) {
+	((Packetsourcetracker *) auxptr)->AdaptiveHopTimer();
+
+	return 1;
+}
+
 int pst_sourceprototimer(TIMEEVENT_PARMS) {
 
 	return 1;
@@ -377,6 +384,9 @@ Packetsourcetracker::Packetsourcetracker(GlobalRegistry *in_globalreg) :
 	running_as_ipc = 0;
 	rootipc = NULL;
 
+	adaptive_hop = 0;
+	adaptive_time_id = -1;
+
 	channel_time_id = 
 		globalreg->timetracker->RegisterTimer(1, NULL, 1, &pst_channeltimer, this);
 
@@ -408,6 +418,10 @@ Packetsourcetracker::Packetsourcetracker(GlobalRegistry *in_globalreg) :
                     "Old packetsource");
         delete(old_builder);
     }
+
+    Httpd_RegisterRoute("POST", "/packetsource/config/channel.cmd");
+    Httpd_RegisterRoute("POST", "/packetsource/config/add_source.cmd");
+    Httpd_RegisterRoute("GET", "/packetsource/all_sources.msgpack");
 }
 
 Packetsourcetracker::~Packetsourcetracker() {
@@ -419,6 +433,9 @@ Packetsourcetracker::~Packetsourcetracker() {
 
 	globalreg->timetracker->RemoveTimer(channel_time_id);
 
+	if (adaptive_time_id >= 0)
+		globalreg->timetracker->RemoveTimer(adaptive_time_id);
+
 	if (globalreg->packetchain != NULL)
 		globalreg->packetchain->RemoveHandler(&pst_chain_hook, CHAINPOS_POSTCAP);
 
@@ -1358,6 +1375,41 @@ int Packetsourcetracker::LoadConfiguration() {
 	// Clear the named vec so we don't use it to compare enable sources again
 	named_vec.clear();
 
+	adaptive_hop = 
+		globalreg->kismet_config->FetchOptBoolean("channel_hop_adaptive", 0);
+
+	if (adaptive_hop) {
+		adaptive_interval = 
+			globalreg->kismet_config->FetchOptUInt("channel_hop_adaptive_interval", 10);
+		if (adaptive_interval < 1)
+			adaptive_interval = 1;
+
+		adaptive_planner.max_dwell =
+			globalreg->kismet_config->FetchOptUInt("channel_hop_adaptive_max_dwell", 6);
+		if (adaptive_planner.max_dwell < 1)
+			adaptive_planner.max_dwell = 1;
+
+		adaptive_planner.explore = 0.25;
+		if (globalreg->kismet_config->FetchOpt("channel_hop_adaptive_explore") != "" &&
+			(sscanf(globalreg->kismet_config->FetchOpt("channel_hop_adaptive_explore").c_str(),
+					"%lf", &adaptive_planner.explore) != 1 ||
+			 adaptive_planner.explore < 0 || adaptive_planner.explore > 1)) {
+			_MSG("Invalid channel_hop_adaptive_explore=... in the Kismet config file, "
+				 "expected a fraction between 0 and 1", MSGFLAG_FATAL);
+			globalreg->fatal_condition = 1;
+			return -1;
+		}
+
+		_MSG("Kismet will split channel lists between sources hopping the same "
+			 "list and spend more time on busy channels, rebalancing every " +
+			 IntToString(adaptive_interval) + " seconds", MSGFLAG_INFO);
+
+		adaptive_time_id =
+			globalreg->timetracker->RegisterTimer(SERVER_TIMESLICES_SEC * 
+												  adaptive_interval, NULL, 1,
+												  &pst_adaptivehoptimer, this);
+	}
+
 	return 1;
 }
 
@@ -2640,6 +2692,287 @@ void Packetsourcetracker::OpenTimer() {
 	}
 }
 
+// Order channels busiest-first when splitting them between sources
+static bool pst_adaptive_share_cmp(const pair<double, unsigned int> &a,
+								   const pair<double, unsigned int> &b) {
+	if (a.first != b.first)
+		return a.first > b.first;
+
+	return a.second < b.second;
+}
+
+void pst_adaptive_planner::Plan(uint64_t in_key, 
+								const vector<pst_channel> &in_base, 
+								const vector<int64_t> &in_packets, int in_window,
+								unsigned int in_sources, 
+								vector<vector<pst_channel> > *ret_plans) {
+	unsigned int nchans = in_base.size();
+
+	ret_plans->clear();
+
+	if (nchans == 0 || in_sources == 0)
+		return;
+
+	map<unsigned int, double> &rate_map = history_map[in_key].rate_map;
+	map<unsigned int, double> &share_map = history_map[in_key].share_map;
+
+	// The configured dwells are the prior; the exploration share is spread
+	// by them, and with no traffic at all we fall back to them entirely
+	vector<double> prior(nchans), rate(nchans), share(nchans);
+	double prior_total = 0, rate_total = 0;
+
+	for (unsigned int c = 0; c < nchans; c++) {
+		prior[c] = kismax((double) in_base[c].u.chan_t.dwell, 1.0);
+		prior_total += prior[c];
+	}
+
+	for (unsigned int c = 0; c < nchans; c++) {
+		unsigned int channel = in_base[c].u.chan_t.channel;
+
+		// Packets seen per second actually spent on the channel, so a
+		// channel isn't rated quiet just because we rarely listened to it
+		double timeshare = prior[c] / prior_total;
+		map<unsigned int, double>::iterator smi = share_map.find(channel);
+		if (smi != share_map.end())
+			timeshare = smi->second;
+		timeshare = kismax(timeshare, 0.01);
+
+		double r = (double) in_packets[c] / (in_window * timeshare);
+
+		map<unsigned int, double>::iterator rmi = rate_map.find(channel);
+		if (rmi != rate_map.end())
+			r = (rmi->second + r) / 2;
+		rate_map[channel] = r;
+
+		rate[c] = r;
+		rate_total += r;
+	}
+
+	for (unsigned int c = 0; c < nchans; c++) {
+		if (rate_total > 0)
+			share[c] = explore * prior[c] / prior_total +
+				(1 - explore) * rate[c] / rate_total;
+		else
+			share[c] = prior[c] / prior_total;
+	}
+
+	// Split the channels between the sources, busiest first to the least
+	// loaded source; each source keeps them in the configured order
+	vector<vector<unsigned int> > assigned(in_sources);
+	vector<double> load(in_sources, 0);
+	vector<pair<double, unsigned int> > order;
+
+	for (unsigned int c = 0; c < nchans; c++)
+		order.push_back(pair<double, unsigned int>(share[c], c));
+
+	sort(order.begin(), order.end(), pst_adaptive_share_cmp);
+
+	for (unsigned int o = 0; o < order.size(); o++) {
+		unsigned int s = 0;
+		for (unsigned int i = 1; i < in_sources; i++) {
+			if (load[i] < load[s] || 
+				(load[i] == load[s] && assigned[i].size() < assigned[s].size()))
+				s = i;
+		}
+
+		assigned[s].push_back(order[o].second);
+		load[s] += order[o].first;
+	}
+
+	// More sources than channels; double up on the busiest
+	for (unsigned int s = 0; s < in_sources; s++) {
+		if (assigned[s].size() == 0)
+			assigned[s].push_back(order[s % order.size()].second);
+
+		sort(assigned[s].begin(), assigned[s].end());
+	}
+
+	ret_plans->resize(in_sources);
+
+	for (unsigned int s = 0; s < in_sources; s++) {
+		vector<pst_channel> &chvec = (*ret_plans)[s];
+		double min_share = share[assigned[s][0]];
+		unsigned int dwell_total = 0;
+
+		for (unsigned int i = 1; i < assigned[s].size(); i++)
+			min_share = kismin(min_share, share[assigned[s][i]]);
+
+		// Dwell in proportion to the share, relative to the quietest channel
+		// this source hops
+		for (unsigned int i = 0; i < assigned[s].size(); i++) {
+			pst_channel ch = in_base[assigned[s][i]];
+
+			ch.u.chan_t.dwell = 1;
+			if (min_share > 0)
+				ch.u.chan_t.dwell = 
+					kismax((unsigned int) 1,
+						   kismin(max_dwell,
+								  (unsigned int) (share[assigned[s][i]] / 
+												  min_share + 0.5)));
+
+			dwell_total += ch.u.chan_t.dwell;
+			chvec.push_back(ch);
+		}
+
+		for (unsigned int i = 0; i < chvec.size(); i++)
+			share_map[chvec[i].u.chan_t.channel] = 
+				(double) chvec[i].u.chan_t.dwell / dwell_total;
+	}
+}
+
+void Packetsourcetracker::AdaptiveHopTimer() {
+	Channeltracker_V2 *chantracker =
+		(Channeltracker_V2 *) globalreg->FetchGlobal("CHANNEL_TRACKER");
+
+	if (chantracker == NULL)
+		return;
+
+	// Group the hopping sources by the channel list they were configured with;
+	// sources which share a list and allow splitting get disjoint parts of it,
+	// the rest are planned on their own
+	vector<vector<pst_packetsource *> > groups;
+	vector<uint16_t> group_base;
+	vector<uint64_t> group_key;
+	map<uint16_t, unsigned int> split_group_map;
+
+	for (unsigned int x = 0; x < packetsource_vec.size(); x++) {
+		pst_packetsource *pst = packetsource_vec[x];
+
+		if (pst->strong_source == NULL || pst->error || pst->channel_hop == 0 ||
+			pst->channel_list == 0)
+			continue;
+
+		// A source which isn't on its generated list has been given a new one
+		// since the last plan (or has never been planned); that's its base now
+		map<uint16_t, uint16_t>::iterator ali = 
+			adaptive_list_map.find(pst->source_id);
+		if (ali == adaptive_list_map.end() || ali->second != pst->channel_list)
+			adaptive_base_map[pst->source_id] = pst->channel_list;
+
+		uint16_t base_id = adaptive_base_map[pst->source_id];
+
+		if (channellist_map.find(base_id) == channellist_map.end())
+			continue;
+
+		if (pst->channel_split) {
+			map<uint16_t, unsigned int>::iterator sgi = split_group_map.find(base_id);
+			if (sgi != split_group_map.end()) {
+				groups[sgi->second].push_back(pst);
+				continue;
+			}
+
+			split_group_map[base_id] = groups.size();
+		}
+
+		groups.push_back(vector<pst_packetsource *>(1, pst));
+		group_base.push_back(base_id);
+
+		// The planner keeps its history per group: a split group by its base
+		// list, a source planned alone by its base list and source
+		if (pst->channel_split)
+			group_key.push_back((uint64_t) base_id << 32);
+		else
+			group_key.push_back(((uint64_t) base_id << 32) | 
+								((uint64_t) pst->source_id + 1));
+	}
+
+	// Forget groups which have gone away, so their history doesn't come back
+	// if they do
+	for (set<uint64_t>::iterator ki = adaptive_key_set.begin(); 
+		 ki != adaptive_key_set.end(); ++ki) {
+		if (find(group_key.begin(), group_key.end(), *ki) == group_key.end())
+			adaptive_planner.Forget(*ki);
+	}
+
+	adaptive_key_set.clear();
+	adaptive_key_set.insert(group_key.begin(), group_key.end());
+
+	int window = kismin(adaptive_interval, 60);
+
+	for (unsigned int g = 0; g < groups.size(); g++) {
+		pst_channellist *base = channellist_map[group_base[g]];
+		vector<pst_packetsource *> &srcs = groups[g];
+		unsigned int nchans = base->channel_vec.size();
+
+		if (nchans == 0)
+			continue;
+
+		// Ranges can't be weighted or split, leave those lists alone
+		bool has_range = false;
+		for (unsigned int c = 0; c < nchans; c++) {
+			if (base->channel_vec[c].range) {
+				has_range = true;
+				break;
+			}
+		}
+
+		if (has_range)
+			continue;
+
+		vector<int64_t> packets(nchans);
+		for (unsigned int c = 0; c < nchans; c++)
+			packets[c] = 
+				chantracker->get_recent_packets(base->channel_vec[c].u.chan_t.channel,
+												window);
+
+		vector<vector<pst_channel> > plans;
+		adaptive_planner.Plan(group_key[g], base->channel_vec, packets, window, 
+							  srcs.size(), &plans);
+
+		for (unsigned int s = 0; s < srcs.size(); s++) {
+			pst_packetsource *pst = srcs[s];
+			vector<pst_channel> &chvec = plans[s];
+
+			// Find or make the generated list for this source
+			pst_channellist *chlist = NULL;
+			map<uint16_t, uint16_t>::iterator ali = 
+				adaptive_list_map.find(pst->source_id);
+			if (ali != adaptive_list_map.end() &&
+				channellist_map.find(ali->second) != channellist_map.end()) {
+				chlist = channellist_map[ali->second];
+			} else {
+				chlist = new pst_channellist;
+				chlist->auto_generated = 0;
+				chlist->channel_id = next_channel_id;
+				chlist->name = base->name + "-adaptive-" + 
+					StrLower(pst->strong_source->FetchName());
+
+				next_channel_id++;
+				channellist_map[chlist->channel_id] = chlist;
+				adaptive_list_map[pst->source_id] = chlist->channel_id;
+			}
+
+			bool changed = (chlist->channel_vec.size() != chvec.size());
+			for (unsigned int i = 0; i < chvec.size() && !changed; i++) {
+				if (chlist->channel_vec[i].u.chan_t.channel != 
+					chvec[i].u.chan_t.channel ||
+					chlist->channel_vec[i].u.chan_t.dwell != chvec[i].u.chan_t.dwell)
+					changed = true;
+			}
+
+			// The hopping side replaces lists in place when it gets the same id
+			// again, and wraps the position itself if the list shrank
+			if (changed) {
+				chlist->channel_vec = chvec;
+				SendIPCChannellist(chlist);
+			}
+
+			if (pst->channel_list != chlist->channel_id) {
+				pst->channel_list = chlist->channel_id;
+				pst->channel_ptr = chlist;
+				pst->channel_position = 0;
+
+				SendIPCChanset(pst);
+
+				for (unsigned int x = 0; x < cb_vec.size(); x++) {
+					(*(cb_vec[x]->cb))(globalreg, pst, SOURCEACT_CHVECTOR, 
+									   0, cb_vec[x]->auxdata);
+				}
+			}
+		}
+	}
+}
+
 void Packetsourcetracker::ChainHandler(kis_packet *in_pack) {
 	kis_datachunk *linkchunk = 
 		(kis_datachunk *) in_pack->fetch(_PCM(PACK_COMP_LINKFRAME));
@@ -2666,33 +2999,6 @@ void Packetsourcetracker::ChainHandler(kis_packet *in_pack) {
 	}
 }
 
-bool Packetsourcetracker::Httpd_VerifyPath(const char *path, const char *method) {
-    /*
-    if (strcmp(method, "GET") != 0)
-        return false;
-
-    if (strcmp(path, "/system/status.msgpack") == 0)
-        return true;
-    */
-
-    if (strcmp(path, "/packetsource/config/channel.cmd") == 0 &&
-            strcmp(method, "POST") == 0) {
-        return true;
-    }
-
-    if (strcmp(path, "/packetsource/config/add_source.cmd") == 0 &&
-            strcmp(method, "POST") == 0) {
-        return true;
-    }
-
-    if (strcmp(path, "/packetsource/all_sources.msgpack") == 0 &&
-            strcmp(method, "GET") == 0) {
-        return true;
-    }
-
-    return false;
-}
-
 void Packetsourcetracker::httpd_pack_all_sources(std::stringstream &stream) {
     if (entrytracker == NULL)
         return;
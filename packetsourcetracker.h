@@ -25,6 +25,7 @@
 #include <time.h>
 #include <list>
 #include <map>
+#include <set>
 #include <vector>
 #include <algorithm>
 #include <string>
@@ -102,6 +103,46 @@ struct pst_channellist {
 	vector<pst_channel> channel_vec;
 };
 
+// Adaptive hop planning.  Weights a channel list by recent traffic and 
+// splits it between the sources hopping it; kept apart from the tracker so
+// the plans can be checked against simulated traffic (sim_channelhop).
+class pst_adaptive_planner {
+public:
+	pst_adaptive_planner() {
+		explore = 0.25;
+		max_dwell = 6;
+	}
+
+	// Share of hop time spread over all channels by their configured dwells
+	double explore;
+	// Longest dwell a plan may give a channel
+	unsigned int max_dwell;
+
+	// Plan the lists of in_sources sources splitting in_base.  in_packets 
+	// holds the packets seen on each channel of in_base over the last 
+	// in_window seconds.  in_base must not contain ranges.  History is kept
+	// per in_key, one for each group of sources planned together, so groups
+	// hopping the same channels don't overwrite each other's rates.
+	void Plan(uint64_t in_key, const vector<pst_channel> &in_base, 
+			  const vector<int64_t> &in_packets, int in_window,
+			  unsigned int in_sources, vector<vector<pst_channel> > *ret_plans);
+
+	// Drop the history of a group which is no longer planned
+	void Forget(uint64_t in_key) {
+		history_map.erase(in_key);
+	}
+
+protected:
+	// Smoothed packets per second of hop time, and the share of its source's
+	// time each channel got in the last plan
+	struct plan_history {
+		map<unsigned int, double> rate_map;
+		map<unsigned int, double> share_map;
+	};
+
+	map<uint64_t, plan_history> history_map;
+};
+
 struct pst_protosource {
 	string type;
 	KisPacketSource *weak_source;
@@ -274,6 +315,10 @@ public:
 	void ChannelTimer();
 	void OpenTimer();
 
+	// Re-weight the channel lists of hopping sources by recent channel
+	// activity (channel_hop_adaptive=true)
+	void AdaptiveHopTimer();
+
 	// Packet chain to IPC / DLT demangle
 	void ChainHandler(kis_packet *in_pack);
 
@@ -304,7 +349,6 @@ public:
 	uint16_t GenChannelList(vector<unsigned int> in_channellist);
 
     // HTTP API
-    virtual bool Httpd_VerifyPath(const char *path, const char *method);
 
     virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
             struct MHD_Connection *connection,
@@ -372,6 +416,20 @@ protected:
 	// Preferred channels
 	vector<unsigned int> preferred_channels;
 
+	// Adaptive hopping.  Each hopping source gets its own generated channel
+	// list, carved out of the list it was configured with and rewritten on
+	// every rebalance; the configured list is kept as the base.
+	int adaptive_hop;
+	int adaptive_time_id;
+	int adaptive_interval;
+	pst_adaptive_planner adaptive_planner;
+
+	// Source id to generated and base channel list ids
+	map<uint16_t, uint16_t> adaptive_list_map;
+	map<uint16_t, uint16_t> adaptive_base_map;
+	// Planner history keys of the groups planned last time
+	set<uint64_t> adaptive_key_set;
+
     // Webserver reference
     Kis_Net_Httpd *httpd;
 
@@ -49,6 +49,7 @@
 
 #ifdef HAVE_LIBPCRE
 #include <pcre.h>
+#include "kis_pcre_set.h"
 #endif
 
 int phydot11_packethook_wep(CHAINCALL_PARMS) {
@@ -249,6 +250,10 @@ Kis_80211_Phy::Kis_80211_Phy(GlobalRegistry *in_globalreg,
 	ssid_conf->ParseConfig(ssid_conf->ExpandLogPath(globalreg->kismet_config->FetchOpt("configdir") + "/" + "ssid_map.conf", "", "", 0, 1).c_str());
 	globalreg->InsertGlobal("SSID_CONF_FILE", ssid_conf);
 
+    // Always register the URLs, but throw an error during post handling if
+    // we don't have PCRE.  Less weird behavior for clients.
+    Httpd_RegisterRoute("POST", "/phy/phy80211/ssid_regex.cmd");
+    Httpd_RegisterRoute("POST", "/phy/phy80211/probe_regex.cmd");
 }
 
 Kis_80211_Phy::~Kis_80211_Phy() {
@@ -526,8 +531,10 @@ void Kis_80211_Phy::HandleSSID(kis_tracked_device_base *basedev,
             ssid->set_wps_model_number(dot11info->wps_model_number);
 
             // Do we not know the basedev manuf?
-            if (basedev->get_manuf() == "" && dot11info->wps_manuf != "")
+            if (basedev->get_manuf() == "" && dot11info->wps_manuf != "") {
                 basedev->set_manuf(dot11info->wps_manuf);
+                devicetracker->ReindexDevice(basedev);
+            }
 
             ssid->set_last_time(in_pack->ts.tv_sec);
             ssid->inc_beacons_sec();
@@ -1978,19 +1985,6 @@ string Kis_80211_Phy::CryptToString(uint64_t cryptset) {
 }
 
 
-bool Kis_80211_Phy::Httpd_VerifyPath(const char *path, const char *method) {
-    // Always return that the URL exists, but throw an error during post
-    // handling if we don't have PCRE.  Less weird behavior for clients.
-    if (strcmp(method, "POST") == 0) {
-        if (strcmp(path, "/phy/phy80211/ssid_regex.cmd") == 0)
-            return true;
-        if (strcmp(path, "/phy/phy80211/probe_regex.cmd") == 0)
-            return true;
-    }
-
-    return false;
-}
-
 void Kis_80211_Phy::Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
         struct MHD_Connection *connection,
         const char *url, const char *method, const char *upload_data,
@@ -2000,23 +1994,20 @@ void Kis_80211_Phy::Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
 }
 
 #ifdef HAVE_LIBPCRE
-typedef struct {
-    pcre *re;
-    pcre_extra *study;
-} phy80211_pcre_filter;
-
 // Worker class.  We build a list of devices which match the PCRE filters
-// and then export it as a device summary vector.
+// and then export it as a device summary vector.  The filters are matched
+// as one set, with results cached by SSID checksum, so SSIDs shared by many
+// devices are only matched once.
 // This all happens inside the thread lock of the devicetracker worker, 
 // so it's safe to build a list of devices
 class phy80211_devicetracker_ssid_pcre_worker : public DevicetrackerFilterWorker {
 public:
     phy80211_devicetracker_ssid_pcre_worker(GlobalRegistry *in_globalreg, 
-            vector<phy80211_pcre_filter *> *filtervec, int entry_id,
+            Kis_Pcre_Set *in_filter_set, int entry_id,
             TrackerElementSerializer *in_serializer) {
 
         globalreg = in_globalreg;
-        this->filter_vec = filtervec;
+        filter_set = in_filter_set;
         dot11_device_entry_id = entry_id;
         error = false;
         serializer = in_serializer;
@@ -2054,29 +2045,15 @@ public:
         for (ssid_itr = adv_ssid_map.begin(); 
                 ssid_itr != adv_ssid_map.end(); ++ssid_itr) {
             ssid = (dot11_advertised_ssid *) ssid_itr->second;
-            bool device_handled = false;
-
-            for (unsigned int i = 0; i < filter_vec->size(); i++) {
-                int rc;
-                int ovector[128];
-
-                rc = pcre_exec((*filter_vec)[i]->re,
-                        (*filter_vec)[i]->study,
-                        ssid->get_ssid().c_str(),
-                        ssid->get_ssid_len(),
-                        0, 0, ovector, 128);
-
-                // Export the device msgpack
-                if (rc >= 0) {
-                    device_handled = true;
-                    devices->push_back(device);
-                    break;
-                }
-            }
+            vector<int> matched;
 
-            // Don't match more than once on a device
-            if (device_handled)
+            // SSIDs are keyed by their checksum
+            if (filter_set->MatchCached(ssid->get_ssid(), 
+                        (uint32_t) ssid_itr->first, &matched) > 0) {
+                // Don't match more than once on a device
+                devices->push_back(device);
                 break;
+            }
         }
 
     }
@@ -2089,7 +2066,7 @@ public:
 protected:
     GlobalRegistry *globalreg;
     std::stringstream *outstream;
-    vector<phy80211_pcre_filter *> *filter_vec;
+    Kis_Pcre_Set *filter_set;
     bool error;
     int dot11_device_entry_id;
     TrackerElement *device_vec;
@@ -2100,11 +2077,11 @@ protected:
 class phy80211_devicetracker_probe_pcre_worker : public DevicetrackerFilterWorker {
 public:
     phy80211_devicetracker_probe_pcre_worker(GlobalRegistry *in_globalreg, 
-            vector<phy80211_pcre_filter *> *filtervec, int entry_id,
+            Kis_Pcre_Set *in_filter_set, int entry_id,
             TrackerElementSerializer *in_serializer) {
 
         globalreg = in_globalreg;
-        this->filter_vec = filtervec;
+        filter_set = in_filter_set;
         dot11_device_entry_id = entry_id;
         error = false;
         serializer = in_serializer;
@@ -2142,29 +2119,15 @@ public:
         for (ssid_itr = probe_ssid_map.begin(); 
                 ssid_itr != probe_ssid_map.end(); ++ssid_itr) {
             ssid = (dot11_probed_ssid *) ssid_itr->second;
-            bool device_handled = false;
-
-            for (unsigned int i = 0; i < filter_vec->size(); i++) {
-                int rc;
-                int ovector[128];
-
-                rc = pcre_exec((*filter_vec)[i]->re,
-                        (*filter_vec)[i]->study,
-                        ssid->get_ssid().c_str(),
-                        ssid->get_ssid_len(),
-                        0, 0, ovector, 128);
-
-                // Export the device msgpack
-                if (rc >= 0) {
-                    device_handled = true;
-                    devices->push_back(device);
-                    break;
-                }
-            }
+            vector<int> matched;
 
-            // Don't match more than once on a device
-            if (device_handled)
+            // SSIDs are keyed by their checksum
+            if (filter_set->MatchCached(ssid->get_ssid(), 
+                        (uint32_t) ssid_itr->first, &matched) > 0) {
+                // Don't match more than once on a device
+                devices->push_back(device);
                 break;
+            }
         }
 
     }
@@ -2177,7 +2140,7 @@ public:
 protected:
     GlobalRegistry *globalreg;
     std::stringstream *outstream;
-    vector<phy80211_pcre_filter *> *filter_vec;
+    Kis_Pcre_Set *filter_set;
     bool error;
     int dot11_device_entry_id;
     TrackerElement *device_vec;
@@ -2204,7 +2167,7 @@ int Kis_80211_Phy::Httpd_PostIterator(void *coninfo_cls, enum MHD_ValueKind kind
 
         string decode = Base64::decode(string(data));
 
-        vector<phy80211_pcre_filter *> filter_vec;
+        Kis_Pcre_Set filter_set;
         std::vector<std::string> regex_vec;
 
         // Get the dictionary
@@ -2223,33 +2186,12 @@ int Kis_80211_Phy::Httpd_PostIterator(void *coninfo_cls, enum MHD_ValueKind kind
             // Get the array of regexes
             MsgpackAdapter::AsStringVector(obj_iter->second, regex_vec);
 
-            // Parse the PCREs we've been passed
+            // Compile all the PCREs we got into one set
             for (unsigned int i = 0; i < regex_vec.size(); i++) {
-                phy80211_pcre_filter *filt = new phy80211_pcre_filter;
-                const char *error, *study_err;
-                int erroffset;
-                ostringstream osstr;
-
-                // Compile all the PCREs we got
-                filt->re =
-                    pcre_compile(regex_vec[i].c_str(), 0, &error, &erroffset, NULL);
-                if (filt->re == NULL) {
-                    delete(filt);
-                    osstr << "Could not parse PCRE expression: " << error << 
-                        " at " << erroffset;
-                    throw std::runtime_error(osstr.str());
-                }
+                string error;
 
-                filt->study = pcre_study(filt->re, 0, &study_err);
-                if (filt->study == NULL) {
-                    osstr << "Could not parse PCRE expression, study/optimization " 
-                        "failure: " << study_err;
-                    pcre_free(filt->re);
-                    delete(filt);
-                    throw std::runtime_error(osstr.str());
-                }
-
-                filter_vec.push_back(filt);
+                if (filter_set.AddPattern(regex_vec[i], &error) < 0)
+                    throw std::runtime_error(error);
             }
 
             // Make a worker instance
@@ -2260,25 +2202,18 @@ int Kis_80211_Phy::Httpd_PostIterator(void *coninfo_cls, enum MHD_ValueKind kind
 
             if (concls->url == "/phy/phy80211/ssid_regex.cmd") {
                 phy80211_devicetracker_ssid_pcre_worker worker(globalreg,
-                        &filter_vec, dot11_device_entry_id, serializer);
+                        &filter_set, dot11_device_entry_id, serializer);
 
                 // Tell devicetracker to do the work
                 devicetracker->MatchOnDevices(&worker);
             } else if (concls->url == "/phy/phy80211/probe_regex.cmd") {
                 phy80211_devicetracker_probe_pcre_worker worker(globalreg,
-                        &filter_vec, dot11_device_entry_id, serializer);
+                        &filter_set, dot11_device_entry_id, serializer);
 
                 // Tell devicetracker to do the work
                 devicetracker->MatchOnDevices(&worker);
             }
             
-            for (unsigned int i = 0; i < filter_vec.size(); i++) {
-                pcre_free(filter_vec[i]->re);
-                pcre_free(filter_vec[i]->study);
-                delete filter_vec[i];
-            }
-            filter_vec.clear();
-
             delete(serializer);
 
             return 1;
@@ -2289,13 +2224,6 @@ int Kis_80211_Phy::Httpd_PostIterator(void *coninfo_cls, enum MHD_ValueKind kind
             concls->response_stream << "Invalid request " << e.what();
             concls->httpcode = 400;
 
-            for (unsigned int i = 0; i < filter_vec.size(); i++) {
-                pcre_free(filter_vec[i]->re);
-                pcre_free(filter_vec[i]->study);
-                delete filter_vec[i];
-            }
-            filter_vec.clear();
-
             return 1;
         }
 
@@ -2344,6 +2272,9 @@ public:
             return;
         }
 
+        // Only devices which lose records are copied into the next snapshot
+        bool changed = false;
+
         // Iterate over all the SSID records
         TrackerElementIntMap adv_ssid_map(dot11dev->get_advertised_ssid_map());
         dot11_advertised_ssid *ssid = NULL;
@@ -2361,6 +2292,7 @@ public:
                 adv_ssid_map.erase(int_itr);
                 int_itr = adv_ssid_map.begin();
                 devicetracker->UpdateFullRefresh();
+                changed = true;
             }
         }
 
@@ -2379,6 +2311,7 @@ public:
                 probe_map.erase(int_itr);
                 int_itr = probe_map.begin();
                 devicetracker->UpdateFullRefresh();
+                changed = true;
             }
         }
 
@@ -2398,8 +2331,12 @@ public:
                 client_map.erase(mac_itr);
                 mac_itr = client_map.begin();
                 devicetracker->UpdateFullRefresh();
+                changed = true;
             }
         }
+
+        if (changed)
+            devicetracker->ReindexDevice(device);
     }
 
 protected:
@@ -499,6 +499,8 @@ protected:
             RegisterComplexField("dot11.advertisedssid.dot11d_entry", 
                     dot11d_builder, "dot11d entry");
         delete(dot11d_builder);
+        globalreg->entrytracker->RegisterContainerEntry(dot11d_vec_id,
+                dot11d_country_entry_id);
 
         wps_state_id =
             RegisterField("dot11.advertisedssid.wps_state", TrackerUInt32,
@@ -944,6 +946,8 @@ protected:
             RegisterComplexField("dot11.device.client", 
                     client_builder, "client record");
         delete(client_builder);
+        globalreg->entrytracker->RegisterContainerEntry(client_map_id,
+                client_map_entry_id);
 
         advertised_ssid_map_id =
             RegisterField("dot11.device.advertised_ssid_map", TrackerIntMap,
@@ -954,6 +958,8 @@ protected:
             RegisterComplexField("dot11.device.advertised_ssid",
                     adv_ssid_builder, "advertised ssid");
         delete(adv_ssid_builder);
+        globalreg->entrytracker->RegisterContainerEntry(advertised_ssid_map_id,
+                advertised_ssid_map_entry_id);
 
         probed_ssid_map_id =
             RegisterField("dot11.device.probed_ssid_map", TrackerIntMap,
@@ -964,6 +970,8 @@ protected:
             RegisterComplexField("dot11.device.probed_ssid",
                     probe_ssid_builder, "probed ssid");
         delete(probe_ssid_builder);
+        globalreg->entrytracker->RegisterContainerEntry(probed_ssid_map_id,
+                probed_ssid_map_entry_id);
 
         associated_client_map_id =
             RegisterField("dot11.device.associated_client_map", TrackerMacMap,
@@ -972,6 +980,8 @@ protected:
         associated_client_map_entry_id =
             RegisterField("dot11.device.associated_client", TrackerUInt64,
                     "associated client");
+        globalreg->entrytracker->RegisterContainerEntry(associated_client_map_id,
+                associated_client_map_entry_id);
 
         client_disconnects_id =
             RegisterField("dot11.device.client_disconnects", TrackerUInt64,
@@ -1176,7 +1186,6 @@ public:
 	static string CryptToString(uint64_t cryptset);
 
     // HTTPD API
-    virtual bool Httpd_VerifyPath(const char *path, const char *method);
 
     virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
             struct MHD_Connection *connection,
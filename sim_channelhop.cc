@@ -0,0 +1,334 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Channel hop simulation:  hops simulated sources over 802.11b channels 1-11
+// with simulated devices transmitting on them, once with the configured
+// channel list and once re-planned by the adaptive hop planner, and compares
+// how much traffic each one catches and how quickly it finds the devices.
+//
+// Most devices sit on 1, 6 and 11 with a few on the other channels, and they
+// show up over the first 80% of the run; a device counts as found once a
+// packet of it is caught.  Halfway through, the devices of channel 6 move to
+// channel 3, so the plan has to follow the traffic.
+//
+//   sim_channelhop [sources] [seconds] [devices] [seed]
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "bench_util.h"
+#include "packetsourcetracker.h"
+
+// Hops per second (channelvelocity) and seconds between re-plans
+// (channel_hop_adaptive_interval), as in the default config
+#define SIM_VELOCITY        3
+#define SIM_INTERVAL        10
+
+#define SIM_CHANNELS        11
+
+struct sim_device {
+    unsigned int channel;
+    double rate;
+    unsigned int arrive_tick;
+    int found_tick;
+};
+
+struct sim_source {
+    vector<pst_channel> channels;
+    unsigned int position;
+    unsigned int dwell_ticks;
+};
+
+struct sim_result {
+    uint64_t sent;
+    uint64_t caught;
+    uint64_t late_sent;
+    uint64_t late_caught;
+    unsigned int found;
+    double found_time_total;
+    int found_90_tick;
+    unsigned int quiet_devices;
+    unsigned int quiet_found;
+};
+
+static double sim_random() {
+    return (rand() + 0.5) / ((double) RAND_MAX + 1.0);
+}
+
+static unsigned int sim_poisson(double in_mean) {
+    double limit = exp(-in_mean), p = sim_random();
+    unsigned int k = 0;
+
+    while (p > limit) {
+        p *= sim_random();
+        k++;
+    }
+
+    return k;
+}
+
+static vector<sim_device> sim_make_devices(unsigned int in_devices,
+        unsigned int in_ticks, unsigned int in_seed) {
+    vector<sim_device> devices;
+
+    srand(in_seed);
+
+    for (unsigned int d = 0; d < in_devices; d++) {
+        sim_device dev;
+        double pick = sim_random();
+
+        // 30% on 1, 35% on 6, 25% on 11, the rest scattered
+        if (pick < 0.30)
+            dev.channel = 1;
+        else if (pick < 0.65)
+            dev.channel = 6;
+        else if (pick < 0.90)
+            dev.channel = 11;
+        else
+            dev.channel = 1 + rand() % SIM_CHANNELS;
+
+        // Mostly quiet clients, some chatty APs; 2 packets/sec on average
+        dev.rate = -log(sim_random()) * 2;
+        dev.arrive_tick = rand() % kismax(1U, in_ticks * 8 / 10);
+        dev.found_tick = -1;
+
+        devices.push_back(dev);
+    }
+
+    return devices;
+}
+
+// The default list:  1-11 with preferredchannels=1,6,11 given a dwell of 3
+static vector<pst_channel> sim_base_list() {
+    vector<pst_channel> base;
+
+    for (unsigned int c = 1; c <= SIM_CHANNELS; c++) {
+        pst_channel ch;
+
+        ch.control_flags = 0;
+        ch.range = 0;
+        ch.u.chan_t.channel = c;
+        ch.u.chan_t.dwell = (c == 1 || c == 6 || c == 11) ? 3 : 1;
+
+        base.push_back(ch);
+    }
+
+    return base;
+}
+
+static sim_result sim_run(bool in_adaptive, unsigned int in_sources,
+        unsigned int in_seconds, unsigned int in_devices, unsigned int in_seed) {
+    unsigned int total_ticks = in_seconds * SIM_VELOCITY;
+    vector<sim_device> devices = 
+        sim_make_devices(in_devices, total_ticks, in_seed);
+    vector<pst_channel> base = sim_base_list();
+    pst_adaptive_planner planner;
+
+    // Sources splitting a list start spread out over it, as the tracker
+    // does with channel_split
+    vector<sim_source> sources(in_sources);
+    for (unsigned int s = 0; s < in_sources; s++) {
+        sources[s].channels = base;
+        sources[s].position = (base.size() / in_sources) * s;
+        sources[s].dwell_ticks = 0;
+    }
+
+    // Packets caught per channel per tick, for the last re-plan window
+    unsigned int window_ticks = SIM_INTERVAL * SIM_VELOCITY;
+    vector<vector<int64_t> > caught_log(window_ticks,
+            vector<int64_t>(SIM_CHANNELS + 1, 0));
+
+    sim_result result;
+    result.sent = 0;
+    result.caught = 0;
+    result.late_sent = 0;
+    result.late_caught = 0;
+
+    srand(in_seed * 7919 + 1);
+
+    for (unsigned int tick = 0; tick < total_ticks; tick++) {
+        if (tick == total_ticks / 2) {
+            for (unsigned int d = 0; d < devices.size(); d++)
+                if (devices[d].channel == 6)
+                    devices[d].channel = 3;
+        }
+
+        if (in_adaptive && tick != 0 && tick % window_ticks == 0) {
+            vector<int64_t> packets(base.size(), 0);
+
+            for (unsigned int t = 0; t < window_ticks; t++)
+                for (unsigned int c = 0; c < base.size(); c++)
+                    packets[c] += caught_log[t][base[c].u.chan_t.channel];
+
+            vector<vector<pst_channel> > plans;
+            planner.Plan(0, base, packets, SIM_INTERVAL, in_sources, &plans);
+
+            // Like the tracker, a changed list starts from the top
+            for (unsigned int s = 0; s < in_sources; s++) {
+                if (plans[s].size() != sources[s].channels.size()) {
+                    sources[s].position = 0;
+                    sources[s].dwell_ticks = 0;
+                } else if (sources[s].position >= plans[s].size()) {
+                    sources[s].position = 0;
+                }
+
+                sources[s].channels = plans[s];
+            }
+        }
+
+        vector<int64_t> &caught_tick = caught_log[tick % window_ticks];
+        for (unsigned int c = 0; c <= SIM_CHANNELS; c++)
+            caught_tick[c] = 0;
+
+        vector<bool> listening(SIM_CHANNELS + 1, false);
+        for (unsigned int s = 0; s < in_sources; s++)
+            listening[sources[s].channels[sources[s].position].u.chan_t.channel] =
+                true;
+
+        bool late = tick >= total_ticks / 2;
+
+        for (unsigned int d = 0; d < devices.size(); d++) {
+            if (tick < devices[d].arrive_tick)
+                continue;
+
+            unsigned int sent =
+                sim_poisson(devices[d].rate / SIM_VELOCITY);
+
+            if (sent == 0)
+                continue;
+
+            result.sent += sent;
+            if (late)
+                result.late_sent += sent;
+
+            if (!listening[devices[d].channel])
+                continue;
+
+            result.caught += sent;
+            if (late)
+                result.late_caught += sent;
+            caught_tick[devices[d].channel] += sent;
+
+            if (devices[d].found_tick < 0)
+                devices[d].found_tick = tick;
+        }
+
+        for (unsigned int s = 0; s < in_sources; s++) {
+            sim_source &src = sources[s];
+
+            src.dwell_ticks++;
+
+            if (src.dwell_ticks >=
+                    kismax((unsigned int) 1,
+                        src.channels[src.position].u.chan_t.dwell)) {
+                src.dwell_ticks = 0;
+                src.position = (src.position + 1) % src.channels.size();
+            }
+        }
+    }
+
+    vector<int> found_ticks;
+
+    result.found = 0;
+    result.found_time_total = 0;
+    result.quiet_devices = 0;
+    result.quiet_found = 0;
+
+    for (unsigned int d = 0; d < devices.size(); d++) {
+        bool quiet = devices[d].channel != 1 && devices[d].channel != 3 &&
+            devices[d].channel != 6 && devices[d].channel != 11;
+
+        if (quiet)
+            result.quiet_devices++;
+
+        if (devices[d].found_tick < 0)
+            continue;
+
+        result.found++;
+        unsigned int delay = devices[d].found_tick - devices[d].arrive_tick;
+
+        result.found_time_total += (double) delay / SIM_VELOCITY;
+        found_ticks.push_back(delay);
+
+        if (quiet)
+            result.quiet_found++;
+    }
+
+    sort(found_ticks.begin(), found_ticks.end());
+
+    result.found_90_tick = -1;
+    unsigned int want = (devices.size() * 9 + 9) / 10;
+    if (found_ticks.size() >= want && want > 0)
+        result.found_90_tick = found_ticks[want - 1];
+
+    return result;
+}
+
+static void sim_print(const char *in_name, const sim_result &in_result,
+        unsigned int in_devices) {
+    printf("%-10s caught %5.1f%% of packets (%5.1f%% after the move), "
+            "found %u/%u devices (quiet channels %u/%u), "
+            "mean %.1fs after arriving, 90%% within ",
+            in_name, 100.0 * in_result.caught / kismax((uint64_t) 1, in_result.sent),
+            100.0 * in_result.late_caught / 
+                kismax((uint64_t) 1, in_result.late_sent),
+            in_result.found, in_devices,
+            in_result.quiet_found, in_result.quiet_devices,
+            in_result.found_time_total / kismax(1U, in_result.found));
+
+    if (in_result.found_90_tick < 0)
+        printf("never\n");
+    else
+        printf("%.1fs\n", (double) in_result.found_90_tick / SIM_VELOCITY);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int num_sources = 1;
+    unsigned int seconds = 600;
+    unsigned int num_devices = 300;
+    unsigned int seed = 1;
+
+    num_sources = bench_arg(argc, argv, 1, num_sources);
+    seconds = bench_arg(argc, argv, 2, seconds);
+    num_devices = bench_arg(argc, argv, 3, num_devices);
+    seed = bench_arg(argc, argv, 4, seed);
+
+    if (num_sources == 0 || seconds == 0 || num_devices == 0) {
+        fprintf(stderr, "usage: %s [sources] [seconds] [devices] [seed]\n",
+                argv[0]);
+        return 1;
+    }
+
+    printf("%u sources, %u seconds, %u devices, %d hops/sec, re-plan every "
+            "%ds\n", num_sources, seconds, num_devices, SIM_VELOCITY,
+            SIM_INTERVAL);
+
+    sim_print("configured",
+            sim_run(false, num_sources, seconds, num_devices, seed), num_devices);
+    sim_print("adaptive",
+            sim_run(true, num_sources, seconds, num_devices, seed), num_devices);
+
+    return 0;
+}
+
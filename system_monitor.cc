@@ -36,6 +36,10 @@ Systemmonitor::Systemmonitor(GlobalRegistry *in_globalreg) :
 
     // Link ourselves so serialization doesn't get rid of us
     link();
+
+    // Status is read when serialized, so it is cached by age alone
+    Httpd_RegisterCachedRoute("GET", "/system/status.msgpack", 0, NULL);
+    Httpd_RegisterCachedRoute("GET", "/system/status.json", 0, NULL);
 }
 
 Systemmonitor::~Systemmonitor() {
@@ -74,18 +78,6 @@ void Systemmonitor::pre_serialize() {
     set_battery_remaining(batinfo.remaining_sec);
 }
 
-bool Systemmonitor::Httpd_VerifyPath(const char *path, const char *method) {
-    if (strcmp(method, "GET") != 0)
-        return false;
-
-    if (strcmp(path, "/system/status.msgpack") == 0)
-        return true;
-    if (strcmp(path, "/system/status.json") == 0)
-        return true;
-
-    return false;
-}
-
 void Systemmonitor::Httpd_CreateStreamResponse(
         Kis_Net_Httpd *httpd __attribute__((unused)),
         struct MHD_Connection *connection __attribute__((unused)),
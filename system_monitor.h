@@ -31,7 +31,6 @@ public:
     Systemmonitor(GlobalRegistry *in_globalreg);
     virtual ~Systemmonitor();
 
-    virtual bool Httpd_VerifyPath(const char *path, const char *method);
 
     virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
             struct MHD_Connection *connection,
@@ -37,6 +37,7 @@ void TrackerElement::Initialize() {
     this->type = TrackerUnassigned;
     reference_count = 0;
     deallocated = false;
+    frozen = false;
 
     set_id(-1);
 
@@ -153,6 +154,141 @@ TrackerElement::~TrackerElement() {
     pthread_mutex_destroy(&mutex);
 }
 
+TrackerElement *TrackerElement::copy_tree(std::map<TrackerElement *, TrackerElement *> &in_memo) {
+    std::map<TrackerElement *, TrackerElement *>::iterator mi = in_memo.find(this);
+
+    if (mi != in_memo.end())
+        return mi->second;
+
+    pre_serialize();
+
+    TrackerElement *dupl = new TrackerElement(type, tracked_id);
+    dupl->local_name = local_name;
+
+    in_memo[this] = dupl;
+
+    switch (type) {
+        case TrackerString:
+            *(dupl->dataunion.string_value) = *(dataunion.string_value);
+            break;
+        case TrackerMac:
+            *(dupl->dataunion.mac_value) = *(dataunion.mac_value);
+            break;
+        case TrackerUuid:
+            *(dupl->dataunion.uuid_value) = *(dataunion.uuid_value);
+            break;
+        case TrackerVector:
+            dupl->dataunion.subvector_value->reserve(dataunion.subvector_value->size());
+
+            for (unsigned int i = 0; i < dataunion.subvector_value->size(); i++) {
+                TrackerElement *c = (*dataunion.subvector_value)[i]->copy_tree(in_memo);
+                c->link();
+                dupl->dataunion.subvector_value->push_back(c);
+            }
+            break;
+        case TrackerMap:
+            for (map_iterator i = dataunion.submap_value->begin();
+                    i != dataunion.submap_value->end(); ++i) {
+                TrackerElement *c = i->second->copy_tree(in_memo);
+                c->link();
+                dupl->dataunion.submap_value->insert(
+                        dupl->dataunion.submap_value->end(), 
+                        std::make_pair(i->first, c));
+            }
+            break;
+        case TrackerIntMap:
+            for (int_map_iterator i = dataunion.subintmap_value->begin();
+                    i != dataunion.subintmap_value->end(); ++i) {
+                TrackerElement *c = i->second->copy_tree(in_memo);
+                c->link();
+                dupl->dataunion.subintmap_value->insert(
+                        dupl->dataunion.subintmap_value->end(), 
+                        std::make_pair(i->first, c));
+            }
+            break;
+        case TrackerMacMap:
+            for (mac_map_iterator i = dataunion.submacmap_value->begin();
+                    i != dataunion.submacmap_value->end(); ++i) {
+                TrackerElement *c = i->second->copy_tree(in_memo);
+                c->link();
+                dupl->dataunion.submacmap_value->insert(
+                        dupl->dataunion.submacmap_value->end(), 
+                        std::make_pair(i->first, c));
+            }
+            break;
+        case TrackerStringMap:
+            for (string_map_iterator i = dataunion.substringmap_value->begin();
+                    i != dataunion.substringmap_value->end(); ++i) {
+                TrackerElement *c = i->second->copy_tree(in_memo);
+                c->link();
+                dupl->dataunion.substringmap_value->insert(
+                        dupl->dataunion.substringmap_value->end(), 
+                        std::make_pair(i->first, c));
+            }
+            break;
+        case TrackerDoubleMap:
+            for (double_map_iterator i = dataunion.subdoublemap_value->begin();
+                    i != dataunion.subdoublemap_value->end(); ++i) {
+                TrackerElement *c = i->second->copy_tree(in_memo);
+                c->link();
+                dupl->dataunion.subdoublemap_value->insert(
+                        dupl->dataunion.subdoublemap_value->end(), 
+                        std::make_pair(i->first, c));
+            }
+            break;
+        case TrackerUnassigned:
+            break;
+        default:
+            // Plain numeric value
+            dupl->dataunion = dataunion;
+            break;
+    }
+
+    return dupl;
+}
+
+void TrackerElement::set_frozen(bool in_frozen) {
+    // Shared elements are reached more than once
+    if (frozen == in_frozen)
+        return;
+
+    frozen = in_frozen;
+
+    switch (type) {
+        case TrackerVector:
+            for (unsigned int i = 0; i < dataunion.subvector_value->size(); i++)
+                (*dataunion.subvector_value)[i]->set_frozen(in_frozen);
+            break;
+        case TrackerMap:
+            for (map_iterator i = dataunion.submap_value->begin();
+                    i != dataunion.submap_value->end(); ++i)
+                i->second->set_frozen(in_frozen);
+            break;
+        case TrackerIntMap:
+            for (int_map_iterator i = dataunion.subintmap_value->begin();
+                    i != dataunion.subintmap_value->end(); ++i)
+                i->second->set_frozen(in_frozen);
+            break;
+        case TrackerMacMap:
+            for (mac_map_iterator i = dataunion.submacmap_value->begin();
+                    i != dataunion.submacmap_value->end(); ++i)
+                i->second->set_frozen(in_frozen);
+            break;
+        case TrackerStringMap:
+            for (string_map_iterator i = dataunion.substringmap_value->begin();
+                    i != dataunion.substringmap_value->end(); ++i)
+                i->second->set_frozen(in_frozen);
+            break;
+        case TrackerDoubleMap:
+            for (double_map_iterator i = dataunion.subdoublemap_value->begin();
+                    i != dataunion.subdoublemap_value->end(); ++i)
+                i->second->set_frozen(in_frozen);
+            break;
+        default:
+            break;
+    }
+}
+
 void TrackerElement::set_type(TrackerType in_type) {
     if (type == in_type)
         return;
@@ -1705,4 +1841,226 @@ TrackerElement *tracker_component::get_child_path(std::vector<string> in_path) {
     return cur_elem;
 }
 
+TrackerElementProjection::TrackerElementProjection(GlobalRegistry *in_globalreg,
+        std::vector<string> in_paths) {
+    Compile(in_globalreg, in_paths);
+}
+
+TrackerElementProjection::TrackerElementProjection(GlobalRegistry *in_globalreg,
+        string in_paths) {
+    Compile(in_globalreg, StrTokenize(in_paths, ","));
+}
+
+void TrackerElementProjection::Compile(GlobalRegistry *in_globalreg,
+        std::vector<string> in_paths) {
+    projection_node root;
+    root.id = -1;
+    root.whole = false;
+    nodes.push_back(root);
+
+    for (unsigned int p = 0; p < in_paths.size(); p++) {
+        vector<string> tok = StrTokenize(in_paths[p], "/");
+        vector<int> ids;
+
+        for (unsigned int x = 0; x < tok.size(); x++) {
+            // Skip empty path element
+            if (tok[x].length() == 0)
+                continue;
+
+            int id = in_globalreg->entrytracker->GetFieldId(tok[x]);
+
+            if (id < 0) {
+                ids.clear();
+                break;
+            }
+
+            ids.push_back(id);
+        }
+
+        // Merge the path into the tree
+        unsigned int node = 0;
+
+        for (unsigned int x = 0; x < ids.size(); x++) {
+            unsigned int next = 0;
+
+            for (unsigned int c = 0; c < nodes[node].children.size(); c++) {
+                if (nodes[nodes[node].children[c]].id == ids[x]) {
+                    next = nodes[node].children[c];
+                    break;
+                }
+            }
+
+            if (next == 0) {
+                projection_node child;
+                child.id = ids[x];
+                child.whole = false;
+
+                next = nodes.size();
+                nodes.push_back(child);
+                nodes[node].children.push_back(next);
+            }
+
+            node = next;
+        }
+
+        if (node != 0)
+            nodes[node].whole = true;
+    }
+}
+
+TrackerElement *TrackerElementProjection::Project(TrackerElement *in_elem, int in_id) {
+    TrackerElement *ret = new TrackerElement(TrackerMap, in_id);
+
+    ProjectNode(in_elem, 0, ret);
+
+    return ret;
+}
+
+void TrackerElementProjection::ProjectNode(TrackerElement *in_elem, 
+        unsigned int in_node, TrackerElement *ret_map) {
+    if (in_elem->get_type() != TrackerMap)
+        return;
+
+    for (unsigned int c = 0; c < nodes[in_node].children.size(); c++) {
+        projection_node *child = &(nodes[nodes[in_node].children[c]]);
+        TrackerElement *elem = in_elem->get_map_value(child->id);
+
+        if (elem == NULL)
+            continue;
+
+        // A requested field covers any deeper paths under it
+        if (child->whole) {
+            ret_map->add_map(elem);
+            continue;
+        }
+
+        TrackerElement *sub = new TrackerElement(TrackerMap, child->id);
+
+        ProjectNode(elem, nodes[in_node].children[c], sub);
+
+        if (sub->get_map()->size() == 0)
+            delete(sub);
+        else
+            ret_map->add_map(sub);
+    }
+}
+
+TrackerElementPlanCache::TrackerElementPlanCache(key_encoder in_encoder) {
+    encoder = in_encoder;
+    pthread_mutex_init(&mutex, NULL);
+
+    table = new plan_table();
+    table->size = 0;
+    table->plans = NULL;
+}
+
+TrackerElementPlanCache::~TrackerElementPlanCache() {
+    for (unsigned int x = 0; x < table->size; x++)
+        delete(table->plans[x]);
+    delete[] table->plans;
+    delete(table);
+
+    for (unsigned int x = 0; x < retired_tables.size(); x++) {
+        delete[] retired_tables[x]->plans;
+        delete(retired_tables[x]);
+    }
+
+    for (unsigned int x = 0; x < retired_plans.size(); x++)
+        delete(retired_plans[x]);
+
+    pthread_mutex_destroy(&mutex);
+}
+
+TrackerElementPlanCache::plan *TrackerElementPlanCache::ExtendPlan(
+        GlobalRegistry *in_globalreg, TrackerElement *in_map) {
+    TrackerElement::tracked_map *tmap = in_map->get_map();
+    int map_id = in_map->get_id();
+
+    if (map_id < 0)
+        return NULL;
+
+    local_locker lock(&mutex);
+
+    plan *p = GetPlan(map_id);
+
+    if (p != NULL) {
+        // Another serializer may have extended it while we waited
+        unsigned int pos = 0;
+        bool covered = true;
+
+        for (TrackerElement::map_iterator i = tmap->begin(); 
+                i != tmap->end(); ++i) {
+            if (Advance(p, pos, i->first) == NULL) {
+                covered = false;
+                break;
+            }
+        }
+
+        if (covered)
+            return p;
+    }
+
+    // Merge the existing plan with the members of this record
+    plan *np = new plan();
+    unsigned int pos = 0;
+
+    for (TrackerElement::map_iterator i = tmap->begin(); i != tmap->end(); ++i) {
+        while (p != NULL && pos < p->fields.size() && 
+                p->fields[pos].id < i->first) {
+            np->fields.push_back(p->fields[pos]);
+            pos++;
+        }
+
+        if (p != NULL && pos < p->fields.size() && p->fields[pos].id == i->first) {
+            np->fields.push_back(p->fields[pos]);
+            pos++;
+            continue;
+        }
+
+        plan_field f;
+        f.id = i->first;
+        f.type = i->second->get_type();
+        f.key = (*encoder)(in_globalreg, f.id, f.type);
+        np->fields.push_back(f);
+    }
+
+    while (p != NULL && pos < p->fields.size()) {
+        np->fields.push_back(p->fields[pos]);
+        pos++;
+    }
+
+    if (p != NULL)
+        retired_plans.push_back(p);
+
+    // Grow the table if this is a field id past the end of it; the old table
+    // stays valid for readers who already loaded it
+    if ((unsigned int) map_id >= table->size) {
+        plan_table *nt = new plan_table();
+        nt->size = map_id + 64;
+        nt->plans = new plan *[nt->size];
+
+        for (unsigned int x = 0; x < nt->size; x++) {
+            if (x < table->size)
+                nt->plans[x] = table->plans[x];
+            else
+                nt->plans[x] = NULL;
+        }
+
+        nt->plans[map_id] = np;
+
+        __sync_synchronize();
+        retired_tables.push_back(table);
+        table = nt;
+        __sync_synchronize();
+
+        return np;
+    }
+
+    // Make the plan contents visible before the pointer to it
+    __sync_synchronize();
+    table->plans[map_id] = np;
+    __sync_synchronize();
+
+    return np;
+}
 
@@ -124,6 +124,23 @@ public:
         return dupl;
     }
 
+    // Copy this element and everything under it into plain elements, for a
+    // snapshot.  Elements reached more than once are copied once, via 
+    // in_memo.  Components are copied as the maps they serialize as, after 
+    // pre_serialize() has brought them up to date.
+    TrackerElement *copy_tree(std::map<TrackerElement *, TrackerElement *> &in_memo);
+
+    // Frozen elements are never changed again; they're read without locking,
+    // and link() and unlink() leave them alone so readers on other threads 
+    // don't race on the reference count.  The owner thaws the tree before
+    // unlinking it to free it.
+    void freeze() { set_frozen(true); }
+    void thaw() { set_frozen(false); }
+
+    bool is_frozen() {
+        return frozen;
+    }
+
     // Called prior to serialization output
     virtual void pre_serialize() { }
 
@@ -143,11 +160,21 @@ public:
         return local_name;
     }
 
+    bool has_local_name() {
+        return local_name.length() != 0;
+    }
+
     void link() {
+        if (frozen)
+            return;
+
         reference_count++;
     }
 
     void unlink() {
+        if (frozen)
+            return;
+
         reference_count--;
 
         // what?
@@ -595,6 +622,10 @@ protected:
     // Try to track if we've been double-freed and blow up cleanly
     bool deallocated;
 
+    bool frozen;
+
+    void set_frozen(bool in_frozen);
+
     TrackerType type;
     int tracked_id;
 
@@ -1138,6 +1169,146 @@ protected:
 
 };
 
+// Precompiled field projection, used to serialize only a subset of a record.
+//
+// Each path is a list of field names, as accepted by 
+// tracker_component::get_child_path (ie "kismet.device.base.signal/
+// kismet.common.signal.last_signal_dbm").  Paths are resolved to field ids once
+// when the projection is built, and merged into a tree, so projecting many 
+// records is only a walk of field id lookups.  Paths containing unknown fields
+// are discarded.
+class TrackerElementProjection {
+public:
+    TrackerElementProjection(GlobalRegistry *in_globalreg, 
+            std::vector<string> in_paths);
+
+    // Parse a comma-separated list of paths, such as a 'fields=' URI option
+    TrackerElementProjection(GlobalRegistry *in_globalreg, string in_paths);
+
+    // No path resolved
+    bool empty() {
+        return nodes[0].children.size() == 0;
+    }
+
+    // Build a map with id in_id which references the projected fields of 
+    // in_elem.  Fields keep the nesting of their path, so the same field 
+    // reached by different paths (such as the last signal of the device and
+    // of a seenby record) doesn't collide; intermediate maps hold only the
+    // requested fields under them.  Fields missing from in_elem are skipped.
+    // Fields are linked, not copied.
+    TrackerElement *Project(TrackerElement *in_elem, int in_id);
+
+protected:
+    void Compile(GlobalRegistry *in_globalreg, std::vector<string> in_paths);
+
+    void ProjectNode(TrackerElement *in_elem, unsigned int in_node, 
+            TrackerElement *ret_map);
+
+    // Path tree, node 0 is the root.  A whole node was requested itself, and
+    // is linked in with everything under it.
+    struct projection_node {
+        int id;
+        bool whole;
+        std::vector<unsigned int> children;
+    };
+
+    std::vector<projection_node> nodes;
+};
+
+// Precompiled serialization plans.
+//
+// Serializers which write the name of every member of a map (JSON, msgpack) 
+// look up and encode the same handful of field names for every record of a
+// type.  A plan is built once per component type (the field id of the map) and 
+// holds the member field ids in map order, each with its name already encoded
+// in the output format by the serializer-provided encoder, so serializing a
+// record is a walk of the map alongside the plan, writing the cached bytes.
+//
+// Plans are immutable once published and are read without locking:  the
+// serializer fetches the current plan for the type, and if it meets a member
+// the plan doesn't cover while walking the map, it encodes that name directly
+// and asks for the plan to be extended afterwards.  Only extending a plan
+// takes the cache lock.  Replaced plans and tables are retained until the 
+// cache is destroyed, because other serializer threads may still be walking 
+// them; there is at most one plan per field id and member, so this is bounded.
+class TrackerElementPlanCache {
+public:
+    // Encode the key of a field for this output format; the type is the type
+    // of the element the first time the field was seen
+    typedef string (*key_encoder)(GlobalRegistry *, int, TrackerType);
+
+    struct plan_field {
+        int id;
+        TrackerType type;
+        string key;
+    };
+
+    struct plan {
+        std::vector<plan_field> fields;
+    };
+
+    TrackerElementPlanCache(key_encoder in_encoder);
+    ~TrackerElementPlanCache();
+
+    // Get the current plan for maps of this field id, or NULL if none has been
+    // built yet.  Lock-free.
+    plan *GetPlan(int in_id) {
+        // Tables and plans are fully built before they're published and are
+        // never modified or freed afterwards, so the dependent loads are safe
+        // without a barrier on the read side
+        plan_table *t = *((plan_table * volatile *) &table);
+
+        if (in_id < 0 || (unsigned int) in_id >= t->size)
+            return NULL;
+
+        return *((plan * volatile *) &(t->plans[in_id]));
+    }
+
+    // Publish a plan covering every member of in_map, which must be a 
+    // TrackerMap, merged with the current plan for its type.  Called by
+    // serializers which missed a member walking the map with GetPlan.
+    plan *ExtendPlan(GlobalRegistry *in_globalreg, TrackerElement *in_map);
+
+    // Find the plan entry for a field, starting at pos and moving it forward.
+    // Both the plan and the map are ordered by field id, so walking a map
+    // in order with one cursor visits each plan entry at most once.
+    static plan_field *Advance(plan *in_plan, unsigned int &pos, int in_id) {
+        if (in_plan == NULL)
+            return NULL;
+
+        while (pos < in_plan->fields.size()) {
+            plan_field *f = &(in_plan->fields[pos]);
+
+            if (f->id == in_id)
+                return f;
+
+            if (f->id > in_id)
+                return NULL;
+
+            pos++;
+        }
+
+        return NULL;
+    }
+
+protected:
+    // Plans indexed by field id
+    struct plan_table {
+        unsigned int size;
+        plan **plans;
+    };
+
+    key_encoder encoder;
+
+    // Held only while extending plans
+    pthread_mutex_t mutex;
+
+    plan_table *table;
+
+    std::vector<plan *> retired_plans;
+    std::vector<plan_table *> retired_tables;
+};
+
 // Generic serializer class to allow easy swapping of serializers
 class TrackerElementSerializer {
 public:
@@ -1187,7 +1358,8 @@ public:
     TrackerElementScopeLocker(TrackerElement *in_elem) {
         elem = NULL;
 
-        if (in_elem != NULL) {
+        // Frozen elements can't change under us
+        if (in_elem != NULL && !in_elem->is_frozen()) {
             elem = in_elem;
             elem->thread_mutex_lock();
             elem->link();